@@ -1,364 +1,7357 @@
 #include "collectd.h"
 
 #include "plugin.h"
+#include "utils_cache.h"
 #include "utils_complain.h"
+#include "utils_random.h"
 #include "utils/common/common.h"
 #include "utils/format_json/format_json.h"
 
+#include <arpa/inet.h>
+#include <fcntl.h>
 #include <mosquitto.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#if KERNEL_LINUX
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define WM_HAVE_EPOLL 1
+#else
+#define WM_HAVE_EPOLL 0
+#endif
+
+#if HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+#if HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+#if HAVE_LZ4FRAME_H
+#include <lz4frame.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Properties, and thereby MQTT v5, are available since libmosquitto 1.6. */
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+#define WM_HAVE_MQTT5 1
+#else
+#define WM_HAVE_MQTT5 0
+#endif
+
+/* libmosquitto takes an OpenSSL context of the caller's since 1.6. */
+#if HAVE_OPENSSL_SSL_H
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+#if HAVE_OPENSSL_SSL_H && (LIBMOSQUITTO_VERSION_NUMBER >= 1006000) &&        \
+    (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+#define WM_HAVE_TLS_CTX 1
+#else
+#define WM_HAVE_TLS_CTX 0
+#endif
 
 #define WRITE_MQTT_MIN_MESSAGE_SIZE 1024
-#define WRITE_MQTT_MAX_MESSAGE_SIZE 1024 * 128
+/* MQTT limits the remaining length of a PUBLISH packet to 256 MiB; leave room
+ * for the topic and the rest of the variable header. */
+#define WRITE_MQTT_MAX_MESSAGE_SIZE (256 * 1024 * 1024 - 128 * 1024)
+#define WRITE_MQTT_DEFAULT_BUFFER_SIZE (128 * 1024)
+#define WRITE_MQTT_INITIAL_BUFFER_SIZE (64 * 1024)
+/* format_json_value_list() allocates (and clears) a temporary buffer the size
+ * of the free space on the stack, so never offer it more than this. */
+#define WRITE_MQTT_FORMAT_WINDOW (128 * 1024)
 #define WRITE_MQTT_DEFAULT_PORT 8883
 #define WRITE_MQTT_DEFAULT_TOPIC "collectd"
 #define WRITE_MQTT_KEEPALIVE 60
+/* How long an MQTT 5 broker keeps a persistent session of a disconnected
+ * client, in seconds. */
+#define WRITE_MQTT_SESSION_EXPIRY 86400
+#define WRITE_MQTT_SHUTDOWN_ACK_TIMEOUT TIME_T_TO_CDTIME_T(5)
+#define WRITE_MQTT_DEFAULT_SEND_BUFFERS 2
+#define WRITE_MQTT_MAX_SEND_BUFFERS 1024
+#define WRITE_MQTT_MAX_CONNECTIONS 64
+#define WRITE_MQTT_MAX_BROKERS 8
+#define WRITE_MQTT_DEFAULT_PROBE_INTERVAL TIME_T_TO_CDTIME_T(30)
+#define WRITE_MQTT_PROBE_TIMEOUT_MS 1000
+#define WRITE_MQTT_MAX_WRITE_SHARDS 64
+#define WRITE_MQTT_INITIAL_TOPICS_SIZE 64
+#define WRITE_MQTT_INITIAL_SERIES_SIZE 256
+#define WRITE_MQTT_DEFAULT_SERIES_CACHE_SIZE 65536
+#define WRITE_MQTT_DEFAULT_MAX_TOPICS 65536
+#define WRITE_MQTT_FILTER_CACHE_SIZE 4096
+#define WRITE_MQTT_DEFAULT_HEARTBEAT_INTERVAL TIME_T_TO_CDTIME_T(300)
+#define WRITE_MQTT_DEFAULT_TOPIC_ALIAS_MAXIMUM 1024
+#define WRITE_MQTT_DEFAULT_MAX_INFLIGHT 64
+#define WRITE_MQTT_DEFAULT_BATCH_POOL_SIZE (16 * 1024 * 1024)
+#define WRITE_MQTT_DEFAULT_RECONNECT_MIN_INTERVAL TIME_T_TO_CDTIME_T(1)
+#define WRITE_MQTT_DEFAULT_RECONNECT_MAX_INTERVAL TIME_T_TO_CDTIME_T(60)
+#define WRITE_MQTT_DEFAULT_MAX_SPOOL_BYTES (64 * 1024 * 1024)
+#define WRITE_MQTT_DEFAULT_REPLAY_RATE 10.0
+/* How long replaying waits after a spooled batch could not be allocated. */
+#define WRITE_MQTT_SPOOL_RETRY_INTERVAL TIME_T_TO_CDTIME_T(1)
+#define WRITE_MQTT_DEFAULT_PRIORITY_BATCH_DELAY MS_TO_CDTIME_T(100)
+#define WRITE_MQTT_DEFAULT_PRIORITY_WEIGHT 4
+#define WRITE_MQTT_DEFAULT_MEMORY_SAMPLE_RATE 10
+#define WRITE_MQTT_DEFAULT_MEMORY_BLOCK_TIMEOUT MS_TO_CDTIME_T(100)
+#define WRITE_MQTT_MEMORY_SAMPLE_SLOTS 4096
+#define WRITE_MQTT_SPOOL_MAGIC 0x4d514d57 /* "WMQM" */
+#define WRITE_MQTT_SPOOL_VERSION 2
+
+#define WM_BROKERS_FAILOVER 0
+#define WM_BROKERS_REPLICATE 1
+
+/* Value lists matching a Priority rule are batched and queued apart from
+ * the others. */
+#define WM_LANE_BULK 0
+#define WM_LANE_PRIORITY 1
+#define WM_LANES 2
+
+/* The timeout of a lane wm_flush_shards() leaves alone. */
+#define WM_FLUSH_NEVER UINT64_MAX
+
+#define WM_COMPRESSION_NONE 0
+#define WM_COMPRESSION_GZIP 1
+#define WM_COMPRESSION_LZ4 2
+#define WM_COMPRESSION_ZSTD 3
+
+/* What wm_memory_admit() does once a node nears its MaxMemory. */
+#define WM_MEMORY_DROP_OLDEST 0
+#define WM_MEMORY_DROP_NEWEST 1
+#define WM_MEMORY_SAMPLE 2
+#define WM_MEMORY_BLOCK 3
 
 /*
  * Private variables
  */
-struct wm_callback_s {
+/* "data" points to "capacity" bytes of address space in the node's arena, of
+ * which the first "size" bytes are in use. Buffers grow by doubling "size"
+ * and are trimmed after mostly empty batches, so memory follows the load
+ * without ever copying a buffer. If MaxMessageSize is set, "splits" holds
+ * the offsets at which the batch is split into separate messages. A
+ * finalized buffer is never modified: with BrokerPolicy "Replicate" it is
+ * queued for one connection per broker at once, linked through the
+ * "queue_next" of the connection's group, and goes back to its shard once
+ * the last of them released its reference in "refs". With Priority rules,
+ * every shard has one "reserved" buffer only the priority lane may use, so
+ * that its batches do not wait for the bulk lane's to be published. */
+struct wm_buffer_s {
+  char *data;
+  size_t capacity;
+  size_t size;
+  size_t free;
+  size_t fill;
+  cdtime_t init_time;
+
+  size_t *splits;
+  size_t splits_num;
+  size_t splits_size;
+
+  struct wm_topic_s *topic;
+  struct wm_shard_s *shard;
+  struct wm_buffer_s *next;
+  struct wm_buffer_s *queue_next[WRITE_MQTT_MAX_BROKERS];
+  int refs;
+  bool reserved;
+};
+typedef struct wm_buffer_s wm_buffer_t;
+
+/* The Include or Exclude rules of a node. Patterns without wildcards are
+ * kept in "exact", an open addressing hash set of "exact_size" slots (a
+ * power of two), so that any number of them costs one lookup; the others
+ * are tried one by one. */
+struct wm_rules_s {
+  char **exact;
+  size_t exact_size;
+  size_t exact_num;
+  char **globs;
+  size_t globs_num;
+};
+typedef struct wm_rules_s wm_rules_t;
+
+/* A topic rendered from the TopicTemplate. Topics are kept in a hash table
+ * keyed by the value list fields the template uses ("key" holds them, each
+ * NUL-terminated), so that writing a value list does not render the topic
+ * again. Value lists are batched per topic in "send_buffer"; topics holding
+ * a buffer are linked in the order they got it, oldest first, one list per
+ * lane. The priority lane has topics of its own, with the same names.
+ *
+ * "refs" counts the buffers of the shard that point to the topic, its send
+ * buffer and those queued for publishing, and the writer using it. Topics
+ * without references are linked in an LRU list, most recently used first,
+ * and the least recently used one is forgotten once the shard holds too
+ * many, see wm_topic_get(). The shard's default and priority topics are not
+ * in the hash table and are never forgotten. */
+struct wm_topic_s {
   char *name;
+  char *key;
+  size_t key_len;
+  uint32_t hash;
+  size_t conn;
+  int lane;
+  int refs;
+
+  wm_buffer_t *send_buffer;
+
+  struct wm_topic_s *hash_next;
+  struct wm_topic_s *active_prev;
+  struct wm_topic_s *active_next;
+  struct wm_topic_s *lru_prev;
+  struct wm_topic_s *lru_next;
+};
+typedef struct wm_topic_s wm_topic_t;
+
+/* Accumulator of one data source over an aggregation window. Gauges, and with
+ * StoreRates the rates of the other types, are aggregated into "min", "max",
+ * "sum" and "last" over "count" non-NaN samples; "raw" is the last value as
+ * written. */
+struct wm_agg_s {
+  gauge_t min;
+  gauge_t max;
+  gauge_t sum;
+  gauge_t last;
+  uint32_t count;
+  value_t raw;
+};
+typedef struct wm_agg_s wm_agg_t;
+
+#define WM_AGG_AVERAGE 0
+#define WM_AGG_MINIMUM 1
+#define WM_AGG_MAXIMUM 2
+#define WM_AGG_LAST 3
+#define WM_AGG_MAX 4
+
+/* What is remembered about a series, keyed by the value list's identifier
+ * ("key" holds all its fields, each NUL-terminated): the values last
+ * published with PublishOnChange, and the parts of its JSON that do not
+ * change from one value list to the next. "json" holds everything from the
+ * end of "values" up to the time, followed at "json_split" by everything from
+ * the host to the end. The identifier and values live in the same allocation
+ * as the entry. Series are evicted least recently written first. */
+struct wm_series_s {
+  uint32_t hash;
+  size_t key_len;
+  cdtime_t published;
+  size_t values_num;
+  value_t *values;
+  char *key;
+
+  char *json;
+  size_t json_len;
+  size_t json_split;
+
+  /* With AggregationInterval, the accumulators of the current window, which
+   * ends at "agg_end" and holds "agg_samples" value lists, the last at
+   * "agg_time". "agg_raw_time" is the time of the raw counter values in
+   * "agg", from which the next rates are computed. Windows holding samples
+   * are linked in the order they were started, see wm_agg_flush(). "lane"
+   * is the lane the windows are published to. */
+  data_set_t const *ds;
+  int lane;
+  wm_agg_t *agg;
+  uint32_t agg_samples;
+  cdtime_t agg_end;
+  cdtime_t agg_time;
+  cdtime_t agg_grace;
+  cdtime_t agg_raw_time;
+  struct wm_series_s *agg_prev;
+  struct wm_series_s *agg_next;
+
+  struct wm_series_s *hash_next;
+  struct wm_series_s *lru_prev;
+  struct wm_series_s *lru_next;
+};
+typedef struct wm_series_s wm_series_t;
+
+#define WM_HISTOGRAM_BUCKETS 48
+
+/* Counts of values in power-of-two buckets: bucket "b" counts values of up to
+ * 2^b, bucket 0 the zeros. */
+struct wm_histogram_s {
+  uint64_t buckets[WM_HISTOGRAM_BUCKETS];
+  uint64_t sum;
+};
+typedef struct wm_histogram_s wm_histogram_t;
+
+/* Self-monitoring counters. Every shard, connection and node has its own set
+ * with a single writer at a time: the shard's lock holder, the connection's
+ * publish thread, and the holder of the node's "send_lock". Updates are plain
+ * relaxed loads and stores; wm_read() adds the sets up. */
+struct wm_stats_s {
+  uint64_t values_written;
+  uint64_t values_suppressed;
+  uint64_t values_aggregated;
+  /* Only summed here, each write thread counts them in its own
+   * wm_writer_stats_t. */
+  uint64_t values_filtered;
+  uint64_t messages_published;
+  uint64_t bytes_published;
+  uint64_t batches_dropped;
+  uint64_t reconnects;
+  uint64_t failovers;
+  /* Microseconds waited for a contended lock. */
+  uint64_t lock_wait;
+  /* Value lists and backlog batches shed to stay within MaxMemory, and
+   * microseconds writers waited for memory, see wm_memory_admit(). Like
+   * "values_filtered", "values_shed" and "memory_wait" are counted per write
+   * thread. */
+  uint64_t values_shed;
+  uint64_t batches_shed;
+  uint64_t memory_wait;
+  /* Bytes per finalized batch and microseconds per mosquitto_publish(). */
+  wm_histogram_t batch_bytes;
+  wm_histogram_t publish_latency;
+  /* Nanoseconds per value list written, only kept with CollectStatistics. */
+  wm_histogram_t write_latency;
+};
+typedef struct wm_stats_s wm_stats_t;
+
+/* The counters wm_write() updates before it knows the shard, and so without
+ * a lock. Every write thread has a slot of its own in the node's
+ * "writer_stats", on a cache line of its own, and is its single writer;
+ * threads beyond WM_WRITER_SLOTS share the last slot and add atomically. See
+ * wm_writer_stats(). */
+#define WM_WRITER_SLOTS 64
+#define WM_CACHE_LINE 64
+struct wm_writer_stats_s {
+  uint64_t values_filtered;
+  uint64_t values_shed;
+  uint64_t memory_wait;
+  char pad[WM_CACHE_LINE - 3 * sizeof(uint64_t)];
+};
+typedef struct wm_writer_stats_s wm_writer_stats_t;
+
+/* The write path is split into shards, each with its own lock, topics and
+ * send buffers, so that write threads appending value lists of different
+ * series do not wait for each other. The shard of a value list follows from
+ * its identifier. "lock" must be taken before the node's "send_lock". */
+struct wm_shard_s {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  wm_topic_t default_topic;
+  wm_topic_t priority_topic;
+  wm_topic_t **topics;
+  size_t topics_size;
+  size_t topics_num;
+  wm_topic_t *active_head[WM_LANES];
+  wm_topic_t *active_tail[WM_LANES];
+  wm_topic_t *topic_lru_head;
+  wm_topic_t *topic_lru_tail;
+
+  wm_series_t **series;
+  size_t series_size;
+  size_t series_num;
+  wm_series_t *lru_head;
+  wm_series_t *lru_tail;
+  wm_series_t *agg_head;
+  wm_series_t *agg_tail;
+
+  wm_buffer_t *free_head;
+  wm_buffer_t *reserved_head;
+
+  wm_stats_t stats;
+};
+typedef struct wm_shard_s wm_shard_t;
+
+#define WM_FIELD_TEXT 0
+#define WM_FIELD_HOST 1
+#define WM_FIELD_PLUGIN 2
+#define WM_FIELD_PLUGIN_INSTANCE 3
+#define WM_FIELD_TYPE 4
+#define WM_FIELD_TYPE_INSTANCE 5
+#define WM_FIELD_MAX 6
+
+/* A TopicTemplate compiled into literal text and value list fields. */
+struct wm_template_part_s {
+  int field;
+  char *text;
+  size_t text_len;
+};
+typedef struct wm_template_part_s wm_template_part_t;
+
+typedef struct wm_format_s wm_format_t;
+
+#if WM_HAVE_MQTT5
+/* An MQTT 5 topic alias. The broker learns an alias from the first message
+ * carrying both the topic and the alias; later messages carry the alias
+ * only. Aliases are kept in LRU order, most recently used first, so that
+ * once all aliases the broker allows are taken the least recently used one
+ * is remapped. */
+struct wm_alias_s {
+  char *topic;
+  uint32_t hash;
+  uint16_t alias;
+
+  struct wm_alias_s *hash_next;
+  struct wm_alias_s *lru_prev;
+  struct wm_alias_s *lru_next;
+};
+typedef struct wm_alias_s wm_alias_t;
+#endif
+
+/* A finalized batch waiting for the broker to come back. "topic" points
+ * into "data", after the payload. */
+struct wm_batch_s {
+  size_t len;
+  char const *topic;
+  /* Message ID while waiting for the broker's acknowledgement. */
+  int mid;
+  /* Size class in the node's pool, or WM_POOL_MALLOC, and the bytes taken
+   * from either. */
+  uint8_t size_class;
+  size_t size;
+  struct wm_batch_s *next;
+  char data[];
+};
+typedef struct wm_batch_s wm_batch_t;
+
+#define WM_POOL_MIN_SHIFT 10
+#define WM_POOL_CLASSES 19
+#define WM_POOL_MALLOC 0xff
+
+/* Batches are carved from one reservation of address space per node in
+ * power-of-two size classes, 1 KiB up to 256 MiB, and recycled through a
+ * free list per class, so that queuing batches does not malloc() in steady
+ * state. A chunk keeps its size class once carved. Batches that find no
+ * room are malloc'd instead and counted as misses. */
+struct wm_pool_s {
+  pthread_mutex_t lock;
+  char *base;
+  size_t size;
+  size_t used;
+  wm_batch_t *free[WM_POOL_CLASSES];
+
+  /* Updated by the holder of "lock". */
+  uint64_t hits;
+  uint64_t misses;
+};
+typedef struct wm_pool_s wm_pool_t;
+
+/* The spool file starts with this header, followed by records consisting of
+ * a uint32_t payload length, a uint16_t topic length, the topic and the
+ * payload. Records are appended at "tail" and
+ * replayed from "head"; both are reset once the spool has been drained. */
+struct wm_spool_header_s {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t head;
+  uint64_t tail;
+};
+typedef struct wm_spool_header_s wm_spool_header_t;
+
+typedef struct wm_callback_s wm_callback_t;
+
+/* One client session with the broker. Every connection has its own publish
+ * queue and publish thread, so that several connections compress and
+ * encrypt in parallel. */
+struct wm_conn_s {
+  wm_callback_t *cb;
+  size_t index;
+  /* With BrokerPolicy "Replicate", every broker has a group of connections
+   * of its own; otherwise all connections are in group 0. "broker" is the
+   * index of the Host the connection uses, "mosq_broker" the one "mosq" was
+   * set up for, and "broker_tries" counts the brokers that failed in a row.
+   * They are owned by the publish thread, which changes "broker" only while
+   * holding "send_lock". */
+  size_t group;
+  size_t broker;
+  size_t mosq_broker;
+  size_t broker_tries;
 
   struct mosquitto *mosq;
+  /* Written by the publish thread and the mosquitto network thread, read by
+   * the write path. Use wm_is_connected() / wm_set_connected(). */
   bool connected;
+  /* Whether the network loop drives "mosq". With the shared loop,
+   * "loop_fd", "loop_events" and "loop_next" are protected by its lock;
+   * "loop_fd" is -1 once the loop has seen the connection fail. */
+  bool loop_running;
+  int loop_fd;
+  uint32_t loop_events;
+  struct wm_conn_s *loop_next;
+  /* QoS 1 messages not acknowledged yet, oldest first, protected by
+   * "inflight_lock". "inflight" counts them and may be read without the
+   * lock. "inflight_publishing" is the message mosquitto_publish() is
+   * called for, "inflight_acked" set if it was acknowledged meanwhile. */
+  pthread_mutex_t inflight_lock;
+  pthread_cond_t inflight_cond;
+  wm_batch_t *inflight_head;
+  wm_batch_t *inflight_tail;
+  wm_batch_t *inflight_publishing;
+  bool inflight_acked;
+  int inflight;
+
+  /* Reconnect backoff, owned by the publish thread. */
+  cdtime_t reconnect_interval;
+  cdtime_t reconnect_next;
+
+  /* Scratch space of Format's "encode", owned by the publish thread. */
+  char *encode_buffer;
+  size_t encode_buffer_size;
+
+  /* Compression state is owned by the publish thread. */
+  char *compress_buffer;
+  size_t compress_buffer_size;
+#if HAVE_ZLIB_H
+  z_stream zstream;
+  bool zstream_initialized;
+#endif
+#if HAVE_ZSTD_H
+  ZSTD_CCtx *zstd_cctx;
+#endif
 
-  char *host;
+#if WM_HAVE_MQTT5
+  /* Topic aliases of the current connection, owned by the publish thread.
+   * "topic_alias_broker" is the Topic Alias Maximum of the broker's CONNACK,
+   * written by the mosquitto network thread. */
+  uint16_t topic_alias_broker;
+  wm_alias_t *aliases;
+  size_t aliases_num;
+  wm_alias_t **alias_table;
+  size_t alias_table_size;
+  wm_alias_t *alias_lru_head;
+  wm_alias_t *alias_lru_tail;
+#endif
+
+  /* Finalized buffers of each lane, owned by "send_lock". "publish_num"
+   * counts both lanes, "priority_streak" the priority batches popped in a
+   * row while bulk batches were waiting, see wm_queue_pop(). */
+  wm_buffer_t *publish_head[WM_LANES];
+  wm_buffer_t *publish_tail[WM_LANES];
+  size_t publish_num;
+  unsigned int priority_streak;
+
+  pthread_t publish_thread;
+  bool publish_thread_running;
+
+  wm_stats_t stats;
+
+  c_complain_t complaint_cantpublish;
+  c_complain_t complaint_encode;
+  c_complain_t complaint_compress;
+  pthread_cond_t publish_cond;
+};
+typedef struct wm_conn_s wm_conn_t;
+
+#if WM_HAVE_TLS_CTX
+/* An OpenSSL context shared by all connections to one broker host with the
+ * same certificates, see wm_tls_acquire(). */
+struct wm_tls_s {
+  char *key;
+  size_t key_size;
+  SSL_CTX *ctx;
+  /* The session offered on the next handshake. */
+  SSL_SESSION *session;
+  size_t refs;
+  struct wm_tls_s *next;
+};
+typedef struct wm_tls_s wm_tls_t;
+#endif
+
+struct wm_callback_s {
+  char *name;
+
+  /* Value lists are spread across the connections by their identifier, or
+   * with QoS 1 to the connection with the fewest messages in flight. There
+   * are "groups_num" groups of "group_size" connections, see wm_conn_t. */
+  wm_conn_t *conns;
+  size_t conns_num;
+  size_t groups_num;
+  size_t group_size;
+
+  cdtime_t reconnect_min_interval;
+  cdtime_t reconnect_max_interval;
+
+  /* With "Failover", connections move on to the next broker when theirs
+   * fails. The probe thread checks which brokers accept connections every
+   * "probe_interval" while a connection is not on the first one, so that
+   * connections go back to the first healthy broker of "hosts". With
+   * "Replicate", every batch is published to all brokers. */
+  char **hosts;
+  size_t hosts_num;
   int port;
+  int broker_policy;
+  cdtime_t probe_interval;
+  uint32_t brokers_healthy;
+  pthread_t probe_thread;
+  bool probe_thread_running;
+  bool probe_thread_stop;
+  pthread_cond_t probe_cond;
   char *client_id;
   char *capath;
   char *clientkey;
   char *clientcert;
   bool insecure;
+#if WM_HAVE_TLS_CTX
+  /* The TLS context of every broker, acquired on the first connect. Guarded
+   * by wm_tls_lock. */
+  wm_tls_t *tls[WRITE_MQTT_MAX_BROKERS];
+#endif
   int protocol_version;
   int qos;
+  /* QoS 1 messages per connection the broker has not acknowledged yet. */
+  int max_inflight;
+  /* With "persistent_session", the broker keeps the session across
+   * reconnects, see wm_session_resumes(). */
+  bool persistent_session;
   char *topic;
 
+  /* With a single connection and no TopicTemplate, the "default_topic" of
+   * each shard is its only topic and "topics" is unused. */
+  wm_template_part_t *topic_template;
+  size_t topic_template_num;
+  unsigned int topic_fields;
+
+  wm_format_t const *format;
   bool store_rates;
 
-  char *send_buffer;
+  /* With "filter", value lists are only written if their identifier matches
+   * one of the "include" rules, if there are any, and none of the "exclude"
+   * rules. The outcome is cached per identifier in "filter_cache", which
+   * has WRITE_MQTT_FILTER_CACHE_SIZE slots. */
+  bool filter;
+  wm_rules_t include;
+  wm_rules_t exclude;
+  uint64_t *filter_cache;
+
+  /* With "priority_lane", value lists matching one of the "priority" rules
+   * are batched for at most "priority_batch_delay" and published before the
+   * others, up to "priority_weight" priority batches per bulk batch. */
+  bool priority_lane;
+  wm_rules_t priority;
+  cdtime_t priority_batch_delay;
+  unsigned int priority_weight;
+
+  /* With "publish_on_change", a value list is only written if one of its
+   * values changed (gauges by more than "deadband") or the series has not
+   * been published for "heartbeat_interval". */
+  bool publish_on_change;
+  cdtime_t heartbeat_interval;
+  double deadband;
+  /* Series are tracked for PublishOnChange and, with the JSON format, to
+   * reuse their rendered metadata. At most "series_cache_size" series are
+   * kept, split evenly across the shards. */
+  bool track_series;
+  bool json_cache;
+  size_t series_cache_size;
+  /* With "aggregation_interval", tracked series are published once per
+   * interval, once for each function set in "aggregation_functions". */
+  cdtime_t aggregation_interval;
+  unsigned int aggregation_functions;
+
+  int compression;
+  int compression_level;
+#if HAVE_ZSTD_H
+  ZSTD_CDict *zstd_cdict;
+#endif
+#if WM_HAVE_MQTT5
+  mosquitto_property *publish_props;
+  /* "alias_props[i]" are the publish properties with topic alias i + 1. */
+  int topic_alias_maximum;
+  mosquitto_property **alias_props;
+#endif
+
+  /* The send buffers form a ring: writers append to the "send_buffer" of a
+   * topic while holding the lock of its shard. A full buffer is moved to
+   * the publish queue of a connection in O(1) and sent by its publish thread
+   * without holding any lock, while writers go on with the next buffer from
+   * the shard's free list. Every shard has "buffers_num" buffers, including
+   * the reserved one of the priority lane. */
+  wm_shard_t *shards;
+  size_t shards_num;
+  wm_buffer_t *buffers;
+  size_t buffers_num;
   size_t send_buffer_size;
-  size_t send_buffer_free;
-  size_t send_buffer_fill;
-  cdtime_t send_buffer_init_time;
+  size_t max_message_size;
+  char *arena;
+  size_t arena_size;
+  /* Whether the arena and the batch pool ask for transparent huge pages. */
+  bool huge_pages;
 
-  c_complain_t complaint_cantpublish;
+  wm_pool_t pool;
+
+  /* With "max_memory", the send buffers, batches, series, topics and caches
+   * of the node are accounted in "memory", which any thread updates
+   * atomically. Past "memory_high", wm_memory_admit() applies
+   * "memory_policy" to new value lists; buffers, series and the backlog do
+   * not grow past "max_memory". Writers blocked by the "Block" policy wait
+   * on "memory_cond" for at most "memory_block_timeout". */
+  size_t max_memory;
+  size_t memory_high;
+  size_t memory;
+  int memory_policy;
+  unsigned int memory_sample_rate;
+  uint32_t *memory_samples;
+  cdtime_t memory_block_timeout;
+  unsigned int memory_waiters;
+  pthread_mutex_t memory_lock;
+  pthread_cond_t memory_cond;
+
+  /* Batches not published because the broker is unavailable, oldest first.
+   * Once "backlog_bytes" would exceed "max_queued_bytes", the oldest batches
+   * are spilled to the spool file, which always holds older batches than the
+   * in-memory backlog. Replay is limited to "replay_rate" batches per second
+   * and only happens while no live batches are waiting. */
+  wm_batch_t *backlog_head;
+  wm_batch_t *backlog_tail;
+  size_t backlog_bytes;
+  size_t max_queued_bytes;
+  char *spool_dir;
+  size_t max_spool_bytes;
+  int spool_fd;
+  char *spool;
+  double replay_rate;
+  cdtime_t replay_next;
+
+  /* "send_lock" protects the publish queues, the offline queue and the
+   * spool file. Writers only take it to hand over a finalized buffer. */
+  bool threads_running;
+  bool shutdown;
+  /* Whether the node holds a reference to the network loop. */
+  bool loop_ref;
+
+  /* Batches are flushed once they are "max_batch_delay" old, by the flush
+   * thread, or once they hold "target_batch_bytes", by the writer. Zero
+   * disables either limit. */
+  cdtime_t max_batch_delay;
+  size_t target_batch_bytes;
+  pthread_t flush_thread;
+  bool flush_thread_running;
+  bool flush_thread_stop;
+  pthread_cond_t flush_cond;
+
+  /* Counters updated under "send_lock", the write threads' counters, and
+   * the totals of the previous wm_read(), which the percentiles are computed
+   * against. */
+  bool collect_stats;
+  wm_stats_t stats;
+  wm_writer_stats_t *writer_stats;
+  wm_stats_t stats_last;
+
+  c_complain_t complaint_dropped;
+  c_complain_t complaint_spool;
   pthread_mutex_t send_lock;
 };
-typedef struct wm_callback_s wm_callback_t;
 
-static void wm_reset_buffer(wm_callback_t *cb) /* {{{ */
+/* Only the owner of "counter" (see wm_stats_t) may call this. */
+static void wm_stat_add(uint64_t *counter, uint64_t n) /* {{{ */
+{
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+} /* }}} void wm_stat_add */
+
+/* Write threads are numbered on first use, from 1; 0 means not numbered yet.
+ * The numbers are shared by all nodes. */
+static unsigned int wm_writers_num;
+static __thread unsigned int wm_writer;
+
+/* Returns the calling thread's counters and whether other threads share
+ * them, in which case they are updated atomically. */
+static wm_writer_stats_t *wm_writer_stats(wm_callback_t *cb, /* {{{ */
+                                          bool *ret_shared) {
+  if (wm_writer == 0)
+    wm_writer = __atomic_add_fetch(&wm_writers_num, 1, __ATOMIC_RELAXED);
+
+  *ret_shared = (wm_writer >= WM_WRITER_SLOTS);
+  return cb->writer_stats +
+         (*ret_shared ? WM_WRITER_SLOTS - 1 : wm_writer - 1);
+} /* }}} wm_writer_stats_t *wm_writer_stats */
+
+/* Adds "n" to the counter at "offset" in the calling thread's
+ * wm_writer_stats_t. */
+static void wm_writer_stat_add(wm_callback_t *cb, /* {{{ */
+                               size_t offset, uint64_t n) {
+  bool shared;
+  uint64_t *counter =
+      (uint64_t *)((char *)wm_writer_stats(cb, &shared) + offset);
+
+  if (shared)
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+  else
+    wm_stat_add(counter, n);
+} /* }}} void wm_writer_stat_add */
+
+static void wm_histogram_add(wm_histogram_t *h, uint64_t value) /* {{{ */
+{
+  size_t bucket = 0;
+
+  if (value > 0)
+    bucket = (size_t)(64 - __builtin_clzll(value));
+  if (bucket >= WM_HISTOGRAM_BUCKETS)
+    bucket = WM_HISTOGRAM_BUCKETS - 1;
+
+  wm_stat_add(&h->buckets[bucket], 1);
+  wm_stat_add(&h->sum, value);
+} /* }}} void wm_histogram_add */
+
+/* Locks "lock" and returns the microseconds spent waiting for it. Only
+ * reads the clock if the lock is contended. */
+static uint64_t wm_lock(pthread_mutex_t *lock) /* {{{ */
+{
+  cdtime_t start;
+
+  if (pthread_mutex_trylock(lock) == 0)
+    return 0;
+
+  start = cdtime();
+  pthread_mutex_lock(lock);
+  return CDTIME_T_TO_US(cdtime() - start);
+} /* }}} uint64_t wm_lock */
+
+/* Whether "n" more bytes would take the node past its MaxMemory. */
+static bool wm_memory_exceeds(wm_callback_t const *cb, size_t n) /* {{{ */
+{
+  return (cb->max_memory > 0) &&
+         ((__atomic_load_n(&cb->memory, __ATOMIC_RELAXED) + n) >
+          cb->max_memory);
+} /* }}} bool wm_memory_exceeds */
+
+static void wm_memory_add(wm_callback_t *cb, size_t n) /* {{{ */
+{
+  if (cb->max_memory > 0)
+    __atomic_add_fetch(&cb->memory, n, __ATOMIC_SEQ_CST);
+} /* }}} void wm_memory_add */
+
+/* Gives back "n" bytes and wakes the writers waiting for memory, see
+ * wm_memory_wait(). */
+static void wm_memory_release(wm_callback_t *cb, size_t n) /* {{{ */
 {
-  if ((cb == NULL) || (cb->send_buffer == NULL))
+  if (cb->max_memory == 0)
     return;
 
-  memset(cb->send_buffer, 0, cb->send_buffer_size);
-  cb->send_buffer_free = cb->send_buffer_size;
-  cb->send_buffer_fill = 0;
-  cb->send_buffer_init_time = cdtime();
+  __atomic_sub_fetch(&cb->memory, n, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&cb->memory_waiters, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&cb->memory_lock);
+    pthread_cond_broadcast(&cb->memory_cond);
+    pthread_mutex_unlock(&cb->memory_lock);
+  }
+} /* }}} void wm_memory_release */
+
+static void wm_reset_buffer(wm_buffer_t *buf) /* {{{ */
+{
+  if ((buf == NULL) || (buf->data == NULL))
+    return;
 
-  format_json_initialize(cb->send_buffer, &cb->send_buffer_fill,
-                         &cb->send_buffer_free);
+  /* Equivalent to format_json_initialize() without clearing the whole buffer:
+   * format_json_value_list() NUL-terminates everything it appends and the
+   * payload length is taken from "fill", so only the first byte matters. */
+  buf->data[0] = 0;
+  buf->free = buf->size;
+  buf->fill = 0;
+  buf->init_time = cdtime();
+  buf->splits_num = 0;
 } /* }}} wm_reset_buffer */
 
-/* must hold cb->send_lock when calling. */
-static int wm_mqtt_reconnect(wm_callback_t *cb) {
-  int status;
+/* A buffer that would take the node past its MaxMemory does not grow and is
+ * handed over as it is. */
+static int wm_buffer_grow(wm_callback_t *cb, wm_buffer_t *buf) /* {{{ */
+{
+  size_t size;
 
-  if (cb->connected)
-    return 0;
+  if (buf->size >= buf->capacity)
+    return -1;
 
-  status = mosquitto_reconnect(cb->mosq);
-  if (status != MOSQ_ERR_SUCCESS) {
-    char errbuf[1024];
-    ERROR("wm_mqtt_reconnect: mosquitto_reconnect failed: %s",
-          (status == MOSQ_ERR_ERRNO) ? sstrerror(errno, errbuf, sizeof(errbuf))
-                                     : mosquitto_strerror(status));
+  size = buf->size * 2;
+  if (size > buf->capacity)
+    size = buf->capacity;
+  if (wm_memory_exceeds(cb, size - buf->size))
     return -1;
+  wm_memory_add(cb, size - buf->size);
+
+  buf->free += size - buf->size;
+  buf->size = size;
+
+  return 0;
+} /* }}} int wm_buffer_grow */
+
+/* Only called by the owner of a buffer that is neither in use nor queued.
+ * Returns the memory of a mostly unused buffer to the system. */
+static void wm_buffer_trim(wm_callback_t *cb, wm_buffer_t *buf) /* {{{ */
+{
+  size_t size;
+
+  if ((buf->size <= WRITE_MQTT_INITIAL_BUFFER_SIZE) ||
+      (buf->fill >= buf->size / 4))
+    return;
+
+  /* Keep "size" a multiple of the initial size and thereby page aligned. */
+  size = (buf->size / 2) / WRITE_MQTT_INITIAL_BUFFER_SIZE *
+         WRITE_MQTT_INITIAL_BUFFER_SIZE;
+  if (size < WRITE_MQTT_INITIAL_BUFFER_SIZE)
+    size = WRITE_MQTT_INITIAL_BUFFER_SIZE;
+
+  (void)madvise(buf->data + size, buf->size - size, MADV_DONTNEED);
+  wm_memory_release(cb, buf->size - size);
+  buf->size = size;
+} /* }}} void wm_buffer_trim */
+
+/* Remembers that a new message starts at "offset" of a buffer. */
+static int wm_buffer_split(wm_buffer_t *buf, size_t offset) /* {{{ */
+{
+  if (buf->splits_num >= buf->splits_size) {
+    size_t splits_size = (buf->splits_size == 0) ? 16 : 2 * buf->splits_size;
+    size_t *tmp = realloc(buf->splits, splits_size * sizeof(*buf->splits));
+
+    /* Without memory the batch simply is sent as one message. */
+    if (tmp == NULL)
+      return ENOMEM;
+
+    buf->splits = tmp;
+    buf->splits_size = splits_size;
   }
-  status = mosquitto_loop_start(cb->mosq);
-  if (status != MOSQ_ERR_SUCCESS) {
-    char errbuf[1024];
-    ERROR("write_mqtt plugin: mosquitto_loop_start failed: %s",
-          (status == MOSQ_ERR_ERRNO) ? sstrerror(errno, errbuf, sizeof(errbuf))
-                                     : mosquitto_strerror(status));
-    (void)mosquitto_disconnect(cb->mosq);
-    return -1;
+
+  buf->splits[buf->splits_num] = offset;
+  buf->splits_num++;
+  return 0;
+} /* }}} int wm_buffer_split */
+
+/* Returns the bounds of message "idx" of a finalized buffer. */
+static void wm_buffer_message(wm_buffer_t const *buf, size_t idx, /* {{{ */
+                              char **ret_data, size_t *ret_len) {
+  size_t start = (idx == 0) ? 0 : buf->splits[idx - 1];
+  size_t end = (idx < buf->splits_num) ? buf->splits[idx] : buf->fill;
+
+  *ret_data = buf->data + start;
+  *ret_len = end - start;
+} /* }}} void wm_buffer_message */
+
+/* FNV-1a */
+static uint32_t wm_hash(char const *data, size_t len) /* {{{ */
+{
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)data[i];
+    hash *= 16777619u;
   }
 
-  cb->connected = 1;
+  return hash;
+} /* }}} uint32_t wm_hash */
 
-  c_release(LOG_INFO, &cb->complaint_cantpublish,
-            "write_mqtt plugin: successfully reconnected to broker \"%s:%d\"",
-            cb->host, cb->port);
+/*
+ * Output formats
+ *
+ * All formats follow the conventions of format_json_value_list(): a value
+ * list is appended at "buffer + *ret_buffer_fill", and if it does not fit into
+ * "*ret_buffer_free" bytes, -ENOMEM is returned and the buffer is left
+ * unchanged. If set, "split" is called when the value list just appended at
+ * "offset" starts a new message (see MaxMessageSize), with at least
+ * WM_SPLIT_RESERVE bytes free, and returns the offset the new message starts
+ * at. Formats without it are streams of self-contained records and can be
+ * split at any record boundary.
+ */
+struct wm_format_s {
+  char const *name;
+  char const *content_type;
+  int (*value_list)(char *buffer, size_t *ret_buffer_fill,
+                    size_t *ret_buffer_free, const data_set_t *ds,
+                    const value_list_t *vl, int store_rates);
+  int (*finalize)(char *buffer, size_t *ret_buffer_fill,
+                  size_t *ret_buffer_free);
+  size_t (*split)(char *buffer, size_t offset, size_t *ret_buffer_fill,
+                  size_t *ret_buffer_free);
+  /* If set, the publish thread re-encodes every message before publishing
+   * it, into scratch space of "encode_scratch" bytes, 0 if the message is
+   * malformed. */
+  size_t (*encode_scratch)(char const *data, size_t len);
+  int (*encode)(char *scratch, char const *data, size_t len, size_t *ret_len);
+};
+
+/* The closing bracket, plus what format_json_value_list() leaves free. */
+#define WM_SPLIT_RESERVE 3
 
+/* Closes the JSON array of the current message in front of the value list at
+ * "offset" and opens the next one in place of its comma, so that every
+ * message of the finalized buffer is an array of its own. */
+static size_t wm_json_split(char *buffer, size_t offset, /* {{{ */
+                            size_t *ret_buffer_fill,
+                            size_t *ret_buffer_free) {
+  memmove(buffer + offset + 1, buffer + offset, *ret_buffer_fill - offset);
+  buffer[offset] = ']';
+  buffer[offset + 1] = '[';
+  (*ret_buffer_fill)++;
+  (*ret_buffer_free)--;
+  buffer[*ret_buffer_fill] = 0;
+
+  return offset + 1;
+} /* }}} size_t wm_json_split */
+
+static int wm_binary_finalize(char *buffer __attribute__((unused)), /* {{{ */
+                              size_t *ret_buffer_fill
+                              __attribute__((unused)),
+                              size_t *ret_buffer_free
+                              __attribute__((unused))) {
   return 0;
-} /* wm_mqtt_reconnect */
+} /* }}} int wm_binary_finalize */
+
+/* Appends to a buffer, remembering whether anything did not fit. */
+typedef struct {
+  char *data;
+  size_t pos;
+  size_t size;
+  bool overflow;
+} wm_writer_t;
 
-/* must hold cb->send_lock when calling */
-static int wm_publish_nolock(wm_callback_t *cb, char const *data) /* {{{ */
+static void wm_put(wm_writer_t *w, void const *data, size_t len) /* {{{ */
 {
-  int status;
+  if (w->overflow || ((w->size - w->pos) < len)) {
+    w->overflow = true;
+    return;
+  }
 
-  status = wm_mqtt_reconnect(cb);
-  if (status != 0) {
-    ERROR("write_mqtt plugin: unable to reconnect to broker");
-    return status;
+  memcpy(w->data + w->pos, data, len);
+  w->pos += len;
+} /* }}} void wm_put */
+
+static void wm_put_u8(wm_writer_t *w, uint8_t v) /* {{{ */
+{
+  wm_put(w, &v, sizeof(v));
+} /* }}} void wm_put_u8 */
+
+static void wm_put_be16(wm_writer_t *w, uint16_t v) /* {{{ */
+{
+  v = htons(v);
+  wm_put(w, &v, sizeof(v));
+} /* }}} void wm_put_be16 */
+
+static void wm_put_be32(wm_writer_t *w, uint32_t v) /* {{{ */
+{
+  v = htonl(v);
+  wm_put(w, &v, sizeof(v));
+} /* }}} void wm_put_be32 */
+
+static void wm_put_be64(wm_writer_t *w, uint64_t v) /* {{{ */
+{
+  v = htonll(v);
+  wm_put(w, &v, sizeof(v));
+} /* }}} void wm_put_be64 */
+
+/* IEEE 754 double in little endian byte order, as used by collectd's network
+ * protocol for gauges and by protobuf. */
+static void wm_put_le_double(wm_writer_t *w, double v) /* {{{ */
+{
+  v = htond(v);
+  wm_put(w, &v, sizeof(v));
+} /* }}} void wm_put_le_double */
+
+static void wm_put_varint(wm_writer_t *w, uint64_t v) /* {{{ */
+{
+  uint8_t tmp[10];
+  size_t len = 0;
+
+  do {
+    tmp[len] = (uint8_t)(v & 0x7f);
+    v >>= 7;
+    if (v != 0)
+      tmp[len] |= 0x80;
+    len++;
+  } while (v != 0);
+
+  wm_put(w, tmp, len);
+} /* }}} void wm_put_varint */
+
+static size_t wm_varint_size(uint64_t v) /* {{{ */
+{
+  size_t len = 1;
+
+  while (v >= 0x80) {
+    v >>= 7;
+    len++;
   }
 
-  status = mosquitto_publish(cb->mosq, /* message_id */ NULL, cb->topic,
-                             (int)strlen(data), data,
-                             cb->qos, /* retain */ false);
-  if (status != MOSQ_ERR_SUCCESS) {
-    char errbuf[1024];
-    c_complain(LOG_ERR, &cb->complaint_cantpublish,
-               "write_mqtt plugin: mosquitto_publish failed with %d: %s", status,
-               (status == MOSQ_ERR_ERRNO)
-                   ? sstrerror(errno, errbuf, sizeof(errbuf))
-                   : mosquitto_strerror(status));
-    /* Mark our connection "down" regardless of the error as a safety
-     * measure; we will try to reconnect the next time we have to publish a
-     * message */
-    cb->connected = 0;
-    (void)mosquitto_disconnect(cb->mosq);
-    (void)mosquitto_loop_stop(cb->mosq, false);
+  return len;
+} /* }}} size_t wm_varint_size */
+
+/* Finishes a value list appended with a wm_writer_t in the format_json style. */
+static int wm_writer_finish(wm_writer_t const *w, /* {{{ */
+                            size_t *ret_buffer_fill,
+                            size_t *ret_buffer_free) {
+  if (w->overflow)
+    return -ENOMEM;
+
+  *ret_buffer_fill += w->pos;
+  *ret_buffer_free -= w->pos;
+  return 0;
+} /* }}} int wm_writer_finish */
+
+/* Rates replace counter values if "StoreRates" is enabled. */
+static int wm_get_rates(const data_set_t *ds, const value_list_t *vl, /* {{{ */
+                        int store_rates, gauge_t **ret_rates) {
+  *ret_rates = NULL;
+
+  if (!store_rates)
+    return 0;
+
+  for (size_t i = 0; i < ds->ds_num; i++) {
+    if (ds->ds[i].type == DS_TYPE_GAUGE)
+      continue;
+
+    *ret_rates = uc_get_rate(ds, vl);
+    if (*ret_rates == NULL) {
+      ERROR("write_mqtt plugin: uc_get_rate failed.");
+      return -1;
+    }
+    break;
+  }
+
+  return 0;
+} /* }}} int wm_get_rates */
+
+/*
+ * Number formatting for the JSON encoder, without going through printf().
+ * Integers and times are exactly what format_json_value_list() prints;
+ * gauges see wm_json_put_gauge().
+ */
+static char const wm_digit_pairs[] = "00010203040506070809"
+                                     "10111213141516171819"
+                                     "20212223242526272829"
+                                     "30313233343536373839"
+                                     "40414243444546474849"
+                                     "50515253545556575859"
+                                     "60616263646566676869"
+                                     "70717273747576777879"
+                                     "80818283848586878889"
+                                     "90919293949596979899";
+
+/* Prints "v" in decimal, like "%" PRIu64, two digits at a time. */
+static void wm_json_put_uint(wm_writer_t *w, uint64_t v) /* {{{ */
+{
+  char tmp[20];
+  size_t pos = sizeof(tmp);
+
+  while (v >= 100) {
+    size_t idx = 2 * (size_t)(v % 100);
+    v /= 100;
+    tmp[--pos] = wm_digit_pairs[idx + 1];
+    tmp[--pos] = wm_digit_pairs[idx];
+  }
+  if (v >= 10) {
+    tmp[--pos] = wm_digit_pairs[2 * v + 1];
+    tmp[--pos] = wm_digit_pairs[2 * v];
+  } else
+    tmp[--pos] = (char)('0' + v);
+
+  wm_put(w, tmp + pos, sizeof(tmp) - pos);
+} /* }}} void wm_json_put_uint */
+
+static void wm_json_put_int(wm_writer_t *w, int64_t v) /* {{{ */
+{
+  if (v < 0) {
+    wm_put_u8(w, '-');
+    /* Negating in unsigned arithmetic also works for INT64_MIN. */
+    wm_json_put_uint(w, -(uint64_t)v);
+  } else
+    wm_json_put_uint(w, (uint64_t)v);
+} /* }}} void wm_json_put_int */
+
+/* Prints a time like "%.3f" does with CDTIME_T_TO_DOUBLE(t): the conversion
+ * to double keeps 53 significant bits, and the result is rounded to
+ * milliseconds, ties to even. */
+static void wm_json_put_cdtime(wm_writer_t *w, cdtime_t t) /* {{{ */
+{
+  uint64_t d;
+  uint64_t frac;
+  uint64_t ms;
+  uint64_t rest;
+
+  if (t >= (UINT64_C(1) << 63)) {
+    char number[64];
+    int len = snprintf(number, sizeof(number), "%.3f", CDTIME_T_TO_DOUBLE(t));
+    wm_put(w, number, (size_t)len);
+    return;
+  }
+
+  d = (uint64_t)(double)t;
+  frac = (d & ((UINT64_C(1) << 30) - 1)) * 1000;
+  ms = frac >> 30;
+  rest = frac & ((UINT64_C(1) << 30) - 1);
+  if ((rest > (UINT64_C(1) << 29)) ||
+      ((rest == (UINT64_C(1) << 29)) && ((ms & 1) != 0)))
+    ms++;
+
+  d >>= 30;
+  if (ms == 1000) {
+    d++;
+    ms = 0;
+  }
+
+  wm_json_put_uint(w, d);
+  wm_put_u8(w, '.');
+  wm_put_u8(w, (char)('0' + ms / 100));
+  wm_put(w, wm_digit_pairs + 2 * (ms % 100), 2);
+} /* }}} void wm_json_put_cdtime */
+
+/*
+ * Shortest round-trip gauges, after Florian Loitsch's Grisu2 ("Printing
+ * Floating-Point Numbers Quickly and Accurately with Integers", PLDI 2010):
+ * the digits printed always parse back to the same double, and are in all
+ * but a few cases the fewest that do. A number is a 64-bit significand "f"
+ * and a binary exponent "e", f * 2^e.
+ */
+typedef struct {
+  uint64_t f;
+  int e;
+} wm_diyfp_t;
+
+/* Grisu2 prints at most 17 digits for a double; some room to spare. */
+#define WM_GRISU_DIGITS 24
+
+/* Normalized 10^(8 i - 348), rounded to 64 bits. */
+static uint64_t const wm_pow10_f[] = {
+    UINT64_C(0xfa8fd5a0081c0288), UINT64_C(0xbaaee17fa23ebf76),
+    UINT64_C(0x8b16fb203055ac76), UINT64_C(0xcf42894a5dce35ea),
+    UINT64_C(0x9a6bb0aa55653b2d), UINT64_C(0xe61acf033d1a45df),
+    UINT64_C(0xab70fe17c79ac6ca), UINT64_C(0xff77b1fcbebcdc4f),
+    UINT64_C(0xbe5691ef416bd60c), UINT64_C(0x8dd01fad907ffc3c),
+    UINT64_C(0xd3515c2831559a83), UINT64_C(0x9d71ac8fada6c9b5),
+    UINT64_C(0xea9c227723ee8bcb), UINT64_C(0xaecc49914078536d),
+    UINT64_C(0x823c12795db6ce57), UINT64_C(0xc21094364dfb5637),
+    UINT64_C(0x9096ea6f3848984f), UINT64_C(0xd77485cb25823ac7),
+    UINT64_C(0xa086cfcd97bf97f4), UINT64_C(0xef340a98172aace5),
+    UINT64_C(0xb23867fb2a35b28e), UINT64_C(0x84c8d4dfd2c63f3b),
+    UINT64_C(0xc5dd44271ad3cdba), UINT64_C(0x936b9fcebb25c996),
+    UINT64_C(0xdbac6c247d62a584), UINT64_C(0xa3ab66580d5fdaf6),
+    UINT64_C(0xf3e2f893dec3f126), UINT64_C(0xb5b5ada8aaff80b8),
+    UINT64_C(0x87625f056c7c4a8b), UINT64_C(0xc9bcff6034c13053),
+    UINT64_C(0x964e858c91ba2655), UINT64_C(0xdff9772470297ebd),
+    UINT64_C(0xa6dfbd9fb8e5b88f), UINT64_C(0xf8a95fcf88747d94),
+    UINT64_C(0xb94470938fa89bcf), UINT64_C(0x8a08f0f8bf0f156b),
+    UINT64_C(0xcdb02555653131b6), UINT64_C(0x993fe2c6d07b7fac),
+    UINT64_C(0xe45c10c42a2b3b06), UINT64_C(0xaa242499697392d3),
+    UINT64_C(0xfd87b5f28300ca0e), UINT64_C(0xbce5086492111aeb),
+    UINT64_C(0x8cbccc096f5088cc), UINT64_C(0xd1b71758e219652c),
+    UINT64_C(0x9c40000000000000), UINT64_C(0xe8d4a51000000000),
+    UINT64_C(0xad78ebc5ac620000), UINT64_C(0x813f3978f8940984),
+    UINT64_C(0xc097ce7bc90715b3), UINT64_C(0x8f7e32ce7bea5c70),
+    UINT64_C(0xd5d238a4abe98068), UINT64_C(0x9f4f2726179a2245),
+    UINT64_C(0xed63a231d4c4fb27), UINT64_C(0xb0de65388cc8ada8),
+    UINT64_C(0x83c7088e1aab65db), UINT64_C(0xc45d1df942711d9a),
+    UINT64_C(0x924d692ca61be758), UINT64_C(0xda01ee641a708dea),
+    UINT64_C(0xa26da3999aef774a), UINT64_C(0xf209787bb47d6b85),
+    UINT64_C(0xb454e4a179dd1877), UINT64_C(0x865b86925b9bc5c2),
+    UINT64_C(0xc83553c5c8965d3d), UINT64_C(0x952ab45cfa97a0b3),
+    UINT64_C(0xde469fbd99a05fe3), UINT64_C(0xa59bc234db398c25),
+    UINT64_C(0xf6c69a72a3989f5c), UINT64_C(0xb7dcbf5354e9bece),
+    UINT64_C(0x88fcf317f22241e2), UINT64_C(0xcc20ce9bd35c78a5),
+    UINT64_C(0x98165af37b2153df), UINT64_C(0xe2a0b5dc971f303a),
+    UINT64_C(0xa8d9d1535ce3b396), UINT64_C(0xfb9b7cd9a4a7443c),
+    UINT64_C(0xbb764c4ca7a44410), UINT64_C(0x8bab8eefb6409c1a),
+    UINT64_C(0xd01fef10a657842c), UINT64_C(0x9b10a4e5e9913129),
+    UINT64_C(0xe7109bfba19c0c9d), UINT64_C(0xac2820d9623bf429),
+    UINT64_C(0x80444b5e7aa7cf85), UINT64_C(0xbf21e44003acdd2d),
+    UINT64_C(0x8e679c2f5e44ff8f), UINT64_C(0xd433179d9c8cb841),
+    UINT64_C(0x9e19db92b4e31ba9), UINT64_C(0xeb96bf6ebadf77d9),
+    UINT64_C(0xaf87023b9bf0ee6b),
+};
+static int16_t const wm_pow10_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954,
+    -927, -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635,
+    -608, -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316,
+    -289, -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30, 56,
+    83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348, 375, 402, 428, 455,
+    481, 508, 534, 561, 588, 614, 641, 667, 694, 720, 747, 774, 800, 827, 853,
+    880, 907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+/* The product of two normalized numbers, rounded to 64 bits. */
+static wm_diyfp_t wm_diyfp_mul(wm_diyfp_t x, wm_diyfp_t y) /* {{{ */
+{
+  uint64_t a = x.f >> 32;
+  uint64_t b = x.f & UINT32_MAX;
+  uint64_t c = y.f >> 32;
+  uint64_t d = y.f & UINT32_MAX;
+  uint64_t ac = a * c;
+  uint64_t bc = b * c;
+  uint64_t ad = a * d;
+  uint64_t bd = b * d;
+  uint64_t mid = (bd >> 32) + (ad & UINT32_MAX) + (bc & UINT32_MAX);
+
+  mid += UINT64_C(1) << 31;
+  return (wm_diyfp_t){
+      .f = ac + (ad >> 32) + (bc >> 32) + (mid >> 32),
+      .e = x.e + y.e + 64,
+  };
+} /* }}} wm_diyfp_t wm_diyfp_mul */
+
+/* Moves the last digit of "digits" towards "w" while it stays within the
+ * rounding interval, see DigitGen in Loitsch's paper. */
+static void wm_grisu_round(char *digits, int len, uint64_t delta, /* {{{ */
+                           uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+  while ((rest < wp_w) && ((delta - rest) >= ten_kappa) &&
+         (((rest + ten_kappa) < wp_w) ||
+          ((wp_w - rest) > (rest + ten_kappa - wp_w)))) {
+    digits[len - 1]--;
+    rest += ten_kappa;
+  }
+} /* }}} void wm_grisu_round */
+
+/* Sets "digits", at least WM_GRISU_DIGITS long, to the shortest digit
+ * string within "delta" below "mp" and adds the decimal exponent of its last
+ * digit to "k". Returns the number of digits. */
+static int wm_grisu_digits(wm_diyfp_t w, wm_diyfp_t mp, /* {{{ */
+                           uint64_t delta, char *digits, int *k) {
+  static uint32_t const pow10[] = {1,         10,        100,     1000,
+                                   10000,     100000,    1000000, 10000000,
+                                   100000000, 1000000000};
+  int shift = -mp.e;
+  uint64_t one = UINT64_C(1) << shift;
+  uint64_t wp_w = mp.f - w.f;
+  uint32_t p1 = (uint32_t)(mp.f >> shift);
+  uint64_t p2 = mp.f & (one - 1);
+  int kappa = 10;
+  int len = 0;
+
+  while ((kappa > 1) && (p1 < pow10[kappa - 1]))
+    kappa--;
+
+  while (kappa > 0) {
+    uint32_t d;
+
+    /* Constant divisors, which compile to multiplications. */
+    switch (kappa) {
+    case 10:
+      d = p1 / 1000000000;
+      p1 %= 1000000000;
+      break;
+    case 9:
+      d = p1 / 100000000;
+      p1 %= 100000000;
+      break;
+    case 8:
+      d = p1 / 10000000;
+      p1 %= 10000000;
+      break;
+    case 7:
+      d = p1 / 1000000;
+      p1 %= 1000000;
+      break;
+    case 6:
+      d = p1 / 100000;
+      p1 %= 100000;
+      break;
+    case 5:
+      d = p1 / 10000;
+      p1 %= 10000;
+      break;
+    case 4:
+      d = p1 / 1000;
+      p1 %= 1000;
+      break;
+    case 3:
+      d = p1 / 100;
+      p1 %= 100;
+      break;
+    case 2:
+      d = p1 / 10;
+      p1 %= 10;
+      break;
+    default:
+      d = p1;
+      p1 = 0;
+    }
+    if ((d != 0) || (len != 0))
+      digits[len++] = (char)('0' + d);
+    kappa--;
+
+    uint64_t rest = ((uint64_t)p1 << shift) + p2;
+    if (rest <= delta) {
+      *k += kappa;
+      wm_grisu_round(digits, len, delta, rest, (uint64_t)pow10[kappa] << shift,
+                     wp_w);
+      return len;
+    }
+  }
+
+  /* The integral part is used up: go on with the fraction. */
+  uint64_t unit = 1;
+  while (42) {
+    p2 *= 10;
+    delta *= 10;
+    unit *= 10;
+
+    char d = (char)(p2 >> shift);
+    if ((d != 0) || (len != 0))
+      digits[len++] = (char)('0' + d);
+    p2 &= one - 1;
+    kappa--;
+    if (p2 < delta) {
+      *k += kappa;
+      wm_grisu_round(digits, len, delta, p2, one, wp_w * unit);
+      return len;
+    }
+  }
+} /* }}} int wm_grisu_digits */
+
+/* Sets "digits", at least WM_GRISU_DIGITS long, to the shortest round-trip
+ * digits of a finite, positive "value" and returns their number; the value
+ * is digits * 10^k. */
+static int wm_grisu2(double value, char *digits, int *k) /* {{{ */
+{
+  uint64_t bits;
+  wm_diyfp_t v;
+  wm_diyfp_t mp;
+  wm_diyfp_t mm;
+  wm_diyfp_t c;
+  int shift;
+
+  memcpy(&bits, &value, sizeof(bits));
+  v.f = bits & ((UINT64_C(1) << 52) - 1);
+  if ((bits >> 52) != 0) {
+    v.f |= UINT64_C(1) << 52;
+    v.e = (int)(bits >> 52) - 1075;
+  } else
+    v.e = -1074;
+
+  /* The boundaries halfway to the neighbouring doubles, normalized to the
+   * exponent of the upper one. The one below is closer at powers of two. */
+  mp = (wm_diyfp_t){.f = (v.f << 1) + 1, .e = v.e - 1};
+  shift = __builtin_clzll(mp.f);
+  mp.f <<= shift;
+  mp.e -= shift;
+  if ((v.f == (UINT64_C(1) << 52)) && (v.e > -1074))
+    mm = (wm_diyfp_t){.f = (v.f << 2) - 1, .e = v.e - 2};
+  else
+    mm = (wm_diyfp_t){.f = (v.f << 1) - 1, .e = v.e - 1};
+  mm.f <<= mm.e - mp.e;
+  mm.e = mp.e;
+
+  shift = __builtin_clzll(v.f);
+  v.f <<= shift;
+  v.e -= shift;
+
+  /* A cached power of ten that brings the exponent of the upper boundary
+   * into [-60, -32]. */
+  double dk = (-61 - mp.e) * 0.30102999566398114 + 347;
+  int ik = (int)dk;
+  if ((dk - ik) > 0.0)
+    ik++;
+  size_t index = (size_t)((ik >> 3) + 1);
+  *k = -(-348 + (int)index * 8);
+  c = (wm_diyfp_t){.f = wm_pow10_f[index], .e = wm_pow10_e[index]};
+
+  v = wm_diyfp_mul(v, c);
+  mp = wm_diyfp_mul(mp, c);
+  mm = wm_diyfp_mul(mm, c);
+  mm.f++;
+  mp.f--;
+  return wm_grisu_digits(v, mp, mp.f - mm.f, digits, k);
+} /* }}} int wm_grisu2 */
+
+/* Prints a finite, non-integral or large gauge with its shortest round-trip
+ * digits, laid out like "%.15g": in positional notation if the decimal
+ * exponent is at least -4 and less than 15, otherwise as "d.ddde+XX". */
+static void wm_json_put_double(wm_writer_t *w, double value) /* {{{ */
+{
+  char digits[WM_GRISU_DIGITS];
+  char number[WM_GRISU_DIGITS + 16];
+  size_t pos = 0;
+  int len;
+  int k;
+  int exp10;
+
+  if (signbit(value)) {
+    number[pos++] = '-';
+    value = -value;
+  }
+  if (value == 0.0) {
+    number[pos++] = '0';
+    wm_put(w, number, pos);
+    return;
+  }
+
+  len = wm_grisu2(value, digits, &k);
+  exp10 = len + k - 1;
+
+  if ((exp10 >= -4) && (exp10 < 15)) {
+    if (exp10 < 0) {
+      number[pos++] = '0';
+      number[pos++] = '.';
+      for (int i = -1; i > exp10; i--)
+        number[pos++] = '0';
+      memcpy(number + pos, digits, (size_t)len);
+      pos += (size_t)len;
+    } else if (exp10 >= len - 1) {
+      memcpy(number + pos, digits, (size_t)len);
+      pos += (size_t)len;
+      for (int i = len - 1; i < exp10; i++)
+        number[pos++] = '0';
+    } else {
+      memcpy(number + pos, digits, (size_t)exp10 + 1);
+      pos += (size_t)exp10 + 1;
+      number[pos++] = '.';
+      memcpy(number + pos, digits + exp10 + 1, (size_t)(len - exp10 - 1));
+      pos += (size_t)(len - exp10 - 1);
+    }
+    wm_put(w, number, pos);
+    return;
+  }
+
+  number[pos++] = digits[0];
+  if (len > 1) {
+    number[pos++] = '.';
+    memcpy(number + pos, digits + 1, (size_t)len - 1);
+    pos += (size_t)len - 1;
+  }
+  number[pos++] = 'e';
+  number[pos++] = (exp10 < 0) ? '-' : '+';
+  if (exp10 < 0)
+    exp10 = -exp10;
+  if (exp10 >= 100) {
+    number[pos++] = (char)('0' + exp10 / 100);
+    exp10 %= 100;
+  }
+  memcpy(number + pos, wm_digit_pairs + 2 * exp10, 2);
+  pos += 2;
+  wm_put(w, number, pos);
+} /* }}} void wm_json_put_double */
+
+/* Prints a gauge, or "null" like format_json if it is not finite. Integral
+ * gauges of up to 15 digits are printed as integers, as "%.15g" does. Other
+ * gauges are printed with the fewest digits that parse back to the same
+ * double, where format_json's GAUGE_FORMAT rounds to 15 digits: the output
+ * is the same for gauges that survive that rounding. */
+static void wm_json_put_gauge(wm_writer_t *w, gauge_t value) /* {{{ */
+{
+  if (!isfinite(value)) {
+    wm_put(w, "null", strlen("null"));
+    return;
+  }
+
+  if ((value > -1e15) && (value < 1e15) && (value == (gauge_t)(int64_t)value) &&
+      ((value != 0.0) || !signbit(value))) {
+    wm_json_put_int(w, (int64_t)value);
+    return;
+  }
+
+  wm_json_put_double(w, value);
+} /* }}} void wm_json_put_gauge */
+
+/* format_json escapes quotes and backslashes and replaces every "char" not
+ * above 0x1f with a question mark, which includes the bytes of multi-byte
+ * UTF-8 sequences where "char" is signed. */
+static bool wm_json_special(char c) /* {{{ */
+{
+  return (c == '"') || (c == '\\') || (c <= 0x1f);
+} /* }}} bool wm_json_special */
+
+/* Returns a bit mask of the bytes at "s" that wm_json_special() matches, or
+ * 0 if all are copied as they are, checking WM_JSON_BLOCK bytes at a time.
+ * SSE2 and NEON are part of the x86-64 and AArch64 base instruction sets;
+ * names are at most DATA_MAX_NAME_LEN bytes long, so wider vectors would
+ * not pay off. */
+#if defined(__SSE2__)
+#define WM_JSON_BLOCK 16
+typedef uint32_t wm_json_mask_t;
+static wm_json_mask_t wm_json_special_block(char const *s) /* {{{ */
+{
+  __m128i v = _mm_loadu_si128((__m128i const *)s);
+  __m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+#if CHAR_MIN < 0
+  special = _mm_or_si128(special, _mm_cmplt_epi8(v, _mm_set1_epi8(0x20)));
+#else
+  special = _mm_or_si128(
+      special, _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v));
+#endif
+  return (uint32_t)_mm_movemask_epi8(special);
+} /* }}} wm_json_mask_t wm_json_special_block */
+#elif defined(__ARM_NEON)
+#define WM_JSON_BLOCK 16
+/* NEON has no byte mask instruction; narrowing leaves four bits per byte. */
+typedef uint64_t wm_json_mask_t;
+static wm_json_mask_t wm_json_special_block(char const *s) /* {{{ */
+{
+  uint8x16_t v = vld1q_u8((uint8_t const *)s);
+  uint8x16_t special =
+      vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')), vceqq_u8(v, vdupq_n_u8('\\')));
+#if CHAR_MIN < 0
+  special = vorrq_u8(special,
+                     vcltq_s8(vreinterpretq_s8_u8(v), vdupq_n_s8(0x20)));
+#else
+  special = vorrq_u8(special, vcltq_u8(v, vdupq_n_u8(0x20)));
+#endif
+  return vget_lane_u64(
+      vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(special), 4)), 0);
+} /* }}} wm_json_mask_t wm_json_special_block */
+#endif
+
+#if WM_JSON_BLOCK
+#if defined(__ARM_NEON) && !defined(__SSE2__)
+#define WM_JSON_BLOCK_FIRST(mask) ((size_t)__builtin_ctzll(mask) / 4)
+#else
+#define WM_JSON_BLOCK_FIRST(mask) ((size_t)__builtin_ctz(mask))
+#endif
+#endif
+
+/* Prints the "len" bytes at "s" as a JSON string, one byte at a time. */
+static void wm_json_put_string_scalar(wm_writer_t *w, /* {{{ */
+                                      char const *s, size_t len) {
+  wm_put_u8(w, '"');
+  for (size_t i = 0; i < len; i++) {
+    if ((s[i] == '"') || (s[i] == '\\')) {
+      wm_put_u8(w, '\\');
+      wm_put_u8(w, (uint8_t)s[i]);
+    } else
+      wm_put_u8(w, wm_json_special(s[i]) ? '?' : (uint8_t)s[i]);
+  }
+  wm_put_u8(w, '"');
+} /* }}} void wm_json_put_string_scalar */
+
+/* Prints "s" as a JSON string, escaped like format_json does. Runs without
+ * special characters are copied in bulk. */
+static void wm_json_put_string(wm_writer_t *w, char const *s) /* {{{ */
+{
+  size_t len = strlen(s);
+  size_t pos = 0;
+  char *out;
+
+  /* Every byte takes at most two. */
+  if (w->overflow || ((w->size - w->pos) < (2 * len + 2))) {
+    wm_json_put_string_scalar(w, s, len);
+    return;
+  }
+
+  out = w->data + w->pos;
+  *(out++) = '"';
+  while (pos < len) {
+#if WM_JSON_BLOCK
+    if (len - pos >= WM_JSON_BLOCK) {
+      wm_json_mask_t mask = wm_json_special_block(s + pos);
+
+      if (mask == 0) {
+        memcpy(out, s + pos, WM_JSON_BLOCK);
+        out += WM_JSON_BLOCK;
+        pos += WM_JSON_BLOCK;
+        continue;
+      }
+
+      size_t clean = WM_JSON_BLOCK_FIRST(mask);
+      memcpy(out, s + pos, clean);
+      out += clean;
+      pos += clean;
+    }
+#endif
+
+    char c = s[pos++];
+    if ((c == '"') || (c == '\\')) {
+      *(out++) = '\\';
+      *(out++) = c;
+    } else
+      *(out++) = wm_json_special(c) ? '?' : c;
+  }
+  *(out++) = '"';
+  w->pos = (size_t)(out - w->data);
+} /* }}} void wm_json_put_string */
+
+/* Remembers the parts of a value list's JSON, as rendered by
+ * format_json_value_list(), that are the same for all value lists of the
+ * series. Values, time and interval are numbers, so the first "]" ends the
+ * values and the first "time" and "host" keys are the series' own. If the
+ * JSON does not look as expected, nothing is cached. */
+static void wm_json_cache_series(wm_series_t *s, char const *json, /* {{{ */
+                                 size_t len) {
+  static char const values_key[] = ",{\"values\":[";
+  static char const time_key[] = ",\"time\":";
+  static char const host_key[] = ",\"host\":";
+  char const *values_end;
+  char const *time_end;
+  char const *host;
+  char *fragment;
+
+  if ((len < strlen(values_key)) ||
+      (memcmp(json, values_key, strlen(values_key)) != 0))
+    return;
+
+  /* format_json_value_list() terminates its output, so the keys can be
+   * searched with strstr(). */
+  values_end = memchr(json, ']', len);
+  time_end = (values_end == NULL) ? NULL : strstr(values_end, time_key);
+  if (time_end == NULL)
+    return;
+  time_end += strlen(time_key);
+  host = strstr(time_end, host_key);
+  if ((host == NULL) || (host >= (json + len)))
+    return;
+
+  fragment = malloc((size_t)(time_end - values_end) +
+                    (size_t)(json + len - host));
+  if (fragment == NULL)
+    return;
+
+  s->json_split = (size_t)(time_end - values_end);
+  s->json_len = s->json_split + (size_t)(json + len - host);
+  memcpy(fragment, values_end, s->json_split);
+  memcpy(fragment + s->json_split, host, s->json_len - s->json_split);
+  s->json = fragment;
+} /* }}} void wm_json_cache_series */
+
+/* Prints the opening of a value list and its values, up to the closing
+ * bracket. */
+static void wm_json_put_values(wm_writer_t *w, const data_set_t *ds, /* {{{ */
+                               const value_list_t *vl, gauge_t const *rates) {
+  wm_put(w, ",{\"values\":[", strlen(",{\"values\":["));
+  for (size_t i = 0; i < ds->ds_num; i++) {
+    if (i > 0)
+      wm_put_u8(w, ',');
+
+    if (ds->ds[i].type == DS_TYPE_GAUGE) {
+      wm_json_put_gauge(w, vl->values[i].gauge);
+      continue;
+    } else if (rates != NULL) {
+      wm_json_put_gauge(w, rates[i]);
+      continue;
+    }
+
+    if (ds->ds[i].type == DS_TYPE_COUNTER)
+      wm_json_put_uint(w, (uint64_t)vl->values[i].counter);
+    else if (ds->ds[i].type == DS_TYPE_DERIVE)
+      wm_json_put_int(w, (int64_t)vl->values[i].derive);
+    else
+      wm_json_put_uint(w, (uint64_t)vl->values[i].absolute);
+  }
+} /* }}} void wm_json_put_values */
+
+/* Same output as wm_json_value_list(), but with the metadata of the series
+ * copied from the cache: only the values, time and interval are
+ * formatted. */
+static int wm_json_value_list_cached(char *buffer, /* {{{ */
+                                     size_t *ret_buffer_fill,
+                                     size_t *ret_buffer_free,
+                                     const data_set_t *ds,
+                                     const value_list_t *vl, int store_rates,
+                                     wm_series_t const *s) {
+  /* Leave room for format_json_finalize()'s closing bracket. */
+  wm_writer_t w = {
+      .data = buffer + *ret_buffer_fill,
+      .size = (*ret_buffer_free > 2) ? (*ret_buffer_free - 2) : 0,
+  };
+  gauge_t *rates;
+
+  if (wm_get_rates(ds, vl, store_rates, &rates) != 0)
+    return -1;
+
+  wm_json_put_values(&w, ds, vl, rates);
+  sfree(rates);
+
+  wm_put(&w, s->json, s->json_split);
+  wm_json_put_cdtime(&w, vl->time);
+  wm_put(&w, ",\"interval\":", strlen(",\"interval\":"));
+  wm_json_put_cdtime(&w, vl->interval);
+  wm_put(&w, s->json + s->json_split, s->json_len - s->json_split);
+
+  if (!w.overflow)
+    w.data[w.pos] = 0;
+  return wm_writer_finish(&w, ret_buffer_fill, ret_buffer_free);
+} /* }}} int wm_json_value_list_cached */
+
+/* Same output as format_json_value_list(), which is left to value lists with
+ * metadata, except for gauges: see wm_json_put_gauge(). */
+static int wm_json_value_list(char *buffer, size_t *ret_buffer_fill, /* {{{ */
+                              size_t *ret_buffer_free, const data_set_t *ds,
+                              const value_list_t *vl, int store_rates) {
+  char const *const names[][2] = {
+      {",\"host\":", vl->host},
+      {",\"plugin\":", vl->plugin},
+      {",\"plugin_instance\":", vl->plugin_instance},
+      {",\"type\":", vl->type},
+      {",\"type_instance\":", vl->type_instance},
+  };
+  wm_writer_t w = {
+      .data = buffer + *ret_buffer_fill,
+      .size = (*ret_buffer_free > 2) ? (*ret_buffer_free - 2) : 0,
+  };
+  gauge_t *rates;
+
+  if (vl->meta != NULL)
+    return format_json_value_list(buffer, ret_buffer_fill, ret_buffer_free,
+                                  ds, vl, store_rates);
+
+  if (wm_get_rates(ds, vl, store_rates, &rates) != 0)
+    return -1;
+  wm_json_put_values(&w, ds, vl, rates);
+  sfree(rates);
+
+  wm_put(&w, "],\"dstypes\":[", strlen("],\"dstypes\":["));
+  for (size_t i = 0; i < ds->ds_num; i++) {
+    if (i > 0)
+      wm_put_u8(&w, ',');
+    wm_put_u8(&w, '"');
+    wm_put(&w, DS_TYPE_TO_STRING(ds->ds[i].type),
+           strlen(DS_TYPE_TO_STRING(ds->ds[i].type)));
+    wm_put_u8(&w, '"');
+  }
+  /* Data source names are not escaped by format_json either. */
+  wm_put(&w, "],\"dsnames\":[", strlen("],\"dsnames\":["));
+  for (size_t i = 0; i < ds->ds_num; i++) {
+    if (i > 0)
+      wm_put_u8(&w, ',');
+    wm_put_u8(&w, '"');
+    wm_put(&w, ds->ds[i].name, strlen(ds->ds[i].name));
+    wm_put_u8(&w, '"');
+  }
+
+  wm_put(&w, "],\"time\":", strlen("],\"time\":"));
+  wm_json_put_cdtime(&w, vl->time);
+  wm_put(&w, ",\"interval\":", strlen(",\"interval\":"));
+  wm_json_put_cdtime(&w, vl->interval);
+  for (size_t i = 0; i < STATIC_ARRAY_SIZE(names); i++) {
+    wm_put(&w, names[i][0], strlen(names[i][0]));
+    wm_json_put_string(&w, names[i][1]);
+  }
+  wm_put_u8(&w, '}');
+
+  if (!w.overflow)
+    w.data[w.pos] = 0;
+  return wm_writer_finish(&w, ret_buffer_fill, ret_buffer_free);
+} /* }}} int wm_json_value_list */
+
+/* collectd's network protocol: every value list is written as a complete set
+ * of parts, so that each message can be decoded on its own. */
+#define WM_NETWORK_TYPE_HOST 0x0000
+#define WM_NETWORK_TYPE_PLUGIN 0x0002
+#define WM_NETWORK_TYPE_PLUGIN_INSTANCE 0x0003
+#define WM_NETWORK_TYPE_TYPE 0x0004
+#define WM_NETWORK_TYPE_TYPE_INSTANCE 0x0005
+#define WM_NETWORK_TYPE_VALUES 0x0006
+#define WM_NETWORK_TYPE_TIME_HR 0x0008
+#define WM_NETWORK_TYPE_INTERVAL_HR 0x0009
+
+static void wm_network_put_string(wm_writer_t *w, uint16_t type, /* {{{ */
+                                  char const *str) {
+  size_t len = strlen(str) + 1;
+
+  wm_put_be16(w, type);
+  wm_put_be16(w, (uint16_t)(4 + len));
+  wm_put(w, str, len);
+} /* }}} void wm_network_put_string */
+
+static void wm_network_put_number(wm_writer_t *w, uint16_t type, /* {{{ */
+                                  uint64_t v) {
+  wm_put_be16(w, type);
+  wm_put_be16(w, 4 + sizeof(uint64_t));
+  wm_put_be64(w, v);
+} /* }}} void wm_network_put_number */
+
+static int wm_network_value_list(char *buffer, /* {{{ */
+                                 size_t *ret_buffer_fill,
+                                 size_t *ret_buffer_free,
+                                 const data_set_t *ds, const value_list_t *vl,
+                                 int store_rates) {
+  wm_writer_t w = {
+      .data = buffer + *ret_buffer_fill,
+      .size = *ret_buffer_free,
+  };
+  gauge_t *rates;
+
+  if (wm_get_rates(ds, vl, store_rates, &rates) != 0)
+    return -1;
+
+  wm_network_put_string(&w, WM_NETWORK_TYPE_HOST, vl->host);
+  wm_network_put_number(&w, WM_NETWORK_TYPE_TIME_HR, vl->time);
+  wm_network_put_number(&w, WM_NETWORK_TYPE_INTERVAL_HR, vl->interval);
+  wm_network_put_string(&w, WM_NETWORK_TYPE_PLUGIN, vl->plugin);
+  wm_network_put_string(&w, WM_NETWORK_TYPE_PLUGIN_INSTANCE,
+                        vl->plugin_instance);
+  wm_network_put_string(&w, WM_NETWORK_TYPE_TYPE, vl->type);
+  wm_network_put_string(&w, WM_NETWORK_TYPE_TYPE_INSTANCE, vl->type_instance);
+
+  wm_put_be16(&w, WM_NETWORK_TYPE_VALUES);
+  wm_put_be16(&w, (uint16_t)(6 + 9 * ds->ds_num));
+  wm_put_be16(&w, (uint16_t)ds->ds_num);
+  for (size_t i = 0; i < ds->ds_num; i++)
+    wm_put_u8(&w, (uint8_t)((rates != NULL) ? DS_TYPE_GAUGE : ds->ds[i].type));
+  for (size_t i = 0; i < ds->ds_num; i++) {
+    if (rates != NULL)
+      wm_put_le_double(&w, rates[i]);
+    else if (ds->ds[i].type == DS_TYPE_GAUGE)
+      wm_put_le_double(&w, vl->values[i].gauge);
+    else if (ds->ds[i].type == DS_TYPE_COUNTER)
+      wm_put_be64(&w, (uint64_t)vl->values[i].counter);
+    else if (ds->ds[i].type == DS_TYPE_DERIVE)
+      wm_put_be64(&w, (uint64_t)vl->values[i].derive);
+    else
+      wm_put_be64(&w, (uint64_t)vl->values[i].absolute);
+  }
+
+  sfree(rates);
+  return wm_writer_finish(&w, ret_buffer_fill, ret_buffer_free);
+} /* }}} int wm_network_value_list */
+
+/* MessagePack: a stream of maps with the same keys and values as the JSON
+ * format. */
+static void wm_msgpack_put_str(wm_writer_t *w, char const *str) /* {{{ */
+{
+  size_t len = strlen(str);
+
+  if (len < 32)
+    wm_put_u8(w, (uint8_t)(0xa0 | len));
+  else if (len <= UINT8_MAX) {
+    wm_put_u8(w, 0xd9);
+    wm_put_u8(w, (uint8_t)len);
+  } else {
+    wm_put_u8(w, 0xda);
+    wm_put_be16(w, (uint16_t)len);
+  }
+  wm_put(w, str, len);
+} /* }}} void wm_msgpack_put_str */
+
+static void wm_msgpack_put_array(wm_writer_t *w, size_t num) /* {{{ */
+{
+  if (num < 16)
+    wm_put_u8(w, (uint8_t)(0x90 | num));
+  else {
+    wm_put_u8(w, 0xdc);
+    wm_put_be16(w, (uint16_t)num);
+  }
+} /* }}} void wm_msgpack_put_array */
+
+static void wm_msgpack_put_double(wm_writer_t *w, double v) /* {{{ */
+{
+  uint64_t bits;
+
+  memcpy(&bits, &v, sizeof(bits));
+  wm_put_u8(w, 0xcb);
+  wm_put_be64(w, bits);
+} /* }}} void wm_msgpack_put_double */
+
+static void wm_msgpack_put_uint(wm_writer_t *w, uint64_t v) /* {{{ */
+{
+  if (v < 0x80)
+    wm_put_u8(w, (uint8_t)v);
+  else if (v <= UINT8_MAX) {
+    wm_put_u8(w, 0xcc);
+    wm_put_u8(w, (uint8_t)v);
+  } else if (v <= UINT16_MAX) {
+    wm_put_u8(w, 0xcd);
+    wm_put_be16(w, (uint16_t)v);
+  } else if (v <= UINT32_MAX) {
+    wm_put_u8(w, 0xce);
+    wm_put_be32(w, (uint32_t)v);
+  } else {
+    wm_put_u8(w, 0xcf);
+    wm_put_be64(w, v);
+  }
+} /* }}} void wm_msgpack_put_uint */
+
+static void wm_msgpack_put_int(wm_writer_t *w, int64_t v) /* {{{ */
+{
+  if (v >= 0)
+    wm_msgpack_put_uint(w, (uint64_t)v);
+  else if (v >= -32)
+    wm_put_u8(w, (uint8_t)v);
+  else if (v >= INT8_MIN) {
+    wm_put_u8(w, 0xd0);
+    wm_put_u8(w, (uint8_t)v);
+  } else if (v >= INT16_MIN) {
+    wm_put_u8(w, 0xd1);
+    wm_put_be16(w, (uint16_t)v);
+  } else if (v >= INT32_MIN) {
+    wm_put_u8(w, 0xd2);
+    wm_put_be32(w, (uint32_t)v);
+  } else {
+    wm_put_u8(w, 0xd3);
+    wm_put_be64(w, (uint64_t)v);
+  }
+} /* }}} void wm_msgpack_put_int */
+
+static int wm_msgpack_value_list(char *buffer, /* {{{ */
+                                 size_t *ret_buffer_fill,
+                                 size_t *ret_buffer_free,
+                                 const data_set_t *ds, const value_list_t *vl,
+                                 int store_rates) {
+  wm_writer_t w = {
+      .data = buffer + *ret_buffer_fill,
+      .size = *ret_buffer_free,
+  };
+  gauge_t *rates;
+
+  if (wm_get_rates(ds, vl, store_rates, &rates) != 0)
+    return -1;
+
+  wm_put_u8(&w, 0x80 | 10); /* fixmap with 10 entries */
+
+  wm_msgpack_put_str(&w, "values");
+  wm_msgpack_put_array(&w, ds->ds_num);
+  for (size_t i = 0; i < ds->ds_num; i++) {
+    if (rates != NULL)
+      wm_msgpack_put_double(&w, rates[i]);
+    else if (ds->ds[i].type == DS_TYPE_GAUGE)
+      wm_msgpack_put_double(&w, vl->values[i].gauge);
+    else if (ds->ds[i].type == DS_TYPE_COUNTER)
+      wm_msgpack_put_uint(&w, (uint64_t)vl->values[i].counter);
+    else if (ds->ds[i].type == DS_TYPE_DERIVE)
+      wm_msgpack_put_int(&w, (int64_t)vl->values[i].derive);
+    else
+      wm_msgpack_put_uint(&w, (uint64_t)vl->values[i].absolute);
+  }
+
+  wm_msgpack_put_str(&w, "dstypes");
+  wm_msgpack_put_array(&w, ds->ds_num);
+  for (size_t i = 0; i < ds->ds_num; i++)
+    wm_msgpack_put_str(&w, (rates != NULL)
+                               ? "gauge"
+                               : DS_TYPE_TO_STRING(ds->ds[i].type));
+
+  wm_msgpack_put_str(&w, "dsnames");
+  wm_msgpack_put_array(&w, ds->ds_num);
+  for (size_t i = 0; i < ds->ds_num; i++)
+    wm_msgpack_put_str(&w, ds->ds[i].name);
+
+  wm_msgpack_put_str(&w, "time");
+  wm_msgpack_put_double(&w, CDTIME_T_TO_DOUBLE(vl->time));
+  wm_msgpack_put_str(&w, "interval");
+  wm_msgpack_put_double(&w, CDTIME_T_TO_DOUBLE(vl->interval));
+  wm_msgpack_put_str(&w, "host");
+  wm_msgpack_put_str(&w, vl->host);
+  wm_msgpack_put_str(&w, "plugin");
+  wm_msgpack_put_str(&w, vl->plugin);
+  wm_msgpack_put_str(&w, "plugin_instance");
+  wm_msgpack_put_str(&w, vl->plugin_instance);
+  wm_msgpack_put_str(&w, "type");
+  wm_msgpack_put_str(&w, vl->type);
+  wm_msgpack_put_str(&w, "type_instance");
+  wm_msgpack_put_str(&w, vl->type_instance);
+
+  sfree(rates);
+  return wm_writer_finish(&w, ret_buffer_fill, ret_buffer_free);
+} /* }}} int wm_msgpack_value_list */
+
+/* Protobuf: a stream of length-delimited messages of this schema:
+ *
+ *   message Value {
+ *     string name = 1;
+ *     oneof value {
+ *       double gauge = 2;
+ *       uint64 counter = 3;
+ *       sint64 derive = 4;
+ *       uint64 absolute = 5;
+ *     }
+ *   }
+ *   message ValueList {
+ *     double time = 1;
+ *     double interval = 2;
+ *     string host = 3;
+ *     string plugin = 4;
+ *     string plugin_instance = 5;
+ *     string type = 6;
+ *     string type_instance = 7;
+ *     repeated Value values = 8;
+ *   }
+ *
+ * Rates (StoreRates) are sent as gauges. */
+#define WM_PB_VARINT 0
+#define WM_PB_FIXED64 1
+#define WM_PB_BYTES 2
+#define WM_PB_TAG(field, wire_type) ((uint8_t)(((field) << 3) | (wire_type)))
+
+static void wm_pb_put_string(wm_writer_t *w, uint8_t tag, /* {{{ */
+                             char const *str) {
+  size_t len = strlen(str);
+
+  /* Empty strings are the default and therefore omitted. */
+  if (len == 0)
+    return;
+
+  wm_put_u8(w, tag);
+  wm_put_varint(w, len);
+  wm_put(w, str, len);
+} /* }}} void wm_pb_put_string */
+
+static int wm_protobuf_value_list(char *buffer, /* {{{ */
+                                  size_t *ret_buffer_fill,
+                                  size_t *ret_buffer_free,
+                                  const data_set_t *ds, const value_list_t *vl,
+                                  int store_rates) {
+  /* The ValueList is written after room for the largest length prefix and
+   * moved into place once its size is known. */
+  size_t const prefix_max = 5;
+  wm_writer_t w = {
+      .data = buffer + *ret_buffer_fill,
+      .pos = prefix_max,
+      .size = *ret_buffer_free,
+  };
+  size_t prefix_len;
+  size_t msg_len;
+  gauge_t *rates;
+
+  if (w.size < prefix_max)
+    return -ENOMEM;
+
+  if (wm_get_rates(ds, vl, store_rates, &rates) != 0)
+    return -1;
+
+  wm_put_u8(&w, WM_PB_TAG(1, WM_PB_FIXED64));
+  wm_put_le_double(&w, CDTIME_T_TO_DOUBLE(vl->time));
+  wm_put_u8(&w, WM_PB_TAG(2, WM_PB_FIXED64));
+  wm_put_le_double(&w, CDTIME_T_TO_DOUBLE(vl->interval));
+  wm_pb_put_string(&w, WM_PB_TAG(3, WM_PB_BYTES), vl->host);
+  wm_pb_put_string(&w, WM_PB_TAG(4, WM_PB_BYTES), vl->plugin);
+  wm_pb_put_string(&w, WM_PB_TAG(5, WM_PB_BYTES), vl->plugin_instance);
+  wm_pb_put_string(&w, WM_PB_TAG(6, WM_PB_BYTES), vl->type);
+  wm_pb_put_string(&w, WM_PB_TAG(7, WM_PB_BYTES), vl->type_instance);
+
+  for (size_t i = 0; i < ds->ds_num; i++) {
+    size_t name_len = strlen(ds->ds[i].name);
+    uint64_t number = 0;
+    size_t value_len;
+    uint8_t tag;
+
+    if ((rates != NULL) || (ds->ds[i].type == DS_TYPE_GAUGE)) {
+      tag = WM_PB_TAG(2, WM_PB_FIXED64);
+      value_len = 1 + sizeof(double);
+    } else {
+      if (ds->ds[i].type == DS_TYPE_COUNTER) {
+        tag = WM_PB_TAG(3, WM_PB_VARINT);
+        number = (uint64_t)vl->values[i].counter;
+      } else if (ds->ds[i].type == DS_TYPE_DERIVE) {
+        int64_t d = (int64_t)vl->values[i].derive;
+        tag = WM_PB_TAG(4, WM_PB_VARINT);
+        number = ((uint64_t)d << 1) ^ (uint64_t)(d >> 63); /* zigzag */
+      } else {
+        tag = WM_PB_TAG(5, WM_PB_VARINT);
+        number = (uint64_t)vl->values[i].absolute;
+      }
+      value_len = 1 + wm_varint_size(number);
+    }
+
+    wm_put_u8(&w, WM_PB_TAG(8, WM_PB_BYTES));
+    wm_put_varint(&w, 1 + wm_varint_size(name_len) + name_len + value_len);
+    wm_put_u8(&w, WM_PB_TAG(1, WM_PB_BYTES));
+    wm_put_varint(&w, name_len);
+    wm_put(&w, ds->ds[i].name, name_len);
+    wm_put_u8(&w, tag);
+    if (rates != NULL)
+      wm_put_le_double(&w, rates[i]);
+    else if (ds->ds[i].type == DS_TYPE_GAUGE)
+      wm_put_le_double(&w, vl->values[i].gauge);
+    else
+      wm_put_varint(&w, number);
+  }
+
+  sfree(rates);
+  if (w.overflow)
+    return -ENOMEM;
+
+  msg_len = w.pos - prefix_max;
+  prefix_len = wm_varint_size(msg_len);
+  memmove(w.data + prefix_len, w.data + prefix_max, msg_len);
+  w.pos = 0;
+  wm_put_varint(&w, msg_len);
+  w.pos = prefix_len + msg_len;
+
+  return wm_writer_finish(&w, ret_buffer_fill, ret_buffer_free);
+} /* }}} int wm_protobuf_value_list */
+
+/* Columnar: the value lists of a message are grouped by series, so that the
+ * metadata of a series is sent once per message, followed by its times and
+ * values packed as bit streams. Every message is
+ *
+ *   message := "WMC1" series_num:varint series*
+ *   series  := host plugin plugin_instance type type_instance:string
+ *              interval:varint values_num:u8 (ds_type:u8 ds_name:string)*
+ *              count:varint time:varint bits_len:varint bits[bits_len]
+ *
+ * Strings are a varint length followed by the bytes, times and intervals are
+ * milliseconds. "time" is the time of the first of the "count" value lists.
+ * "bits" holds, most significant bit first, the times of the other value
+ * lists as delta-of-delta, followed by the "count" values of each data
+ * source in turn: gauges XOR-ed with their predecessor, counters, derives
+ * and absolutes as delta-of-delta, both as in Facebook's Gorilla. Rates
+ * (StoreRates) are sent as gauges.
+ *
+ * While the batch is being filled, value lists are appended as row records,
+ * which the publish thread rewrites with wm_columnar_encode(), message by
+ * message, into scratch space of its connection:
+ *
+ *   record := len:u32 time:u64 key_len:u32 key values:u64[values_num] pad
+ *   key    := interval:u64 host plugin plugin_instance type type_instance
+ *             values_num:u8 (ds_type:u8 ds_name)*
+ *
+ * in host byte order with NUL-terminated strings. Records are padded to the
+ * most their row can take once encoded, so no message grows. */
+#define WM_COLUMNAR_MAGIC "WMC1"
+#define WM_COLUMNAR_RECORD_HEADER (4 + 8 + 4)
+/* What the message and series headers take at most beyond the key: magic,
+ * series_num, the longer interval, count, time and bits_len. */
+#define WM_COLUMNAR_OVERHEAD (4 + 5 + 2 + 5 + 10 + 5)
+/* Worst case of a time: a delta-of-delta of 68 bits. */
+#define WM_COLUMNAR_TIME_MAX 9
+/* Worst case of a value: XOR with a new window of 77 bits. */
+#define WM_COLUMNAR_VALUE_MAX 10
+
+static void wm_put_cstring(wm_writer_t *w, char const *str) /* {{{ */
+{
+  wm_put(w, str, strlen(str) + 1);
+} /* }}} void wm_put_cstring */
+
+static int wm_columnar_value_list(char *buffer, /* {{{ */
+                                  size_t *ret_buffer_fill,
+                                  size_t *ret_buffer_free,
+                                  const data_set_t *ds, const value_list_t *vl,
+                                  int store_rates) {
+  wm_writer_t w = {
+      .data = buffer + *ret_buffer_fill,
+      .pos = WM_COLUMNAR_RECORD_HEADER,
+      .size = *ret_buffer_free,
+  };
+  uint64_t interval = vl->interval;
+  uint64_t time = vl->time;
+  uint32_t key_len;
+  uint32_t len;
+  size_t pad;
+  gauge_t *rates;
+
+  if ((w.size < WM_COLUMNAR_RECORD_HEADER) || (ds->ds_num > UINT8_MAX))
+    return (ds->ds_num > UINT8_MAX) ? -EINVAL : -ENOMEM;
+
+  if (wm_get_rates(ds, vl, store_rates, &rates) != 0)
+    return -1;
+
+  wm_put(&w, &interval, sizeof(interval));
+  wm_put_cstring(&w, vl->host);
+  wm_put_cstring(&w, vl->plugin);
+  wm_put_cstring(&w, vl->plugin_instance);
+  wm_put_cstring(&w, vl->type);
+  wm_put_cstring(&w, vl->type_instance);
+  wm_put_u8(&w, (uint8_t)ds->ds_num);
+  for (size_t i = 0; i < ds->ds_num; i++) {
+    wm_put_u8(&w, (uint8_t)((rates != NULL) ? DS_TYPE_GAUGE : ds->ds[i].type));
+    wm_put_cstring(&w, ds->ds[i].name);
+  }
+  key_len = (uint32_t)(w.pos - WM_COLUMNAR_RECORD_HEADER);
+
+  for (size_t i = 0; i < ds->ds_num; i++) {
+    if (rates != NULL)
+      wm_put(&w, rates + i, sizeof(rates[i]));
+    else
+      wm_put(&w, vl->values + i, sizeof(vl->values[i]));
+  }
+  sfree(rates);
+
+  pad = WM_COLUMNAR_OVERHEAD + WM_COLUMNAR_TIME_MAX +
+        WM_COLUMNAR_VALUE_MAX * ds->ds_num + key_len;
+  pad = (pad > w.pos) ? (pad - w.pos) : 0;
+  if (w.overflow || ((w.size - w.pos) < pad))
+    return -ENOMEM;
+  memset(w.data + w.pos, 0, pad);
+  w.pos += pad;
+
+  len = (uint32_t)w.pos;
+  memcpy(w.data, &len, sizeof(len));
+  memcpy(w.data + sizeof(len), &time, sizeof(time));
+  memcpy(w.data + sizeof(len) + sizeof(time), &key_len, sizeof(key_len));
+
+  return wm_writer_finish(&w, ret_buffer_fill, ret_buffer_free);
+} /* }}} int wm_columnar_value_list */
+
+/* Writes bits most significant first. */
+typedef struct {
+  wm_writer_t *w;
+  uint64_t acc;
+  int num;
+} wm_bits_t;
+
+static void wm_bits_put(wm_bits_t *b, uint64_t v, int num) /* {{{ */
+{
+  /* Leaves room for the up to 7 bits not written yet. */
+  if (num > 32) {
+    wm_bits_put(b, v >> 32, num - 32);
+    wm_bits_put(b, v, 32);
+    return;
+  }
+
+  b->acc = (b->acc << num) | (v & ((UINT64_C(1) << num) - 1));
+  b->num += num;
+  while (b->num >= 8) {
+    b->num -= 8;
+    wm_put_u8(b->w, (uint8_t)(b->acc >> b->num));
+  }
+} /* }}} void wm_bits_put */
+
+static void wm_bits_flush(wm_bits_t *b) /* {{{ */
+{
+  if (b->num > 0)
+    wm_bits_put(b, 0, 8 - b->num);
+} /* }}} void wm_bits_flush */
+
+/* Gorilla's delta-of-delta buckets, with 64 bits for anything larger. The
+ * difference wraps around, so that any two deltas round-trip. */
+static void wm_bits_put_dod(wm_bits_t *b, int64_t delta, /* {{{ */
+                            int64_t prev_delta) {
+  int64_t dod = (int64_t)((uint64_t)delta - (uint64_t)prev_delta);
+
+  if (dod == 0)
+    wm_bits_put(b, 0x0, 1);
+  else if ((dod >= -64) && (dod < 64))
+    wm_bits_put(b, (0x2 << 7) | ((uint64_t)dod & 0x7f), 2 + 7);
+  else if ((dod >= -256) && (dod < 256))
+    wm_bits_put(b, (0x6 << 9) | ((uint64_t)dod & 0x1ff), 3 + 9);
+  else if ((dod >= -2048) && (dod < 2048))
+    wm_bits_put(b, (0xe << 12) | ((uint64_t)dod & 0xfff), 4 + 12);
+  else {
+    wm_bits_put(b, 0xf, 4);
+    wm_bits_put(b, (uint64_t)dod, 64);
+  }
+} /* }}} void wm_bits_put_dod */
+
+typedef struct {
+  char const *key;
+  uint32_t key_len;
+  uint32_t hash;
+  size_t first;
+  size_t last;
+  size_t count;
+} wm_columnar_series_t;
+
+typedef struct {
+  char const *record;
+  size_t next;
+} wm_columnar_row_t;
+
+static uint64_t wm_columnar_u64(char const *p) /* {{{ */
+{
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+} /* }}} uint64_t wm_columnar_u64 */
+
+static uint32_t wm_columnar_u32(char const *p) /* {{{ */
+{
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+} /* }}} uint32_t wm_columnar_u32 */
+
+/* Encodes the rows of "s" into "bits". */
+static void wm_columnar_put_bits(wm_writer_t *bits, /* {{{ */
+                                 wm_columnar_series_t const *s,
+                                 wm_columnar_row_t const *rows,
+                                 uint8_t const *types, size_t values_num) {
+  char const *values_start = s->key + s->key_len;
+  wm_bits_t b = {.w = bits};
+  uint64_t prev = CDTIME_T_TO_MS(wm_columnar_u64(rows[s->first].record + 4));
+  int64_t prev_delta = 0;
+
+  for (size_t r = rows[s->first].next; r != SIZE_MAX; r = rows[r].next) {
+    uint64_t time = CDTIME_T_TO_MS(wm_columnar_u64(rows[r].record + 4));
+    int64_t delta = (int64_t)(time - prev);
+
+    wm_bits_put_dod(&b, delta, prev_delta);
+    prev = time;
+    prev_delta = delta;
+  }
+
+  for (size_t i = 0; i < values_num; i++) {
+    size_t offset = (size_t)(values_start - rows[s->first].record) + 8 * i;
+    uint64_t prev_value = 0;
+    int prev_leading = -1;
+    int prev_trailing = 0;
+
+    prev_delta = 0;
+    for (size_t r = s->first; r != SIZE_MAX; r = rows[r].next) {
+      uint64_t value = wm_columnar_u64(rows[r].record + offset);
+
+      if (types[i] != DS_TYPE_GAUGE) {
+        int64_t delta = (int64_t)(value - prev_value);
+
+        wm_bits_put_dod(&b, delta, prev_delta);
+        prev_value = value;
+        prev_delta = delta;
+        continue;
+      }
+
+      if (r == s->first) {
+        wm_bits_put(&b, value, 64);
+        prev_value = value;
+        continue;
+      }
+
+      uint64_t xor = value ^ prev_value;
+      prev_value = value;
+      if (xor == 0) {
+        wm_bits_put(&b, 0x0, 1);
+        continue;
+      }
+
+      int leading = __builtin_clzll(xor);
+      int trailing = __builtin_ctzll(xor);
+      if (leading > 31)
+        leading = 31;
+
+      if ((prev_leading >= 0) && (leading >= prev_leading) &&
+          (trailing >= prev_trailing)) {
+        /* The meaningful bits fit into the previous window. */
+        wm_bits_put(&b, 0x2, 2);
+        wm_bits_put(&b, xor >> prev_trailing,
+                    64 - prev_leading - prev_trailing);
+      } else {
+        int meaningful = 64 - leading - trailing;
+
+        wm_bits_put(&b, 0x3, 2);
+        wm_bits_put(&b, (uint64_t)leading, 5);
+        wm_bits_put(&b, (uint64_t)(meaningful - 1), 6);
+        wm_bits_put(&b, xor >> trailing, meaningful);
+        prev_leading = leading;
+        prev_trailing = trailing;
+      }
+    }
+  }
+
+  wm_bits_flush(&b);
+} /* }}} void wm_columnar_put_bits */
+
+/* Counts the records of a message and checks that they are well-formed,
+ * which they might not be when replayed from a damaged spool file. */
+static int wm_columnar_rows(char const *data, size_t len, /* {{{ */
+                            size_t *ret_rows_num) {
+  size_t rows_num = 0;
+
+  for (size_t pos = 0; pos < len; rows_num++) {
+    uint32_t rec_len;
+    uint32_t key_len;
+
+    if ((len - pos) < WM_COLUMNAR_RECORD_HEADER)
+      return -EINVAL;
+    rec_len = wm_columnar_u32(data + pos);
+    key_len = wm_columnar_u32(data + pos + 12);
+    if ((rec_len < WM_COLUMNAR_RECORD_HEADER) || (rec_len > (len - pos)) ||
+        (key_len < sizeof(uint64_t)) ||
+        (key_len > (rec_len - WM_COLUMNAR_RECORD_HEADER)))
+      return -EINVAL;
+    pos += rec_len;
+  }
+
+  *ret_rows_num = rows_num;
+  return 0;
+} /* }}} int wm_columnar_rows */
+
+static size_t wm_columnar_table_size(size_t rows_num) /* {{{ */
+{
+  size_t table_size = 1;
+
+  while (table_size < 2 * rows_num)
+    table_size *= 2;
+  return table_size;
+} /* }}} size_t wm_columnar_table_size */
+
+/* The length of the NUL-terminated string at "field", -1 if it does not end
+ * before "end". */
+static ssize_t wm_columnar_strlen(char const *field, /* {{{ */
+                                  char const *end) {
+  char const *nul;
+
+  if (field >= end)
+    return -1;
+  nul = memchr(field, 0, (size_t)(end - field));
+  return (nul != NULL) ? (nul - field) : -1;
+} /* }}} ssize_t wm_columnar_strlen */
+
+#define WM_COLUMNAR_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/* The scratch space wm_columnar_encode() takes for a message: the encoded
+ * message and the bits of one series, neither larger than the message
+ * thanks to the records' padding, and the index of the rows by series. */
+static size_t wm_columnar_scratch(char const *data, size_t len) /* {{{ */
+{
+  size_t rows_num = 0;
+
+  if (wm_columnar_rows(data, len, &rows_num) != 0)
+    return 0;
+  return 2 * WM_COLUMNAR_ALIGN(len) +
+         rows_num * (sizeof(wm_columnar_series_t) + sizeof(wm_columnar_row_t)) +
+         wm_columnar_table_size(rows_num) * sizeof(size_t);
+} /* }}} size_t wm_columnar_scratch */
+
+/* Encodes the row records of one message in the columnar layout to the
+ * start of "scratch", which has wm_columnar_scratch() bytes. */
+static int wm_columnar_encode(char *scratch, char const *data, /* {{{ */
+                              size_t len, size_t *ret_len) {
+  wm_writer_t out = {.data = scratch, .size = len};
+  wm_writer_t bits = {.data = scratch + WM_COLUMNAR_ALIGN(len), .size = len};
+  wm_columnar_series_t *series;
+  wm_columnar_row_t *rows;
+  size_t *table;
+  size_t table_size;
+  size_t rows_num = 0;
+  size_t series_num = 0;
+  size_t r = 0;
+
+  if (wm_columnar_rows(data, len, &rows_num) != 0)
+    return -EINVAL;
+  table_size = wm_columnar_table_size(rows_num);
+
+  series = (void *)(scratch + 2 * WM_COLUMNAR_ALIGN(len));
+  rows = (void *)(series + rows_num);
+  table = (void *)(rows + rows_num);
+  memset(table, 0xff, table_size * sizeof(*table));
+
+  /* Group the rows by series, in the order the series first appear. */
+  for (size_t pos = 0; pos < len; pos += wm_columnar_u32(data + pos), r++) {
+    char const *key = data + pos + WM_COLUMNAR_RECORD_HEADER;
+    uint32_t key_len = wm_columnar_u32(data + pos + 12);
+    uint32_t hash = wm_hash(key, key_len);
+    size_t i = hash & (table_size - 1);
+
+    for (; table[i] != SIZE_MAX; i = (i + 1) & (table_size - 1)) {
+      wm_columnar_series_t const *s = series + table[i];
+      if ((s->hash == hash) && (s->key_len == key_len) &&
+          (memcmp(s->key, key, key_len) == 0))
+        break;
+    }
+
+    rows[r].record = data + pos;
+    rows[r].next = SIZE_MAX;
+    if (table[i] == SIZE_MAX) {
+      table[i] = series_num++;
+      series[table[i]] = (wm_columnar_series_t){
+          .key = key, .key_len = key_len, .hash = hash, .first = r};
+    } else {
+      rows[series[table[i]].last].next = r;
+    }
+    series[table[i]].last = r;
+    series[table[i]].count++;
+  }
+
+  wm_put(&out, WM_COLUMNAR_MAGIC, strlen(WM_COLUMNAR_MAGIC));
+  wm_put_varint(&out, series_num);
+  for (size_t i = 0; i < series_num; i++) {
+    wm_columnar_series_t const *s = series + i;
+    char const *field = s->key + sizeof(uint64_t);
+    char const *key_end = s->key + s->key_len;
+    uint8_t types[UINT8_MAX];
+    size_t values_num;
+
+    for (int f = WM_FIELD_HOST; f < WM_FIELD_MAX; f++) {
+      ssize_t field_len = wm_columnar_strlen(field, key_end);
+      if (field_len < 0)
+        return -EINVAL;
+      wm_put_varint(&out, (uint64_t)field_len);
+      wm_put(&out, field, (size_t)field_len);
+      field += field_len + 1;
+    }
+    if (field >= key_end)
+      return -EINVAL;
+    wm_put_varint(&out, CDTIME_T_TO_MS(wm_columnar_u64(s->key)));
+    values_num = (uint8_t)*field++;
+    wm_put_u8(&out, (uint8_t)values_num);
+    for (size_t j = 0; j < values_num; j++) {
+      ssize_t name_len;
+
+      if (field >= key_end)
+        return -EINVAL;
+      types[j] = (uint8_t)*field++;
+      name_len = wm_columnar_strlen(field, key_end);
+      if (name_len < 0)
+        return -EINVAL;
+      wm_put_u8(&out, types[j]);
+      wm_put_varint(&out, (uint64_t)name_len);
+      wm_put(&out, field, (size_t)name_len);
+      field += name_len + 1;
+    }
+    /* Every record of the series carries the values after the key. */
+    for (size_t j = s->first; j != SIZE_MAX; j = rows[j].next)
+      if ((wm_columnar_u32(rows[j].record) - WM_COLUMNAR_RECORD_HEADER -
+           s->key_len) < 8 * values_num)
+        return -EINVAL;
+
+    wm_put_varint(&out, s->count);
+    wm_put_varint(&out, CDTIME_T_TO_MS(wm_columnar_u64(rows[s->first].record +
+                                                       4)));
+
+    bits.pos = 0;
+    wm_columnar_put_bits(&bits, s, rows, types, values_num);
+    wm_put_varint(&out, bits.pos);
+    wm_put(&out, bits.data, bits.pos);
+  }
+
+  if (out.overflow || bits.overflow)
+    return -ENOMEM;
+  *ret_len = out.pos;
+  return 0;
+} /* }}} int wm_columnar_encode */
+
+static wm_format_t const wm_formats[] = {
+    {
+        .name = "JSON",
+        .content_type = "application/json",
+        .value_list = wm_json_value_list,
+        .finalize = format_json_finalize,
+        .split = wm_json_split,
+    },
+    {
+        .name = "Network",
+        .content_type = "application/vnd.collectd.network",
+        .value_list = wm_network_value_list,
+        .finalize = wm_binary_finalize,
+    },
+    {
+        .name = "MessagePack",
+        .content_type = "application/msgpack",
+        .value_list = wm_msgpack_value_list,
+        .finalize = wm_binary_finalize,
+    },
+    {
+        .name = "Protobuf",
+        .content_type = "application/x-protobuf",
+        .value_list = wm_protobuf_value_list,
+        .finalize = wm_binary_finalize,
+    },
+    {
+        .name = "Columnar",
+        .content_type = "application/vnd.collectd.columnar",
+        .value_list = wm_columnar_value_list,
+        .finalize = wm_binary_finalize,
+        .encode_scratch = wm_columnar_scratch,
+        .encode = wm_columnar_encode,
+    },
+};
+
+static bool wm_is_connected(wm_conn_t *conn) /* {{{ */
+{
+  return __atomic_load_n(&conn->connected, __ATOMIC_ACQUIRE);
+} /* }}} bool wm_is_connected */
+
+static void wm_set_connected(wm_conn_t *conn, bool connected) /* {{{ */
+{
+  __atomic_store_n(&conn->connected, connected, __ATOMIC_RELEASE);
+} /* }}} void wm_set_connected */
+
+/* must not hold any lock when calling. Lets writers waiting for a buffer
+ * notice that a connection is down. */
+static void wm_wake_writers(wm_callback_t *cb) /* {{{ */
+{
+  for (size_t i = 0; i < cb->shards_num; i++) {
+    pthread_mutex_lock(&cb->shards[i].lock);
+    pthread_cond_broadcast(&cb->shards[i].cond);
+    pthread_mutex_unlock(&cb->shards[i].lock);
+  }
+} /* }}} void wm_wake_writers */
+
+/* The pool's size class for "size" bytes, WM_POOL_CLASSES if there is
+ * none. */
+static unsigned int wm_pool_class(size_t size) /* {{{ */
+{
+  unsigned int size_class = 0;
+
+  while ((size_class < WM_POOL_CLASSES) &&
+         (((size_t)1 << (WM_POOL_MIN_SHIFT + size_class)) < size))
+    size_class++;
+
+  return size_class;
+} /* }}} unsigned int wm_pool_class */
+
+/* The bytes a batch of "size" bytes takes from the node's memory at most,
+ * see wm_batch_alloc(). */
+static size_t wm_batch_bytes(wm_callback_t const *cb, size_t size) /* {{{ */
+{
+  unsigned int size_class = wm_pool_class(size);
+
+  if ((cb->pool.base == NULL) || (size_class >= WM_POOL_CLASSES))
+    return size;
+  return (size_t)1 << (WM_POOL_MIN_SHIFT + size_class);
+} /* }}} size_t wm_batch_bytes */
+
+/* Takes a batch of at least "size" bytes from the node's pool, or from
+ * malloc() if the pool has no room for it. */
+static wm_batch_t *wm_batch_alloc(wm_callback_t *cb, size_t size) /* {{{ */
+{
+  wm_pool_t *pool = &cb->pool;
+  wm_batch_t *batch = NULL;
+  unsigned int size_class = wm_pool_class(size);
+
+  if (pool->base != NULL) {
+    pthread_mutex_lock(&pool->lock);
+    if (size_class < WM_POOL_CLASSES) {
+      size_t chunk = (size_t)1 << (WM_POOL_MIN_SHIFT + size_class);
+
+      batch = pool->free[size_class];
+      if (batch != NULL)
+        pool->free[size_class] = batch->next;
+      else if ((pool->size - pool->used) >= chunk) {
+        batch = (wm_batch_t *)(pool->base + pool->used);
+        pool->used += chunk;
+      }
+    }
+    wm_stat_add((batch != NULL) ? &pool->hits : &pool->misses, 1);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  if (batch == NULL) {
+    batch = malloc(size);
+    if (batch == NULL)
+      return NULL;
+    size_class = WM_POOL_MALLOC;
+  } else
+    size = (size_t)1 << (WM_POOL_MIN_SHIFT + size_class);
+
+  batch->size_class = (uint8_t)size_class;
+  batch->size = size;
+  wm_memory_add(cb, size);
+  return batch;
+} /* }}} wm_batch_t *wm_batch_alloc */
+
+static void wm_batch_free(wm_callback_t *cb, wm_batch_t *batch) /* {{{ */
+{
+  wm_pool_t *pool = &cb->pool;
+
+  if (batch == NULL)
+    return;
+
+  wm_memory_release(cb, batch->size);
+  if (batch->size_class == WM_POOL_MALLOC) {
+    free(batch);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  batch->next = pool->free[batch->size_class];
+  pool->free[batch->size_class] = batch;
+  pthread_mutex_unlock(&pool->lock);
+} /* }}} void wm_batch_free */
+
+static wm_batch_t *wm_batch_create(wm_callback_t *cb, /* {{{ */
+                                   char const *topic, size_t topic_len,
+                                   char const *data, size_t len) {
+  wm_batch_t *batch = wm_batch_alloc(cb, sizeof(*batch) + len + topic_len + 2);
+  if (batch == NULL)
+    return NULL;
+
+  batch->len = len;
+  batch->mid = 0;
+  batch->next = NULL;
+  memcpy(batch->data, data, len);
+  batch->data[len] = 0;
+  memcpy(batch->data + len + 1, topic, topic_len);
+  batch->data[len + 1 + topic_len] = 0;
+  batch->topic = batch->data + len + 1;
+
+  return batch;
+} /* }}} wm_batch_t *wm_batch_create */
+
+/* Only called from the publish thread. Waits until fewer than MaxInflight
+ * QoS 1 messages are unacknowledged and records a copy of the message, to
+ * be retried from the offline queue should the connection be lost before
+ * the broker acknowledged it. A batch the caller "owned" is recorded instead
+ * of a copy. Returns NULL if the connection was lost while waiting. */
+static wm_batch_t *wm_inflight_begin(wm_conn_t *conn, /* {{{ */
+                                     char const *topic, char const *data,
+                                     size_t len, wm_batch_t *owned) {
+  wm_callback_t *cb = conn->cb;
+  wm_batch_t *batch =
+      (owned != NULL) ? owned
+                      : wm_batch_create(cb, topic, strlen(topic), data, len);
+
+  if (batch == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&conn->inflight_lock);
+  while (wm_is_connected(conn) && (conn->inflight >= cb->max_inflight)) {
+    /* Also check the connection every once in a while: the network thread
+     * notices a broker that stopped responding only after the keepalive. */
+    struct timespec ts = CDTIME_T_TO_TIMESPEC(cdtime() + TIME_T_TO_CDTIME_T(1));
+    pthread_cond_timedwait(&conn->inflight_cond, &conn->inflight_lock, &ts);
+  }
+
+  if (!wm_is_connected(conn)) {
+    pthread_mutex_unlock(&conn->inflight_lock);
+    if (batch != owned)
+      wm_batch_free(cb, batch);
+    return NULL;
+  }
+
+  batch->mid = 0;
+  batch->next = NULL;
+  if (conn->inflight_tail == NULL)
+    conn->inflight_head = batch;
+  else
+    conn->inflight_tail->next = batch;
+  conn->inflight_tail = batch;
+  __atomic_store_n(&conn->inflight, conn->inflight + 1, __ATOMIC_RELAXED);
+
+  /* The acknowledgement may arrive before mosquitto_publish() tells us the
+   * message ID. */
+  conn->inflight_publishing = batch;
+  conn->inflight_acked = false;
+  pthread_mutex_unlock(&conn->inflight_lock);
+
+  return batch;
+} /* }}} wm_batch_t *wm_inflight_begin */
+
+/* must hold conn->inflight_lock when calling. */
+static void wm_inflight_unlink(wm_conn_t *conn, wm_batch_t *batch) /* {{{ */
+{
+  wm_batch_t *prev = NULL;
+
+  for (wm_batch_t *b = conn->inflight_head; b != batch; b = b->next)
+    prev = b;
+
+  if (prev == NULL)
+    conn->inflight_head = batch->next;
+  else
+    prev->next = batch->next;
+  if (conn->inflight_tail == batch)
+    conn->inflight_tail = prev;
+  __atomic_store_n(&conn->inflight, conn->inflight - 1, __ATOMIC_RELAXED);
+  batch->next = NULL;
+
+  pthread_cond_signal(&conn->inflight_cond);
+} /* }}} void wm_inflight_unlink */
+
+/* Only called from the publish thread, once mosquitto_publish() returned.
+ * "mid" is the message ID, or negative if publishing failed, in which case
+ * the batch is handed back to the caller. */
+static void wm_inflight_end(wm_conn_t *conn, wm_batch_t *batch, /* {{{ */
+                            int mid) {
+  pthread_mutex_lock(&conn->inflight_lock);
+  if (mid < 0)
+    wm_inflight_unlink(conn, batch);
+  else if (conn->inflight_acked) {
+    wm_inflight_unlink(conn, batch);
+    wm_batch_free(conn->cb, batch);
+  } else
+    batch->mid = mid;
+  conn->inflight_publishing = NULL;
+  pthread_mutex_unlock(&conn->inflight_lock);
+} /* }}} void wm_inflight_end */
+
+/* Only called from the publish thread. Waits up to "timeout" for the broker
+ * to acknowledge the messages in flight. */
+static void wm_inflight_drain(wm_conn_t *conn, cdtime_t timeout) /* {{{ */
+{
+  struct timespec ts = CDTIME_T_TO_TIMESPEC(cdtime() + timeout);
+
+  pthread_mutex_lock(&conn->inflight_lock);
+  while (wm_is_connected(conn) && (conn->inflight > 0)) {
+    if (pthread_cond_timedwait(&conn->inflight_cond, &conn->inflight_lock,
+                               &ts) == ETIMEDOUT)
+      break;
+  }
+  pthread_mutex_unlock(&conn->inflight_lock);
+} /* }}} void wm_inflight_drain */
+
+/* Called from the mosquitto network thread when the broker acknowledged a
+ * message. */
+static void wm_on_publish(struct mosquitto *mosq __attribute__((unused)),
+                          void *obj, int mid) /* {{{ */
+{
+  wm_conn_t *conn = obj;
+  wm_batch_t *batch;
+
+  if (conn->cb->qos == 0)
+    return;
+
+  pthread_mutex_lock(&conn->inflight_lock);
+  for (batch = conn->inflight_head; batch != NULL; batch = batch->next)
+    if ((batch->mid == mid) && (batch != conn->inflight_publishing))
+      break;
+
+  if (batch != NULL) {
+    wm_inflight_unlink(conn, batch);
+    wm_batch_free(conn->cb, batch);
+  } else if (conn->inflight_publishing != NULL)
+    conn->inflight_acked = true;
+  pthread_mutex_unlock(&conn->inflight_lock);
+} /* }}} void wm_on_publish */
+
+/* Called from the mosquitto network thread. */
+static void wm_on_disconnect(struct mosquitto *mosq __attribute__((unused)),
+                             void *obj, int rc) /* {{{ */
+{
+  wm_conn_t *conn = obj;
+  wm_callback_t *cb = conn->cb;
+
+  /* rc == 0 means the disconnect was requested by us. */
+  if (rc == 0)
+    return;
+
+  wm_set_connected(conn, false);
+
+  /* Wake up the publish thread so it starts reconnecting, and any writers
+   * waiting for a buffer so they stop waiting for the publish thread. */
+  pthread_mutex_lock(&cb->send_lock);
+  pthread_cond_signal(&conn->publish_cond);
+  pthread_mutex_unlock(&cb->send_lock);
+  pthread_mutex_lock(&conn->inflight_lock);
+  pthread_cond_signal(&conn->inflight_cond);
+  pthread_mutex_unlock(&conn->inflight_lock);
+  wm_wake_writers(cb);
+} /* }}} void wm_on_disconnect */
+
+#if WM_HAVE_MQTT5
+/* Called from the mosquitto network thread. */
+static void wm_on_connect_v5(struct mosquitto *mosq __attribute__((unused)),
+                             void *obj, int rc, /* {{{ */
+                             int flags __attribute__((unused)),
+                             mosquitto_property const *props) {
+  wm_conn_t *conn = obj;
+  uint16_t maximum = 0;
+
+  if (rc != 0)
+    return;
+
+  /* Without the property, the broker does not accept topic aliases. */
+  (void)mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM,
+                                      &maximum, /* skip_first = */ false);
+  __atomic_store_n(&conn->topic_alias_broker, maximum, __ATOMIC_RELEASE);
+} /* }}} void wm_on_connect_v5 */
+
+/* Only called from the publish thread. The broker forgets all aliases when
+ * the connection is closed. */
+static void wm_alias_reset(wm_conn_t *conn) /* {{{ */
+{
+  __atomic_store_n(&conn->topic_alias_broker, 0, __ATOMIC_RELEASE);
+
+  for (size_t i = 0; i < conn->aliases_num; i++) {
+    sfree(conn->aliases[i].topic);
+    conn->aliases[i].hash_next = NULL;
+    conn->aliases[i].lru_prev = NULL;
+    conn->aliases[i].lru_next = NULL;
+  }
+  conn->aliases_num = 0;
+  conn->alias_lru_head = NULL;
+  conn->alias_lru_tail = NULL;
+
+  if (conn->alias_table != NULL)
+    memset(conn->alias_table, 0,
+           conn->alias_table_size * sizeof(*conn->alias_table));
+} /* }}} void wm_alias_reset */
+
+/* Only called from the publish thread. */
+static void wm_alias_unlink(wm_conn_t *conn, wm_alias_t *alias) /* {{{ */
+{
+  if (alias->lru_prev == NULL)
+    conn->alias_lru_head = alias->lru_next;
+  else
+    alias->lru_prev->lru_next = alias->lru_next;
+  if (alias->lru_next == NULL)
+    conn->alias_lru_tail = alias->lru_prev;
+  else
+    alias->lru_next->lru_prev = alias->lru_prev;
+  alias->lru_prev = NULL;
+  alias->lru_next = NULL;
+} /* }}} void wm_alias_unlink */
+
+/* Only called from the publish thread. */
+static void wm_alias_link(wm_conn_t *conn, wm_alias_t *alias) /* {{{ */
+{
+  alias->lru_prev = NULL;
+  alias->lru_next = conn->alias_lru_head;
+  if (conn->alias_lru_head == NULL)
+    conn->alias_lru_tail = alias;
+  else
+    conn->alias_lru_head->lru_prev = alias;
+  conn->alias_lru_head = alias;
+} /* }}} void wm_alias_link */
+
+/* Only called from the publish thread. Returns the alias to publish "topic"
+ * with, or NULL if no alias can be used. "*known" is set if the broker
+ * already knows the alias, so the topic can be left out. */
+static wm_alias_t *wm_alias_get(wm_conn_t *conn, /* {{{ */
+                                char const *topic, bool *known) {
+  wm_callback_t *cb = conn->cb;
+  size_t limit = __atomic_load_n(&conn->topic_alias_broker, __ATOMIC_ACQUIRE);
+  size_t topic_len = strlen(topic);
+  uint32_t hash = wm_hash(topic, topic_len);
+  wm_alias_t **slot;
+  wm_alias_t *alias;
+  char *copy;
+
+  *known = false;
+
+  if (limit > (size_t)cb->topic_alias_maximum)
+    limit = (size_t)cb->topic_alias_maximum;
+  if ((limit == 0) || (conn->aliases == NULL))
+    return NULL;
+
+  slot = &conn->alias_table[hash & (conn->alias_table_size - 1)];
+  for (alias = *slot; alias != NULL; alias = alias->hash_next) {
+    if ((alias->hash == hash) && (strcmp(alias->topic, topic) == 0)) {
+      wm_alias_unlink(conn, alias);
+      wm_alias_link(conn, alias);
+      *known = true;
+      return alias;
+    }
+  }
+
+  copy = malloc(topic_len + 1);
+  if (copy == NULL)
+    return NULL;
+  memcpy(copy, topic, topic_len + 1);
+
+  if (conn->aliases_num < limit) {
+    alias = conn->aliases + conn->aliases_num;
+    conn->aliases_num++;
+  } else {
+    wm_alias_t **prev;
+
+    /* Remap the least recently used alias. */
+    alias = conn->alias_lru_tail;
+    wm_alias_unlink(conn, alias);
+    prev = &conn->alias_table[alias->hash & (conn->alias_table_size - 1)];
+    while (*prev != alias)
+      prev = &(*prev)->hash_next;
+    *prev = alias->hash_next;
+    sfree(alias->topic);
+  }
+
+  alias->topic = copy;
+  alias->hash = hash;
+  alias->hash_next = *slot;
+  *slot = alias;
+  wm_alias_link(conn, alias);
+
+  return alias;
+} /* }}} wm_alias_t *wm_alias_get */
+#endif
+
+/*
+ * Network loop
+ *
+ * Where epoll is available, the connections of all nodes are driven by one
+ * plugin-wide thread instead of a libmosquitto thread per connection. It
+ * reads acknowledgements when a socket becomes readable, writes the packets
+ * queued by mosquitto_publish() when woken up by wm_loop_wakeup() or the
+ * socket becomes writable again, and lets libmosquitto send keep-alives once
+ * a second. "lock" is held while the thread works on connections, so once
+ * wm_loop_remove() returns, the connection is no longer touched. It must be
+ * taken without holding any other lock, since libmosquitto's callbacks run
+ * under it.
+ */
+#if WM_HAVE_EPOLL
+struct wm_loop_s {
+  pthread_mutex_t lock;
+  int epoll_fd;
+  int event_fd;
+  bool wakeup_pending;
+  /* Incremented by wm_loop_remove(); events returned before are dropped. */
+  uint64_t generation;
+  size_t users;
+  pthread_t thread;
+  bool thread_stop;
+  wm_conn_t *conns_head;
+};
+
+static struct wm_loop_s wm_loop = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .epoll_fd = -1,
+    .event_fd = -1,
+};
+
+/* must hold wm_loop.lock when calling. Stops watching a connection once its
+ * socket failed and lets the publish thread know. */
+static void wm_loop_lost(wm_conn_t *conn, int rc) /* {{{ */
+{
+  if (conn->loop_fd < 0)
+    return;
+
+  if (mosquitto_socket(conn->mosq) == conn->loop_fd)
+    (void)epoll_ctl(wm_loop.epoll_fd, EPOLL_CTL_DEL, conn->loop_fd, NULL);
+  conn->loop_fd = -1;
+
+  wm_on_disconnect(conn->mosq, conn,
+                   (rc != MOSQ_ERR_SUCCESS) ? rc : MOSQ_ERR_CONN_LOST);
+} /* }}} void wm_loop_lost */
+
+/* must hold wm_loop.lock when calling. */
+static void wm_loop_check(wm_conn_t *conn, int rc) /* {{{ */
+{
+  /* libmosquitto closes the socket itself, e.g. when a keep-alive timed
+   * out. */
+  if ((rc != MOSQ_ERR_SUCCESS) || (mosquitto_socket(conn->mosq) != conn->loop_fd))
+    wm_loop_lost(conn, rc);
+} /* }}} void wm_loop_check */
+
+/* must hold wm_loop.lock when calling. Writes what has been queued and
+ * watches the socket for writability as long as anything is left. */
+static void wm_loop_write(wm_conn_t *conn) /* {{{ */
+{
+  uint32_t events = EPOLLIN;
+
+  if (conn->loop_fd < 0)
+    return;
+
+  if (mosquitto_want_write(conn->mosq)) {
+    wm_loop_check(conn, mosquitto_loop_write(conn->mosq, /* max_packets = */ 1));
+    if (conn->loop_fd < 0)
+      return;
+    if (mosquitto_want_write(conn->mosq))
+      events |= EPOLLOUT;
+  }
+
+  if (events != conn->loop_events) {
+    struct epoll_event ev = {.events = events, .data.ptr = conn};
+
+    if (epoll_ctl(wm_loop.epoll_fd, EPOLL_CTL_MOD, conn->loop_fd, &ev) == 0)
+      conn->loop_events = events;
+  }
+} /* }}} void wm_loop_write */
+
+static void *wm_loop_thread(void *arg __attribute__((unused))) /* {{{ */
+{
+  struct epoll_event events[64];
+  cdtime_t misc_next = 0;
+
+  pthread_mutex_lock(&wm_loop.lock);
+  while (!wm_loop.thread_stop) {
+    uint64_t generation = wm_loop.generation;
+    cdtime_t now;
+    int events_num;
+
+    pthread_mutex_unlock(&wm_loop.lock);
+    events_num = epoll_wait(wm_loop.epoll_fd, events,
+                            STATIC_ARRAY_SIZE(events), /* timeout = */ 1000);
+    pthread_mutex_lock(&wm_loop.lock);
+
+    /* Connections may have been removed while waiting. Their sockets are
+     * level-triggered, so events of the others are reported again. */
+    if (generation != wm_loop.generation)
+      events_num = 0;
+
+    for (int i = 0; i < events_num; i++) {
+      wm_conn_t *conn = events[i].data.ptr;
+
+      if (conn == NULL) {
+        uint64_t value;
+        (void)read(wm_loop.event_fd, &value, sizeof(value));
+        continue;
+      }
+      if ((conn->loop_fd < 0) ||
+          ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) == 0))
+        continue;
+
+      wm_loop_check(conn, mosquitto_loop_read(conn->mosq, /* max_packets = */ 1));
+    }
+
+    /* Publishing after this point wakes the loop up again. */
+    __atomic_store_n(&wm_loop.wakeup_pending, false, __ATOMIC_SEQ_CST);
+
+    now = cdtime();
+    for (wm_conn_t *conn = wm_loop.conns_head; conn != NULL;
+         conn = conn->loop_next) {
+      if ((now >= misc_next) && (conn->loop_fd >= 0))
+        wm_loop_check(conn, mosquitto_loop_misc(conn->mosq));
+      wm_loop_write(conn);
+    }
+    if (now >= misc_next)
+      misc_next = now + TIME_T_TO_CDTIME_T(1);
+  }
+  pthread_mutex_unlock(&wm_loop.lock);
+
+  return NULL;
+} /* }}} void *wm_loop_thread */
+
+/* must not hold any lock when calling. Lets the network loop write what
+ * mosquitto_publish() has queued. Wake-ups are coalesced until the loop
+ * gets to writing. */
+static void wm_loop_wakeup(void) /* {{{ */
+{
+  uint64_t value = 1;
+
+  if (__atomic_exchange_n(&wm_loop.wakeup_pending, true, __ATOMIC_SEQ_CST))
+    return;
+  (void)write(wm_loop.event_fd, &value, sizeof(value));
+} /* }}} void wm_loop_wakeup */
+
+/* Called once per node before its connections are added; starts the loop
+ * for the first node. */
+static int wm_loop_ref(void) /* {{{ */
+{
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  int status;
+
+  pthread_mutex_lock(&wm_loop.lock);
+  if (wm_loop.users++ > 0) {
+    pthread_mutex_unlock(&wm_loop.lock);
+    return 0;
+  }
+
+  wm_loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wm_loop.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if ((wm_loop.epoll_fd < 0) || (wm_loop.event_fd < 0) ||
+      (epoll_ctl(wm_loop.epoll_fd, EPOLL_CTL_ADD, wm_loop.event_fd, &ev) !=
+       0)) {
+    char errbuf[1024];
+    ERROR("write_mqtt plugin: setting up the network loop failed: %s",
+          sstrerror(errno, errbuf, sizeof(errbuf)));
+    status = -1;
+  } else {
+    wm_loop.thread_stop = false;
+    status = plugin_thread_create(&wm_loop.thread, wm_loop_thread, NULL,
+                                  "write_mqtt net");
+    if (status != 0) {
+      char errbuf[1024];
+      ERROR("write_mqtt plugin: plugin_thread_create failed: %s",
+            sstrerror(status, errbuf, sizeof(errbuf)));
+    }
+  }
+
+  if (status != 0) {
+    if (wm_loop.epoll_fd >= 0)
+      close(wm_loop.epoll_fd);
+    if (wm_loop.event_fd >= 0)
+      close(wm_loop.event_fd);
+    wm_loop.epoll_fd = wm_loop.event_fd = -1;
+    wm_loop.users--;
+  }
+  pthread_mutex_unlock(&wm_loop.lock);
+
+  return status;
+} /* }}} int wm_loop_ref */
+
+/* Called once per node after its connections have been removed; stops the
+ * loop with the last node. */
+static void wm_loop_unref(void) /* {{{ */
+{
+  pthread_mutex_lock(&wm_loop.lock);
+  if (--wm_loop.users > 0) {
+    pthread_mutex_unlock(&wm_loop.lock);
+    return;
+  }
+  wm_loop.thread_stop = true;
+  pthread_mutex_unlock(&wm_loop.lock);
+
+  __atomic_store_n(&wm_loop.wakeup_pending, false, __ATOMIC_SEQ_CST);
+  wm_loop_wakeup();
+  pthread_join(wm_loop.thread, /* retval = */ NULL);
+
+  close(wm_loop.epoll_fd);
+  close(wm_loop.event_fd);
+  wm_loop.epoll_fd = wm_loop.event_fd = -1;
+} /* }}} void wm_loop_unref */
+
+/* Only called from the publish thread, once conn->mosq is connected. */
+static int wm_loop_add(wm_conn_t *conn) /* {{{ */
+{
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+
+  pthread_mutex_lock(&wm_loop.lock);
+  conn->loop_fd = mosquitto_socket(conn->mosq);
+  if ((conn->loop_fd < 0) ||
+      (epoll_ctl(wm_loop.epoll_fd, EPOLL_CTL_ADD, conn->loop_fd, &ev) != 0)) {
+    char errbuf[1024];
+    ERROR("write_mqtt plugin: adding a connection to the network loop "
+          "failed: %s",
+          sstrerror(errno, errbuf, sizeof(errbuf)));
+    conn->loop_fd = -1;
+    pthread_mutex_unlock(&wm_loop.lock);
+    return -1;
+  }
+  conn->loop_events = EPOLLIN;
+  conn->loop_next = wm_loop.conns_head;
+  wm_loop.conns_head = conn;
+  pthread_mutex_unlock(&wm_loop.lock);
+
+  /* The CONNECT packet is waiting to be written. */
+  wm_loop_wakeup();
+  return 0;
+} /* }}} int wm_loop_add */
+
+/* Only called from the publish thread. Writes what is still queued, like a
+ * DISCONNECT packet, and stops driving the connection. */
+static void wm_loop_remove(wm_conn_t *conn) /* {{{ */
+{
+  pthread_mutex_lock(&wm_loop.lock);
+  if (conn->loop_fd >= 0) {
+    if (mosquitto_want_write(conn->mosq))
+      (void)mosquitto_loop_write(conn->mosq, /* max_packets = */ 1);
+    if (mosquitto_socket(conn->mosq) == conn->loop_fd)
+      (void)epoll_ctl(wm_loop.epoll_fd, EPOLL_CTL_DEL, conn->loop_fd, NULL);
+    conn->loop_fd = -1;
+  }
+
+  for (wm_conn_t **prev = &wm_loop.conns_head; *prev != NULL;
+       prev = &(*prev)->loop_next) {
+    if (*prev == conn) {
+      *prev = conn->loop_next;
+      break;
+    }
+  }
+  conn->loop_next = NULL;
+  wm_loop.generation++;
+  pthread_mutex_unlock(&wm_loop.lock);
+} /* }}} void wm_loop_remove */
+#else  /* !WM_HAVE_EPOLL */
+/* Without epoll, every connection has its own libmosquitto thread. */
+static void wm_loop_wakeup(void) /* {{{ */
+{
+} /* }}} void wm_loop_wakeup */
+
+static int wm_loop_ref(void) /* {{{ */
+{
+  return 0;
+} /* }}} int wm_loop_ref */
+
+static void wm_loop_unref(void) /* {{{ */
+{
+} /* }}} void wm_loop_unref */
+
+static int wm_loop_add(wm_conn_t *conn) /* {{{ */
+{
+  int status = mosquitto_loop_start(conn->mosq);
+
+  if (status != MOSQ_ERR_SUCCESS) {
+    char errbuf[1024];
+    ERROR("write_mqtt plugin: mosquitto_loop_start failed: %s",
+          (status == MOSQ_ERR_ERRNO) ? sstrerror(errno, errbuf, sizeof(errbuf))
+                                     : mosquitto_strerror(status));
+    return -1;
+  }
+
+  return 0;
+} /* }}} int wm_loop_add */
+
+static void wm_loop_remove(wm_conn_t *conn) /* {{{ */
+{
+  (void)mosquitto_loop_stop(conn->mosq, false);
+} /* }}} void wm_loop_remove */
+#endif /* !WM_HAVE_EPOLL */
+
+/* Only called from the publish thread, without holding any lock. */
+static void wm_mqtt_disconnect(wm_conn_t *conn) /* {{{ */
+{
+  wm_set_connected(conn, false);
+  /* Writers waiting for a free buffer must not wait for the broker. */
+  wm_wake_writers(conn->cb);
+
+  if ((conn->mosq == NULL) || !conn->loop_running)
+    return;
+
+  (void)mosquitto_disconnect(conn->mosq);
+  wm_loop_remove(conn);
+  conn->loop_running = false;
+} /* }}} void wm_mqtt_disconnect */
+
+/* must hold cb->send_lock when calling. Doubles the reconnect interval up to
+ * ReconnectMaxInterval; the actual wait is randomized between half and all of
+ * the interval so that agents losing the same broker do not reconnect in
+ * lock-step. */
+static void wm_schedule_reconnect(wm_conn_t *conn) /* {{{ */
+{
+  wm_callback_t *cb = conn->cb;
+  cdtime_t interval = conn->reconnect_interval;
+
+  if (interval == 0)
+    interval = cb->reconnect_min_interval;
+
+  conn->reconnect_next =
+      cdtime() + interval / 2 + (cdtime_t)(cdrand_d() * (double)(interval / 2));
+
+  interval *= 2;
+  if (interval > cb->reconnect_max_interval)
+    interval = cb->reconnect_max_interval;
+  conn->reconnect_interval = interval;
+
+  wm_stat_add(&conn->stats.reconnects, 1);
+} /* }}} void wm_schedule_reconnect */
+
+/* Returns the broker after "broker" that passed the last probe, or simply the
+ * next one if none did. */
+static size_t wm_next_broker(wm_callback_t *cb, size_t broker) /* {{{ */
+{
+  uint32_t healthy = __atomic_load_n(&cb->brokers_healthy, __ATOMIC_RELAXED);
+
+  for (size_t i = 1; i < cb->hosts_num; i++) {
+    size_t next = (broker + i) % cb->hosts_num;
+    if (healthy & (UINT32_C(1) << next))
+      return next;
+  }
+
+  return (broker + 1) % cb->hosts_num;
+} /* }}} size_t wm_next_broker */
+
+/* must hold cb->send_lock when calling. With BrokerPolicy "Failover", moves
+ * the connection on to the next broker once its own failed. Returns true if
+ * that one is to be tried right away, which is the case unless all brokers
+ * failed in a row and the caller should back off. */
+static bool wm_failover(wm_conn_t *conn) /* {{{ */
+{
+  wm_callback_t *cb = conn->cb;
+  size_t failed = conn->broker;
+
+  if ((cb->broker_policy != WM_BROKERS_FAILOVER) || (cb->hosts_num < 2))
+    return false;
+
+  /* Only the probe thread declares a broker healthy again. */
+  __atomic_and_fetch(&cb->brokers_healthy, ~(UINT32_C(1) << failed),
+                     __ATOMIC_RELAXED);
+  conn->broker = wm_next_broker(cb, failed);
+  wm_stat_add(&conn->stats.failovers, 1);
+
+  if (conn->broker_tries == 0)
+    NOTICE("write_mqtt plugin: broker \"%s:%d\" failed, failing over to "
+           "\"%s:%d\".",
+           cb->hosts[failed], cb->port, cb->hosts[conn->broker], cb->port);
+
+  conn->broker_tries++;
+  if (conn->broker_tries < cb->hosts_num) {
+    conn->reconnect_next = 0;
+    return true;
+  }
+
+  conn->broker_tries = 0;
+  return false;
+} /* }}} bool wm_failover */
+
+/* Returns the healthy broker listed before the connection's own one that it
+ * should go back to, or its own broker. */
+static size_t wm_failback_broker(wm_conn_t *conn) /* {{{ */
+{
+  wm_callback_t *cb = conn->cb;
+  uint32_t healthy;
+
+  if ((cb->broker_policy != WM_BROKERS_FAILOVER) || (conn->broker == 0))
+    return conn->broker;
+
+  healthy = __atomic_load_n(&cb->brokers_healthy, __ATOMIC_RELAXED);
+  for (size_t i = 0; i < conn->broker; i++)
+    if (healthy & (UINT32_C(1) << i))
+      return i;
+
+  return conn->broker;
+} /* }}} size_t wm_failback_broker */
+
+/* Checks whether a broker accepts TCP connections within
+ * WRITE_MQTT_PROBE_TIMEOUT_MS, without speaking MQTT to it. */
+static bool wm_probe_broker(char const *host, int port) /* {{{ */
+{
+  struct addrinfo hints = {
+      .ai_family = AF_UNSPEC,
+      .ai_socktype = SOCK_STREAM,
+      .ai_flags = AI_ADDRCONFIG,
+  };
+  struct addrinfo *res;
+  char service[16];
+  bool healthy = false;
+
+  snprintf(service, sizeof(service), "%d", port);
+  if (getaddrinfo(host, service, &hints, &res) != 0)
+    return false;
+
+  for (struct addrinfo *ai = res; (ai != NULL) && !healthy; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+    if (fd < 0)
+      continue;
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+      close(fd);
+      continue;
+    }
+
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      healthy = true;
+    else if (errno == EINPROGRESS) {
+      struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+      int error = 0;
+      socklen_t error_len = sizeof(error);
+
+      healthy = (poll(&pfd, 1, WRITE_MQTT_PROBE_TIMEOUT_MS) == 1) &&
+                (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) ==
+                 0) &&
+                (error == 0);
+    }
+    close(fd);
+  }
+  freeaddrinfo(res);
+
+  return healthy;
+} /* }}} bool wm_probe_broker */
+
+/*
+ * TLS contexts
+ *
+ * Instead of letting libmosquitto load the certificates for every connection
+ * and every reconnect, connections to the same broker host with the same
+ * CAPath, ClientCert, ClientKey and Insecure share one OpenSSL context, also
+ * across nodes. The context remembers the last session the broker handed
+ * out and offers it on the next handshake, so a reconnect resumes the TLS
+ * session with an abbreviated handshake instead of verifying the broker's
+ * certificate chain again. The broker host is part of the key since the
+ * context checks the certificate's host name. "wm_tls_lock" guards the list,
+ * the reference counts and the sessions; it is taken last, since OpenSSL's
+ * callbacks run under wm_loop.lock.
+ *
+ * Early data (TLS 1.3 0-RTT) is not used: libmosquitto does not send it, and
+ * a replayed CONNECT or PUBLISH would not be safe anyway.
+ */
+#if WM_HAVE_TLS_CTX
+static pthread_mutex_t wm_tls_lock = PTHREAD_MUTEX_INITIALIZER;
+static wm_tls_t *wm_tls_head;
+static int wm_tls_index = -1;
+
+static void wm_tls_error(char const *what, char const *path) /* {{{ */
+{
+  char errbuf[256];
+
+  ERR_error_string_n(ERR_get_error(), errbuf, sizeof(errbuf));
+  ERR_clear_error();
+  if (path != NULL)
+    ERROR("write_mqtt plugin: %s \"%s\" failed: %s", what, path, errbuf);
+  else
+    ERROR("write_mqtt plugin: %s failed: %s", what, errbuf);
+} /* }}} void wm_tls_error */
+
+/* Called by OpenSSL when the broker sent a session, possibly long after the
+ * handshake with TLS 1.3. Keeping the session takes over the reference. */
+static int wm_tls_new_session(SSL *ssl, SSL_SESSION *session) /* {{{ */
+{
+  wm_tls_t *tls = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), wm_tls_index);
+
+  if (tls == NULL)
+    return 0;
+
+  pthread_mutex_lock(&wm_tls_lock);
+  if (tls->session != NULL)
+    SSL_SESSION_free(tls->session);
+  tls->session = session;
+  pthread_mutex_unlock(&wm_tls_lock);
+
+  return 1;
+} /* }}} int wm_tls_new_session */
+
+/* libmosquitto creates the SSL object and starts the handshake in one go, so
+ * the session to resume is set when OpenSSL starts the handshake, before the
+ * ClientHello is written. */
+static void wm_tls_info(SSL const *ssl, int where, /* {{{ */
+                        int ret __attribute__((unused))) {
+  wm_tls_t *tls;
+
+  if (!(where & SSL_CB_HANDSHAKE_START) || (SSL_get_session(ssl) != NULL))
+    return;
+
+  tls = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), wm_tls_index);
+  if (tls == NULL)
+    return;
+
+  pthread_mutex_lock(&wm_tls_lock);
+  if (tls->session != NULL)
+    (void)SSL_set_session((SSL *)ssl, tls->session);
+  pthread_mutex_unlock(&wm_tls_lock);
+} /* }}} void wm_tls_info */
+
+/* Sets up a context the way libmosquitto would for "host". */
+static SSL_CTX *wm_tls_ctx_create(wm_callback_t const *cb, /* {{{ */
+                                  char const *host) {
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  if (ctx == NULL) {
+    wm_tls_error("SSL_CTX_new", NULL);
+    return NULL;
+  }
+
+  SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv3);
+  SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+
+  if (SSL_CTX_load_verify_locations(ctx, cb->capath, NULL) != 1) {
+    wm_tls_error("loading the CA certificate", cb->capath);
+    SSL_CTX_free(ctx);
+    return NULL;
+  }
+
+  if (cb->clientcert != NULL) {
+    if (SSL_CTX_use_certificate_chain_file(ctx, cb->clientcert) != 1) {
+      wm_tls_error("loading the client certificate", cb->clientcert);
+      SSL_CTX_free(ctx);
+      return NULL;
+    }
+    if ((SSL_CTX_use_PrivateKey_file(ctx, cb->clientkey, SSL_FILETYPE_PEM) !=
+         1) ||
+        (SSL_CTX_check_private_key(ctx) != 1)) {
+      wm_tls_error("loading the client key", cb->clientkey);
+      SSL_CTX_free(ctx);
+      return NULL;
+    }
+  }
+
+  /* With Insecure, the certificate chain is still verified, only the host
+   * name is not, as with mosquitto_tls_insecure_set(). */
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  if (!cb->insecure) {
+    X509_VERIFY_PARAM *param = SSL_CTX_get0_param(ctx);
+
+    X509_VERIFY_PARAM_set_hostflags(param,
+                                    X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
+    if ((X509_VERIFY_PARAM_set1_ip_asc(param, host) != 1) &&
+        (X509_VERIFY_PARAM_set1_host(param, host, 0) != 1)) {
+      wm_tls_error("setting the host name to verify", host);
+      SSL_CTX_free(ctx);
+      return NULL;
+    }
+  }
+
+  /* Sessions are kept by wm_tls_new_session(), not in OpenSSL's cache. */
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                          SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, wm_tls_new_session);
+  SSL_CTX_set_info_callback(ctx, wm_tls_info);
+
+  return ctx;
+} /* }}} SSL_CTX *wm_tls_ctx_create */
+
+/* The strings identifying a context, each terminated by a null byte. */
+static size_t wm_tls_key(wm_callback_t const *cb, char const *host, /* {{{ */
+                         char *buffer, size_t buffer_size) {
+  char const *fields[] = {
+      cb->capath,
+      (cb->clientcert != NULL) ? cb->clientcert : "",
+      (cb->clientkey != NULL) ? cb->clientkey : "",
+      host,
+      cb->insecure ? "insecure" : "",
+  };
+  size_t size = 0;
+
+  for (size_t i = 0; i < STATIC_ARRAY_SIZE(fields); i++) {
+    size_t len = strlen(fields[i]) + 1;
+    if ((buffer != NULL) && (size + len <= buffer_size))
+      memcpy(buffer + size, fields[i], len);
+    size += len;
+  }
+
+  return size;
+} /* }}} size_t wm_tls_key */
+
+/* Only called from the publish thread. Returns the context for connections
+ * to "broker", which is valid until wm_tls_release(). */
+static SSL_CTX *wm_tls_acquire(wm_callback_t *cb, size_t broker) /* {{{ */
+{
+  char const *host = cb->hosts[broker];
+  wm_tls_t *tls;
+  SSL_CTX *ctx = NULL;
+  size_t key_size;
+  char *key;
+
+  key_size = wm_tls_key(cb, host, NULL, 0);
+  key = malloc(key_size);
+  if (key == NULL) {
+    ERROR("write_mqtt plugin: malloc failed.");
+    return NULL;
+  }
+  wm_tls_key(cb, host, key, key_size);
+
+  pthread_mutex_lock(&wm_tls_lock);
+  if (cb->tls[broker] != NULL) {
+    ctx = cb->tls[broker]->ctx;
+    goto out;
+  }
+
+  for (tls = wm_tls_head; tls != NULL; tls = tls->next)
+    if ((tls->key_size == key_size) && (memcmp(tls->key, key, key_size) == 0))
+      break;
+
+  if (tls == NULL) {
+    if (wm_tls_index < 0)
+      wm_tls_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    if (wm_tls_index < 0) {
+      wm_tls_error("SSL_CTX_get_ex_new_index", NULL);
+      goto out;
+    }
+
+    tls = calloc(1, sizeof(*tls));
+    if (tls == NULL) {
+      ERROR("write_mqtt plugin: calloc failed.");
+      goto out;
+    }
+    tls->ctx = wm_tls_ctx_create(cb, host);
+    if (tls->ctx == NULL) {
+      sfree(tls);
+      goto out;
+    }
+    SSL_CTX_set_ex_data(tls->ctx, wm_tls_index, tls);
+    tls->key = key;
+    tls->key_size = key_size;
+    key = NULL;
+    tls->next = wm_tls_head;
+    wm_tls_head = tls;
+  }
+
+  tls->refs++;
+  cb->tls[broker] = tls;
+  ctx = tls->ctx;
+
+out:
+  pthread_mutex_unlock(&wm_tls_lock);
+  sfree(key);
+  return ctx;
+} /* }}} SSL_CTX *wm_tls_acquire */
+
+/* Called once all connections of "cb" are destroyed. libmosquitto holds
+ * references of its own, so a context outlives the last connection using
+ * it. */
+static void wm_tls_release(wm_callback_t *cb) /* {{{ */
+{
+  pthread_mutex_lock(&wm_tls_lock);
+  for (size_t i = 0; i < STATIC_ARRAY_SIZE(cb->tls); i++) {
+    wm_tls_t *tls = cb->tls[i];
+
+    cb->tls[i] = NULL;
+    if ((tls == NULL) || (--tls->refs > 0))
+      continue;
+
+    for (wm_tls_t **prev = &wm_tls_head; *prev != NULL;
+         prev = &(*prev)->next) {
+      if (*prev == tls) {
+        *prev = tls->next;
+        break;
+      }
+    }
+
+    SSL_CTX_set_ex_data(tls->ctx, wm_tls_index, NULL);
+    SSL_CTX_free(tls->ctx);
+    if (tls->session != NULL)
+      SSL_SESSION_free(tls->session);
+    sfree(tls->key);
+    sfree(tls);
+  }
+  pthread_mutex_unlock(&wm_tls_lock);
+} /* }}} void wm_tls_release */
+#endif /* WM_HAVE_TLS_CTX */
+
+/* Only called from the publish thread. Whether connecting again resumes the
+ * session: libmosquitto then resends the unacknowledged messages with their
+ * message IDs, so they stay in flight instead of going back to the offline
+ * queue. Sessions do not move to another broker. */
+static bool wm_session_resumes(wm_conn_t const *conn) /* {{{ */
+{
+  return conn->cb->persistent_session && (conn->mosq != NULL) &&
+         (conn->mosq_broker == conn->broker);
+} /* }}} bool wm_session_resumes */
+
+/* Only called from the publish thread. An MQTT 5 broker ends the session
+ * once the connection closes unless the client asks it otherwise, on every
+ * connect. */
+static int wm_mqtt_connect_broker(wm_conn_t *conn, bool reconnect) /* {{{ */
+{
+  wm_callback_t *cb = conn->cb;
+
+#if WM_HAVE_MQTT5
+  if ((cb->protocol_version == MQTT_PROTOCOL_V5) && cb->persistent_session) {
+    mosquitto_property *props = NULL;
+    int status;
+
+    status = mosquitto_property_add_int32(
+        &props, MQTT_PROP_SESSION_EXPIRY_INTERVAL, WRITE_MQTT_SESSION_EXPIRY);
+    if (status == MOSQ_ERR_SUCCESS)
+      status = mosquitto_connect_bind_v5(conn->mosq, cb->hosts[conn->broker],
+                                         cb->port, WRITE_MQTT_KEEPALIVE,
+                                         /* bind_address = */ NULL, props);
+    mosquitto_property_free_all(&props);
+    return status;
+  }
+#endif
+
+  if (reconnect)
+    return mosquitto_reconnect(conn->mosq);
+  return mosquitto_connect(conn->mosq, cb->hosts[conn->broker], cb->port,
+                           WRITE_MQTT_KEEPALIVE);
+} /* }}} int wm_mqtt_connect_broker */
+
+/* Only called from the publish thread. */
+static int wm_mqtt_reconnect(wm_conn_t *conn) {
+  wm_callback_t *cb = conn->cb;
+  int status;
+
+  if (wm_is_connected(conn))
+    return 0;
+
+  wm_mqtt_disconnect(conn);
+
+  status = wm_mqtt_connect_broker(conn, /* reconnect = */ true);
+  if (status != MOSQ_ERR_SUCCESS) {
+    char errbuf[1024];
+    c_complain(LOG_ERR, &conn->complaint_cantpublish,
+               "write_mqtt plugin: mosquitto_reconnect failed: %s",
+               (status == MOSQ_ERR_ERRNO)
+                   ? sstrerror(errno, errbuf, sizeof(errbuf))
+                   : mosquitto_strerror(status));
+    return -1;
+  }
+  if (wm_loop_add(conn) != 0) {
+    (void)mosquitto_disconnect(conn->mosq);
+    return -1;
+  }
+
+  conn->loop_running = true;
+  wm_set_connected(conn, true);
+
+  c_release(LOG_INFO, &conn->complaint_cantpublish,
+            "write_mqtt plugin: successfully reconnected to broker \"%s:%d\"",
+            cb->hosts[conn->broker], cb->port);
+
+  return 0;
+} /* wm_mqtt_reconnect */
+
+/* Only called from the publish thread. */
+static int wm_mqtt_connect(wm_conn_t *conn) /* {{{ */
+{
+  wm_callback_t *cb = conn->cb;
+  char client_id[1024];
+  int status;
+
+#if WM_HAVE_MQTT5
+  wm_alias_reset(conn);
+#endif
+
+  /* libmosquitto would resend its own copies of unacknowledged messages,
+   * which are retried from the offline queue instead, unless the session is
+   * resumed. */
+  if ((conn->mosq != NULL) &&
+      (((cb->qos > 0) && !cb->persistent_session) ||
+       (conn->mosq_broker != conn->broker))) {
+    mosquitto_destroy(conn->mosq);
+    conn->mosq = NULL;
+  }
+
+  if (conn->mosq != NULL)
+    return wm_mqtt_reconnect(conn);
+
+  /* Sessions with the same client ID would take over each other. */
+  if (cb->conns_num > 1)
+    snprintf(client_id, sizeof(client_id), "%s-%" PRIsz,
+             (cb->client_id != NULL) ? cb->client_id : hostname_g,
+             conn->index);
+  else
+    sstrncpy(client_id, (cb->client_id != NULL) ? cb->client_id : hostname_g,
+             sizeof(client_id));
+
+  conn->mosq = mosquitto_new(client_id,
+                             /* clean session */ !cb->persistent_session,
+                             /* user data */ conn);
+  if (conn->mosq == NULL) {
+    ERROR("write_mqtt plugin: mosquitto_new failed");
+    return -1;
+  }
+
+  mosquitto_disconnect_callback_set(conn->mosq, wm_on_disconnect);
+  mosquitto_publish_callback_set(conn->mosq, wm_on_publish);
+#if WM_HAVE_MQTT5
+  if (cb->protocol_version == MQTT_PROTOCOL_V5)
+    mosquitto_connect_v5_callback_set(conn->mosq, wm_on_connect_v5);
+#endif
+
+  mosquitto_opts_set(conn->mosq, MOSQ_OPT_PROTOCOL_VERSION, &cb->protocol_version);
+#if WM_HAVE_EPOLL
+  /* Packets are written by the shared network loop, not by the thread that
+   * queues them. */
+  mosquitto_threaded_set(conn->mosq, true);
+#endif
+  if (cb->qos > 0)
+    mosquitto_max_inflight_messages_set(conn->mosq,
+                                        (unsigned int)cb->max_inflight);
+
+  if (cb->capath) {
+#if WM_HAVE_TLS_CTX
+    SSL_CTX *ctx = wm_tls_acquire(cb, conn->broker);
+
+    status = (ctx != NULL)
+                 ? mosquitto_opts_set(conn->mosq, MOSQ_OPT_SSL_CTX, ctx)
+                 : MOSQ_ERR_TLS;
+    if (status != MOSQ_ERR_SUCCESS) {
+      ERROR("write_mqtt plugin: cannot set the TLS context: %s",
+            mosquitto_strerror(status));
+      mosquitto_destroy(conn->mosq);
+      conn->mosq = NULL;
+      return -1;
+    }
+#else
+    status = mosquitto_tls_set(conn->mosq, cb->capath, NULL,
+                               cb->clientcert, cb->clientkey,
+                               /* pw_callback */ NULL);
+    if (status != MOSQ_ERR_SUCCESS) {
+      ERROR("write_mqtt plugin: cannot mosquitto_tls_set: %s",
+            mosquitto_strerror(status));
+      mosquitto_destroy(conn->mosq);
+      conn->mosq = NULL;
+      return -1;
+    }
+
+    status = mosquitto_tls_insecure_set(conn->mosq, cb->insecure);
+    if (status != MOSQ_ERR_SUCCESS) {
+      ERROR("write_mqtt plugin: cannot mosquitto_tls_insecure_set: %s",
+            mosquitto_strerror(status));
+      mosquitto_destroy(conn->mosq);
+      conn->mosq = NULL;
+      return -1;
+    }
+#endif
+  }
+
+  conn->mosq_broker = conn->broker;
+  status = wm_mqtt_connect_broker(conn, /* reconnect = */ false);
+  if (status != MOSQ_ERR_SUCCESS) {
+    char errbuf[1024];
+    c_complain(LOG_ERR, &conn->complaint_cantpublish,
+               "write_mqtt plugin: mosquitto_connect failed: %s",
+               (status == MOSQ_ERR_ERRNO)
+                   ? sstrerror(errno, errbuf, sizeof(errbuf))
+                   : mosquitto_strerror(status));
+
+    mosquitto_destroy(conn->mosq);
+    conn->mosq = NULL;
+    return -1;
+  }
+
+  if (wm_loop_add(conn) != 0) {
+    (void)mosquitto_disconnect(conn->mosq);
+    mosquitto_destroy(conn->mosq);
+    conn->mosq = NULL;
+    return -1;
+  }
+
+  conn->loop_running = true;
+  wm_set_connected(conn, true);
+
+  c_release(LOG_INFO, &conn->complaint_cantpublish,
+            "write_mqtt plugin: successfully connected to broker \"%s:%d\"",
+            cb->hosts[conn->broker], cb->port);
+
+  return 0;
+} /* }}} int wm_mqtt_connect */
+
+static char const *wm_compression_name(int compression) /* {{{ */
+{
+  switch (compression) {
+  case WM_COMPRESSION_GZIP:
+    return "gzip";
+  case WM_COMPRESSION_LZ4:
+    return "lz4";
+  case WM_COMPRESSION_ZSTD:
+    return "zstd";
+  }
+  return "none";
+} /* }}} char const *wm_compression_name */
+
+/* Only called from the publish thread. Re-encodes a message into
+ * conn->encode_buffer if the format asks for it. */
+static int wm_encode(wm_conn_t *conn, char const *data, /* {{{ */
+                     size_t len, char const **ret_data, size_t *ret_len) {
+  wm_callback_t *cb = conn->cb;
+  size_t size;
+
+  if (cb->format->encode == NULL) {
+    *ret_data = data;
+    *ret_len = len;
+    return 0;
+  }
+
+  size = cb->format->encode_scratch(data, len);
+  if (size == 0) {
+    WARNING("write_mqtt plugin: a %s message of %" PRIsz " bytes is "
+            "malformed.",
+            cb->format->name, len);
+    return -1;
+  }
+  if (size > conn->encode_buffer_size) {
+    char *tmp = realloc(conn->encode_buffer, size);
+    if (tmp == NULL) {
+      ERROR("write_mqtt plugin: realloc(%" PRIsz ") failed.", size);
+      return -1;
+    }
+    wm_memory_add(cb, size - conn->encode_buffer_size);
+    conn->encode_buffer = tmp;
+    conn->encode_buffer_size = size;
+  }
+
+  if (cb->format->encode(conn->encode_buffer, data, len, ret_len) != 0) {
+    WARNING("write_mqtt plugin: encoding a %s message of %" PRIsz " bytes "
+            "failed.",
+            cb->format->name, len);
+    return -1;
+  }
+  *ret_data = conn->encode_buffer;
+  return 0;
+} /* }}} int wm_encode */
+
+/* Only called from the publish thread. Compresses a message into
+ * conn->compress_buffer using the configured codec. */
+static int wm_compress(wm_conn_t *conn, char const *data, /* {{{ */
+                       size_t len, char const **ret_data, size_t *ret_len) {
+  wm_callback_t *cb = conn->cb;
+  size_t bound = 0;
+
+  if (cb->compression == WM_COMPRESSION_NONE) {
+    *ret_data = data;
+    *ret_len = len;
+    return 0;
+  }
+
+#if HAVE_ZLIB_H
+  if ((cb->compression == WM_COMPRESSION_GZIP) && !conn->zstream_initialized) {
+    /* 15 + 16: the default window with a gzip instead of a zlib header. */
+    if (deflateInit2(&conn->zstream, cb->compression_level, Z_DEFLATED, 15 + 16,
+                     /* memLevel = */ 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      ERROR("write_mqtt plugin: deflateInit2 failed: %s",
+            (conn->zstream.msg != NULL) ? conn->zstream.msg : "unknown error");
+      return -1;
+    }
+    conn->zstream_initialized = true;
+  }
+  if (cb->compression == WM_COMPRESSION_GZIP)
+    bound = deflateBound(&conn->zstream, (uLong)len);
+#endif
+#if HAVE_LZ4FRAME_H
+  LZ4F_preferences_t lz4_prefs = {
+      .compressionLevel = cb->compression_level,
+      .frameInfo.contentSize = len,
+  };
+  if (cb->compression == WM_COMPRESSION_LZ4)
+    bound = LZ4F_compressFrameBound(len, &lz4_prefs);
+#endif
+#if HAVE_ZSTD_H
+  if ((cb->compression == WM_COMPRESSION_ZSTD) && (conn->zstd_cctx == NULL)) {
+    conn->zstd_cctx = ZSTD_createCCtx();
+    if (conn->zstd_cctx == NULL) {
+      ERROR("write_mqtt plugin: ZSTD_createCCtx failed.");
+      return -1;
+    }
+  }
+  if (cb->compression == WM_COMPRESSION_ZSTD)
+    bound = ZSTD_compressBound(len);
+#endif
+
+  if (bound > conn->compress_buffer_size) {
+    char *tmp = realloc(conn->compress_buffer, bound);
+    if (tmp == NULL) {
+      ERROR("write_mqtt plugin: realloc(%" PRIsz ") failed.", bound);
+      return -1;
+    }
+    wm_memory_add(cb, bound - conn->compress_buffer_size);
+    conn->compress_buffer = tmp;
+    conn->compress_buffer_size = bound;
+  }
+
+  switch (cb->compression) {
+#if HAVE_ZLIB_H
+  case WM_COMPRESSION_GZIP: {
+    int status;
+
+    deflateReset(&conn->zstream);
+    conn->zstream.next_in = (Bytef *)data;
+    conn->zstream.avail_in = (uInt)len;
+    conn->zstream.next_out = (Bytef *)conn->compress_buffer;
+    conn->zstream.avail_out = (uInt)conn->compress_buffer_size;
+
+    status = deflate(&conn->zstream, Z_FINISH);
+    if (status != Z_STREAM_END) {
+      WARNING("write_mqtt plugin: deflate failed with %d.", status);
+      return -1;
+    }
+    *ret_len = (size_t)conn->zstream.total_out;
+    break;
+  }
+#endif
+#if HAVE_LZ4FRAME_H
+  case WM_COMPRESSION_LZ4: {
+    size_t status = LZ4F_compressFrame(
+        conn->compress_buffer, conn->compress_buffer_size, data, len, &lz4_prefs);
+    if (LZ4F_isError(status)) {
+      WARNING("write_mqtt plugin: LZ4F_compressFrame failed: %s",
+            LZ4F_getErrorName(status));
+      return -1;
+    }
+    *ret_len = status;
+    break;
+  }
+#endif
+#if HAVE_ZSTD_H
+  case WM_COMPRESSION_ZSTD: {
+    size_t status;
+
+    if (cb->zstd_cdict != NULL)
+      status = ZSTD_compress_usingCDict(conn->zstd_cctx, conn->compress_buffer,
+                                        conn->compress_buffer_size, data, len,
+                                        cb->zstd_cdict);
+    else
+      status = ZSTD_compressCCtx(conn->zstd_cctx, conn->compress_buffer,
+                                 conn->compress_buffer_size, data, len,
+                                 cb->compression_level);
+    if (ZSTD_isError(status)) {
+      WARNING("write_mqtt plugin: ZSTD_compress failed: %s",
+            ZSTD_getErrorName(status));
+      return -1;
+    }
+    *ret_len = status;
+    break;
+  }
+#endif
+  default:
+    return -1;
+  }
+
+  *ret_data = conn->compress_buffer;
+  return 0;
+} /* }}} int wm_compress */
+
+/* Only called from the publish thread. If the message is held in a batch,
+ * the batch is passed as "owned" and belongs to wm_publish() once it
+ * succeeded: with QoS 1 it is kept until the broker acknowledged the
+ * message, rather than copied. Only replayed messages come in a batch; a
+ * live message is still in its send buffer, so with QoS 1 it is copied
+ * once for the retry. Either way, mosquitto_publish() copies the payload
+ * into its own packet. */
+static int wm_publish(wm_conn_t *conn, char const *topic, /* {{{ */
+                      char const *data, size_t len, wm_batch_t *owned) {
+  wm_callback_t *cb = conn->cb;
+  wm_batch_t *inflight = NULL;
+  cdtime_t start;
+  int mid = 0;
+  int status;
+
+  if (cb->qos > 0) {
+    inflight = wm_inflight_begin(conn, topic, data, len, owned);
+    if (inflight == NULL)
+      return -1;
+  }
+
+  /* A message that cannot be encoded or compressed would fail again after
+   * reconnecting, so it is dropped and counted rather than reported as a
+   * failure. Publishing it uncompressed is no option: consumers could not
+   * tell it apart from a compressed one. */
+  if (wm_encode(conn, data, len, &data, &len) != 0) {
+    c_complain(LOG_WARNING, &conn->complaint_encode,
+               "write_mqtt plugin: encoding a message for broker \"%s:%d\" "
+               "failed, dropping it.",
+               cb->hosts[conn->broker], cb->port);
+    goto drop;
+  }
+  c_release(LOG_INFO, &conn->complaint_encode,
+            "write_mqtt plugin: encoding messages for broker \"%s:%d\" "
+            "works again.",
+            cb->hosts[conn->broker], cb->port);
+
+  if (wm_compress(conn, data, len, &data, &len) != 0) {
+    c_complain(LOG_WARNING, &conn->complaint_compress,
+               "write_mqtt plugin: compressing a message for broker "
+               "\"%s:%d\" failed, dropping it.",
+               cb->hosts[conn->broker], cb->port);
+    goto drop;
+  }
+  c_release(LOG_INFO, &conn->complaint_compress,
+            "write_mqtt plugin: compressing messages for broker \"%s:%d\" "
+            "works again.",
+            cb->hosts[conn->broker], cb->port);
+
+  start = cdtime();
+#if WM_HAVE_MQTT5
+  if (cb->protocol_version == MQTT_PROTOCOL_V5) {
+    bool known;
+    wm_alias_t *alias = wm_alias_get(conn, topic, &known);
+
+    status = mosquitto_publish_v5(
+        conn->mosq, &mid, known ? NULL : topic, (int)len, data,
+        cb->qos, /* retain */ false,
+        (alias != NULL) ? cb->alias_props[alias->alias - 1]
+                        : cb->publish_props);
+  } else
+#endif
+    status = mosquitto_publish(conn->mosq, &mid, topic, (int)len, data,
+                               cb->qos, /* retain */ false);
+  if (inflight != NULL)
+    wm_inflight_end(conn, inflight, (status == MOSQ_ERR_SUCCESS) ? mid : -1);
+  if (status != MOSQ_ERR_SUCCESS) {
+    char errbuf[1024];
+
+    if ((inflight != NULL) && (inflight != owned))
+      wm_batch_free(cb, inflight);
+
+    c_complain(LOG_ERR, &conn->complaint_cantpublish,
+               "write_mqtt plugin: mosquitto_publish failed with %d: %s", status,
+               (status == MOSQ_ERR_ERRNO)
+                   ? sstrerror(errno, errbuf, sizeof(errbuf))
+                   : mosquitto_strerror(status));
+    /* Mark our connection "down" regardless of the error as a safety
+     * measure; the publish thread will reconnect after the backoff
+     * interval. */
+    wm_mqtt_disconnect(conn);
+
+    return -1;
+  }
+
+  wm_loop_wakeup();
+
+  wm_histogram_add(&conn->stats.publish_latency,
+                   CDTIME_T_TO_US(cdtime() - start));
+  wm_stat_add(&conn->stats.messages_published, 1);
+  wm_stat_add(&conn->stats.bytes_published, len);
+  if (inflight == NULL)
+    wm_batch_free(cb, owned);
+  return 0;
+
+drop:
+  wm_stat_add(&conn->stats.batches_dropped, 1);
+  if (inflight != NULL) {
+    wm_inflight_end(conn, inflight, /* mid = */ -1);
+    if (inflight != owned)
+      wm_batch_free(cb, inflight);
+  }
+  wm_batch_free(cb, owned);
+  return 0;
+} /* }}} wm_publish */
+
+/* must hold cb->send_lock when calling. */
+static int wm_spool_open(wm_callback_t *cb) /* {{{ */
+{
+  wm_spool_header_t *hdr;
+  char path[PATH_MAX];
+  struct stat statbuf;
+  void *addr;
+
+  if ((cb->spool_dir == NULL) || (cb->spool != NULL))
+    return 0;
+
+  /* A "/" in the node's name would leave SpoolDir, like in topic fields it
+   * is replaced by "_". */
+  snprintf(path, sizeof(path), "%s/%s.spool", cb->spool_dir, cb->name);
+  size_t dir_len = strlen(cb->spool_dir) + 1;
+  if (dir_len < sizeof(path))
+    for (char *c = path + dir_len; *c != 0; c++)
+      if (*c == '/')
+        *c = '_';
+
+  cb->spool_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (cb->spool_fd < 0) {
+    char errbuf[1024];
+    ERROR("write_mqtt plugin: open(\"%s\") failed: %s", path,
+          sstrerror(errno, errbuf, sizeof(errbuf)));
+    return -1;
+  }
+
+  if ((fstat(cb->spool_fd, &statbuf) != 0) ||
+      (((size_t)statbuf.st_size != cb->max_spool_bytes) &&
+       (ftruncate(cb->spool_fd, (off_t)cb->max_spool_bytes) != 0))) {
+    char errbuf[1024];
+    ERROR("write_mqtt plugin: resizing \"%s\" failed: %s", path,
+          sstrerror(errno, errbuf, sizeof(errbuf)));
+    close(cb->spool_fd);
+    cb->spool_fd = -1;
+    return -1;
+  }
+
+  addr = mmap(NULL, cb->max_spool_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+              cb->spool_fd, 0);
+  if (addr == MAP_FAILED) {
+    char errbuf[1024];
+    ERROR("write_mqtt plugin: mmap(\"%s\") failed: %s", path,
+          sstrerror(errno, errbuf, sizeof(errbuf)));
+    close(cb->spool_fd);
+    cb->spool_fd = -1;
+    return -1;
+  }
+  cb->spool = addr;
+
+  /* Keep batches spooled by a previous run unless the file is not ours or
+   * was written with a larger MaxSpoolBytes. */
+  hdr = (wm_spool_header_t *)cb->spool;
+  if ((hdr->magic != WRITE_MQTT_SPOOL_MAGIC) ||
+      (hdr->version != WRITE_MQTT_SPOOL_VERSION) ||
+      (hdr->head < sizeof(*hdr)) || (hdr->head > hdr->tail) ||
+      (hdr->tail > cb->max_spool_bytes)) {
+    hdr->magic = WRITE_MQTT_SPOOL_MAGIC;
+    hdr->version = WRITE_MQTT_SPOOL_VERSION;
+    hdr->head = sizeof(*hdr);
+    hdr->tail = sizeof(*hdr);
+  } else if (hdr->head != hdr->tail) {
+    INFO("write_mqtt plugin: replaying %" PRIu64 " spooled bytes from \"%s\"",
+         hdr->tail - hdr->head, path);
+  }
+
+  return 0;
+} /* }}} int wm_spool_open */
+
+/* must hold cb->send_lock when calling. */
+static void wm_spool_close(wm_callback_t *cb) /* {{{ */
+{
+  if (cb->spool != NULL) {
+    (void)msync(cb->spool, cb->max_spool_bytes, MS_SYNC);
+    (void)munmap(cb->spool, cb->max_spool_bytes);
+    cb->spool = NULL;
+  }
+
+  if (cb->spool_fd >= 0) {
+    close(cb->spool_fd);
+    cb->spool_fd = -1;
+  }
+} /* }}} void wm_spool_close */
+
+/* must hold cb->send_lock when calling. Moves the records not replayed yet
+ * to the start of the file once the replayed ones take up at least as much
+ * room, so the copy neither overlaps them nor happens more than once per
+ * file's worth of records. */
+static void wm_spool_compact(wm_callback_t *cb) /* {{{ */
+{
+  wm_spool_header_t *hdr = (wm_spool_header_t *)cb->spool;
+  uint64_t live = hdr->tail - hdr->head;
+
+  if ((hdr->head - sizeof(*hdr)) < live)
+    return;
+
+  memcpy(cb->spool + sizeof(*hdr), cb->spool + hdr->head, live);
+  hdr->head = sizeof(*hdr);
+  hdr->tail = sizeof(*hdr) + live;
+} /* }}} void wm_spool_compact */
+
+/* must hold cb->send_lock when calling. */
+static int wm_spool_append(wm_callback_t *cb, char const *topic, /* {{{ */
+                           char const *data, size_t len) {
+  wm_spool_header_t *hdr;
+  size_t topic_len = strlen(topic);
+  uint32_t rec_len = (uint32_t)len;
+  uint16_t rec_topic_len = (uint16_t)topic_len;
+  char *ptr;
+
+  if (cb->spool == NULL)
+    return -1;
+
+  hdr = (wm_spool_header_t *)cb->spool;
+  if ((len > UINT32_MAX) || (topic_len > UINT16_MAX))
+    return -1;
+
+  size_t rec_size = sizeof(rec_len) + sizeof(rec_topic_len) + topic_len + len;
+  if ((hdr->tail + rec_size) > cb->max_spool_bytes)
+    wm_spool_compact(cb);
+  if ((hdr->tail + rec_size) > cb->max_spool_bytes)
+    return -1;
+
+  ptr = cb->spool + hdr->tail;
+  memcpy(ptr, &rec_len, sizeof(rec_len));
+  ptr += sizeof(rec_len);
+  memcpy(ptr, &rec_topic_len, sizeof(rec_topic_len));
+  ptr += sizeof(rec_topic_len);
+  memcpy(ptr, topic, topic_len);
+  ptr += topic_len;
+  memcpy(ptr, data, len);
+  hdr->tail += rec_size;
+
+  return 0;
+} /* }}} int wm_spool_append */
+
+/* must hold cb->send_lock when calling. Sets "ret_batch" to the oldest
+ * record, or to NULL if there is none. Returns -ENOMEM, keeping the record,
+ * if no batch could be allocated for it. */
+static int wm_spool_pop(wm_callback_t *cb, wm_batch_t **ret_batch) /* {{{ */
+{
+  wm_spool_header_t *hdr;
+  wm_batch_t *batch;
+  uint32_t rec_len = 0;
+  uint16_t rec_topic_len = 0;
+  size_t hdr_len = sizeof(rec_len) + sizeof(rec_topic_len);
+  uint64_t rec_end = UINT64_MAX;
+  char const *ptr;
+
+  *ret_batch = NULL;
+  if (cb->spool == NULL)
+    return 0;
+
+  hdr = (wm_spool_header_t *)cb->spool;
+  if (hdr->head == hdr->tail)
+    return 0;
+
+  ptr = cb->spool + hdr->head;
+  if ((hdr->head + hdr_len) <= hdr->tail) {
+    memcpy(&rec_len, ptr, sizeof(rec_len));
+    memcpy(&rec_topic_len, ptr + sizeof(rec_len), sizeof(rec_topic_len));
+    rec_end = hdr->head + hdr_len + rec_topic_len + rec_len;
+  }
+  if (rec_end > hdr->tail) {
+    ERROR("write_mqtt plugin: spool file of instance '%s' is corrupt, "
+          "discarding it.",
+          cb->name);
+    hdr->head = hdr->tail = sizeof(*hdr);
+    return 0;
+  }
+
+  batch = wm_batch_create(cb, ptr + hdr_len, rec_topic_len,
+                          ptr + hdr_len + rec_topic_len, rec_len);
+  if (batch == NULL)
+    return -ENOMEM;
+
+  hdr->head = rec_end;
+  if (hdr->head == hdr->tail)
+    hdr->head = hdr->tail = sizeof(*hdr);
+
+  *ret_batch = batch;
+  return 0;
+} /* }}} int wm_spool_pop */
+
+/* must hold cb->send_lock when calling. */
+static bool wm_backlog_enabled(wm_callback_t const *cb) /* {{{ */
+{
+  return (cb->max_queued_bytes > 0) || (cb->spool != NULL);
+} /* }}} bool wm_backlog_enabled */
+
+/* must hold cb->send_lock when calling. With BrokerPolicy "Replicate", only
+ * the connections to the first broker use the offline queue; the others
+ * drop what they cannot publish. */
+static bool wm_conn_backlog(wm_conn_t const *conn) /* {{{ */
+{
+  return (conn->group == 0) && wm_backlog_enabled(conn->cb);
+} /* }}} bool wm_conn_backlog */
+
+/* must hold cb->send_lock when calling. */
+static void wm_backlog_drop(wm_callback_t *cb, size_t len) /* {{{ */
+{
+  wm_stat_add(&cb->stats.batches_dropped, 1);
+  c_complain(LOG_WARNING, &cb->complaint_dropped,
+             "write_mqtt plugin: no broker of instance '%s' available and "
+             "offline queue full, dropping %" PRIsz " bytes of values.",
+             cb->name, len);
+} /* }}} void wm_backlog_drop */
+
+/* must hold cb->send_lock when calling. Moves the oldest in-memory batch to
+ * the spool file, or drops it if there is no room. */
+static void wm_backlog_spill(wm_callback_t *cb) /* {{{ */
+{
+  wm_batch_t *batch = cb->backlog_head;
+
+  if (batch == NULL)
+    return;
+
+  cb->backlog_head = batch->next;
+  if (cb->backlog_head == NULL)
+    cb->backlog_tail = NULL;
+  cb->backlog_bytes -= batch->len;
+
+  if (wm_spool_append(cb, batch->topic, batch->data, batch->len) != 0)
+    wm_backlog_drop(cb, batch->len);
+  wm_batch_free(cb, batch);
+} /* }}} void wm_backlog_spill */
+
+/* must hold cb->send_lock when calling. Makes room within MaxMemory by
+ * moving the oldest in-memory batch to the spool file, or by dropping it if
+ * there is no spool file. */
+static void wm_backlog_shed(wm_callback_t *cb) /* {{{ */
+{
+  wm_batch_t *batch = cb->backlog_head;
+
+  if (cb->spool != NULL) {
+    wm_backlog_spill(cb);
+    return;
+  }
+  if (batch == NULL)
+    return;
+
+  cb->backlog_head = batch->next;
+  if (cb->backlog_head == NULL)
+    cb->backlog_tail = NULL;
+  cb->backlog_bytes -= batch->len;
+
+  wm_stat_add(&cb->stats.batches_shed, 1);
+  wm_batch_free(cb, batch);
+} /* }}} void wm_backlog_shed */
+
+/* must hold cb->send_lock when calling. Queues a batch the broker did not
+ * get for replay after reconnecting. */
+static void wm_backlog_push(wm_callback_t *cb, char const *topic, /* {{{ */
+                            char const *data, size_t len) {
+  size_t bytes =
+      wm_batch_bytes(cb, sizeof(wm_batch_t) + len + strlen(topic) + 2);
+  wm_batch_t *batch;
+
+  if (len > cb->max_queued_bytes) {
+    /* Keep the spool ordered: everything in memory is newer. */
+    while (cb->backlog_head != NULL)
+      wm_backlog_spill(cb);
+    if (wm_spool_append(cb, topic, data, len) != 0)
+      wm_backlog_drop(cb, len);
+    return;
+  }
+
+  while ((cb->backlog_head != NULL) &&
+         ((cb->backlog_bytes + len) > cb->max_queued_bytes))
+    wm_backlog_spill(cb);
+
+  /* Within MaxMemory, older batches make room if they can go to the spool
+   * file or the policy is "DropOldest"; otherwise the new one is dropped. */
+  while ((cb->backlog_head != NULL) &&
+         ((cb->spool != NULL) ||
+          (cb->memory_policy == WM_MEMORY_DROP_OLDEST)) &&
+         wm_memory_exceeds(cb, bytes))
+    wm_backlog_shed(cb);
+  if (wm_memory_exceeds(cb, bytes)) {
+    if (wm_spool_append(cb, topic, data, len) != 0)
+      wm_backlog_drop(cb, len);
+    return;
+  }
+
+  batch = wm_batch_create(cb, topic, strlen(topic), data, len);
+  if (batch == NULL) {
+    wm_backlog_drop(cb, len);
+    return;
+  }
+
+  if (cb->backlog_tail == NULL)
+    cb->backlog_head = batch;
+  else
+    cb->backlog_tail->next = batch;
+  cb->backlog_tail = batch;
+  cb->backlog_bytes += len;
+} /* }}} void wm_backlog_push */
+
+/* must hold cb->send_lock when calling. Queues messages "first" and following
+ * of a finalized buffer. */
+static void wm_backlog_push_buffer(wm_callback_t *cb, /* {{{ */
+                                   wm_buffer_t *buf, size_t first) {
+  for (size_t i = first; i <= buf->splits_num; i++) {
+    char *data;
+    size_t len;
+
+    wm_buffer_message(buf, i, &data, &len);
+    wm_backlog_push(cb, buf->topic->name, data, len);
+  }
+} /* }}} void wm_backlog_push_buffer */
+
+/* must hold cb->send_lock when calling. Returns a batch the replay failed for
+ * to the front of the backlog. */
+static void wm_backlog_unpop(wm_callback_t *cb, wm_batch_t *batch) /* {{{ */
+{
+  batch->next = cb->backlog_head;
+  cb->backlog_head = batch;
+  if (cb->backlog_tail == NULL)
+    cb->backlog_tail = batch;
+  cb->backlog_bytes += batch->len;
+} /* }}} void wm_backlog_unpop */
+
+/* must hold cb->send_lock when calling. Puts all unacknowledged messages
+ * back in front of the offline queue, oldest first. The broker may have
+ * received some of them, which QoS 1 allows to be delivered twice. Replicas
+ * (see wm_conn_backlog()) drop them instead. */
+static void wm_inflight_requeue(wm_conn_t *conn) /* {{{ */
+{
+  wm_batch_t *list;
+  wm_batch_t *reversed = NULL;
+
+  pthread_mutex_lock(&conn->inflight_lock);
+  list = conn->inflight_head;
+  conn->inflight_head = NULL;
+  conn->inflight_tail = NULL;
+  __atomic_store_n(&conn->inflight, 0, __ATOMIC_RELAXED);
+  pthread_cond_signal(&conn->inflight_cond);
+  pthread_mutex_unlock(&conn->inflight_lock);
+
+  if (conn->group > 0) {
+    while (list != NULL) {
+      wm_batch_t *next = list->next;
+      wm_stat_add(&conn->stats.batches_dropped, 1);
+      wm_batch_free(conn->cb, list);
+      list = next;
+    }
+    return;
+  }
+
+  while (list != NULL) {
+    wm_batch_t *next = list->next;
+    list->next = reversed;
+    reversed = list;
+    list = next;
+  }
+  while (reversed != NULL) {
+    wm_batch_t *next = reversed->next;
+    reversed->mid = 0;
+    wm_backlog_unpop(conn->cb, reversed);
+    reversed = next;
+  }
+} /* }}} void wm_inflight_requeue */
+
+/* must hold cb->send_lock when calling. Oldest batches (spool) first. Sets
+ * "ret_batch" to NULL if the backlog is empty; see wm_spool_pop() for the
+ * return value. */
+static int wm_backlog_pop(wm_callback_t *cb, wm_batch_t **ret_batch) /* {{{ */
+{
+  wm_batch_t *batch;
+  int status = wm_spool_pop(cb, ret_batch);
+
+  if ((status != 0) || (*ret_batch != NULL))
+    return status;
+
+  batch = cb->backlog_head;
+  if (batch == NULL)
+    return 0;
+
+  cb->backlog_head = batch->next;
+  if (cb->backlog_head == NULL)
+    cb->backlog_tail = NULL;
+  cb->backlog_bytes -= batch->len;
+  batch->next = NULL;
+
+  *ret_batch = batch;
+  return 0;
+} /* }}} int wm_backlog_pop */
+
+/* must hold cb->send_lock when calling. */
+static bool wm_backlog_empty(wm_callback_t const *cb) /* {{{ */
+{
+  wm_spool_header_t const *hdr = (wm_spool_header_t const *)cb->spool;
+
+  return (cb->backlog_head == NULL) &&
+         ((hdr == NULL) || (hdr->head == hdr->tail));
+} /* }}} bool wm_backlog_empty */
+
+/* Drops a reference to a queued buffer. Returns true for the last one, after
+ * which the caller returns the buffer to its shard. */
+static bool wm_buffer_unref(wm_buffer_t *buf) /* {{{ */
+{
+  return __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0;
+} /* }}} bool wm_buffer_unref */
+
+/* must hold cb->send_lock when calling. The priority lane goes first, but
+ * while bulk batches are waiting, every "priority_weight" priority batches
+ * are followed by a bulk one, so that the bulk lane is not starved. */
+static wm_buffer_t *wm_queue_pop(wm_conn_t *conn) /* {{{ */
+{
+  int lane = WM_LANE_BULK;
+  wm_buffer_t *buf;
+
+  if ((conn->publish_head[WM_LANE_PRIORITY] != NULL) &&
+      ((conn->publish_head[WM_LANE_BULK] == NULL) ||
+       (conn->priority_streak < conn->cb->priority_weight)))
+    lane = WM_LANE_PRIORITY;
+
+  buf = conn->publish_head[lane];
+  if (buf == NULL)
+    return NULL;
+
+  conn->publish_head[lane] = buf->queue_next[conn->group];
+  if (conn->publish_head[lane] == NULL)
+    conn->publish_tail[lane] = NULL;
+  conn->publish_num--;
+  buf->queue_next[conn->group] = NULL;
+
+  if (lane == WM_LANE_BULK)
+    conn->priority_streak = 0;
+  else if (conn->publish_head[WM_LANE_BULK] != NULL)
+    conn->priority_streak++;
+
+  return buf;
+} /* }}} wm_buffer_t *wm_queue_pop */
+
+/* must hold cb->send_lock when calling. */
+static void wm_queue_push(wm_conn_t *conn, wm_buffer_t *buf) /* {{{ */
+{
+  int lane = buf->topic->lane;
+
+  buf->queue_next[conn->group] = NULL;
+  if (conn->publish_tail[lane] == NULL)
+    conn->publish_head[lane] = buf;
+  else
+    conn->publish_tail[lane]->queue_next[conn->group] = buf;
+  conn->publish_tail[lane] = buf;
+  conn->publish_num++;
+
+  pthread_cond_signal(&conn->publish_cond);
+} /* }}} void wm_queue_push */
+
+/* must hold cb->send_lock when calling. Removes the oldest buffer of "shard"
+ * from the connection's queue, bulk batches first. */
+static wm_buffer_t *wm_queue_take(wm_conn_t *conn, /* {{{ */
+                                  wm_shard_t const *shard) {
+  size_t g = conn->group;
+
+  for (int lane = 0; lane < WM_LANES; lane++) {
+    wm_buffer_t *prev = NULL;
+
+    for (wm_buffer_t *buf = conn->publish_head[lane]; buf != NULL;
+         buf = buf->queue_next[g]) {
+      if (buf->shard != shard) {
+        prev = buf;
+        continue;
+      }
+
+      if (prev == NULL)
+        conn->publish_head[lane] = buf->queue_next[g];
+      else
+        prev->queue_next[g] = buf->queue_next[g];
+      if (conn->publish_tail[lane] == buf)
+        conn->publish_tail[lane] = prev;
+      conn->publish_num--;
+      buf->queue_next[g] = NULL;
+      return buf;
+    }
+  }
+
+  return NULL;
+} /* }}} wm_buffer_t *wm_queue_take */
+
+/* must hold cb->send_lock when calling. Moves all queued batches of the
+ * connection to the backlog, or drops them, and returns the buffers no other
+ * connection holds, which the caller passes to wm_release_buffers() after
+ * releasing "send_lock". */
+static wm_buffer_t *wm_queue_spill(wm_conn_t *conn) /* {{{ */
+{
+  wm_buffer_t *release = NULL;
+  wm_buffer_t *buf;
+
+  while ((buf = wm_queue_pop(conn)) != NULL) {
+    if (wm_conn_backlog(conn))
+      wm_backlog_push_buffer(conn->cb, buf, /* first = */ 0);
+    else
+      wm_stat_add(&conn->stats.batches_dropped, 1);
+
+    if (wm_buffer_unref(buf)) {
+      buf->next = release;
+      release = buf;
+    }
+  }
+
+  return release;
+} /* }}} wm_buffer_t *wm_queue_spill */
+
+/* must hold shard->lock when calling. */
+static void wm_topic_lru_unlink(wm_shard_t *shard, /* {{{ */
+                                wm_topic_t *topic) {
+  if (topic->lru_prev != NULL)
+    topic->lru_prev->lru_next = topic->lru_next;
+  else
+    shard->topic_lru_head = topic->lru_next;
+  if (topic->lru_next != NULL)
+    topic->lru_next->lru_prev = topic->lru_prev;
+  else
+    shard->topic_lru_tail = topic->lru_prev;
+  topic->lru_prev = topic->lru_next = NULL;
+} /* }}} void wm_topic_lru_unlink */
+
+/* must hold shard->lock when calling. Takes a reference to a topic, which
+ * keeps it from being forgotten. */
+static void wm_topic_hold(wm_shard_t *shard, wm_topic_t *topic) /* {{{ */
+{
+  if ((topic->refs++ == 0) && (topic->key != NULL))
+    wm_topic_lru_unlink(shard, topic);
+} /* }}} void wm_topic_hold */
+
+/* must hold shard->lock when calling. Drops a reference to a topic taken
+ * with wm_topic_hold(). */
+static void wm_topic_put(wm_shard_t *shard, wm_topic_t *topic) /* {{{ */
+{
+  if ((--topic->refs > 0) || (topic->key == NULL))
+    return;
+
+  topic->lru_prev = NULL;
+  topic->lru_next = shard->topic_lru_head;
+  if (shard->topic_lru_head != NULL)
+    shard->topic_lru_head->lru_prev = topic;
+  else
+    shard->topic_lru_tail = topic;
+  shard->topic_lru_head = topic;
+} /* }}} void wm_topic_put */
+
+/* must hold buf->shard->lock when calling. */
+static void wm_release_buffer_nolock(wm_buffer_t *buf) /* {{{ */
+{
+  wm_shard_t *shard = buf->shard;
+
+  if (buf->topic != NULL)
+    wm_topic_put(shard, buf->topic);
+  buf->topic = NULL;
+  if (buf->reserved) {
+    buf->next = shard->reserved_head;
+    shard->reserved_head = buf;
+  } else {
+    buf->next = shard->free_head;
+    shard->free_head = buf;
+  }
+
+  pthread_cond_broadcast(&shard->cond);
+} /* }}} void wm_release_buffer_nolock */
+
+/* must not hold cb->send_lock when calling: the shard lock is taken first. */
+static void wm_release_buffer(wm_buffer_t *buf) /* {{{ */
+{
+  wm_shard_t *shard = buf->shard;
+
+  pthread_mutex_lock(&shard->lock);
+  wm_release_buffer_nolock(buf);
+  pthread_mutex_unlock(&shard->lock);
+} /* }}} void wm_release_buffer */
+
+/* Releases a list of buffers linked by "next". */
+static void wm_release_buffers(wm_buffer_t *buf) /* {{{ */
+{
+  while (buf != NULL) {
+    wm_buffer_t *next = buf->next;
+    wm_release_buffer(buf);
+    buf = next;
+  }
+} /* }}} void wm_release_buffers */
+
+static char const *wm_field_value(value_list_t const *vl, /* {{{ */
+                                  int field) {
+  switch (field) {
+  case WM_FIELD_HOST:
+    return vl->host;
+  case WM_FIELD_PLUGIN:
+    return vl->plugin;
+  case WM_FIELD_PLUGIN_INSTANCE:
+    return vl->plugin_instance;
+  case WM_FIELD_TYPE:
+    return vl->type;
+  case WM_FIELD_TYPE_INSTANCE:
+    return vl->type_instance;
+  }
+
+  return "";
+} /* }}} char const *wm_field_value */
+
+/* Jump consistent hash (Lamping, Veach): maps "key" to one of "buckets"
+ * buckets, moving as few keys as possible when the number changes. */
+static size_t wm_jump_hash(uint64_t key, size_t buckets) /* {{{ */
+{
+  int64_t b = -1;
+  int64_t j = 0;
+
+  while (j < (int64_t)buckets) {
+    b = j;
+    key = key * 2862933555777941757ULL + 1;
+    j = (int64_t)((double)(b + 1) *
+                  ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+  }
+
+  return (size_t)b;
+} /* }}} size_t wm_jump_hash */
+
+/* Hash of a value list's identifier, which picks its shard and connection.
+ */
+static uint32_t wm_identifier_hash(value_list_t const *vl) /* {{{ */
+{
+  uint32_t hash = 2166136261u;
+
+  for (int field = WM_FIELD_HOST; field < WM_FIELD_MAX; field++) {
+    char const *value = wm_field_value(vl, field);
+    size_t value_len = strnlen(value, DATA_MAX_NAME_LEN - 1);
+
+    /* FNV-1a over all fields, including their terminating NUL. */
+    for (size_t i = 0; i <= value_len; i++) {
+      hash ^= (i < value_len) ? (uint8_t)value[i] : 0;
+      hash *= 16777619u;
+    }
+  }
+
+  return hash;
+} /* }}} uint32_t wm_identifier_hash */
+
+/*
+ * Filters
+ */
+/* Matches "text" against "pattern", in which "*" stands for any number of
+ * characters and "?" for exactly one, except for "/". */
+static bool wm_glob_match(char const *pattern, char const *text) /* {{{ */
+{
+  char const *star = NULL;
+  char const *star_text = NULL;
+
+  while (*text != 0) {
+    if (*pattern == '*') {
+      star = ++pattern;
+      star_text = text;
+    } else if ((*pattern == *text) || ((*pattern == '?') && (*text != '/'))) {
+      pattern++;
+      text++;
+    } else if ((star != NULL) && (*star_text != '/')) {
+      /* Let the last "*" take one more character. */
+      pattern = star;
+      text = ++star_text;
+    } else {
+      return false;
+    }
+  }
+
+  while (*pattern == '*')
+    pattern++;
+  return *pattern == 0;
+} /* }}} bool wm_glob_match */
+
+static bool wm_rules_match(wm_rules_t const *rules, /* {{{ */
+                           char const *identifier) {
+  if (rules->exact_num > 0) {
+    size_t mask = rules->exact_size - 1;
+    size_t i = wm_hash(identifier, strlen(identifier)) & mask;
+
+    for (; rules->exact[i] != NULL; i = (i + 1) & mask)
+      if (strcmp(rules->exact[i], identifier) == 0)
+        return true;
+  }
+
+  for (size_t i = 0; i < rules->globs_num; i++)
+    if (wm_glob_match(rules->globs[i], identifier))
+      return true;
+
+  return false;
+} /* }}} bool wm_rules_match */
+
+static int wm_rules_add_exact(wm_rules_t *rules, char *pattern) /* {{{ */
+{
+  size_t mask;
+  size_t i;
+
+  if (2 * (rules->exact_num + 1) > rules->exact_size) {
+    size_t size = (rules->exact_size == 0) ? 16 : 2 * rules->exact_size;
+    char **exact = calloc(size, sizeof(*exact));
+
+    if (exact == NULL)
+      return ENOMEM;
+    for (size_t j = 0; j < rules->exact_size; j++) {
+      if (rules->exact[j] == NULL)
+        continue;
+      i = wm_hash(rules->exact[j], strlen(rules->exact[j])) & (size - 1);
+      while (exact[i] != NULL)
+        i = (i + 1) & (size - 1);
+      exact[i] = rules->exact[j];
+    }
+    sfree(rules->exact);
+    rules->exact = exact;
+    rules->exact_size = size;
+  }
+
+  mask = rules->exact_size - 1;
+  for (i = wm_hash(pattern, strlen(pattern)) & mask; rules->exact[i] != NULL;
+       i = (i + 1) & mask) {
+    if (strcmp(rules->exact[i], pattern) == 0) {
+      sfree(pattern);
+      return 0;
+    }
+  }
+  rules->exact[i] = pattern;
+  rules->exact_num++;
+  return 0;
+} /* }}} int wm_rules_add_exact */
+
+static int wm_rules_add(wm_rules_t *rules, char const *pattern) /* {{{ */
+{
+  char *copy = strdup(pattern);
+  char **globs;
+
+  if (copy == NULL)
+    return ENOMEM;
+  if (strpbrk(copy, "*?") == NULL)
+    return wm_rules_add_exact(rules, copy);
+
+  globs = realloc(rules->globs, (rules->globs_num + 1) * sizeof(*globs));
+  if (globs == NULL) {
+    sfree(copy);
+    return ENOMEM;
+  }
+  rules->globs = globs;
+  rules->globs[rules->globs_num++] = copy;
+  return 0;
+} /* }}} int wm_rules_add */
+
+static void wm_rules_free(wm_rules_t *rules) /* {{{ */
+{
+  for (size_t i = 0; i < rules->exact_size; i++)
+    sfree(rules->exact[i]);
+  sfree(rules->exact);
+  for (size_t i = 0; i < rules->globs_num; i++)
+    sfree(rules->globs[i]);
+  sfree(rules->globs);
+} /* }}} void wm_rules_free */
+
+/* 64-bit FNV-1a over the identifier fields, the key of the filter cache. */
+static uint64_t wm_identifier_hash64(value_list_t const *vl) /* {{{ */
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (int field = WM_FIELD_HOST; field < WM_FIELD_MAX; field++) {
+    char const *value = wm_field_value(vl, field);
+    size_t value_len = strnlen(value, DATA_MAX_NAME_LEN - 1);
+
+    for (size_t i = 0; i <= value_len; i++) {
+      hash ^= (i < value_len) ? (uint8_t)value[i] : 0;
+      hash *= 1099511628211ULL;
+    }
+  }
+
+  return hash;
+} /* }}} uint64_t wm_identifier_hash64 */
+
+/* Whether value lists of the series of "vl" are written, and to which lane.
+ * Takes no lock: a cache slot holds the identifier's hash with the outcome
+ * in bit 0, the lane in bit 1 and bit 2 set, so that it never matches while
+ * empty. Writers racing for a slot only cost each other another match. */
+static bool wm_filter_pass(wm_callback_t *cb, value_list_t const *vl, /* {{{ */
+                           int *ret_lane) {
+  uint64_t hash = wm_identifier_hash64(vl);
+  uint64_t key = (hash & ~UINT64_C(7)) | 4;
+  uint64_t *slot =
+      cb->filter_cache + (hash >> 32) % WRITE_MQTT_FILTER_CACHE_SIZE;
+  uint64_t entry = __atomic_load_n(slot, __ATOMIC_RELAXED);
+  bool pass;
+
+  if ((entry & ~UINT64_C(3)) == key) {
+    pass = (entry & 1) != 0;
+    *ret_lane = (entry & 2) ? WM_LANE_PRIORITY : WM_LANE_BULK;
+  } else {
+    char identifier[6 * DATA_MAX_NAME_LEN];
+
+    FORMAT_VL(identifier, sizeof(identifier), vl);
+    pass = (((cb->include.exact_num + cb->include.globs_num) == 0) ||
+            wm_rules_match(&cb->include, identifier)) &&
+           !wm_rules_match(&cb->exclude, identifier);
+    *ret_lane = (pass && cb->priority_lane &&
+                 wm_rules_match(&cb->priority, identifier))
+                    ? WM_LANE_PRIORITY
+                    : WM_LANE_BULK;
+    __atomic_store_n(slot,
+                     key | (pass ? 1 : 0) |
+                         ((*ret_lane == WM_LANE_PRIORITY) ? 2 : 0),
+                     __ATOMIC_RELAXED);
+  }
+
+  if (!pass && cb->collect_stats)
+    wm_writer_stat_add(cb, offsetof(wm_writer_stats_t, values_filtered), 1);
+  return pass;
+} /* }}} bool wm_filter_pass */
+
+/* must hold shard->lock when calling. */
+static int wm_series_grow(wm_callback_t *cb, wm_shard_t *shard) /* {{{ */
+{
+  size_t size = (shard->series_size == 0) ? WRITE_MQTT_INITIAL_SERIES_SIZE
+                                          : 2 * shard->series_size;
+  wm_series_t **series = calloc(size, sizeof(*series));
+
+  if (series == NULL)
+    return ENOMEM;
+
+  for (size_t i = 0; i < shard->series_size; i++) {
+    while (shard->series[i] != NULL) {
+      wm_series_t *s = shard->series[i];
+
+      shard->series[i] = s->hash_next;
+      s->hash_next = series[s->hash & (size - 1)];
+      series[s->hash & (size - 1)] = s;
+    }
+  }
+
+  wm_memory_add(cb, (size - shard->series_size) * sizeof(*series));
+  sfree(shard->series);
+  shard->series = series;
+  shard->series_size = size;
+
+  return 0;
+} /* }}} int wm_series_grow */
+
+/* must hold shard->lock when calling. */
+static void wm_series_lru_unlink(wm_shard_t *shard, /* {{{ */
+                                 wm_series_t *s) {
+  if (s->lru_prev != NULL)
+    s->lru_prev->lru_next = s->lru_next;
+  else
+    shard->lru_head = s->lru_next;
+  if (s->lru_next != NULL)
+    s->lru_next->lru_prev = s->lru_prev;
+  else
+    shard->lru_tail = s->lru_prev;
+  s->lru_prev = s->lru_next = NULL;
+} /* }}} void wm_series_lru_unlink */
+
+/* must hold shard->lock when calling. */
+static void wm_series_lru_push(wm_shard_t *shard, wm_series_t *s) /* {{{ */
+{
+  s->lru_prev = NULL;
+  s->lru_next = shard->lru_head;
+  if (shard->lru_head != NULL)
+    shard->lru_head->lru_prev = s;
+  else
+    shard->lru_tail = s;
+  shard->lru_head = s;
+} /* }}} void wm_series_lru_push */
+
+/* The bytes a series takes, including its JSON fragment. */
+static size_t wm_series_size(wm_series_t const *s) /* {{{ */
+{
+  size_t agg_num = (s->agg != NULL) ? s->values_num : 0;
+
+  return sizeof(*s) + s->values_num * sizeof(value_t) +
+         agg_num * sizeof(wm_agg_t) + s->key_len +
+         ((s->json != NULL) ? s->json_len : 0);
+} /* }}} size_t wm_series_size */
+
+/* must hold shard->lock when calling. Forgets the least recently written
+ * series of the shard. */
+static void wm_series_evict(wm_callback_t *cb, wm_shard_t *shard) /* {{{ */
+{
+  wm_series_t *s = shard->lru_tail;
+  wm_series_t **prev;
+
+  if (s == NULL)
+    return;
+
+  wm_series_lru_unlink(shard, s);
+  for (prev = &shard->series[s->hash & (shard->series_size - 1)];
+       *prev != NULL; prev = &(*prev)->hash_next) {
+    if (*prev == s) {
+      *prev = s->hash_next;
+      break;
+    }
+  }
+  shard->series_num--;
+
+  wm_memory_release(cb, wm_series_size(s));
+  sfree(s->json);
+  sfree(s);
+} /* }}} void wm_series_evict */
+
+/* must hold shard->lock when calling. Returns the series of a value list,
+ * adding it the first time it is seen, or NULL if that fails. "id_hash" is
+ * the value list's wm_identifier_hash(). Within MaxMemory, the least recently
+ * written series make room for new ones. */
+static wm_series_t *wm_series_get(wm_callback_t *cb, /* {{{ */
+                                  wm_shard_t *shard, data_set_t const *ds,
+                                  value_list_t const *vl, uint32_t id_hash) {
+  size_t series_max =
+      (cb->series_cache_size + cb->shards_num - 1) / cb->shards_num;
+  char key[WM_FIELD_MAX * DATA_MAX_NAME_LEN];
+  size_t key_len = 0;
+  size_t agg_num = (cb->aggregation_interval > 0) ? ds->ds_num : 0;
+  size_t size;
+  wm_series_t *s;
+
+  for (int field = WM_FIELD_HOST; field < WM_FIELD_MAX; field++) {
+    char const *value = wm_field_value(vl, field);
+    size_t value_len = strnlen(value, DATA_MAX_NAME_LEN - 1);
+
+    memcpy(key + key_len, value, value_len);
+    key_len += value_len;
+    key[key_len++] = 0;
+  }
+
+  if (shard->series_size > 0) {
+    for (s = shard->series[id_hash & (shard->series_size - 1)]; s != NULL;
+         s = s->hash_next)
+      if ((s->hash == id_hash) && (s->key_len == key_len) &&
+          (memcmp(s->key, key, key_len) == 0)) {
+        if (s != shard->lru_head) {
+          wm_series_lru_unlink(shard, s);
+          wm_series_lru_push(shard, s);
+        }
+        return s;
+      }
+  }
+
+  size = sizeof(*s) + ds->ds_num * sizeof(value_t) +
+         agg_num * sizeof(wm_agg_t) + key_len;
+
+  /* A window still being aggregated is not given up: the new series is
+   * simply written as is. */
+  while ((shard->series_num >= series_max) ||
+         ((shard->series_num > 0) && wm_memory_exceeds(cb, size))) {
+    if (shard->lru_tail->agg_samples > 0)
+      return NULL;
+    wm_series_evict(cb, shard);
+  }
+  if (wm_memory_exceeds(cb, size))
+    return NULL;
+
+  if ((4 * (shard->series_num + 1)) > (3 * shard->series_size))
+    if (wm_series_grow(cb, shard) != 0)
+      return NULL;
+
+  s = calloc(1, size);
+  if (s == NULL)
+    return NULL;
+  wm_memory_add(cb, size);
+
+  s->hash = id_hash;
+  s->values = (value_t *)(s + 1);
+  s->values_num = ds->ds_num;
+  s->ds = ds;
+  s->agg = (agg_num > 0) ? (wm_agg_t *)(s->values + ds->ds_num) : NULL;
+  s->key = (char *)(s->values + ds->ds_num) + agg_num * sizeof(wm_agg_t);
+  s->key_len = key_len;
+  memcpy(s->key, key, key_len);
+
+  s->hash_next = shard->series[id_hash & (shard->series_size - 1)];
+  shard->series[id_hash & (shard->series_size - 1)] = s;
+  shard->series_num++;
+  wm_series_lru_push(shard, s);
+
+  return s;
+} /* }}} wm_series_t *wm_series_get */
+
+/* Returns true if the values of "vl" are the same as the ones last published
+ * for the series "s" and a heartbeat is not due yet. */
+static bool wm_series_unchanged(wm_callback_t const *cb, /* {{{ */
+                                wm_series_t const *s, data_set_t const *ds,
+                                value_list_t const *vl) {
+  if ((s->published == 0) || (s->values_num != ds->ds_num))
+    return false;
+
+  if ((cb->heartbeat_interval > 0) &&
+      ((vl->time < s->published) ||
+       ((vl->time - s->published) >= cb->heartbeat_interval)))
+    return false;
+
+  for (size_t i = 0; i < ds->ds_num; i++) {
+    switch (ds->ds[i].type) {
+    case DS_TYPE_GAUGE: {
+      gauge_t last = s->values[i].gauge;
+      gauge_t value = vl->values[i].gauge;
+
+      if (isnan(last) || isnan(value)) {
+        if (isnan(last) != isnan(value))
+          return false;
+      } else if (fabs(value - last) > cb->deadband)
+        return false;
+      break;
+    }
+    case DS_TYPE_COUNTER:
+      if (s->values[i].counter != vl->values[i].counter)
+        return false;
+      break;
+    case DS_TYPE_DERIVE:
+      if (s->values[i].derive != vl->values[i].derive)
+        return false;
+      break;
+    case DS_TYPE_ABSOLUTE:
+      if (s->values[i].absolute != vl->values[i].absolute)
+        return false;
+      break;
+    default:
+      return false;
+    }
+  }
+
+  return true;
+} /* }}} bool wm_series_unchanged */
+
+/* Remembers the values of "vl" as the last published ones of "s". */
+static void wm_series_update(wm_series_t *s, data_set_t const *ds, /* {{{ */
+                             value_list_t const *vl) {
+  if (s->values_num == ds->ds_num)
+    memcpy(s->values, vl->values, ds->ds_num * sizeof(value_t));
+  s->published = (vl->time > 0) ? vl->time : 1;
+} /* }}} void wm_series_update */
+
+/* Returns the rate of a counter-like value since "raw", or NAN without an
+ * earlier value. */
+static gauge_t wm_agg_rate(int type, value_t raw, value_t value, /* {{{ */
+                           cdtime_t raw_time, cdtime_t time) {
+  double interval;
+
+  if ((raw_time == 0) || (time <= raw_time))
+    return NAN;
+  interval = CDTIME_T_TO_DOUBLE(time - raw_time);
+
+  switch (type) {
+  case DS_TYPE_COUNTER:
+    return (gauge_t)counter_diff(raw.counter, value.counter) / interval;
+  case DS_TYPE_DERIVE:
+    return (gauge_t)(value.derive - raw.derive) / interval;
+  case DS_TYPE_ABSOLUTE:
+    return (gauge_t)value.absolute / interval;
+  default:
+    return NAN;
+  }
+} /* }}} gauge_t wm_agg_rate */
+
+/* must hold shard->lock when calling. Adds a value list to the current
+ * window of "s", starting a new one if it is empty. Does not allocate. */
+static void wm_agg_add(wm_callback_t const *cb, wm_shard_t *shard, /* {{{ */
+                       wm_series_t *s, value_list_t const *vl) {
+  data_set_t const *ds = s->ds;
+
+  if (s->agg_samples == 0) {
+    s->agg_end = (vl->time / cb->aggregation_interval + 1) *
+                 cb->aggregation_interval;
+    s->agg_grace = (vl->interval > 0) ? vl->interval : cb->aggregation_interval;
+
+    s->agg_prev = shard->agg_tail;
+    s->agg_next = NULL;
+    if (shard->agg_tail == NULL)
+      shard->agg_head = s;
+    else
+      shard->agg_tail->agg_next = s;
+    shard->agg_tail = s;
+  }
+
+  for (size_t i = 0; i < ds->ds_num; i++) {
+    wm_agg_t *a = s->agg + i;
+    gauge_t value;
+
+    if (ds->ds[i].type == DS_TYPE_GAUGE)
+      value = vl->values[i].gauge;
+    else if (cb->store_rates)
+      value = wm_agg_rate(ds->ds[i].type, a->raw, vl->values[i],
+                          s->agg_raw_time, vl->time);
+    else
+      value = NAN;
+    a->raw = vl->values[i];
+    a->last = value;
+
+    if (isnan(value))
+      continue;
+    if ((a->count == 0) || (value < a->min))
+      a->min = value;
+    if ((a->count == 0) || (value > a->max))
+      a->max = value;
+    a->sum += value;
+    a->count++;
+  }
+
+  s->agg_raw_time = vl->time;
+  s->agg_time = vl->time;
+  s->agg_samples++;
+} /* }}} void wm_agg_add */
+
+/* must hold shard->lock when calling. Empties the window of "s", keeping the
+ * raw values for the next rates. */
+static void wm_agg_reset(wm_shard_t *shard, wm_series_t *s) /* {{{ */
+{
+  if (s->agg_prev == NULL)
+    shard->agg_head = s->agg_next;
+  else
+    s->agg_prev->agg_next = s->agg_next;
+  if (s->agg_next == NULL)
+    shard->agg_tail = s->agg_prev;
+  else
+    s->agg_next->agg_prev = s->agg_prev;
+  s->agg_prev = NULL;
+  s->agg_next = NULL;
+
+  for (size_t i = 0; i < s->values_num; i++) {
+    s->agg[i].sum = 0.0;
+    s->agg[i].count = 0;
+  }
+  s->agg_samples = 0;
+} /* }}} void wm_agg_reset */
+
+static gauge_t wm_agg_value(wm_agg_t const *a, int function) /* {{{ */
+{
+  if (function == WM_AGG_LAST)
+    return a->last;
+  if (a->count == 0)
+    return NAN;
+
+  switch (function) {
+  case WM_AGG_AVERAGE:
+    return a->sum / (gauge_t)a->count;
+  case WM_AGG_MINIMUM:
+    return a->min;
+  case WM_AGG_MAXIMUM:
+    return a->max;
+  default:
+    return NAN;
+  }
+} /* }}} gauge_t wm_agg_value */
+
+/* Concatenates the fields the template uses, each NUL-terminated, the
+ * connection index and the lane. "buffer" must hold WM_TOPIC_KEY_SIZE
+ * bytes. */
+#define WM_TOPIC_KEY_SIZE (WM_FIELD_MAX * DATA_MAX_NAME_LEN + sizeof(size_t) + 1)
+static size_t wm_topic_key(wm_callback_t const *cb, /* {{{ */
+                           value_list_t const *vl, size_t conn, int lane,
+                           char *buffer) {
+  size_t len = 0;
+
+  for (int field = WM_FIELD_HOST; field < WM_FIELD_MAX; field++) {
+    char const *value;
+    size_t value_len;
+
+    if ((cb->topic_fields & (1u << field)) == 0)
+      continue;
+
+    value = wm_field_value(vl, field);
+    value_len = strnlen(value, DATA_MAX_NAME_LEN - 1);
+    memcpy(buffer + len, value, value_len);
+    len += value_len;
+    buffer[len++] = 0;
+  }
+
+  memcpy(buffer + len, &conn, sizeof(conn));
+  len += sizeof(conn);
+  buffer[len++] = (char)lane;
+
+  return len;
+} /* }}} size_t wm_topic_key */
+
+/* Renders the TopicTemplate for a value list. Characters with a special
+ * meaning in MQTT topics are replaced in field values, so that each field
+ * is exactly one level of the topic and the topic contains no wildcards. */
+static char *wm_topic_render(wm_callback_t const *cb, /* {{{ */
+                             value_list_t const *vl) {
+  char *topic;
+  size_t len = 0;
+
+  if (cb->topic_template == NULL)
+    return strdup(cb->topic);
+
+  for (size_t i = 0; i < cb->topic_template_num; i++) {
+    wm_template_part_t const *part = cb->topic_template + i;
+
+    if (part->field == WM_FIELD_TEXT)
+      len += part->text_len;
+    else
+      len += strnlen(wm_field_value(vl, part->field), DATA_MAX_NAME_LEN - 1);
+  }
+
+  topic = malloc(len + 1);
+  if (topic == NULL)
+    return NULL;
+
+  len = 0;
+  for (size_t i = 0; i < cb->topic_template_num; i++) {
+    wm_template_part_t const *part = cb->topic_template + i;
+    char const *value;
+    size_t value_len;
+
+    if (part->field == WM_FIELD_TEXT) {
+      memcpy(topic + len, part->text, part->text_len);
+      len += part->text_len;
+      continue;
+    }
+
+    value = wm_field_value(vl, part->field);
+    value_len = strnlen(value, DATA_MAX_NAME_LEN - 1);
+    for (size_t j = 0; j < value_len; j++) {
+      char c = value[j];
+      topic[len++] = ((c == '/') || (c == '+') || (c == '#')) ? '_' : c;
+    }
+  }
+  topic[len] = 0;
+
+  return topic;
+} /* }}} char *wm_topic_render */
+
+/* must hold shard->lock when calling. */
+static int wm_topics_grow(wm_callback_t *cb, wm_shard_t *shard) /* {{{ */
+{
+  size_t size = (shard->topics_size == 0) ? WRITE_MQTT_INITIAL_TOPICS_SIZE
+                                          : 2 * shard->topics_size;
+  wm_topic_t **topics = calloc(size, sizeof(*topics));
+
+  if (topics == NULL)
+    return ENOMEM;
+
+  for (size_t i = 0; i < shard->topics_size; i++) {
+    while (shard->topics[i] != NULL) {
+      wm_topic_t *topic = shard->topics[i];
+
+      shard->topics[i] = topic->hash_next;
+      topic->hash_next = topics[topic->hash & (size - 1)];
+      topics[topic->hash & (size - 1)] = topic;
+    }
+  }
+
+  wm_memory_add(cb, (size - shard->topics_size) * sizeof(*topics));
+  sfree(shard->topics);
+  shard->topics = topics;
+  shard->topics_size = size;
+
+  return 0;
+} /* }}} int wm_topics_grow */
+
+/* must hold shard->lock when calling. Forgets the least recently used topic
+ * of the shard that no buffer points to. */
+static void wm_topic_evict(wm_callback_t *cb, wm_shard_t *shard) /* {{{ */
+{
+  wm_topic_t *topic = shard->topic_lru_tail;
+  wm_topic_t **prev;
+
+  if (topic == NULL)
+    return;
+
+  wm_topic_lru_unlink(shard, topic);
+  for (prev = &shard->topics[topic->hash & (shard->topics_size - 1)];
+       *prev != NULL; prev = &(*prev)->hash_next) {
+    if (*prev == topic) {
+      *prev = topic->hash_next;
+      break;
+    }
+  }
+  shard->topics_num--;
+
+  wm_memory_release(cb, sizeof(*topic) + strlen(topic->name) + 1 +
+                            topic->key_len);
+  sfree(topic->name);
+  sfree(topic->key);
+  sfree(topic);
+} /* }}} void wm_topic_evict */
+
+/* must hold shard->lock when calling. Returns the topic of a value list in
+ * "lane", rendering it the first time it is seen, with a reference the
+ * caller drops with wm_topic_put(). "id_hash" is the value list's
+ * wm_identifier_hash(). At most SeriesCacheSize topics are kept, split
+ * evenly across the shards; within that and MaxMemory, topics without
+ * references make room for new ones, least recently used first. */
+static wm_topic_t *wm_topic_get(wm_callback_t *cb, wm_shard_t *shard, /* {{{ */
+                                value_list_t const *vl, uint32_t id_hash,
+                                int lane) {
+  size_t topics_max = (cb->series_cache_size > 0)
+                          ? cb->series_cache_size
+                          : WRITE_MQTT_DEFAULT_MAX_TOPICS;
+  char key[WM_TOPIC_KEY_SIZE];
+  size_t key_len;
+  size_t conn;
+  uint32_t hash;
+  wm_topic_t *topic;
+
+  if ((cb->topic_template == NULL) && (cb->group_size < 2)) {
+    topic = (lane == WM_LANE_PRIORITY) ? &shard->priority_topic
+                                       : &shard->default_topic;
+    wm_topic_hold(shard, topic);
+    return topic;
+  }
+
+  conn = (cb->group_size < 2) ? 0 : wm_jump_hash(id_hash, cb->group_size);
+  key_len = wm_topic_key(cb, vl, conn, lane, key);
+  hash = wm_hash(key, key_len);
+
+  if (shard->topics_size > 0) {
+    for (topic = shard->topics[hash & (shard->topics_size - 1)]; topic != NULL;
+         topic = topic->hash_next)
+      if ((topic->hash == hash) && (topic->key_len == key_len) &&
+          (memcmp(topic->key, key, key_len) == 0)) {
+        wm_topic_hold(shard, topic);
+        return topic;
+      }
+  }
+
+  /* The key estimates the size of the rendered name. */
+  topics_max = (topics_max + cb->shards_num - 1) / cb->shards_num;
+  while ((shard->topic_lru_tail != NULL) &&
+         ((shard->topics_num >= topics_max) ||
+          wm_memory_exceeds(cb, sizeof(*topic) + 2 * key_len)))
+    wm_topic_evict(cb, shard);
+
+  if ((4 * (shard->topics_num + 1)) > (3 * shard->topics_size))
+    if (wm_topics_grow(cb, shard) != 0)
+      return NULL;
+
+  topic = calloc(1, sizeof(*topic));
+  if (topic == NULL)
+    return NULL;
+
+  topic->name = wm_topic_render(cb, vl);
+  topic->key = malloc(key_len);
+  if ((topic->name == NULL) || (topic->key == NULL)) {
+    sfree(topic->name);
+    sfree(topic->key);
+    sfree(topic);
+    return NULL;
+  }
+  memcpy(topic->key, key, key_len);
+  topic->key_len = key_len;
+  topic->hash = hash;
+  topic->conn = conn;
+  topic->lane = lane;
+  topic->refs = 1;
+  wm_memory_add(cb, sizeof(*topic) + strlen(topic->name) + 1 + key_len);
+
+  topic->hash_next = shard->topics[hash & (shard->topics_size - 1)];
+  shard->topics[hash & (shard->topics_size - 1)] = topic;
+  shard->topics_num++;
+
+  DEBUG("write_mqtt plugin: <%s> new topic \"%s\"", cb->name, topic->name);
+  return topic;
+} /* }}} wm_topic_t *wm_topic_get */
+
+/* must hold shard->lock when calling. */
+static void wm_topic_activate(wm_shard_t *shard, wm_topic_t *topic) /* {{{ */
+{
+  int lane = topic->lane;
+
+  topic->active_prev = shard->active_tail[lane];
+  topic->active_next = NULL;
+  if (shard->active_tail[lane] == NULL)
+    shard->active_head[lane] = topic;
+  else
+    shard->active_tail[lane]->active_next = topic;
+  shard->active_tail[lane] = topic;
+} /* }}} void wm_topic_activate */
+
+/* must hold shard->lock when calling. */
+static void wm_topic_deactivate(wm_shard_t *shard, /* {{{ */
+                                wm_topic_t *topic) {
+  int lane = topic->lane;
+
+  if (topic->active_prev == NULL)
+    shard->active_head[lane] = topic->active_next;
+  else
+    topic->active_prev->active_next = topic->active_next;
+  if (topic->active_next == NULL)
+    shard->active_tail[lane] = topic->active_prev;
+  else
+    topic->active_next->active_prev = topic->active_prev;
+  topic->active_prev = NULL;
+  topic->active_next = NULL;
+} /* }}} void wm_topic_deactivate */
+
+/* must hold cb->send_lock when calling. Returns the connection of "group"
+ * to publish a batch of "topic" with. With QoS 1 that is the connected one
+ * with the fewest messages waiting for an acknowledgement or in its queue,
+ * at the cost of the order of a series across batches. */
+static wm_conn_t *wm_select_conn(wm_callback_t *cb, /* {{{ */
+                                 wm_topic_t const *topic, size_t group) {
+  wm_conn_t *first = cb->conns + group * cb->group_size;
+  wm_conn_t *best = first + topic->conn;
+  size_t best_load = SIZE_MAX;
+
+  if ((cb->qos == 0) || (cb->group_size < 2))
+    return best;
+
+  for (size_t i = 0; i < cb->group_size; i++) {
+    wm_conn_t *conn = first + i;
+    int inflight = __atomic_load_n(&conn->inflight, __ATOMIC_RELAXED);
+    size_t load = conn->publish_num + (size_t)((inflight > 0) ? inflight : 0);
+
+    if (!wm_is_connected(conn))
+      continue;
+    if (load < best_load) {
+      best = conn;
+      best_load = load;
+    }
+  }
+
+  return best;
+} /* }}} wm_conn_t *wm_select_conn */
+
+/* must hold shard->lock when calling. Hands the topic's buffer over to a
+ * publish thread, or back to the free list if it is empty. */
+static int wm_flush_topic(cdtime_t timeout, wm_callback_t *cb, /* {{{ */
+                          wm_shard_t *shard, wm_topic_t *topic) {
+  wm_buffer_t *buf = topic->send_buffer;
+  int status;
+
+  if (buf == NULL)
+    return 0;
+
+  DEBUG("write_mqtt plugin: wm_flush_topic: timeout = %.3f; topic = %s; "
+        "send_buffer_fill = %" PRIsz ";",
+        CDTIME_T_TO_DOUBLE(timeout), topic->name, buf->fill);
+
+  /* timeout == 0  => flush unconditionally */
+  if (timeout > 0) {
+    cdtime_t now;
+
+    now = cdtime();
+    if ((buf->init_time + timeout) > now)
+      return 0;
+  }
+
+  topic->send_buffer = NULL;
+  wm_topic_deactivate(shard, topic);
+
+  if (buf->fill == 0) {
+    wm_release_buffer_nolock(buf);
+    return 0;
+  }
+
+  status = cb->format->finalize(buf->data, &buf->fill, &buf->free);
+  if (status != 0) {
+    ERROR("write_mqtt: wm_flush_topic: "
+          "finalizing the %s batch failed.",
+          cb->format->name);
+    wm_release_buffer_nolock(buf);
+    return status;
+  }
+  wm_histogram_add(&shard->stats.batch_bytes, buf->fill);
+
+  /* Encoded once, published to every broker. */
+  buf->refs = (int)cb->groups_num;
+  wm_stat_add(&shard->stats.lock_wait, wm_lock(&cb->send_lock));
+  for (size_t g = 0; g < cb->groups_num; g++)
+    wm_queue_push(wm_select_conn(cb, topic, g), buf);
+  pthread_mutex_unlock(&cb->send_lock);
+
+  return 0;
+} /* }}} int wm_flush_topic */
+
+/* must hold shard->lock when calling. Blocks until a publish thread returns
+ * a buffer if all of the shard's buffers are queued for publishing. While a
+ * connection is down, the oldest batch of the shard queued for it is dropped
+ * instead. If the other topics hold all buffers, the oldest of them is
+ * flushed early. The priority lane falls back to the reserved buffer. */
+static wm_buffer_t *wm_get_send_buffer(wm_callback_t *cb, /* {{{ */
+                                       wm_shard_t *shard, wm_topic_t *topic) {
+  while (topic->send_buffer == NULL) {
+    wm_buffer_t **free_head = &shard->free_head;
+    wm_buffer_t *buf = NULL;
+    bool taken = false;
+
+    if ((*free_head == NULL) && (topic->lane == WM_LANE_PRIORITY))
+      free_head = &shard->reserved_head;
+
+    if (*free_head != NULL) {
+      topic->send_buffer = *free_head;
+      *free_head = topic->send_buffer->next;
+      topic->send_buffer->next = NULL;
+      topic->send_buffer->topic = topic;
+      wm_topic_hold(shard, topic);
+      wm_reset_buffer(topic->send_buffer);
+      wm_topic_activate(shard, topic);
+      break;
+    }
+
+    pthread_mutex_lock(&cb->send_lock);
+    for (size_t i = 0; (i < cb->conns_num) && (buf == NULL); i++) {
+      wm_conn_t *conn = cb->conns + i;
+
+      if (wm_is_connected(conn))
+        continue;
+      buf = wm_queue_take(conn, shard);
+      if (buf == NULL)
+        continue;
+
+      if (wm_conn_backlog(conn))
+        wm_backlog_push_buffer(cb, buf, /* first = */ 0);
+      else {
+        wm_stat_add(&cb->stats.batches_dropped, 1);
+        c_complain(LOG_WARNING, &cb->complaint_dropped,
+                   "write_mqtt plugin: not connected to broker \"%s:%d\", "
+                   "dropping queued values.",
+                   cb->hosts[conn->broker], cb->port);
+      }
+      taken = true;
+      /* Still queued for another broker. */
+      if (!wm_buffer_unref(buf))
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&cb->send_lock);
+
+    if (buf != NULL) {
+      wm_release_buffer_nolock(buf);
+      continue;
+    }
+    if (taken)
+      continue;
+
+    if (shard->active_head[WM_LANE_BULK] != NULL) {
+      (void)wm_flush_topic(/* timeout = */ 0, cb, shard,
+                           shard->active_head[WM_LANE_BULK]);
+      continue;
+    }
+    if (shard->active_head[WM_LANE_PRIORITY] != NULL) {
+      (void)wm_flush_topic(/* timeout = */ 0, cb, shard,
+                           shard->active_head[WM_LANE_PRIORITY]);
+      continue;
+    }
+
+    pthread_cond_wait(&shard->cond, &shard->lock);
+  }
+
+  return topic->send_buffer;
+} /* }}} wm_buffer_t *wm_get_send_buffer */
+
+/* must hold the buffer's shard lock when calling. Appends a value list to
+ * the buffer, growing the buffer if needed. With the JSON cache, "series" is
+ * the value list's series, NULL otherwise. */
+static int wm_buffer_append(wm_callback_t *cb, wm_buffer_t *buf, /* {{{ */
+                            const data_set_t *ds, const value_list_t *vl,
+                            wm_series_t *series) {
+  while (42) {
+    size_t fill = buf->fill;
+    size_t free = buf->free;
+    size_t msg_start;
+    bool split;
+    int status;
+
+    if (free > WRITE_MQTT_FORMAT_WINDOW)
+      free = WRITE_MQTT_FORMAT_WINDOW;
+
+    if ((series != NULL) && (series->json != NULL) &&
+        (series->values_num == ds->ds_num) && (vl->meta == NULL))
+      status = wm_json_value_list_cached(buf->data, &fill, &free, ds, vl,
+                                         cb->store_rates, series);
+    else
+      status = cb->format->value_list(buf->data, &fill, &free, ds, vl,
+                                      cb->store_rates);
+    if (status == -ENOMEM) {
+      /* Larger than the formatting window: it won't fit in any buffer. */
+      if (buf->free > WRITE_MQTT_FORMAT_WINDOW)
+        return status;
+      if (wm_buffer_grow(cb, buf) != 0)
+        return status;
+      continue;
+    }
+    if (status != 0)
+      return status;
+
+    /* Start a new message if this value list (plus the closing bracket) does
+     * not fit into the current one. */
+    msg_start = (buf->splits_num == 0) ? 0 : buf->splits[buf->splits_num - 1];
+    split = (cb->max_message_size > 0) && (buf->fill > msg_start) &&
+            ((fill + 1 - msg_start) > cb->max_message_size);
+    if (split && (cb->format->split != NULL) && (free < WM_SPLIT_RESERVE)) {
+      if (buf->free > WRITE_MQTT_FORMAT_WINDOW)
+        return -ENOMEM;
+      if (wm_buffer_grow(cb, buf) != 0)
+        return -ENOMEM;
+      continue;
+    }
+
+    if ((series != NULL) && (series->json == NULL) && (vl->meta == NULL) &&
+        (series->values_num == ds->ds_num)) {
+      wm_json_cache_series(series, buf->data + buf->fill, fill - buf->fill);
+      if (series->json != NULL)
+        wm_memory_add(cb, series->json_len);
+    }
+
+    if (split && (wm_buffer_split(buf, buf->fill) == 0) &&
+        (cb->format->split != NULL))
+      buf->splits[buf->splits_num - 1] =
+          cb->format->split(buf->data, buf->fill, &fill, &free);
+
+    buf->free -= fill - buf->fill;
+    buf->fill = fill;
+    return 0;
+  }
+} /* }}} int wm_buffer_append */
+
+/* must hold shard->lock when calling. Appends a value list to the buffer of
+ * its topic, handing the buffer over to the publish threads once it is full.
+ * "series" is the value list's series or NULL. */
+static int wm_write_value_list(wm_callback_t *cb, wm_shard_t *shard, /* {{{ */
+                               data_set_t const *ds, value_list_t const *vl,
+                               uint32_t id_hash, wm_series_t *series,
+                               int lane) {
+  wm_topic_t *topic;
+  wm_buffer_t *buf;
+  int status;
+
+  topic = wm_topic_get(cb, shard, vl, id_hash, lane);
+  if (topic == NULL) {
+    ERROR("write_mqtt plugin: rendering the topic failed.");
+    return -ENOMEM;
+  }
+
+  /* While wm_get_send_buffer() waits, other writers of the shard may fill the
+   * new buffer: only give up once the value list fails on an empty one. */
+  buf = wm_get_send_buffer(cb, shard, topic);
+  status = wm_buffer_append(cb, buf, ds, vl, cb->json_cache ? series : NULL);
+  while ((status == -ENOMEM) && (buf->fill > 0)) {
+    status = wm_flush_topic(/* timeout = */ 0, cb, shard, topic);
+    if (status != 0)
+      break;
+
+    buf = wm_get_send_buffer(cb, shard, topic);
+    status = wm_buffer_append(cb, buf, ds, vl, cb->json_cache ? series : NULL);
+  }
+  if (status != 0) {
+    wm_topic_put(shard, topic);
+    return status;
+  }
+
+  DEBUG("write_mqtt plugin: <%s> buffer %" PRIsz "/%" PRIsz " (%g%%)",
+        cb->name, buf->fill, buf->size,
+        100.0 * ((double)buf->fill) / ((double)buf->size));
+
+  wm_stat_add(&shard->stats.values_written, 1);
+  if ((series != NULL) && cb->publish_on_change)
+    wm_series_update(series, ds, vl);
+
+  if ((cb->target_batch_bytes > 0) && (buf->fill >= cb->target_batch_bytes))
+    status = wm_flush_topic(/* timeout = */ 0, cb, shard, topic);
+
+  wm_topic_put(shard, topic);
+  return status;
+} /* }}} int wm_write_value_list */
+
+static char const *const wm_agg_names[WM_AGG_MAX] = {
+    [WM_AGG_AVERAGE] = "average",
+    [WM_AGG_MINIMUM] = "minimum",
+    [WM_AGG_MAXIMUM] = "maximum",
+    [WM_AGG_LAST] = "last",
+};
+
+/* must hold shard->lock when calling. Publishes the aggregates "agg" of a
+ * window of "s" whose last value list was written at "time", once for each
+ * aggregation function. With several functions, the type instance gets the
+ * function's name appended. With StoreRates, counters were aggregated as
+ * rates and are published as gauges. "s" is only used before anything is
+ * appended; with "cache" its JSON metadata is reused. */
+static int wm_agg_emit(wm_callback_t *cb, wm_shard_t *shard, /* {{{ */
+                       wm_series_t *s, wm_agg_t const *agg, cdtime_t time,
+                       bool cache) {
+  data_set_t const *ds = s->ds;
+  size_t values_num = s->values_num;
+  uint32_t hash = s->hash;
+  int lane = s->lane;
+  value_t values[values_num];
+  data_source_t sources[values_num];
+  data_set_t rates_ds;
+  value_list_t vl = VALUE_LIST_INIT;
+  char const *field = s->key;
+  char type_instance[DATA_MAX_NAME_LEN];
+  bool suffix =
+      (cb->aggregation_functions & (cb->aggregation_functions - 1)) != 0;
+  int status = 0;
+
+  sstrncpy(vl.host, field, sizeof(vl.host));
+  field += strlen(field) + 1;
+  sstrncpy(vl.plugin, field, sizeof(vl.plugin));
+  field += strlen(field) + 1;
+  sstrncpy(vl.plugin_instance, field, sizeof(vl.plugin_instance));
+  field += strlen(field) + 1;
+  sstrncpy(vl.type, field, sizeof(vl.type));
+  field += strlen(field) + 1;
+  sstrncpy(type_instance, field, sizeof(type_instance));
+  vl.values = values;
+  vl.values_len = values_num;
+  vl.time = time;
+  vl.interval = cb->aggregation_interval;
+
+  if (cb->store_rates) {
+    memcpy(sources, ds->ds, sizeof(sources));
+    for (size_t i = 0; i < values_num; i++)
+      sources[i].type = DS_TYPE_GAUGE;
+    rates_ds = *ds;
+    rates_ds.ds = sources;
+    ds = &rates_ds;
+  }
+
+  /* The cached JSON metadata includes the type instance. */
+  if (!cache || suffix)
+    s = NULL;
+
+  for (int function = 0; function < WM_AGG_MAX; function++) {
+    if ((cb->aggregation_functions & (1u << function)) == 0)
+      continue;
+
+    for (size_t i = 0; i < values_num; i++) {
+      if (ds->ds[i].type == DS_TYPE_GAUGE)
+        values[i].gauge = wm_agg_value(agg + i, function);
+      else
+        values[i] = agg[i].raw;
+    }
+
+    if (suffix) {
+      char const *name = wm_agg_names[function];
+      size_t name_len = strlen(name);
+      /* The suffix tells the functions apart, so a long type instance is
+       * cut short to make room for it. */
+      size_t len =
+          strnlen(type_instance, sizeof(vl.type_instance) - name_len - 2);
+
+      memcpy(vl.type_instance, type_instance, len);
+      if (len > 0)
+        vl.type_instance[len++] = '-';
+      memcpy(vl.type_instance + len, name, name_len + 1);
+    } else
+      sstrncpy(vl.type_instance, type_instance, sizeof(vl.type_instance));
+
+    status = wm_write_value_list(cb, shard, ds, &vl, hash, s, lane);
+    if (status != 0)
+      break;
+  }
+
+  return status;
+} /* }}} int wm_agg_emit */
+
+/* must hold shard->lock when calling. Publishes the windows of series that
+ * have not been written to for a while after their window ended, e.g.
+ * because they stopped reporting; with "now" zero, all windows. */
+static int wm_agg_flush(wm_callback_t *cb, wm_shard_t *shard, /* {{{ */
+                        cdtime_t now) {
+  wm_series_t *s;
+  int status = 0;
+
+  while ((s = shard->agg_head) != NULL) {
+    if ((now > 0) && (now < s->agg_end + s->agg_grace))
+      break;
+
+    wm_agg_t agg[s->values_num];
+    cdtime_t time = s->agg_time;
+
+    memcpy(agg, s->agg, sizeof(agg));
+    wm_agg_reset(shard, s);
+    if (wm_agg_emit(cb, shard, s, agg, time, /* cache = */ false) != 0)
+      status = -1;
+  }
+
+  return status;
+} /* }}} int wm_agg_flush */
+
+static void *wm_publish_thread(void *arg) /* {{{ */
+{
+  wm_conn_t *conn = arg;
+  wm_callback_t *cb = conn->cb;
+
+  pthread_mutex_lock(&cb->send_lock);
+  while (42) {
+    wm_buffer_t *buf;
+    size_t i;
+    int status;
+
+    if (!wm_is_connected(conn)) {
+      cdtime_t now = cdtime();
+
+      /* Move live batches to the backlog so writers always find a free
+       * buffer during an outage. Buffers go back to their shard once
+       * "send_lock" has been released. */
+      if (wm_backlog_enabled(cb) && (conn->publish_num > 0)) {
+        buf = wm_queue_spill(conn);
+        pthread_mutex_unlock(&cb->send_lock);
+        wm_release_buffers(buf);
+        pthread_mutex_lock(&cb->send_lock);
+        continue;
+      }
+
+      if (conn->loop_running) {
+        /* Connection lost in the network thread: stop it and fail over or
+         * back off. */
+        pthread_mutex_unlock(&cb->send_lock);
+        wm_mqtt_disconnect(conn);
+        pthread_mutex_lock(&cb->send_lock);
+        if (!wm_failover(conn))
+          wm_schedule_reconnect(conn);
+        continue;
+      }
+
+      if (conn->reconnect_next > now) {
+        struct timespec ts = CDTIME_T_TO_TIMESPEC(conn->reconnect_next);
+
+        if (cb->shutdown)
+          break;
+
+        pthread_cond_timedwait(&conn->publish_cond, &cb->send_lock, &ts);
+        continue;
+      }
+
+      if (!wm_session_resumes(conn))
+        wm_inflight_requeue(conn);
+      pthread_mutex_unlock(&cb->send_lock);
+      status = wm_mqtt_connect(conn);
+      pthread_mutex_lock(&cb->send_lock);
+
+      if (status != 0) {
+        if (!wm_failover(conn))
+          wm_schedule_reconnect(conn);
+      } else {
+        conn->reconnect_interval = 0;
+        conn->broker_tries = 0;
+        __atomic_or_fetch(&cb->brokers_healthy, UINT32_C(1) << conn->broker,
+                          __ATOMIC_RELAXED);
+      }
+      continue;
+    }
+
+    /* Go back to an earlier broker once the probe thread found it healthy.
+     * The switch is a reconnect: unacknowledged messages are retried. */
+    size_t broker = wm_failback_broker(conn);
+    if (broker != conn->broker) {
+      pthread_mutex_unlock(&cb->send_lock);
+      wm_mqtt_disconnect(conn);
+      pthread_mutex_lock(&cb->send_lock);
+
+      NOTICE("write_mqtt plugin: failing back to broker \"%s:%d\".",
+             cb->hosts[broker], cb->port);
+      conn->broker = broker;
+      conn->broker_tries = 0;
+      conn->reconnect_interval = 0;
+      conn->reconnect_next = 0;
+      continue;
+    }
+
+    if (conn->publish_num == 0) {
+      cdtime_t now = cdtime();
+      wm_batch_t *batch;
+
+      /* Drain the queue before honoring a shutdown request. The backlog is
+       * kept in the spool file for the next run instead. */
+      if (cb->shutdown)
+        break;
+
+      /* The backlog is only replayed to the first broker. */
+      if ((conn->group > 0) || wm_backlog_empty(cb)) {
+        pthread_cond_wait(&conn->publish_cond, &cb->send_lock);
+        continue;
+      }
+
+      if (cb->replay_next > now) {
+        struct timespec ts = CDTIME_T_TO_TIMESPEC(cb->replay_next);
+        pthread_cond_timedwait(&conn->publish_cond, &cb->send_lock, &ts);
+        continue;
+      }
+
+      if (wm_backlog_pop(cb, &batch) != 0) {
+        /* The record stays in the spool file; try again later instead of
+         * spinning. */
+        c_complain(LOG_ERR, &cb->complaint_spool,
+                   "write_mqtt plugin: allocating a batch for the spool file "
+                   "of instance '%s' failed, retrying.",
+                   cb->name);
+        cb->replay_next = now + WRITE_MQTT_SPOOL_RETRY_INTERVAL;
+        continue;
+      }
+      if (batch == NULL)
+        continue;
+      c_release(LOG_INFO, &cb->complaint_spool,
+                "write_mqtt plugin: replaying the spool file of instance "
+                "'%s' again.",
+                cb->name);
+
+      pthread_mutex_unlock(&cb->send_lock);
+      status = wm_publish(conn, batch->topic, batch->data, batch->len, batch);
+      pthread_mutex_lock(&cb->send_lock);
+
+      if (status != 0) {
+        wm_backlog_unpop(cb, batch);
+        wm_schedule_reconnect(conn);
+        continue;
+      }
+
+      if (cb->replay_rate > 0.0)
+        cb->replay_next = now + DOUBLE_TO_CDTIME_T(1.0 / cb->replay_rate);
+      continue;
+    }
+
+    buf = wm_queue_pop(conn);
+    pthread_mutex_unlock(&cb->send_lock);
+
+    status = 0;
+    for (i = 0; i <= buf->splits_num; i++) {
+      char *data;
+      size_t len;
+
+      wm_buffer_message(buf, i, &data, &len);
+      status = wm_publish(conn, buf->topic->name, data, len,
+                          /* owned = */ NULL);
+      if (status != 0)
+        break;
+    }
+
+    if (status != 0) {
+      pthread_mutex_lock(&cb->send_lock);
+      if (wm_conn_backlog(conn))
+        wm_backlog_push_buffer(cb, buf, /* first = */ i);
+      else
+        wm_stat_add(&conn->stats.batches_dropped, 1);
+      wm_schedule_reconnect(conn);
+      pthread_mutex_unlock(&cb->send_lock);
+    }
+    if (wm_buffer_unref(buf)) {
+      wm_buffer_trim(cb, buf);
+      wm_release_buffer(buf);
+    }
+
+    pthread_mutex_lock(&cb->send_lock);
+  }
+
+  /* With a persistent session, messages in flight only go to the spool file
+   * if the broker does not acknowledge them in time, so that the next run
+   * does not publish them again. */
+  if (cb->persistent_session && (cb->qos > 0)) {
+    pthread_mutex_unlock(&cb->send_lock);
+    wm_inflight_drain(conn, WRITE_MQTT_SHUTDOWN_ACK_TIMEOUT);
+    pthread_mutex_lock(&cb->send_lock);
+  }
+
+  /* Whatever could not be published goes to the spool file. */
+  wm_inflight_requeue(conn);
+  wm_buffer_t *spilled = wm_backlog_enabled(cb) ? wm_queue_spill(conn) : NULL;
+  while ((cb->spool != NULL) && (cb->backlog_head != NULL))
+    wm_backlog_spill(cb);
+  pthread_mutex_unlock(&cb->send_lock);
+
+  wm_release_buffers(spilled);
+
+  return NULL;
+} /* }}} void *wm_publish_thread */
+
+/* Hands the buffers of all topics older than "timeout", or in the priority
+ * lane older than "priority_timeout", over to the publish threads; writers
+ * get new ones from wm_get_send_buffer(). Takes the shard locks one at a
+ * time. If "ret_next" is not NULL, it is lowered to the time the oldest
+ * remaining buffer becomes due. */
+static int wm_flush_shards(cdtime_t timeout, /* {{{ */
+                           cdtime_t priority_timeout, wm_callback_t *cb,
+                           cdtime_t *ret_next) {
+  cdtime_t const timeouts[WM_LANES] = {
+      [WM_LANE_BULK] = timeout,
+      [WM_LANE_PRIORITY] = priority_timeout,
+  };
+  cdtime_t now = cdtime();
+  int status = 0;
+
+  for (size_t i = 0; i < cb->shards_num; i++) {
+    wm_shard_t *shard = cb->shards + i;
+
+    pthread_mutex_lock(&shard->lock);
+    if ((cb->aggregation_interval > 0) && (wm_agg_flush(cb, shard, now) != 0))
+      status = -1;
+
+    for (int lane = 0; lane < WM_LANES; lane++) {
+      wm_topic_t *topic = shard->active_head[lane];
+
+      if (timeouts[lane] == WM_FLUSH_NEVER)
+        continue;
+
+      while (topic != NULL) {
+        wm_topic_t *next = topic->active_next;
+        cdtime_t due = topic->send_buffer->init_time + timeouts[lane];
+
+        /* Topics are linked in the order they got their buffer, so all
+         * following ones are younger. */
+        if ((timeouts[lane] > 0) && (due > now)) {
+          if ((ret_next != NULL) && (due < *ret_next))
+            *ret_next = due;
+          break;
+        }
+
+        if (wm_flush_topic(timeouts[lane], cb, shard, topic) != 0)
+          status = -1;
+        topic = next;
+      }
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  return status;
+} /* }}} int wm_flush_shards */
+
+/* Flushes batches once they are "max_batch_delay" old, and those of the
+ * priority lane once they are "priority_batch_delay" old, sleeping until the
+ * oldest one is due. */
+static void *wm_flush_thread(void *arg) /* {{{ */
+{
+  wm_callback_t *cb = arg;
+  cdtime_t timeout =
+      (cb->max_batch_delay > 0) ? cb->max_batch_delay : WM_FLUSH_NEVER;
+  cdtime_t priority_timeout =
+      cb->priority_lane ? cb->priority_batch_delay : WM_FLUSH_NEVER;
+  cdtime_t interval = (timeout < priority_timeout) ? timeout : priority_timeout;
+
+  pthread_mutex_lock(&cb->send_lock);
+  while (!cb->flush_thread_stop) {
+    cdtime_t next = cdtime() + interval;
+    struct timespec ts;
+
+    pthread_mutex_unlock(&cb->send_lock);
+    (void)wm_flush_shards(timeout, priority_timeout, cb, &next);
+    pthread_mutex_lock(&cb->send_lock);
+
+    if (cb->flush_thread_stop)
+      break;
+
+    ts = CDTIME_T_TO_TIMESPEC(next);
+    pthread_cond_timedwait(&cb->flush_cond, &cb->send_lock, &ts);
+  }
+  pthread_mutex_unlock(&cb->send_lock);
+
+  return NULL;
+} /* }}} void *wm_flush_thread */
+
+/* With BrokerPolicy "Failover", probes all brokers every "probe_interval"
+ * while a connection is down or not on the first broker, and wakes up the
+ * publish threads of connections that can go back to an earlier one. */
+static void *wm_probe_thread(void *arg) /* {{{ */
+{
+  wm_callback_t *cb = arg;
+
+  pthread_mutex_lock(&cb->send_lock);
+  while (!cb->probe_thread_stop) {
+    bool probe = false;
+    struct timespec ts;
+
+    for (size_t i = 0; i < cb->conns_num; i++)
+      if ((cb->conns[i].broker != 0) || !wm_is_connected(cb->conns + i))
+        probe = true;
+
+    if (probe) {
+      uint32_t healthy = 0;
+
+      pthread_mutex_unlock(&cb->send_lock);
+      for (size_t i = 0; i < cb->hosts_num; i++)
+        if (wm_probe_broker(cb->hosts[i], cb->port))
+          healthy |= UINT32_C(1) << i;
+      pthread_mutex_lock(&cb->send_lock);
+
+      __atomic_store_n(&cb->brokers_healthy, healthy, __ATOMIC_RELAXED);
+      for (size_t i = 0; i < cb->conns_num; i++)
+        if (wm_failback_broker(cb->conns + i) != cb->conns[i].broker)
+          pthread_cond_signal(&cb->conns[i].publish_cond);
+    }
+
+    if (cb->probe_thread_stop)
+      break;
+
+    ts = CDTIME_T_TO_TIMESPEC(cdtime() + cb->probe_interval);
+    pthread_cond_timedwait(&cb->probe_cond, &cb->send_lock, &ts);
+  }
+  pthread_mutex_unlock(&cb->send_lock);
+
+  return NULL;
+} /* }}} void *wm_probe_thread */
+
+/* must hold cb->send_lock when calling. */
+static int wm_callback_init_nolock(wm_callback_t *cb) /* {{{ */
+{
+  if (cb->threads_running)
+    return 0;
+
+  if (!cb->loop_ref) {
+    if (wm_loop_ref() != 0)
+      return -1;
+    cb->loop_ref = true;
+  }
+
+  /* Without the spool, batches go into the in-memory backlog only. */
+  if (wm_spool_open(cb) != 0)
+    WARNING("write_mqtt plugin: cannot open the spool file of instance '%s'.",
+            cb->name);
+
+  for (size_t i = 0; i < cb->conns_num; i++) {
+    wm_conn_t *conn = cb->conns + i;
+    int status;
+
+    if (conn->publish_thread_running)
+      continue;
+
+    status = plugin_thread_create(&conn->publish_thread, wm_publish_thread,
+                                  conn, "write_mqtt");
+    if (status != 0) {
+      char errbuf[1024];
+      ERROR("write_mqtt plugin: plugin_thread_create failed: %s",
+            sstrerror(status, errbuf, sizeof(errbuf)));
+      return -1;
+    }
+
+    conn->publish_thread_running = true;
+  }
+
+  if (((cb->max_batch_delay > 0) || cb->priority_lane) &&
+      !cb->flush_thread_running) {
+    int status = plugin_thread_create(&cb->flush_thread, wm_flush_thread, cb,
+                                      "write_mqtt");
+    if (status != 0) {
+      char errbuf[1024];
+      ERROR("write_mqtt plugin: plugin_thread_create failed: %s",
+            sstrerror(status, errbuf, sizeof(errbuf)));
+      return -1;
+    }
+
+    cb->flush_thread_running = true;
+  }
+
+  if ((cb->broker_policy == WM_BROKERS_FAILOVER) && (cb->hosts_num > 1) &&
+      !cb->probe_thread_running) {
+    int status = plugin_thread_create(&cb->probe_thread, wm_probe_thread, cb,
+                                      "write_mqtt");
+    if (status != 0) {
+      char errbuf[1024];
+      ERROR("write_mqtt plugin: plugin_thread_create failed: %s",
+            sstrerror(status, errbuf, sizeof(errbuf)));
+      return -1;
+    }
+
+    cb->probe_thread_running = true;
+  }
+
+  __atomic_store_n(&cb->threads_running, true, __ATOMIC_RELEASE);
+
+  return 0;
+} /* }}} int wm_callback_init_nolock */
+
+/* Starts the publish threads on first use. Only takes "send_lock" until
+ * they are running. */
+static int wm_callback_init(wm_callback_t *cb) /* {{{ */
+{
+  int status;
+
+  if (__atomic_load_n(&cb->threads_running, __ATOMIC_ACQUIRE))
+    return 0;
+
+  pthread_mutex_lock(&cb->send_lock);
+  status = wm_callback_init_nolock(cb);
+  pthread_mutex_unlock(&cb->send_lock);
+
+  if (status != 0)
+    ERROR("write_mqtt plugin: wm_callback_init failed.");
+  return status;
+} /* }}} int wm_callback_init */
+
+static int wm_flush(cdtime_t timeout, /* {{{ */
+                    const char *identifier __attribute__((unused)),
+                    user_data_t *user_data) {
+  wm_callback_t *cb;
+  int status;
+
+  if (user_data == NULL)
+    return -EINVAL;
+
+  cb = user_data->data;
+
+  if (wm_callback_init(cb) != 0)
+    return -1;
+
+  /* The priority lane is flushed at least as eagerly as the bulk lane. */
+  status = wm_flush_shards(
+      timeout,
+      (cb->priority_lane && (timeout > 0) &&
+       (cb->priority_batch_delay < timeout))
+          ? cb->priority_batch_delay
+          : timeout,
+      cb, /* ret_next = */ NULL);
+
+  return status;
+} /* }}} int wm_flush */
+
+/* Sets up the next connection of a node. */
+static int wm_conn_create(wm_callback_t *cb) /* {{{ */
+{
+  wm_conn_t *conn = cb->conns + cb->conns_num;
+
+  memset(conn, 0, sizeof(*conn));
+  conn->cb = cb;
+  conn->index = cb->conns_num;
+  conn->group = conn->index / cb->group_size;
+  conn->broker = conn->group;
+  conn->loop_fd = -1;
+
+#if WM_HAVE_MQTT5
+  if (cb->topic_alias_maximum > 0) {
+    conn->aliases =
+        calloc((size_t)cb->topic_alias_maximum, sizeof(*conn->aliases));
+    conn->alias_table_size = 1;
+    while (conn->alias_table_size < 2 * (size_t)cb->topic_alias_maximum)
+      conn->alias_table_size *= 2;
+    conn->alias_table =
+        calloc(conn->alias_table_size, sizeof(*conn->alias_table));
+    if ((conn->aliases == NULL) || (conn->alias_table == NULL)) {
+      sfree(conn->aliases);
+      sfree(conn->alias_table);
+      return ENOMEM;
+    }
+
+    for (int i = 0; i < cb->topic_alias_maximum; i++)
+      conn->aliases[i].alias = (uint16_t)(i + 1);
+  }
+#endif
+
+  pthread_cond_init(&conn->publish_cond, /* attr = */ NULL);
+  pthread_mutex_init(&conn->inflight_lock, /* attr = */ NULL);
+  pthread_cond_init(&conn->inflight_cond, /* attr = */ NULL);
+  C_COMPLAIN_INIT(&conn->complaint_cantpublish);
+  C_COMPLAIN_INIT(&conn->complaint_encode);
+  C_COMPLAIN_INIT(&conn->complaint_compress);
+
+  cb->conns_num++;
+  return 0;
+} /* }}} int wm_conn_create */
+
+/* The connection's publish thread must have been stopped. */
+static void wm_conn_destroy(wm_conn_t *conn) /* {{{ */
+{
+  if (conn->mosq != NULL) {
+    wm_mqtt_disconnect(conn);
+    (void)mosquitto_destroy(conn->mosq);
+    conn->mosq = NULL;
+  }
+
+#if HAVE_ZLIB_H
+  if (conn->zstream_initialized)
+    (void)deflateEnd(&conn->zstream);
+#endif
+#if HAVE_ZSTD_H
+  ZSTD_freeCCtx(conn->zstd_cctx);
+#endif
+#if WM_HAVE_MQTT5
+  if (conn->aliases != NULL) {
+    for (size_t i = 0; i < conn->aliases_num; i++)
+      sfree(conn->aliases[i].topic);
+    sfree(conn->aliases);
+  }
+  sfree(conn->alias_table);
+#endif
+  sfree(conn->encode_buffer);
+  sfree(conn->compress_buffer);
+
+  while (conn->inflight_head != NULL) {
+    wm_batch_t *next = conn->inflight_head->next;
+    wm_batch_free(conn->cb, conn->inflight_head);
+    conn->inflight_head = next;
+  }
+
+  pthread_cond_destroy(&conn->publish_cond);
+  pthread_cond_destroy(&conn->inflight_cond);
+  pthread_mutex_destroy(&conn->inflight_lock);
+} /* }}} void wm_conn_destroy */
+
+static void wm_callback_free(void *data) /* {{{ */
+{
+  wm_callback_t *cb;
+
+  if (data == NULL)
+    return;
+
+  cb = data;
+
+  /* Stop the flush thread first, so that nothing is queued after the
+   * publish threads are done. */
+  if (cb->flush_thread_running) {
+    pthread_mutex_lock(&cb->send_lock);
+    cb->flush_thread_stop = true;
+    pthread_cond_signal(&cb->flush_cond);
+    pthread_mutex_unlock(&cb->send_lock);
+
+    pthread_join(cb->flush_thread, /* retval = */ NULL);
+    cb->flush_thread_running = false;
+  }
+
+  if (cb->probe_thread_running) {
+    pthread_mutex_lock(&cb->send_lock);
+    cb->probe_thread_stop = true;
+    pthread_cond_signal(&cb->probe_cond);
+    pthread_mutex_unlock(&cb->send_lock);
+
+    pthread_join(cb->probe_thread, /* retval = */ NULL);
+    cb->probe_thread_running = false;
+  }
+
+  if (cb->threads_running) {
+    /* Windows still being aggregated are published as they are. */
+    if (cb->aggregation_interval > 0) {
+      for (size_t i = 0; i < cb->shards_num; i++) {
+        pthread_mutex_lock(&cb->shards[i].lock);
+        (void)wm_agg_flush(cb, cb->shards + i, /* now = */ 0);
+        pthread_mutex_unlock(&cb->shards[i].lock);
+      }
+    }
+    wm_flush_shards(/* timeout = */ 0, /* priority_timeout = */ 0, cb,
+                    /* ret_next = */ NULL);
+    pthread_mutex_lock(&cb->send_lock);
+    cb->shutdown = true;
+    for (size_t i = 0; i < cb->conns_num; i++)
+      pthread_cond_signal(&cb->conns[i].publish_cond);
+    pthread_mutex_unlock(&cb->send_lock);
+
+    for (size_t i = 0; i < cb->conns_num; i++) {
+      if (!cb->conns[i].publish_thread_running)
+        continue;
+      pthread_join(cb->conns[i].publish_thread, /* retval = */ NULL);
+      cb->conns[i].publish_thread_running = false;
+    }
+    cb->threads_running = false;
+  }
+
+  if (cb->conns != NULL) {
+    for (size_t i = 0; i < cb->conns_num; i++)
+      wm_conn_destroy(cb->conns + i);
+    sfree(cb->conns);
+  }
+#if WM_HAVE_TLS_CTX
+  wm_tls_release(cb);
+#endif
+  if (cb->loop_ref) {
+    wm_loop_unref();
+    cb->loop_ref = false;
+  }
+
+  while (cb->backlog_head != NULL) {
+    wm_batch_t *next = cb->backlog_head->next;
+    wm_batch_free(cb, cb->backlog_head);
+    cb->backlog_head = next;
+  }
+  wm_spool_close(cb);
+  sfree(cb->spool_dir);
+
+#if HAVE_ZSTD_H
+  ZSTD_freeCDict(cb->zstd_cdict);
+#endif
+#if WM_HAVE_MQTT5
+  mosquitto_property_free_all(&cb->publish_props);
+  if (cb->alias_props != NULL) {
+    for (int i = 0; i < cb->topic_alias_maximum; i++)
+      mosquitto_property_free_all(&cb->alias_props[i]);
+    sfree(cb->alias_props);
+  }
+#endif
+
+  sfree(cb->name);
+  for (size_t i = 0; i < cb->hosts_num; i++)
+    sfree(cb->hosts[i]);
+  sfree(cb->hosts);
+  sfree(cb->client_id);
+  sfree(cb->capath);
+  sfree(cb->clientkey);
+  sfree(cb->clientcert);
+  sfree(cb->topic);
+  for (size_t i = 0; i < cb->topic_template_num; i++)
+    sfree(cb->topic_template[i].text);
+  sfree(cb->topic_template);
+  wm_rules_free(&cb->include);
+  wm_rules_free(&cb->exclude);
+  wm_rules_free(&cb->priority);
+  sfree(cb->filter_cache);
+  sfree(cb->memory_samples);
+  for (size_t i = 0; i < cb->shards_num; i++) {
+    wm_shard_t *shard = cb->shards + i;
+
+    for (size_t j = 0; j < shard->topics_size; j++) {
+      while (shard->topics[j] != NULL) {
+        wm_topic_t *next = shard->topics[j]->hash_next;
+        sfree(shard->topics[j]->name);
+        sfree(shard->topics[j]->key);
+        sfree(shard->topics[j]);
+        shard->topics[j] = next;
+      }
+    }
+    sfree(shard->topics);
+    for (size_t j = 0; j < shard->series_size; j++) {
+      while (shard->series[j] != NULL) {
+        wm_series_t *next = shard->series[j]->hash_next;
+        sfree(shard->series[j]->json);
+        sfree(shard->series[j]);
+        shard->series[j] = next;
+      }
+    }
+    sfree(shard->series);
+
+    pthread_cond_destroy(&shard->cond);
+    pthread_mutex_destroy(&shard->lock);
+  }
+  sfree(cb->shards);
+  sfree(cb->writer_stats);
+
+  if (cb->buffers != NULL) {
+    for (size_t i = 0; i < cb->shards_num * cb->buffers_num; i++)
+      sfree(cb->buffers[i].splits);
+    sfree(cb->buffers);
+  }
+  if (cb->arena != NULL)
+    (void)munmap(cb->arena, cb->arena_size);
+  /* All batches have been returned by now. */
+  if (cb->pool.base != NULL)
+    (void)munmap(cb->pool.base, cb->pool.size);
+
+  sfree(cb);
+} /* }}} void wm_callback_free */
+
+static int wm_write_json(const data_set_t *ds, const value_list_t *vl, /* {{{ */
+                         wm_callback_t *cb, int lane) {
+  cdtime_t start = cb->collect_stats ? cdtime() : 0;
+  uint32_t id_hash = 0;
+  uint64_t wait;
+  wm_shard_t *shard;
+  wm_series_t *series = NULL;
+  int status;
+
+  if (wm_callback_init(cb) != 0)
+    return -1;
+
+  if ((cb->shards_num > 1) || (cb->group_size > 1) || cb->track_series)
+    id_hash = wm_identifier_hash(vl);
+  shard = cb->shards + (id_hash % cb->shards_num);
+
+  wait = wm_lock(&shard->lock);
+  wm_stat_add(&shard->stats.lock_wait, wait);
+
+  /* If the series cannot be tracked, its values are simply written. */
+  if (cb->track_series) {
+    series = wm_series_get(cb, shard, ds, vl, id_hash);
+    if ((series != NULL) && cb->publish_on_change &&
+        wm_series_unchanged(cb, series, ds, vl)) {
+      wm_stat_add(&shard->stats.values_suppressed, 1);
+      pthread_mutex_unlock(&shard->lock);
+      return 0;
+    }
+  }
+
+  if ((series != NULL) && (cb->aggregation_interval > 0) &&
+      (series->ds == ds)) {
+    series->lane = lane;
+    /* The first value list of the next window publishes the last one. */
+    if ((series->agg_samples > 0) && (vl->time >= series->agg_end)) {
+      wm_agg_t agg[series->values_num];
+      cdtime_t time = series->agg_time;
+
+      memcpy(agg, series->agg, sizeof(agg));
+      wm_agg_reset(shard, series);
+      wm_agg_add(cb, shard, series, vl);
+      status = wm_agg_emit(cb, shard, series, agg, time, /* cache = */ true);
+    } else {
+      wm_agg_add(cb, shard, series, vl);
+      status = 0;
+    }
+    wm_stat_add(&shard->stats.values_aggregated, 1);
+
+    if (status == 0)
+      status = wm_agg_flush(cb, shard, vl->time);
+  } else
+    status = wm_write_value_list(cb, shard, ds, vl, id_hash, series, lane);
+
+  if ((status == 0) && cb->collect_stats)
+    wm_histogram_add(&shard->stats.write_latency,
+                     CDTIME_T_TO_NS(cdtime() - start));
+  pthread_mutex_unlock(&shard->lock);
+
+  return status;
+} /* }}} int wm_write_json */
+
+static void wm_histogram_sum(wm_histogram_t *sum, /* {{{ */
+                             wm_histogram_t const *h) {
+  for (size_t i = 0; i < WM_HISTOGRAM_BUCKETS; i++)
+    sum->buckets[i] += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+  sum->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+} /* }}} void wm_histogram_sum */
+
+static void wm_stats_sum(wm_stats_t *sum, wm_stats_t const *stats) /* {{{ */
+{
+  sum->values_written +=
+      __atomic_load_n(&stats->values_written, __ATOMIC_RELAXED);
+  sum->values_suppressed +=
+      __atomic_load_n(&stats->values_suppressed, __ATOMIC_RELAXED);
+  sum->values_aggregated +=
+      __atomic_load_n(&stats->values_aggregated, __ATOMIC_RELAXED);
+  sum->values_filtered +=
+      __atomic_load_n(&stats->values_filtered, __ATOMIC_RELAXED);
+  sum->messages_published +=
+      __atomic_load_n(&stats->messages_published, __ATOMIC_RELAXED);
+  sum->bytes_published +=
+      __atomic_load_n(&stats->bytes_published, __ATOMIC_RELAXED);
+  sum->batches_dropped +=
+      __atomic_load_n(&stats->batches_dropped, __ATOMIC_RELAXED);
+  sum->reconnects += __atomic_load_n(&stats->reconnects, __ATOMIC_RELAXED);
+  sum->failovers += __atomic_load_n(&stats->failovers, __ATOMIC_RELAXED);
+  sum->lock_wait += __atomic_load_n(&stats->lock_wait, __ATOMIC_RELAXED);
+  sum->values_shed += __atomic_load_n(&stats->values_shed, __ATOMIC_RELAXED);
+  sum->batches_shed +=
+      __atomic_load_n(&stats->batches_shed, __ATOMIC_RELAXED);
+  sum->memory_wait += __atomic_load_n(&stats->memory_wait, __ATOMIC_RELAXED);
+  wm_histogram_sum(&sum->batch_bytes, &stats->batch_bytes);
+  wm_histogram_sum(&sum->publish_latency, &stats->publish_latency);
+  wm_histogram_sum(&sum->write_latency, &stats->write_latency);
+} /* }}} void wm_stats_sum */
+
+static void wm_writer_stats_sum(wm_stats_t *sum, /* {{{ */
+                                wm_callback_t const *cb) {
+  for (size_t i = 0; i < WM_WRITER_SLOTS; i++) {
+    wm_writer_stats_t const *ws = cb->writer_stats + i;
+
+    sum->values_filtered +=
+        __atomic_load_n(&ws->values_filtered, __ATOMIC_RELAXED);
+    sum->values_shed += __atomic_load_n(&ws->values_shed, __ATOMIC_RELAXED);
+    sum->memory_wait += __atomic_load_n(&ws->memory_wait, __ATOMIC_RELAXED);
+  }
+} /* }}} void wm_writer_stats_sum */
+
+/* Returns the mean and the upper bound of the bucket holding quantile "q" of
+ * the values added to "h" since "last", or NAN if there are none. */
+static void wm_histogram_get(wm_histogram_t const *h, /* {{{ */
+                             wm_histogram_t const *last, double q,
+                             gauge_t *ret_mean, gauge_t *ret_quantile) {
+  uint64_t count = 0;
+  uint64_t rank;
+  uint64_t seen = 0;
+
+  for (size_t i = 0; i < WM_HISTOGRAM_BUCKETS; i++)
+    count += h->buckets[i] - last->buckets[i];
+
+  *ret_mean = NAN;
+  *ret_quantile = NAN;
+  if (count == 0)
+    return;
+
+  *ret_mean = ((gauge_t)(h->sum - last->sum)) / ((gauge_t)count);
+
+  rank = (uint64_t)ceil(q * (double)count);
+  for (size_t i = 0; i < WM_HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i] - last->buckets[i];
+    if (seen >= rank) {
+      *ret_quantile = (i == 0) ? 0.0 : ldexp(1.0, (int)i);
+      return;
+    }
+  }
+} /* }}} void wm_histogram_get */
+
+static void wm_submit(wm_callback_t const *cb, char const *type, /* {{{ */
+                      char const *type_instance, value_t value) {
+  value_list_t vl = VALUE_LIST_INIT;
+
+  vl.values = &value;
+  vl.values_len = 1;
+  sstrncpy(vl.plugin, "write_mqtt", sizeof(vl.plugin));
+  sstrncpy(vl.plugin_instance, cb->name, sizeof(vl.plugin_instance));
+  sstrncpy(vl.type, type, sizeof(vl.type));
+  sstrncpy(vl.type_instance, type_instance, sizeof(vl.type_instance));
+
+  plugin_dispatch_values(&vl);
+} /* }}} void wm_submit */
+
+static void wm_submit_derive(wm_callback_t const *cb, /* {{{ */
+                             char const *type_instance, uint64_t value) {
+  wm_submit(cb, "derive", type_instance, (value_t){.derive = (derive_t)value});
+} /* }}} void wm_submit_derive */
+
+static void wm_submit_gauge(wm_callback_t const *cb, char const *type, /* {{{ */
+                            char const *type_instance, gauge_t value) {
+  wm_submit(cb, type, type_instance, (value_t){.gauge = value});
+} /* }}} void wm_submit_gauge */
+
+/* Dispatches the node's statistics as plugin instance "write_mqtt-<Node>". */
+static int wm_read(user_data_t *user_data) /* {{{ */
+{
+  wm_callback_t *cb;
+  wm_stats_t total = {0};
+  int inflight = 0;
+  size_t queued = 0;
+  size_t backlog_bytes;
+  uint64_t pool_used;
+  gauge_t mean;
+  gauge_t p50;
+  gauge_t p99;
+
+  if (user_data == NULL)
+    return -EINVAL;
+
+  cb = user_data->data;
+
+  for (size_t i = 0; i < cb->shards_num; i++)
+    wm_stats_sum(&total, &cb->shards[i].stats);
+  wm_writer_stats_sum(&total, cb);
+  for (size_t i = 0; i < cb->conns_num; i++) {
+    wm_stats_sum(&total, &cb->conns[i].stats);
+    inflight += __atomic_load_n(&cb->conns[i].inflight, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_lock(&cb->send_lock);
+  wm_stats_sum(&total, &cb->stats);
+  for (size_t i = 0; i < cb->conns_num; i++)
+    queued += cb->conns[i].publish_num;
+  backlog_bytes = cb->backlog_bytes;
+  pthread_mutex_unlock(&cb->send_lock);
+
+  pthread_mutex_lock(&cb->pool.lock);
+  pool_used = cb->pool.used;
+  pthread_mutex_unlock(&cb->pool.lock);
+
+  wm_submit_derive(cb, "values_written", total.values_written);
+  if (cb->publish_on_change)
+    wm_submit_derive(cb, "values_suppressed", total.values_suppressed);
+  if (cb->aggregation_interval > 0)
+    wm_submit_derive(cb, "values_aggregated", total.values_aggregated);
+  if (cb->filter)
+    wm_submit_derive(cb, "values_filtered", total.values_filtered);
+  wm_submit_derive(cb, "messages_published", total.messages_published);
+  wm_submit_derive(cb, "bytes_published", total.bytes_published);
+  wm_submit_derive(cb, "batches_dropped", total.batches_dropped);
+  wm_submit_derive(cb, "reconnects", total.reconnects);
+  if ((cb->broker_policy == WM_BROKERS_FAILOVER) && (cb->hosts_num > 1))
+    wm_submit_derive(cb, "failovers", total.failovers);
+  wm_submit_derive(cb, "lock_wait_us", total.lock_wait);
+  if (cb->max_memory > 0) {
+    wm_submit_derive(cb, "values_shed", total.values_shed);
+    wm_submit_derive(cb, "batches_shed", total.batches_shed);
+    if (cb->memory_policy == WM_MEMORY_BLOCK)
+      wm_submit_derive(cb, "memory_wait_us", total.memory_wait);
+    wm_submit_gauge(cb, "bytes", "memory",
+                    (gauge_t)__atomic_load_n(&cb->memory, __ATOMIC_RELAXED));
+  }
+
+  wm_submit_gauge(cb, "queue_length", "inflight",
+                  (gauge_t)((inflight > 0) ? inflight : 0));
+  wm_submit_gauge(cb, "queue_length", "publish", (gauge_t)queued);
+  wm_submit_gauge(cb, "bytes", "backlog", (gauge_t)backlog_bytes);
+
+  wm_submit_derive(cb, "pool_hits",
+                   __atomic_load_n(&cb->pool.hits, __ATOMIC_RELAXED));
+  wm_submit_derive(cb, "pool_misses",
+                   __atomic_load_n(&cb->pool.misses, __ATOMIC_RELAXED));
+  wm_submit_gauge(cb, "bytes", "pool_used", (gauge_t)pool_used);
+
+  wm_histogram_get(&total.batch_bytes, &cb->stats_last.batch_bytes, 0.99,
+                   &mean, &p99);
+  wm_submit_gauge(cb, "bytes", "batch", mean);
+  wm_submit_gauge(cb, "bytes", "batch_p99", p99);
+
+  wm_histogram_get(&total.publish_latency, &cb->stats_last.publish_latency,
+                   0.99, &mean, &p99);
+  wm_submit_gauge(cb, "response_time", "publish", mean / 1e6);
+  wm_submit_gauge(cb, "response_time", "publish_p99", p99 / 1e6);
+
+  wm_histogram_get(&total.write_latency, &cb->stats_last.write_latency, 0.5,
+                   &mean, &p50);
+  wm_histogram_get(&total.write_latency, &cb->stats_last.write_latency,
+                   0.99, &mean, &p99);
+  wm_submit_gauge(cb, "response_time", "write", mean / 1e9);
+  wm_submit_gauge(cb, "response_time", "write_p50", p50 / 1e9);
+  wm_submit_gauge(cb, "response_time", "write_p99", p99 / 1e9);
+
+  /* CPU time of the publish threads, which compress and publish. */
+  if (__atomic_load_n(&cb->threads_running, __ATOMIC_ACQUIRE)) {
+    uint64_t cpu_us = 0;
+
+    for (size_t i = 0; i < cb->conns_num; i++) {
+      clockid_t clock;
+      struct timespec ts;
+
+      if (!cb->conns[i].publish_thread_running ||
+          (pthread_getcpuclockid(cb->conns[i].publish_thread, &clock) != 0) ||
+          (clock_gettime(clock, &ts) != 0))
+        continue;
+      cpu_us += (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+    }
+    wm_submit_derive(cb, "publish_cpu_us", cpu_us);
+  }
+
+  cb->stats_last = total;
+  return 0;
+} /* }}} int wm_read */
+
+/* must not hold any lock when calling. Waits up to MemoryBlockTimeout for
+ * the node to fall below its high watermark. Returns false if it did not. */
+static bool wm_memory_wait(wm_callback_t *cb) /* {{{ */
+{
+  cdtime_t start = cdtime();
+  struct timespec ts = CDTIME_T_TO_TIMESPEC(start + cb->memory_block_timeout);
+  bool below;
+
+  pthread_mutex_lock(&cb->memory_lock);
+  /* wm_memory_release() only signals while there are waiters. */
+  __atomic_add_fetch(&cb->memory_waiters, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&cb->memory, __ATOMIC_SEQ_CST) >= cb->memory_high)
+    if (pthread_cond_timedwait(&cb->memory_cond, &cb->memory_lock, &ts) ==
+        ETIMEDOUT)
+      break;
+  below = __atomic_load_n(&cb->memory, __ATOMIC_SEQ_CST) < cb->memory_high;
+  __atomic_sub_fetch(&cb->memory_waiters, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&cb->memory_lock);
+
+  wm_writer_stat_add(cb, offsetof(wm_writer_stats_t, memory_wait),
+                     CDTIME_T_TO_US(cdtime() - start));
+  return below;
+} /* }}} bool wm_memory_wait */
+
+/* must not hold any lock when calling. Applies the MemoryPolicy once the
+ * node is past its high watermark. Returns false if "vl" is to be shed.
+ * "DropOldest" sheds the oldest batches of the backlog and lets "vl" in:
+ * what else the node holds is bounded by MaxMemory itself. */
+static bool wm_memory_admit(wm_callback_t *cb, /* {{{ */
+                            value_list_t const *vl) {
+  uint32_t *sample;
+
+  if (__atomic_load_n(&cb->memory, __ATOMIC_RELAXED) < cb->memory_high)
+    return true;
+
+  switch (cb->memory_policy) {
+  case WM_MEMORY_DROP_OLDEST:
+    pthread_mutex_lock(&cb->send_lock);
+    while ((cb->backlog_head != NULL) &&
+           (__atomic_load_n(&cb->memory, __ATOMIC_RELAXED) >= cb->memory_high))
+      wm_backlog_shed(cb);
+    pthread_mutex_unlock(&cb->send_lock);
+    return true;
+  case WM_MEMORY_SAMPLE:
+    /* Series sharing a slot share its count. */
+    sample = cb->memory_samples +
+             wm_identifier_hash(vl) % WRITE_MQTT_MEMORY_SAMPLE_SLOTS;
+    if ((__atomic_fetch_add(sample, 1, __ATOMIC_RELAXED) %
+         cb->memory_sample_rate) == 0)
+      return true;
+    break;
+  case WM_MEMORY_BLOCK:
+    if (wm_memory_wait(cb))
+      return true;
+    break;
+  }
+
+  wm_writer_stat_add(cb, offsetof(wm_writer_stats_t, values_shed), 1);
+  return false;
+} /* }}} bool wm_memory_admit */
+
+static int wm_write(const data_set_t *ds, const value_list_t *vl, /* {{{ */
+                    user_data_t *user_data) {
+  wm_callback_t *cb;
+  int lane = WM_LANE_BULK;
+  int status;
+
+  if (user_data == NULL)
+    return -EINVAL;
+
+  cb = user_data->data;
+
+  if (cb->filter && !wm_filter_pass(cb, vl, &lane))
+    return 0;
+  if ((cb->max_memory > 0) && !wm_memory_admit(cb, vl))
+    return 0;
+
+  status = wm_write_json(ds, vl, cb, lane);
+  return status;
+} /* }}} int wm_write */
+
+static void wm_advise_huge_pages(void *addr, size_t size) /* {{{ */
+{
+#ifdef MADV_HUGEPAGE
+  if (madvise(addr, size, MADV_HUGEPAGE) != 0) {
+    char errbuf[1024];
+    WARNING("write_mqtt plugin: madvise(MADV_HUGEPAGE) failed: %s",
+            sstrerror(errno, errbuf, sizeof(errbuf)));
+  }
+#else
+  WARNING("write_mqtt plugin: HugePages is not supported on this system.");
+#endif
+} /* }}} void wm_advise_huge_pages */
+
+static int wm_config_get_size(oconfig_item_t const *ci, /* {{{ */
+                              size_t *ret_size) {
+  double size = 0.0;
+  int status;
 
-    return -1;
+  status = cf_util_get_double(ci, &size);
+  if ((status != 0) || !(size >= 0.0) || (size > (double)SIZE_MAX)) {
+    ERROR("write_mqtt plugin: The \"%s\" option requires a non-negative "
+          "number of bytes.",
+          ci->key);
+    return EINVAL;
   }
 
+  *ret_size = (size_t)size;
   return 0;
-} /* }}} wm_publish_nolock */
+} /* }}} int wm_config_get_size */
 
-/* must hold cb->send_lock when calling. */
-static int wm_callback_init(wm_callback_t *cb) /* {{{ */
-{
-  char const *client_id;
-  int status;
+/* "Include" and "Exclude" take one or more identifier patterns and may be
+ * repeated. */
+static int wm_config_rules(oconfig_item_t const *ci, /* {{{ */
+                           wm_rules_t *rules) {
+  if (ci->values_num < 1) {
+    ERROR("write_mqtt plugin: The \"%s\" option requires at least one "
+          "string argument.",
+          ci->key);
+    return EINVAL;
+  }
 
-  if (cb->mosq != NULL)
-    return 0;
+  for (int i = 0; i < ci->values_num; i++) {
+    if (ci->values[i].type != OCONFIG_TYPE_STRING) {
+      ERROR("write_mqtt plugin: The \"%s\" option requires string "
+            "arguments.",
+            ci->key);
+      return EINVAL;
+    }
+    if (wm_rules_add(rules, ci->values[i].value.string) != 0) {
+      ERROR("write_mqtt plugin: wm_rules_add failed.");
+      return ENOMEM;
+    }
+  }
 
-  if (cb->client_id)
-    client_id = cb->client_id;
-  else
-    client_id = hostname_g;
+  return 0;
+} /* }}} int wm_config_rules */
 
-  cb->mosq =
-      mosquitto_new(client_id, /* clean session */ true, /* user data */ cb);
-  if (cb->mosq == NULL) {
-    ERROR("write_mqtt plugin: mosquitto_new failed");
-    return -1;
+/* "AggregationFunction" takes one or more function names and may be
+ * repeated. */
+static int wm_config_aggregation(oconfig_item_t const *ci, /* {{{ */
+                                 wm_callback_t *cb) {
+  if (ci->values_num < 1) {
+    ERROR("write_mqtt plugin: The \"AggregationFunction\" option requires at "
+          "least one string argument.");
+    return EINVAL;
   }
 
-  mosquitto_opts_set(cb->mosq, MOSQ_OPT_PROTOCOL_VERSION, &cb->protocol_version);
+  for (int i = 0; i < ci->values_num; i++) {
+    int function;
 
-  if (cb->capath) {
-    status = mosquitto_tls_set(cb->mosq, cb->capath, NULL,
-                               cb->clientcert, cb->clientkey,
-                               /* pw_callback */ NULL);
-    if (status != MOSQ_ERR_SUCCESS) {
-      ERROR("write_mqtt plugin: cannot mosquitto_tls_set: %s",
-            mosquitto_strerror(status));
-      mosquitto_destroy(cb->mosq);
-      cb->mosq = NULL;
-      return -1;
+    if (ci->values[i].type != OCONFIG_TYPE_STRING) {
+      ERROR("write_mqtt plugin: The \"AggregationFunction\" option requires "
+            "string arguments.");
+      return EINVAL;
     }
 
-    status = mosquitto_tls_insecure_set(cb->mosq, cb->insecure);
-    if (status != MOSQ_ERR_SUCCESS) {
-      ERROR("write_mqtt plugin: cannot mosquitto_tls_insecure_set: %s",
-            mosquitto_strerror(status));
-      mosquitto_destroy(cb->mosq);
-      cb->mosq = NULL;
-      return -1;
+    for (function = 0; function < WM_AGG_MAX; function++)
+      if (strcasecmp(wm_agg_names[function], ci->values[i].value.string) == 0)
+        break;
+    if (function == WM_AGG_MAX) {
+      ERROR("write_mqtt plugin: Unknown AggregationFunction \"%s\".",
+            ci->values[i].value.string);
+      return EINVAL;
     }
+
+    cb->aggregation_functions |= 1u << function;
   }
 
-  status =
-      mosquitto_connect(cb->mosq, cb->host, cb->port, WRITE_MQTT_KEEPALIVE);
-  if (status != MOSQ_ERR_SUCCESS) {
-    char errbuf[1024];
-    ERROR("write_mqtt plugin: mosquitto_connect failed: %s",
-          (status == MOSQ_ERR_ERRNO) ? sstrerror(errno, errbuf, sizeof(errbuf))
-                                     : mosquitto_strerror(status));
+  return 0;
+} /* }}} int wm_config_aggregation */
 
-    mosquitto_destroy(cb->mosq);
-    cb->mosq = NULL;
-    return -1;
+/* "Host" takes one or more brokers and may be repeated. */
+static int wm_config_get_hosts(oconfig_item_t const *ci, /* {{{ */
+                               wm_callback_t *cb) {
+  if (ci->values_num < 1) {
+    ERROR("write_mqtt plugin: The \"Host\" option requires at least one "
+          "string argument.");
+    return EINVAL;
   }
 
-  status = mosquitto_loop_start(cb->mosq);
-  if (status != MOSQ_ERR_SUCCESS) {
-    char errbuf[1024];
-    ERROR("write_mqtt plugin: mosquitto_loop_start failed: %s",
-          (status == MOSQ_ERR_ERRNO) ? sstrerror(errno, errbuf, sizeof(errbuf))
-                                     : mosquitto_strerror(status));
-    (void)mosquitto_disconnect(cb->mosq);
-    mosquitto_destroy(cb->mosq);
-    cb->mosq = NULL;
-    return -1;
-  }
+  for (int i = 0; i < ci->values_num; i++) {
+    char **tmp;
+
+    if (ci->values[i].type != OCONFIG_TYPE_STRING) {
+      ERROR("write_mqtt plugin: The \"Host\" option requires string "
+            "arguments.");
+      return EINVAL;
+    }
+    if (cb->hosts_num >= WRITE_MQTT_MAX_BROKERS) {
+      ERROR("write_mqtt plugin: At most %d brokers are supported per "
+            "instance.",
+            WRITE_MQTT_MAX_BROKERS);
+      return EINVAL;
+    }
 
-  cb->connected = 1;
+    tmp = realloc(cb->hosts, (cb->hosts_num + 1) * sizeof(*cb->hosts));
+    if (tmp == NULL)
+      return ENOMEM;
+    cb->hosts = tmp;
 
-  wm_reset_buffer(cb);
+    cb->hosts[cb->hosts_num] = strdup(ci->values[i].value.string);
+    if (cb->hosts[cb->hosts_num] == NULL)
+      return ENOMEM;
+    cb->hosts_num++;
+  }
 
   return 0;
-} /* }}} int wm_callback_init */
+} /* }}} int wm_config_get_hosts */
 
-static int wm_flush_nolock(cdtime_t timeout, wm_callback_t *cb) /* {{{ */
-{
+static int wm_config_format(oconfig_item_t const *ci, /* {{{ */
+                            wm_callback_t *cb) {
+  char name[16];
   int status;
 
-  DEBUG("write_mqtt plugin: wm_flush_nolock: timeout = %.3f; "
-        "send_buffer_fill = %" PRIsz ";",
-        CDTIME_T_TO_DOUBLE(timeout), cb->send_buffer_fill);
-
-  /* timeout == 0  => flush unconditionally */
-  if (timeout > 0) {
-    cdtime_t now;
+  status = cf_util_get_string_buffer(ci, name, sizeof(name));
+  if (status != 0)
+    return status;
 
-    now = cdtime();
-    if ((cb->send_buffer_init_time + timeout) > now)
+  for (size_t i = 0; i < STATIC_ARRAY_SIZE(wm_formats); i++) {
+    if (strcasecmp(wm_formats[i].name, name) == 0) {
+      cb->format = wm_formats + i;
       return 0;
+    }
   }
 
-  if (cb->send_buffer_fill <= 2) {
-    cb->send_buffer_init_time = cdtime();
-    return 0;
-  }
+  ERROR("write_mqtt plugin: Unknown Format \"%s\".", name);
+  return EINVAL;
+} /* }}} int wm_config_format */
 
-  status = format_json_finalize(cb->send_buffer, &cb->send_buffer_fill,
-                                &cb->send_buffer_free);
-  if (status != 0) {
-    ERROR("write_mqtt: wm_flush_nolock: "
-          "format_json_finalize failed.");
-    wm_reset_buffer(cb);
+static int wm_config_compression(oconfig_item_t const *ci, /* {{{ */
+                                 wm_callback_t *cb) {
+  char name[16];
+  int status;
+
+  status = cf_util_get_string_buffer(ci, name, sizeof(name));
+  if (status != 0)
     return status;
-  }
 
-  status = wm_publish_nolock(cb, cb->send_buffer);
-  wm_reset_buffer(cb);
+  if (strcasecmp("none", name) == 0)
+    cb->compression = WM_COMPRESSION_NONE;
+#if HAVE_ZLIB_H
+  else if (strcasecmp("gzip", name) == 0)
+    cb->compression = WM_COMPRESSION_GZIP;
+#endif
+#if HAVE_LZ4FRAME_H
+  else if (strcasecmp("lz4", name) == 0)
+    cb->compression = WM_COMPRESSION_LZ4;
+#endif
+#if HAVE_ZSTD_H
+  else if (strcasecmp("zstd", name) == 0)
+    cb->compression = WM_COMPRESSION_ZSTD;
+#endif
+  else {
+    ERROR("write_mqtt plugin: Compression \"%s\" is unknown or not "
+          "supported by this build.",
+          name);
+    return EINVAL;
+  }
 
-  return status;
-} /* }}} wm_flush_nolock */
+  return 0;
+} /* }}} int wm_config_compression */
 
-static int wm_flush(cdtime_t timeout, /* {{{ */
-                    const char *identifier __attribute__((unused)),
-                    user_data_t *user_data) {
-  wm_callback_t *cb;
+static int wm_config_memory_policy(oconfig_item_t const *ci, /* {{{ */
+                                   wm_callback_t *cb) {
+  char name[16];
   int status;
 
-  if (user_data == NULL)
-    return -EINVAL;
-
-  cb = user_data->data;
-
-  pthread_mutex_lock(&cb->send_lock);
+  status = cf_util_get_string_buffer(ci, name, sizeof(name));
+  if (status != 0)
+    return status;
 
-  if (wm_callback_init(cb) != 0) {
-    ERROR("write_mqtt plugin: wm_callback_init failed.");
-    pthread_mutex_unlock(&cb->send_lock);
-    return -1;
+  if (strcasecmp("DropOldest", name) == 0)
+    cb->memory_policy = WM_MEMORY_DROP_OLDEST;
+  else if (strcasecmp("DropNewest", name) == 0)
+    cb->memory_policy = WM_MEMORY_DROP_NEWEST;
+  else if (strcasecmp("Sample", name) == 0)
+    cb->memory_policy = WM_MEMORY_SAMPLE;
+  else if (strcasecmp("Block", name) == 0)
+    cb->memory_policy = WM_MEMORY_BLOCK;
+  else {
+    ERROR("write_mqtt plugin: Unknown MemoryPolicy \"%s\".", name);
+    return EINVAL;
   }
 
-  status = wm_flush_nolock(timeout, cb);
-  pthread_mutex_unlock(&cb->send_lock);
-
-  return status;
-} /* }}} int wm_flush */
+  return 0;
+} /* }}} int wm_config_memory_policy */
 
-static void wm_callback_free(void *data) /* {{{ */
-{
-  wm_callback_t *cb;
+static int wm_config_protocol_version(oconfig_item_t const *ci, /* {{{ */
+                                      wm_callback_t *cb) {
+  char version[16];
+  int status;
 
-  if (data == NULL)
-    return;
+  status = cf_util_get_string_buffer(ci, version, sizeof(version));
+  if (status != 0)
+    return status;
 
-  cb = data;
+  if (strcmp("3.1", version) == 0)
+    cb->protocol_version = MQTT_PROTOCOL_V31;
+  else if (strcmp("3.1.1", version) == 0)
+    cb->protocol_version = MQTT_PROTOCOL_V311;
+#if WM_HAVE_MQTT5
+  else if (strcmp("5", version) == 0)
+    cb->protocol_version = MQTT_PROTOCOL_V5;
+#endif
+  else {
+    ERROR("write_mqtt plugin: ProtocolVersion \"%s\" is unknown or not "
+          "supported by this build.",
+          version);
+    return EINVAL;
+  }
 
-  if (cb->mosq != NULL) {
-    if (cb->send_buffer != NULL)
-      wm_flush_nolock(/* timeout = */ 0, cb);
+  return 0;
+} /* }}} int wm_config_protocol_version */
 
-    if (cb->connected)
-      (void)mosquitto_disconnect(cb->mosq);
-    cb->connected = 0;
+/* Compiles a template such as "collectd/%{host}/%{plugin}" into parts. */
+static int wm_config_topic_template(oconfig_item_t const *ci, /* {{{ */
+                                    wm_callback_t *cb) {
+  static struct {
+    char const *name;
+    int field;
+  } const fields[] = {
+      {"host", WM_FIELD_HOST},
+      {"plugin", WM_FIELD_PLUGIN},
+      {"plugin_instance", WM_FIELD_PLUGIN_INSTANCE},
+      {"type", WM_FIELD_TYPE},
+      {"type_instance", WM_FIELD_TYPE_INSTANCE},
+  };
+  char *template = NULL;
+  char const *ptr;
+  int status;
 
-    (void)mosquitto_loop_stop(cb->mosq, false);
+  status = cf_util_get_string(ci, &template);
+  if (status != 0)
+    return status;
 
-    (void)mosquitto_destroy(cb->mosq);
+  if ((template[0] == 0) || (strpbrk(template, "+#") != NULL)) {
+    ERROR("write_mqtt plugin: TopicTemplate must not be empty and must not "
+          "contain wildcards.");
+    sfree(template);
+    return EINVAL;
   }
 
-  sfree(cb->name);
-  sfree(cb->host);
-  sfree(cb->client_id);
-  sfree(cb->capath);
-  sfree(cb->clientkey);
-  sfree(cb->clientcert);
-  sfree(cb->topic);
-  sfree(cb->send_buffer);
+  for (size_t i = 0; i < cb->topic_template_num; i++)
+    sfree(cb->topic_template[i].text);
+  sfree(cb->topic_template);
+  cb->topic_template_num = 0;
+  cb->topic_fields = 0;
 
-  sfree(cb);
-} /* }}} void wm_callback_free */
+  /* There are at most twice as many parts as placeholders, plus one. */
+  cb->topic_template = calloc(strlen(template) + 1, sizeof(*cb->topic_template));
+  if (cb->topic_template == NULL) {
+    sfree(template);
+    return ENOMEM;
+  }
 
-static int wm_write_json(const data_set_t *ds, const value_list_t *vl, /* {{{ */
-                         wm_callback_t *cb) {
-  int status;
+  ptr = template;
+  while (*ptr != 0) {
+    wm_template_part_t *part = cb->topic_template + cb->topic_template_num;
+    char const *end;
 
-  pthread_mutex_lock(&cb->send_lock);
-  if (wm_callback_init(cb) != 0) {
-    ERROR("write_mqtt plugin: wm_callback_init failed.");
-    pthread_mutex_unlock(&cb->send_lock);
-    return -1;
-  }
+    if (strncmp(ptr, "%{", 2) == 0) {
+      size_t i;
 
-  status =
-      format_json_value_list(cb->send_buffer, &cb->send_buffer_fill,
-                             &cb->send_buffer_free, ds, vl, cb->store_rates);
-  if (status == -ENOMEM) {
-    status = wm_flush_nolock(/* timeout = */ 0, cb);
-    if (status != 0) {
-      wm_reset_buffer(cb);
-      pthread_mutex_unlock(&cb->send_lock);
-      return status;
+      end = strchr(ptr, '}');
+      for (i = 0; (end != NULL) && (i < STATIC_ARRAY_SIZE(fields)); i++)
+        if ((strlen(fields[i].name) == (size_t)(end - ptr - 2)) &&
+            (strncmp(ptr + 2, fields[i].name, (size_t)(end - ptr - 2)) == 0))
+          break;
+      if ((end == NULL) || (i >= STATIC_ARRAY_SIZE(fields))) {
+        ERROR("write_mqtt plugin: TopicTemplate: unknown placeholder at "
+              "\"%s\".",
+              ptr);
+        sfree(template);
+        return EINVAL;
+      }
+
+      part->field = fields[i].field;
+      cb->topic_fields |= 1u << fields[i].field;
+      cb->topic_template_num++;
+      ptr = end + 1;
+      continue;
     }
 
-    status =
-        format_json_value_list(cb->send_buffer, &cb->send_buffer_fill,
-                               &cb->send_buffer_free, ds, vl, cb->store_rates);
-  }
-  if (status != 0) {
-    pthread_mutex_unlock(&cb->send_lock);
-    return status;
+    end = strstr(ptr + 1, "%{");
+    if (end == NULL)
+      end = ptr + strlen(ptr);
+
+    part->field = WM_FIELD_TEXT;
+    part->text_len = (size_t)(end - ptr);
+    part->text = malloc(part->text_len + 1);
+    if (part->text == NULL) {
+      sfree(template);
+      return ENOMEM;
+    }
+    memcpy(part->text, ptr, part->text_len);
+    part->text[part->text_len] = 0;
+    cb->topic_template_num++;
+    ptr = end;
   }
 
-  DEBUG("write_mqtt plugin: <%s> buffer %" PRIsz "/%" PRIsz " (%g%%) \"%s\"",
-        cb->location, cb->send_buffer_fill, cb->send_buffer_size,
-        100.0 * ((double)cb->send_buffer_fill) /
-            ((double)cb->send_buffer_size));
+  sfree(template);
+  return 0;
+} /* }}} int wm_config_topic_template */
 
-  /* Check if we have enough space for this command. */
-  pthread_mutex_unlock(&cb->send_lock);
+#if HAVE_ZSTD_H
+static int wm_load_dictionary(wm_callback_t *cb, char const *path) /* {{{ */
+{
+  struct stat statbuf;
+  char *dict;
+  ssize_t status;
+  int fd;
 
-  return 0;
-} /* }}} int wm_write_json */
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    char errbuf[1024];
+    ERROR("write_mqtt plugin: open(\"%s\") failed: %s", path,
+          sstrerror(errno, errbuf, sizeof(errbuf)));
+    return -1;
+  }
 
-static int wm_write(const data_set_t *ds, const value_list_t *vl, /* {{{ */
-                    user_data_t *user_data) {
-  wm_callback_t *cb;
-  int status;
+  if ((fstat(fd, &statbuf) != 0) || (statbuf.st_size <= 0)) {
+    ERROR("write_mqtt plugin: dictionary \"%s\" is empty or unreadable.",
+          path);
+    close(fd);
+    return -1;
+  }
 
-  if (user_data == NULL)
-    return -EINVAL;
+  dict = malloc((size_t)statbuf.st_size);
+  if (dict == NULL) {
+    ERROR("write_mqtt plugin: malloc failed.");
+    close(fd);
+    return -1;
+  }
 
-  cb = user_data->data;
+  status = read(fd, dict, (size_t)statbuf.st_size);
+  close(fd);
+  if (status != (ssize_t)statbuf.st_size) {
+    ERROR("write_mqtt plugin: reading dictionary \"%s\" failed.", path);
+    sfree(dict);
+    return -1;
+  }
 
-  status = wm_write_json(ds, vl, cb);
-  return status;
-} /* }}} int wm_write */
+  cb->zstd_cdict =
+      ZSTD_createCDict(dict, (size_t)statbuf.st_size, cb->compression_level);
+  sfree(dict);
+  if (cb->zstd_cdict == NULL) {
+    ERROR("write_mqtt plugin: ZSTD_createCDict(\"%s\") failed.", path);
+    return -1;
+  }
+
+  return 0;
+} /* }}} int wm_load_dictionary */
+#endif
 
 static int wm_config_node(oconfig_item_t *ci) /* {{{ */
 {
+  char *dictionary = NULL;
+  int connections = 1;
+  int write_shards = 1;
   wm_callback_t *cb;
   char callback_name[DATA_MAX_NAME_LEN];
   int status = 0;
@@ -370,9 +7363,33 @@ static int wm_config_node(oconfig_item_t *ci) /* {{{ */
   }
 
   cb->port = WRITE_MQTT_DEFAULT_PORT;
+  cb->broker_policy = WM_BROKERS_FAILOVER;
+  cb->probe_interval = WRITE_MQTT_DEFAULT_PROBE_INTERVAL;
+  cb->brokers_healthy = UINT32_MAX;
   cb->protocol_version = MQTT_PROTOCOL_V311;
   cb->topic = strdup(WRITE_MQTT_DEFAULT_TOPIC);
-  cb->send_buffer_size = WRITE_MQTT_MAX_MESSAGE_SIZE;
+  cb->send_buffer_size = WRITE_MQTT_DEFAULT_BUFFER_SIZE;
+  cb->buffers_num = WRITE_MQTT_DEFAULT_SEND_BUFFERS;
+  cb->reconnect_min_interval = WRITE_MQTT_DEFAULT_RECONNECT_MIN_INTERVAL;
+  cb->reconnect_max_interval = WRITE_MQTT_DEFAULT_RECONNECT_MAX_INTERVAL;
+  cb->max_spool_bytes = WRITE_MQTT_DEFAULT_MAX_SPOOL_BYTES;
+  cb->spool_fd = -1;
+  cb->replay_rate = WRITE_MQTT_DEFAULT_REPLAY_RATE;
+  cb->priority_batch_delay = WRITE_MQTT_DEFAULT_PRIORITY_BATCH_DELAY;
+  cb->priority_weight = WRITE_MQTT_DEFAULT_PRIORITY_WEIGHT;
+  cb->memory_policy = WM_MEMORY_DROP_OLDEST;
+  cb->memory_sample_rate = WRITE_MQTT_DEFAULT_MEMORY_SAMPLE_RATE;
+  cb->memory_block_timeout = WRITE_MQTT_DEFAULT_MEMORY_BLOCK_TIMEOUT;
+  cb->max_inflight = WRITE_MQTT_DEFAULT_MAX_INFLIGHT;
+  cb->pool.size = WRITE_MQTT_DEFAULT_BATCH_POOL_SIZE;
+  cb->heartbeat_interval = WRITE_MQTT_DEFAULT_HEARTBEAT_INTERVAL;
+  cb->series_cache_size = WRITE_MQTT_DEFAULT_SERIES_CACHE_SIZE;
+  cb->format = wm_formats;
+  cb->compression = WM_COMPRESSION_NONE;
+  cb->compression_level = -1;
+#if WM_HAVE_MQTT5
+  cb->topic_alias_maximum = WRITE_MQTT_DEFAULT_TOPIC_ALIAS_MAXIMUM;
+#endif
 
   status = cf_util_get_string(ci, &cb->name);
   if (status != 0) {
@@ -385,15 +7402,50 @@ static int wm_config_node(oconfig_item_t *ci) /* {{{ */
     wm_callback_free(cb);
     return status;
   }
+  pthread_cond_init(&cb->flush_cond, /* attr = */ NULL);
+  pthread_cond_init(&cb->probe_cond, /* attr = */ NULL);
+  status = pthread_mutex_init(&cb->memory_lock, /* attr = */ NULL);
+  if (status != 0) {
+    wm_callback_free(cb);
+    return status;
+  }
+  pthread_cond_init(&cb->memory_cond, /* attr = */ NULL);
+  status = pthread_mutex_init(&cb->pool.lock, /* attr = */ NULL);
+  if (status != 0) {
+    wm_callback_free(cb);
+    return status;
+  }
 
-  C_COMPLAIN_INIT(&cb->complaint_cantpublish);
+  C_COMPLAIN_INIT(&cb->complaint_dropped);
+  C_COMPLAIN_INIT(&cb->complaint_spool);
 
   for (int i = 0; i < ci->children_num; i++) {
     oconfig_item_t *child = ci->children + i;
 
     if (strcasecmp("Host", child->key) == 0)
-      status = cf_util_get_string(child, &cb->host);
-    else if (strcasecmp("Port", child->key) == 0) {
+      status = wm_config_get_hosts(child, cb);
+    else if (strcasecmp("BrokerPolicy", child->key) == 0) {
+      char *policy = NULL;
+
+      status = cf_util_get_string(child, &policy);
+      if (status == 0) {
+        if (strcasecmp("Failover", policy) == 0)
+          cb->broker_policy = WM_BROKERS_FAILOVER;
+        else if (strcasecmp("Replicate", policy) == 0)
+          cb->broker_policy = WM_BROKERS_REPLICATE;
+        else {
+          ERROR("write_mqtt plugin: Unknown BrokerPolicy \"%s\".", policy);
+          status = EINVAL;
+        }
+      }
+      sfree(policy);
+    } else if (strcasecmp("ProbeInterval", child->key) == 0) {
+      status = cf_util_get_cdtime(child, &cb->probe_interval);
+      if ((status == 0) && (cb->probe_interval == 0)) {
+        ERROR("write_mqtt plugin: ProbeInterval must be positive.");
+        status = EINVAL;
+      }
+    } else if (strcasecmp("Port", child->key) == 0) {
       int port = cf_util_get_port_number(child);
       if (port < 0) {
         ERROR("write_mqtt plugin: Invalid port number.");
@@ -410,6 +7462,8 @@ static int wm_config_node(oconfig_item_t *ci) /* {{{ */
       status = cf_util_get_string(child, &cb->clientcert);
     else if (strcasecmp("Insecure", child->key) == 0)
       status = cf_util_get_boolean(child, &cb->insecure);
+    else if (strcasecmp("ProtocolVersion", child->key) == 0)
+      status = wm_config_protocol_version(child, cb);
     else if (strcasecmp("QoS", child->key) == 0) {
       int qos = -1;
       status = cf_util_get_int(child, &qos);
@@ -420,16 +7474,160 @@ static int wm_config_node(oconfig_item_t *ci) /* {{{ */
         cb->qos = qos;
     } else if (strcasecmp("Topic", child->key) == 0)
       status = cf_util_get_string(child, &cb->topic);
+    else if (strcasecmp("TopicTemplate", child->key) == 0)
+      status = wm_config_topic_template(child, cb);
+    else if (strcasecmp("TopicAliasMaximum", child->key) == 0) {
+#if WM_HAVE_MQTT5
+      status = cf_util_get_int(child, &cb->topic_alias_maximum);
+      if ((status != 0) || (cb->topic_alias_maximum < 0) ||
+          (cb->topic_alias_maximum > UINT16_MAX)) {
+        ERROR("write_mqtt plugin: Not a valid TopicAliasMaximum setting.");
+        status = EINVAL;
+      }
+#else
+      WARNING("write_mqtt plugin: TopicAliasMaximum requires libmosquitto 1.6 "
+              "or later, ignoring it.");
+#endif
+    } else if (strcasecmp("Format", child->key) == 0)
+      status = wm_config_format(child, cb);
     else if (strcasecmp("StoreRates", child->key) == 0)
       status = cf_util_get_boolean(child, &cb->store_rates);
+    else if (strcasecmp("PublishOnChange", child->key) == 0)
+      status = cf_util_get_boolean(child, &cb->publish_on_change);
+    else if (strcasecmp("AggregationInterval", child->key) == 0)
+      status = cf_util_get_cdtime(child, &cb->aggregation_interval);
+    else if (strcasecmp("AggregationFunction", child->key) == 0)
+      status = wm_config_aggregation(child, cb);
+    else if (strcasecmp("Include", child->key) == 0)
+      status = wm_config_rules(child, &cb->include);
+    else if (strcasecmp("Exclude", child->key) == 0)
+      status = wm_config_rules(child, &cb->exclude);
+    else if (strcasecmp("Priority", child->key) == 0)
+      status = wm_config_rules(child, &cb->priority);
+    else if (strcasecmp("PriorityBatchDelay", child->key) == 0) {
+      status = cf_util_get_cdtime(child, &cb->priority_batch_delay);
+      if ((status != 0) || (cb->priority_batch_delay == 0)) {
+        ERROR("write_mqtt plugin: PriorityBatchDelay must be positive.");
+        status = EINVAL;
+      }
+    } else if (strcasecmp("PriorityWeight", child->key) == 0) {
+      int priority_weight = 0;
+      status = cf_util_get_int(child, &priority_weight);
+      if ((status != 0) || (priority_weight < 1)) {
+        ERROR("write_mqtt plugin: PriorityWeight must be at least 1.");
+        status = EINVAL;
+      } else
+        cb->priority_weight = (unsigned int)priority_weight;
+    } else if (strcasecmp("SeriesCacheSize", child->key) == 0) {
+      int series_cache_size = 0;
+      status = cf_util_get_int(child, &series_cache_size);
+      if ((status != 0) || (series_cache_size < 0)) {
+        ERROR("write_mqtt plugin: Not a valid SeriesCacheSize setting.");
+        status = EINVAL;
+      } else
+        cb->series_cache_size = (size_t)series_cache_size;
+    } else if (strcasecmp("HeartbeatInterval", child->key) == 0)
+      status = cf_util_get_cdtime(child, &cb->heartbeat_interval);
+    else if (strcasecmp("Deadband", child->key) == 0) {
+      status = cf_util_get_double(child, &cb->deadband);
+      if ((status != 0) || !(cb->deadband >= 0.0)) {
+        ERROR("write_mqtt plugin: Deadband must be a non-negative number.");
+        status = EINVAL;
+      }
+    } else if (strcasecmp("CollectStatistics", child->key) == 0)
+      status = cf_util_get_boolean(child, &cb->collect_stats);
     else if (strcasecmp("BufferSize", child->key) == 0) {
-      int buffer_size = 0;
-      status = cf_util_get_int(child, &buffer_size);
-      if ((status != 0) || (buffer_size < WRITE_MQTT_MIN_MESSAGE_SIZE) || (buffer_size > WRITE_MQTT_MAX_MESSAGE_SIZE)) {
+      status = wm_config_get_size(child, &cb->send_buffer_size);
+      if ((status != 0) ||
+          (cb->send_buffer_size < WRITE_MQTT_MIN_MESSAGE_SIZE) ||
+          (cb->send_buffer_size > WRITE_MQTT_MAX_MESSAGE_SIZE)) {
         ERROR("write_mqtt plugin: Not a valid BufferSize setting.");
         status = EINVAL;
+      }
+    } else if (strcasecmp("MaxMessageSize", child->key) == 0) {
+      status = wm_config_get_size(child, &cb->max_message_size);
+      if ((status != 0) ||
+          (cb->max_message_size < WRITE_MQTT_MIN_MESSAGE_SIZE) ||
+          (cb->max_message_size > WRITE_MQTT_MAX_MESSAGE_SIZE)) {
+        ERROR("write_mqtt plugin: Not a valid MaxMessageSize setting.");
+        status = EINVAL;
+      }
+    } else if (strcasecmp("MaxBatchDelay", child->key) == 0)
+      status = cf_util_get_cdtime(child, &cb->max_batch_delay);
+    else if (strcasecmp("TargetBatchBytes", child->key) == 0)
+      status = wm_config_get_size(child, &cb->target_batch_bytes);
+    else if (strcasecmp("BatchPoolSize", child->key) == 0)
+      status = wm_config_get_size(child, &cb->pool.size);
+    else if (strcasecmp("HugePages", child->key) == 0)
+      status = cf_util_get_boolean(child, &cb->huge_pages);
+    else if (strcasecmp("SendBuffers", child->key) == 0) {
+      int buffers_num = 0;
+      status = cf_util_get_int(child, &buffers_num);
+      if ((status != 0) || (buffers_num < 2) ||
+          (buffers_num > WRITE_MQTT_MAX_SEND_BUFFERS)) {
+        ERROR("write_mqtt plugin: Not a valid SendBuffers setting.");
+        status = EINVAL;
+      } else
+        cb->buffers_num = (size_t)buffers_num;
+    } else if (strcasecmp("WriteShards", child->key) == 0) {
+      status = cf_util_get_int(child, &write_shards);
+      if ((status != 0) || (write_shards < 1) ||
+          (write_shards > WRITE_MQTT_MAX_WRITE_SHARDS)) {
+        ERROR("write_mqtt plugin: Not a valid WriteShards setting.");
+        status = EINVAL;
+      }
+    } else if (strcasecmp("Connections", child->key) == 0) {
+      status = cf_util_get_int(child, &connections);
+      if ((status != 0) || (connections < 1) ||
+          (connections > WRITE_MQTT_MAX_CONNECTIONS)) {
+        ERROR("write_mqtt plugin: Not a valid Connections setting.");
+        status = EINVAL;
+      }
+    } else if (strcasecmp("PersistentSession", child->key) == 0)
+      status = cf_util_get_boolean(child, &cb->persistent_session);
+    else if (strcasecmp("MaxInflight", child->key) == 0) {
+      status = cf_util_get_int(child, &cb->max_inflight);
+      if ((status != 0) || (cb->max_inflight < 1) ||
+          (cb->max_inflight > UINT16_MAX)) {
+        ERROR("write_mqtt plugin: Not a valid MaxInflight setting.");
+        status = EINVAL;
+      }
+    } else if (strcasecmp("ReconnectMinInterval", child->key) == 0)
+      status = cf_util_get_cdtime(child, &cb->reconnect_min_interval);
+    else if (strcasecmp("ReconnectMaxInterval", child->key) == 0)
+      status = cf_util_get_cdtime(child, &cb->reconnect_max_interval);
+    else if (strcasecmp("MaxQueuedBytes", child->key) == 0)
+      status = wm_config_get_size(child, &cb->max_queued_bytes);
+    else if (strcasecmp("MaxMemory", child->key) == 0)
+      status = wm_config_get_size(child, &cb->max_memory);
+    else if (strcasecmp("MemoryPolicy", child->key) == 0)
+      status = wm_config_memory_policy(child, cb);
+    else if (strcasecmp("MemorySampleRate", child->key) == 0) {
+      int memory_sample_rate = 0;
+      status = cf_util_get_int(child, &memory_sample_rate);
+      if ((status != 0) || (memory_sample_rate < 1)) {
+        ERROR("write_mqtt plugin: MemorySampleRate must be at least 1.");
+        status = EINVAL;
       } else
-        cb->send_buffer_size = buffer_size;
+        cb->memory_sample_rate = (unsigned int)memory_sample_rate;
+    } else if (strcasecmp("MemoryBlockTimeout", child->key) == 0)
+      status = cf_util_get_cdtime(child, &cb->memory_block_timeout);
+    else if (strcasecmp("SpoolDir", child->key) == 0)
+      status = cf_util_get_string(child, &cb->spool_dir);
+    else if (strcasecmp("MaxSpoolBytes", child->key) == 0)
+      status = wm_config_get_size(child, &cb->max_spool_bytes);
+    else if (strcasecmp("Compression", child->key) == 0)
+      status = wm_config_compression(child, cb);
+    else if (strcasecmp("CompressionLevel", child->key) == 0)
+      status = cf_util_get_int(child, &cb->compression_level);
+    else if (strcasecmp("CompressionDictionary", child->key) == 0)
+      status = cf_util_get_string(child, &dictionary);
+    else if (strcasecmp("ReplayRate", child->key) == 0) {
+      status = cf_util_get_double(child, &cb->replay_rate);
+      if ((status != 0) || !(cb->replay_rate >= 0.0)) {
+        ERROR("write_mqtt plugin: Not a valid ReplayRate setting.");
+        status = EINVAL;
+      }
     } else {
       ERROR("write_mqtt plugin: Invalid configuration "
             "option: %s.",
@@ -442,31 +7640,298 @@ static int wm_config_node(oconfig_item_t *ci) /* {{{ */
   }
 
   if (status != 0) {
+    sfree(dictionary);
     wm_callback_free(cb);
     return status;
   }
 
-  if (cb->host == NULL) {
+  if (cb->publish_on_change && (cb->series_cache_size == 0)) {
+    ERROR("write_mqtt plugin: PublishOnChange requires a SeriesCacheSize "
+          "greater than zero.");
+    wm_callback_free(cb);
+    return -1;
+  }
+  if ((cb->aggregation_interval > 0) &&
+      (cb->publish_on_change || (cb->series_cache_size == 0))) {
+    ERROR("write_mqtt plugin: AggregationInterval requires a SeriesCacheSize "
+          "greater than zero and cannot be combined with PublishOnChange.");
+    wm_callback_free(cb);
+    return -1;
+  }
+  if (cb->aggregation_functions == 0)
+    cb->aggregation_functions = 1u << WM_AGG_AVERAGE;
+  cb->json_cache = (cb->format->value_list == wm_json_value_list) &&
+                   (cb->series_cache_size > 0);
+  cb->track_series =
+      cb->publish_on_change || cb->json_cache || (cb->aggregation_interval > 0);
+
+  cb->priority_lane = (cb->priority.exact_num + cb->priority.globs_num) > 0;
+  cb->filter = cb->priority_lane ||
+               ((cb->include.exact_num + cb->include.globs_num +
+                 cb->exclude.exact_num + cb->exclude.globs_num) > 0);
+  /* The reserved buffer of the priority lane. */
+  if (cb->priority_lane)
+    cb->buffers_num++;
+  if (cb->filter) {
+    cb->filter_cache =
+        calloc(WRITE_MQTT_FILTER_CACHE_SIZE, sizeof(*cb->filter_cache));
+    if (cb->filter_cache == NULL) {
+      ERROR("write_mqtt plugin: calloc failed.");
+      wm_callback_free(cb);
+      return -1;
+    }
+  }
+
+  /* The codecs' own defaults. */
+  if (cb->compression_level < 0) {
+    if (cb->compression == WM_COMPRESSION_GZIP)
+      cb->compression_level = 6;
+    else if (cb->compression == WM_COMPRESSION_ZSTD)
+      cb->compression_level = 3;
+    else
+      cb->compression_level = 0;
+  }
+  if (((cb->compression == WM_COMPRESSION_GZIP) &&
+       (cb->compression_level > 9)) ||
+      ((cb->compression == WM_COMPRESSION_LZ4) &&
+       (cb->compression_level > 12)) ||
+      ((cb->compression == WM_COMPRESSION_ZSTD) &&
+       (cb->compression_level > 22))) {
+    ERROR("write_mqtt plugin: CompressionLevel %d is out of range for %s.",
+          cb->compression_level, wm_compression_name(cb->compression));
+    wm_callback_free(cb);
+    return -1;
+  }
+
+  if (dictionary != NULL) {
+#if HAVE_ZSTD_H
+    if (cb->compression == WM_COMPRESSION_ZSTD)
+      status = wm_load_dictionary(cb, dictionary);
+    else
+#endif
+    {
+      ERROR("write_mqtt plugin: CompressionDictionary requires "
+            "Compression \"zstd\".");
+      status = -1;
+    }
+    sfree(dictionary);
+    if (status != 0) {
+      wm_callback_free(cb);
+      return -1;
+    }
+  }
+
+#if WM_HAVE_MQTT5
+  /* Describe the payload so that consumers know how to decode it. */
+  if (cb->protocol_version == MQTT_PROTOCOL_V5) {
+    status = mosquitto_property_add_string(
+        &cb->publish_props, MQTT_PROP_CONTENT_TYPE, cb->format->content_type);
+    if ((status == MOSQ_ERR_SUCCESS) &&
+        (cb->compression != WM_COMPRESSION_NONE))
+      status = mosquitto_property_add_string_pair(
+          &cb->publish_props, MQTT_PROP_USER_PROPERTY, "content-encoding",
+          wm_compression_name(cb->compression));
+    if (status != MOSQ_ERR_SUCCESS) {
+      ERROR("write_mqtt plugin: adding MQTT properties failed: %s",
+            mosquitto_strerror(status));
+      wm_callback_free(cb);
+      return -1;
+    }
+  }
+
+  /* With QoS 1, libmosquitto resends unacknowledged messages after
+   * reconnecting, when the broker no longer knows the aliases they use. */
+  if ((cb->protocol_version != MQTT_PROTOCOL_V5) || (cb->qos != 0))
+    cb->topic_alias_maximum = 0;
+
+  if (cb->topic_alias_maximum > 0) {
+    cb->alias_props =
+        calloc((size_t)cb->topic_alias_maximum, sizeof(*cb->alias_props));
+    if (cb->alias_props == NULL) {
+      ERROR("write_mqtt plugin: calloc failed.");
+      wm_callback_free(cb);
+      return -1;
+    }
+
+    for (int i = 0; i < cb->topic_alias_maximum; i++) {
+      status =
+          mosquitto_property_copy_all(&cb->alias_props[i], cb->publish_props);
+      if (status == MOSQ_ERR_SUCCESS)
+        status = mosquitto_property_add_int16(
+            &cb->alias_props[i], MQTT_PROP_TOPIC_ALIAS, (uint16_t)(i + 1));
+      if (status != MOSQ_ERR_SUCCESS) {
+        ERROR("write_mqtt plugin: adding MQTT properties failed: %s",
+              mosquitto_strerror(status));
+        wm_callback_free(cb);
+        return -1;
+      }
+    }
+  }
+#endif
+
+  if (cb->hosts_num == 0) {
     ERROR("write_mqtt plugin: no Host defined for instance '%s'", cb->name);
     wm_callback_free(cb);
     return -1;
   }
 
-  /* Allocate the buffer. */
-  cb->send_buffer = malloc(cb->send_buffer_size);
-  if (cb->send_buffer == NULL) {
-    ERROR("write_mqtt plugin: malloc(%" PRIsz ") failed.",
-          cb->send_buffer_size);
+  if ((cb->reconnect_min_interval == 0) ||
+      (cb->reconnect_max_interval < cb->reconnect_min_interval)) {
+    ERROR("write_mqtt plugin: ReconnectMinInterval must be positive and must "
+          "not exceed ReconnectMaxInterval for instance '%s'",
+          cb->name);
+    wm_callback_free(cb);
+    return -1;
+  }
+
+  if ((cb->spool_dir != NULL) &&
+      (cb->max_spool_bytes <= sizeof(wm_spool_header_t))) {
+    ERROR("write_mqtt plugin: MaxSpoolBytes is too small for instance '%s'",
+          cb->name);
+    wm_callback_free(cb);
+    return -1;
+  }
+
+  /* With "Replicate", "Connections" is per broker. */
+  cb->group_size = (size_t)connections;
+  cb->groups_num =
+      (cb->broker_policy == WM_BROKERS_REPLICATE) ? cb->hosts_num : 1;
+  cb->conns = calloc(cb->groups_num * cb->group_size, sizeof(*cb->conns));
+  if (cb->conns == NULL) {
+    ERROR("write_mqtt plugin: calloc failed.");
+    wm_callback_free(cb);
+    return -1;
+  }
+  while (cb->conns_num < cb->groups_num * cb->group_size) {
+    if (wm_conn_create(cb) != 0) {
+      ERROR("write_mqtt plugin: setting up connection %" PRIsz " failed.",
+            cb->conns_num);
+      wm_callback_free(cb);
+      return -1;
+    }
+  }
+
+  cb->writer_stats = aligned_alloc(WM_CACHE_LINE, WM_WRITER_SLOTS *
+                                                     sizeof(*cb->writer_stats));
+  if (cb->writer_stats == NULL) {
+    ERROR("write_mqtt plugin: aligned_alloc failed.");
+    wm_callback_free(cb);
+    return -1;
+  }
+  memset(cb->writer_stats, 0, WM_WRITER_SLOTS * sizeof(*cb->writer_stats));
+
+  cb->shards = calloc((size_t)write_shards, sizeof(*cb->shards));
+  if (cb->shards == NULL) {
+    ERROR("write_mqtt plugin: calloc failed.");
+    wm_callback_free(cb);
+    return -1;
+  }
+  while (cb->shards_num < (size_t)write_shards) {
+    wm_shard_t *shard = cb->shards + cb->shards_num;
+
+    status = pthread_mutex_init(&shard->lock, /* attr = */ NULL);
+    if (status != 0) {
+      wm_callback_free(cb);
+      return status;
+    }
+    pthread_cond_init(&shard->cond, /* attr = */ NULL);
+    shard->default_topic.name = cb->topic;
+    shard->priority_topic.name = cb->topic;
+    shard->priority_topic.lane = WM_LANE_PRIORITY;
+    cb->shards_num++;
+  }
+
+  /* Allocate the buffers. */
+  cb->buffers = calloc(cb->shards_num * cb->buffers_num, sizeof(*cb->buffers));
+  if (cb->buffers == NULL) {
+    ERROR("write_mqtt plugin: calloc failed.");
+    wm_callback_free(cb);
+    return -1;
+  }
+
+  /* All buffers share one reservation of address space; pages are only
+   * backed by memory once a buffer grows into them. */
+  long pagesize = sysconf(_SC_PAGESIZE);
+  size_t stride = cb->send_buffer_size;
+  if (pagesize > 0)
+    stride = ((stride + (size_t)pagesize - 1) / (size_t)pagesize) *
+             (size_t)pagesize;
+
+  cb->arena_size = cb->shards_num * cb->buffers_num * stride;
+  cb->arena = mmap(NULL, cb->arena_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (cb->arena == MAP_FAILED) {
+    char errbuf[1024];
+    ERROR("write_mqtt plugin: mmap(%" PRIsz ") failed: %s", cb->arena_size,
+          sstrerror(errno, errbuf, sizeof(errbuf)));
+    cb->arena = NULL;
     wm_callback_free(cb);
     return -1;
   }
+  if (cb->huge_pages)
+    wm_advise_huge_pages(cb->arena, cb->arena_size);
+
+  if (cb->pool.size > 0) {
+    cb->pool.base = mmap(NULL, cb->pool.size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (cb->pool.base == MAP_FAILED) {
+      char errbuf[1024];
+      ERROR("write_mqtt plugin: mmap(%" PRIsz ") failed: %s", cb->pool.size,
+            sstrerror(errno, errbuf, sizeof(errbuf)));
+      cb->pool.base = NULL;
+      wm_callback_free(cb);
+      return -1;
+    }
+    if (cb->huge_pages)
+      wm_advise_huge_pages(cb->pool.base, cb->pool.size);
+  }
+
+  for (size_t i = 0; i < cb->shards_num * cb->buffers_num; i++) {
+    wm_buffer_t *buf = cb->buffers + i;
+
+    buf->shard = cb->shards + (i / cb->buffers_num);
+    buf->reserved =
+        cb->priority_lane && ((i % cb->buffers_num) == (cb->buffers_num - 1));
+    buf->data = cb->arena + i * stride;
+    buf->capacity = cb->send_buffer_size;
+    buf->size = WRITE_MQTT_INITIAL_BUFFER_SIZE;
+    if (buf->size > buf->capacity)
+      buf->size = buf->capacity;
+
+    wm_memory_add(cb, buf->size);
+
+    wm_reset_buffer(buf);
+    wm_release_buffer_nolock(buf);
+  }
 
-  /* Nulls the buffer and sets ..._free and ..._fill. */
-  wm_reset_buffer(cb);
+  if (cb->max_memory > 0) {
+    cb->memory_high = cb->max_memory - cb->max_memory / 8;
+    if (cb->filter)
+      wm_memory_add(cb,
+                    WRITE_MQTT_FILTER_CACHE_SIZE * sizeof(*cb->filter_cache));
+    if (cb->memory_policy == WM_MEMORY_SAMPLE) {
+      cb->memory_samples = calloc(WRITE_MQTT_MEMORY_SAMPLE_SLOTS,
+                                  sizeof(*cb->memory_samples));
+      if (cb->memory_samples == NULL) {
+        ERROR("write_mqtt plugin: calloc failed.");
+        wm_callback_free(cb);
+        return -1;
+      }
+      wm_memory_add(cb, WRITE_MQTT_MEMORY_SAMPLE_SLOTS *
+                            sizeof(*cb->memory_samples));
+    }
+    if (cb->memory >= cb->memory_high) {
+      ERROR("write_mqtt plugin: MaxMemory is too small for the send buffers "
+            "of instance '%s'",
+            cb->name);
+      wm_callback_free(cb);
+      return -1;
+    }
+  }
 
   snprintf(callback_name, sizeof(callback_name), "write_mqtt/%s", cb->name);
   DEBUG("write_mqtt: Registering write callback '%s' with Host '%s'",
-        callback_name, cb->host);
+        callback_name, cb->hosts[0]);
 
   plugin_register_write(callback_name, wm_write, &(user_data_t){
                                                      .data = cb,
@@ -475,6 +7940,12 @@ static int wm_config_node(oconfig_item_t *ci) /* {{{ */
   plugin_register_flush(callback_name, wm_flush, &(user_data_t){
                                                      .data = cb,
                                                  });
+  if (cb->collect_stats)
+    plugin_register_complex_read(/* group = */ "write_mqtt", callback_name,
+                                 wm_read, /* interval = */ 0,
+                                 &(user_data_t){
+                                     .data = cb,
+                                 });
 
   return 0;
 } /* }}} int wm_config_node */
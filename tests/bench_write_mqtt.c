@@ -0,0 +1,492 @@
+/**
+ * Benchmarks of the write path against the loopback broker, see
+ * tests/Makefile and the "Testing" section of README.md.
+ *
+ *   bench_write_mqtt [write] [-t threads] [-n values] [-s series] [-q qos]
+ *                    [-c connections] [-f format] [-z compression]
+ *   bench_write_mqtt gauge [-n values]
+ *   bench_write_mqtt escape [-n values]
+ *   bench_write_mqtt flush [-r rounds] [-s series] [-f format]
+ *                    [-z compression]
+ *
+ * "write" has "threads" write threads hand "values" value lists each, of
+ * "series" series per thread, to one node and reports values per second,
+ * the median and 99th percentile time per write callback, the time spent
+ * waiting for contended locks, Bytes per message and CPU time per million
+ * value lists.
+ *
+ * "gauge" prints "values" gauges, measured values with a few digits and
+ * random doubles, with the plugin's encoder and with format_json's
+ * GAUGE_FORMAT, and reports the time per gauge of each, how many printed
+ * the same bytes and how many parse back to the gauge.
+ *
+ * "escape" escapes "values" names of the lengths found in identifiers, with
+ * a special character in one of eight, with the vectorized and the scalar
+ * escaper and reports the time per name of each.
+ *
+ * "flush" fills the send buffer of one topic to an eighth, a quarter, ...
+ * and all of BufferSize with value lists of "series" series, flushes it
+ * "rounds" times per level and reports the median time of the flush
+ * callback and until the broker received the message.
+ **/
+
+#include "harness.h"
+
+#include <getopt.h>
+#include <sys/resource.h>
+
+typedef struct {
+  int threads;
+  int values;
+  int series;
+  int qos;
+  int connections;
+  int rounds;
+  char const *format;
+  char const *compression;
+} bench_options_t;
+
+typedef struct {
+  wm_callback_t *cb;
+  bench_options_t const *options;
+  int id;
+  /* Nanoseconds per wm_write() call. */
+  uint32_t *latency;
+  pthread_barrier_t *start;
+} bench_writer_t;
+
+static uint64_t bench_now_ns(clockid_t clock) /* {{{ */
+{
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+} /* }}} uint64_t bench_now_ns */
+
+static int bench_compare_u32(void const *a, void const *b) /* {{{ */
+{
+  uint32_t x = *(uint32_t const *)a;
+  uint32_t y = *(uint32_t const *)b;
+
+  return (x > y) - (x < y);
+} /* }}} int bench_compare_u32 */
+
+static void *bench_writer(void *arg) /* {{{ */
+{
+  bench_writer_t *w = arg;
+  value_t values[2];
+  value_list_t vl;
+
+  pthread_barrier_wait(w->start);
+  for (int i = 0; i < w->options->values; i++) {
+    h_value_list(&vl, values, w->id * w->options->series + i % w->options->series,
+                 i);
+
+    uint64_t start = bench_now_ns(CLOCK_MONOTONIC);
+    CHECK(h_write(w->cb, &h_if_octets, &vl) == 0);
+    uint64_t elapsed = bench_now_ns(CLOCK_MONOTONIC) - start;
+
+    w->latency[i] = (elapsed > UINT32_MAX) ? UINT32_MAX : (uint32_t)elapsed;
+  }
+
+  return NULL;
+} /* }}} void *bench_writer */
+
+/* Sums the node's statistics like wm_read() does. */
+static void bench_stats(wm_callback_t *cb, wm_stats_t *total) /* {{{ */
+{
+  *total = (wm_stats_t){0};
+  for (size_t i = 0; i < cb->shards_num; i++)
+    wm_stats_sum(total, &cb->shards[i].stats);
+  wm_writer_stats_sum(total, cb);
+  for (size_t i = 0; i < cb->conns_num; i++)
+    wm_stats_sum(total, &cb->conns[i].stats);
+  pthread_mutex_lock(&cb->send_lock);
+  wm_stats_sum(total, &cb->stats);
+  pthread_mutex_unlock(&cb->send_lock);
+} /* }}} void bench_stats */
+
+static int bench_write(bench_options_t const *o) /* {{{ */
+{
+  size_t total_values = (size_t)o->threads * (size_t)o->values;
+  bench_writer_t writers[o->threads];
+  pthread_t threads[o->threads];
+  pthread_barrier_t start;
+  uint32_t *latency;
+  wm_stats_t stats;
+  wm_callback_t *cb;
+
+  h_config_string("Host", "localhost");
+  h_config_number("QoS", o->qos);
+  h_config_number("Connections", o->connections);
+  if (o->format != NULL)
+    h_config_string("Format", o->format);
+  if (o->compression != NULL)
+    h_config_string("Compression", o->compression);
+  cb = h_configure("bench");
+  CHECK(cb != NULL);
+
+  latency = calloc(total_values, sizeof(*latency));
+  CHECK(latency != NULL);
+  pthread_barrier_init(&start, NULL, (unsigned)o->threads + 1);
+
+  for (int i = 0; i < o->threads; i++) {
+    writers[i] = (bench_writer_t){
+        .cb = cb,
+        .options = o,
+        .id = i,
+        .latency = latency + (size_t)i * (size_t)o->values,
+        .start = &start,
+    };
+    CHECK(pthread_create(threads + i, NULL, bench_writer, writers + i) == 0);
+  }
+
+  uint64_t cpu_start = bench_now_ns(CLOCK_PROCESS_CPUTIME_ID);
+  uint64_t wall_start = bench_now_ns(CLOCK_MONOTONIC);
+  pthread_barrier_wait(&start);
+  for (int i = 0; i < o->threads; i++)
+    pthread_join(threads[i], NULL);
+  uint64_t write_end = bench_now_ns(CLOCK_MONOTONIC);
+
+  /* Publishing what is still buffered is part of the cost. */
+  CHECK(h_flush(cb, 0) == 0);
+  h_settle(TIME_T_TO_CDTIME_T(10));
+  uint64_t cpu = bench_now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+  bench_stats(cb, &stats);
+
+  qsort(latency, total_values, sizeof(*latency), bench_compare_u32);
+
+  printf("threads %d, series %d, QoS %d, connections %d, format %s, "
+         "compression %s\n",
+         o->threads, o->threads * o->series, o->qos, o->connections,
+         (o->format != NULL) ? o->format : "JSON",
+         (o->compression != NULL) ? o->compression : "none");
+  printf("  values/s          %12.0f\n",
+         (double)total_values * 1e9 / (double)(write_end - wall_start));
+  printf("  write p50         %12.0f ns\n",
+         (double)latency[total_values / 2]);
+  printf("  write p99         %12.0f ns\n",
+         (double)latency[(total_values * 99) / 100]);
+  printf("  lock wait         %12.3f ms\n", (double)stats.lock_wait / 1e3);
+  printf("  messages          %12" PRIu64 "\n", stub_published);
+  printf("  bytes/message     %12.0f\n",
+         (stub_published > 0)
+             ? (double)stub_published_bytes / (double)stub_published
+             : 0.0);
+  printf("  CPU/1M values     %12.3f s\n",
+         ((double)cpu / 1e9) * (1e6 / (double)total_values));
+
+  CHECK(stats.values_written == total_values);
+
+  pthread_barrier_destroy(&start);
+  free(latency);
+  h_free(cb);
+  return 0;
+} /* }}} int bench_write */
+
+/* Gauges of "kind" 0 look like measurements, 1 are random doubles. */
+static void bench_gauges(gauge_t *gauges, int num, int kind) /* {{{ */
+{
+  uint64_t state = UINT64_C(0x9e3779b97f4a7c15);
+
+  for (int i = 0; i < num; i++) {
+    uint64_t bits;
+
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    bits = state;
+    if (kind == 0)
+      gauges[i] = (double)(bits % 100000000) / 1000.0;
+    else {
+      /* Finite doubles of any exponent. */
+      bits &= ~(UINT64_C(1) << 62);
+      memcpy(gauges + i, &bits, sizeof(bits));
+    }
+  }
+} /* }}} void bench_gauges */
+
+static int bench_gauge(bench_options_t const *o) /* {{{ */
+{
+  static char const *const kinds[] = {"measured", "random"};
+  size_t size = (size_t)o->values * 32;
+  gauge_t *gauges = calloc((size_t)o->values, sizeof(*gauges));
+  char *ours = malloc(size);
+  char *theirs = malloc(size);
+
+  CHECK((gauges != NULL) && (ours != NULL) && (theirs != NULL));
+
+  for (int kind = 0; kind < 2; kind++) {
+    wm_writer_t w = {.data = ours, .size = size};
+    size_t pos = 0;
+    int same = 0;
+    int ours_exact = 0;
+    int theirs_exact = 0;
+
+    bench_gauges(gauges, o->values, kind);
+
+    uint64_t start = bench_now_ns(CLOCK_MONOTONIC);
+    for (int i = 0; i < o->values; i++) {
+      wm_json_put_gauge(&w, gauges[i]);
+      wm_put_u8(&w, 0);
+    }
+    uint64_t ours_ns = bench_now_ns(CLOCK_MONOTONIC) - start;
+    CHECK(!w.overflow);
+
+    start = bench_now_ns(CLOCK_MONOTONIC);
+    for (int i = 0; i < o->values; i++)
+      pos += (size_t)snprintf(theirs + pos, size - pos, GAUGE_FORMAT,
+                              gauges[i]) +
+             1;
+    uint64_t theirs_ns = bench_now_ns(CLOCK_MONOTONIC) - start;
+
+    char const *a = ours;
+    char const *b = theirs;
+    for (int i = 0; i < o->values; i++) {
+      same += (strcmp(a, b) == 0);
+      ours_exact += (strtod(a, NULL) == gauges[i]);
+      theirs_exact += (strtod(b, NULL) == gauges[i]);
+      a += strlen(a) + 1;
+      b += strlen(b) + 1;
+    }
+
+    printf("%s gauges, %d values\n", kinds[kind], o->values);
+    printf("  encoder           %12.1f ns/value\n",
+           (double)ours_ns / o->values);
+    printf("  \"%s\"           %12.1f ns/value\n", GAUGE_FORMAT,
+           (double)theirs_ns / o->values);
+    printf("  same bytes        %12.2f %%\n", 100.0 * same / o->values);
+    printf("  round-trip        %12.2f %% (\"%s\": %.2f %%)\n",
+           100.0 * ours_exact / o->values, GAUGE_FORMAT,
+           100.0 * theirs_exact / o->values);
+    CHECK(ours_exact == o->values);
+  }
+
+  free(gauges);
+  free(ours);
+  free(theirs);
+  return 0;
+} /* }}} int bench_gauge */
+
+static int bench_escape(bench_options_t const *o) /* {{{ */
+{
+  static char const *const names[] = {
+      "localhost",
+      "interface",
+      "if_octets",
+      "web-frontend-07.example.org",
+      "docker-3f2a8c91d0e4b5a6c7d8e9f0a1b2c3d4",
+      "kube-pods-burstable-pod1234abcd-5678-90ef-ghij-klmnopqrstuv",
+      "rx",
+      "path\\with\"quotes\"",
+  };
+  size_t size = (size_t)o->values * 2 * (DATA_MAX_NAME_LEN + 2);
+  char *vector = malloc(size);
+  char *scalar = malloc(size);
+  wm_writer_t v = {.data = vector, .size = size};
+  wm_writer_t w = {.data = scalar, .size = size};
+  size_t bytes = 0;
+
+  CHECK((vector != NULL) && (scalar != NULL));
+
+  uint64_t start = bench_now_ns(CLOCK_MONOTONIC);
+  for (int i = 0; i < o->values; i++)
+    wm_json_put_string(&v, names[i % STATIC_ARRAY_SIZE(names)]);
+  uint64_t vector_ns = bench_now_ns(CLOCK_MONOTONIC) - start;
+
+  start = bench_now_ns(CLOCK_MONOTONIC);
+  for (int i = 0; i < o->values; i++) {
+    char const *name = names[i % STATIC_ARRAY_SIZE(names)];
+    wm_json_put_string_scalar(&w, name, strlen(name));
+  }
+  uint64_t scalar_ns = bench_now_ns(CLOCK_MONOTONIC) - start;
+
+  for (int i = 0; i < o->values; i++)
+    bytes += strlen(names[i % STATIC_ARRAY_SIZE(names)]);
+
+  CHECK(!v.overflow && !w.overflow);
+  CHECK((v.pos == w.pos) && (memcmp(vector, scalar, v.pos) == 0));
+
+  printf("escape, %d names, %.1f Bytes each\n", o->values,
+         (double)bytes / o->values);
+  printf("  vector            %12.1f ns/name\n",
+         (double)vector_ns / o->values);
+  printf("  scalar            %12.1f ns/name\n",
+         (double)scalar_ns / o->values);
+
+  free(vector);
+  free(scalar);
+  return 0;
+} /* }}} int bench_escape */
+
+/* The fill level of the buffer the single topic is batched in. */
+static size_t bench_fill(wm_callback_t *cb) /* {{{ */
+{
+  wm_shard_t *shard = cb->shards;
+  wm_topic_t *topic;
+  size_t fill = 0;
+
+  pthread_mutex_lock(&shard->lock);
+  topic = shard->active_head[WM_LANE_BULK];
+  if ((topic != NULL) && (topic->send_buffer != NULL))
+    fill = topic->send_buffer->fill;
+  pthread_mutex_unlock(&shard->lock);
+  return fill;
+} /* }}} size_t bench_fill */
+
+static int bench_flush(bench_options_t const *o) /* {{{ */
+{
+  uint32_t *flush_ns = calloc((size_t)o->rounds, sizeof(*flush_ns));
+  uint32_t *publish_ns = calloc((size_t)o->rounds, sizeof(*publish_ns));
+  wm_callback_t *cb;
+  int written = 0;
+
+  CHECK((flush_ns != NULL) && (publish_ns != NULL));
+
+  h_config_string("Host", "localhost");
+  h_config_string("TopicTemplate", "collectd/%{host}/%{plugin}");
+  if (o->format != NULL)
+    h_config_string("Format", o->format);
+  if (o->compression != NULL)
+    h_config_string("Compression", o->compression);
+  cb = h_configure("bench");
+  CHECK(cb != NULL);
+
+  printf("flush, BufferSize %" PRIsz ", series %d, format %s, "
+         "compression %s\n",
+         cb->send_buffer_size, o->series,
+         (o->format != NULL) ? o->format : "JSON",
+         (o->compression != NULL) ? o->compression : "none");
+  printf("  %-7s %10s %14s %14s\n", "fill", "Bytes", "flush p50",
+         "publish p50");
+
+  for (int eighths = 1; eighths <= 8; eighths++) {
+    size_t target = cb->send_buffer_size * (size_t)eighths / 8;
+    size_t fill_sum = 0;
+
+    for (int r = 0; r < o->rounds; r++) {
+      size_t fill = 0;
+      size_t step = 0;
+      value_t values[2];
+      value_list_t vl;
+
+      /* Stops before the value list that would not fit, which would flush
+       * the buffer on its own. */
+      while ((fill + 2 * step) < target) {
+        size_t before = fill;
+
+        h_value_list(&vl, values, written % o->series, written);
+        CHECK(h_write(cb, &h_if_octets, &vl) == 0);
+        written++;
+        fill = bench_fill(cb);
+        CHECK(fill > before);
+        step = fill - before;
+      }
+      fill_sum += fill;
+
+      uint64_t published = __atomic_load_n(&stub_published, __ATOMIC_ACQUIRE);
+      uint64_t start = bench_now_ns(CLOCK_MONOTONIC);
+      CHECK(h_flush(cb, 0) == 0);
+      uint64_t flushed = bench_now_ns(CLOCK_MONOTONIC);
+      while (__atomic_load_n(&stub_published, __ATOMIC_ACQUIRE) == published)
+        ;
+      uint64_t received = bench_now_ns(CLOCK_MONOTONIC);
+
+      flush_ns[r] = (uint32_t)(flushed - start);
+      publish_ns[r] = (uint32_t)(received - start);
+    }
+
+    qsort(flush_ns, (size_t)o->rounds, sizeof(*flush_ns), bench_compare_u32);
+    qsort(publish_ns, (size_t)o->rounds, sizeof(*publish_ns),
+          bench_compare_u32);
+    printf("  %d/8     %10.0f %11.0f ns %11.0f ns\n", eighths,
+           (double)fill_sum / o->rounds, (double)flush_ns[o->rounds / 2],
+           (double)publish_ns[o->rounds / 2]);
+  }
+
+  h_settle(TIME_T_TO_CDTIME_T(10));
+  CHECK(stub_published == (uint64_t)(8 * o->rounds));
+
+  free(flush_ns);
+  free(publish_ns);
+  h_free(cb);
+  return 0;
+} /* }}} int bench_flush */
+
+static void bench_usage(char const *name) /* {{{ */
+{
+  fprintf(stderr,
+          "Usage: %s [write] [-t threads] [-n values] [-s series] [-q qos]\n"
+          "       [-c connections] [-f format] [-z compression]\n"
+          "       %s gauge [-n values]\n"
+          "       %s escape [-n values]\n"
+          "       %s flush [-r rounds] [-s series] [-f format]\n"
+          "       [-z compression]\n",
+          name, name, name, name);
+  exit(EXIT_FAILURE);
+} /* }}} void bench_usage */
+
+int main(int argc, char **argv) /* {{{ */
+{
+  bench_options_t o = {
+      .threads = 4,
+      .values = 250000,
+      .series = 100,
+      .qos = 0,
+      .connections = 1,
+      .rounds = 200,
+  };
+  char const *mode = "write";
+  int opt;
+
+  if ((argc > 1) && (argv[1][0] != '-')) {
+    mode = argv[1];
+    argc--;
+    argv++;
+  }
+
+  while ((opt = getopt(argc, argv, "t:n:s:q:c:r:f:z:")) != -1) {
+    switch (opt) {
+    case 't':
+      o.threads = atoi(optarg);
+      break;
+    case 'n':
+      o.values = atoi(optarg);
+      break;
+    case 's':
+      o.series = atoi(optarg);
+      break;
+    case 'q':
+      o.qos = atoi(optarg);
+      break;
+    case 'c':
+      o.connections = atoi(optarg);
+      break;
+    case 'r':
+      o.rounds = atoi(optarg);
+      break;
+    case 'f':
+      o.format = optarg;
+      break;
+    case 'z':
+      o.compression = optarg;
+      break;
+    default:
+      bench_usage(argv[0]);
+    }
+  }
+  if ((o.threads < 1) || (o.values < 1) || (o.series < 1) ||
+      (o.rounds < 1))
+    bench_usage(argv[0]);
+
+  if (strcmp("write", mode) == 0)
+    return bench_write(&o);
+  if (strcmp("gauge", mode) == 0)
+    return bench_gauge(&o);
+  if (strcmp("escape", mode) == 0)
+    return bench_escape(&o);
+  if (strcmp("flush", mode) == 0)
+    return bench_flush(&o);
+  bench_usage(argv[0]);
+  return EXIT_FAILURE;
+} /* }}} int main */
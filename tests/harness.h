@@ -0,0 +1,156 @@
+/**
+ * Shared by the tests and the benchmark: builds the plugin into the test
+ * program, so its static functions and data are reachable, and drives it the
+ * way the daemon would.
+ **/
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include "../src/write_mqtt.c"
+
+#include "stub.h"
+
+#define CHECK(expr)                                                            \
+  do {                                                                         \
+    if (!(expr)) {                                                             \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+      exit(EXIT_FAILURE);                                                      \
+    }                                                                          \
+  } while (0)
+
+/*
+ * <Node> configuration, built with the h_config_*() functions and applied by
+ * h_configure().
+ */
+#define H_CONFIG_MAX 64
+static oconfig_item_t h_config_items[H_CONFIG_MAX];
+static oconfig_value_t h_config_values[H_CONFIG_MAX];
+static int h_config_num;
+
+static oconfig_item_t *h_config_add(const char *key) /* {{{ */
+{
+  CHECK(h_config_num < H_CONFIG_MAX);
+
+  oconfig_item_t *ci = h_config_items + h_config_num;
+  *ci = (oconfig_item_t){.key = (char *)key,
+                         .values = h_config_values + h_config_num,
+                         .values_num = 1};
+  h_config_num++;
+  return ci;
+} /* }}} oconfig_item_t *h_config_add */
+
+static void h_config_string(const char *key, const char *value) /* {{{ */
+{
+  oconfig_item_t *ci = h_config_add(key);
+  ci->values[0].type = OCONFIG_TYPE_STRING;
+  ci->values[0].value.string = (char *)value;
+} /* }}} void h_config_string */
+
+static void h_config_number(const char *key, double value) /* {{{ */
+{
+  oconfig_item_t *ci = h_config_add(key);
+  ci->values[0].type = OCONFIG_TYPE_NUMBER;
+  ci->values[0].value.number = value;
+} /* }}} void h_config_number */
+
+static void h_config_boolean(const char *key, bool value) /* {{{ */
+{
+  oconfig_item_t *ci = h_config_add(key);
+  ci->values[0].type = OCONFIG_TYPE_BOOLEAN;
+  ci->values[0].value.boolean = value;
+} /* }}} void h_config_boolean */
+
+/* Configures a <Node> from the items added so far and returns the plugin's
+ * instance, i.e. the user data of its write callback. Unless the broker is
+ * down, waits for the connections to come up, which the plugin starts on
+ * first use. */
+static wm_callback_t *h_configure(const char *name) /* {{{ */
+{
+  oconfig_value_t name_value = {.value.string = (char *)name,
+                                .type = OCONFIG_TYPE_STRING};
+  oconfig_item_t node = {.key = "Node",
+                         .values = &name_value,
+                         .values_num = 1,
+                         .children = h_config_items,
+                         .children_num = h_config_num};
+  int writes_num = stub_writes_num;
+
+  if (stub_config_cb == NULL)
+    module_register();
+
+  h_config_num = 0;
+  if (wm_config_node(&node) != 0)
+    return NULL;
+  CHECK(stub_writes_num == writes_num + 1);
+  wm_callback_t *cb = stub_writes[writes_num].user_data.data;
+
+  CHECK(wm_callback_init(cb) == 0);
+  for (cdtime_t end = cdtime() + TIME_T_TO_CDTIME_T(5);
+       !stub_broker_down && (cdtime() < end);) {
+    size_t connected = 0;
+    for (size_t i = 0; i < cb->conns_num; i++)
+      connected += __atomic_load_n(&cb->conns[i].connected, __ATOMIC_ACQUIRE);
+    if (connected == cb->conns_num)
+      break;
+    usleep(1000);
+  }
+  return cb;
+} /* }}} wm_callback_t *h_configure */
+
+static int h_write(wm_callback_t *cb, const data_set_t *ds, /* {{{ */
+                   const value_list_t *vl) {
+  user_data_t ud = {.data = cb};
+  return wm_write(ds, vl, &ud);
+} /* }}} int h_write */
+
+static int h_flush(wm_callback_t *cb, cdtime_t timeout) /* {{{ */
+{
+  user_data_t ud = {.data = cb};
+  return wm_flush(timeout, /* identifier = */ NULL, &ud);
+} /* }}} int h_flush */
+
+static void h_free(wm_callback_t *cb) /* {{{ */
+{
+  wm_callback_free(cb);
+} /* }}} void h_free */
+
+/* The "if_octets" data set and a value list of it, plugin instance numbered. */
+static data_source_t h_if_octets_sources[] __attribute__((unused)) = {
+    {"rx", DS_TYPE_DERIVE, 0, NAN},
+    {"tx", DS_TYPE_DERIVE, 0, NAN},
+};
+static data_set_t h_if_octets __attribute__((unused)) = {"if_octets", 2, h_if_octets_sources};
+
+static void h_value_list(value_list_t *vl, value_t values[2], /* {{{ */
+                         int instance, derive_t value) {
+  *vl = (value_list_t)VALUE_LIST_INIT;
+  values[0].derive = value;
+  values[1].derive = 2 * value;
+  vl->values = values;
+  vl->values_len = 2;
+  vl->time = cdtime();
+  vl->interval = TIME_T_TO_CDTIME_T(10);
+  sstrncpy(vl->host, "example.org", sizeof(vl->host));
+  sstrncpy(vl->plugin, "interface", sizeof(vl->plugin));
+  snprintf(vl->plugin_instance, sizeof(vl->plugin_instance), "eth%d",
+           instance);
+  sstrncpy(vl->type, "if_octets", sizeof(vl->type));
+} /* }}} void h_value_list */
+
+/* Waits for the publish threads: until nothing is queued or in flight and no
+ * message went out for a while, or the timeout passed. */
+static void h_settle(cdtime_t timeout) /* {{{ */
+{
+  cdtime_t end = cdtime() + timeout;
+  uint64_t published = 0;
+  int quiet = 0;
+
+  while ((cdtime() < end) && (quiet < 5)) {
+    uint64_t now = __atomic_load_n(&stub_published, __ATOMIC_RELAXED);
+    quiet = (now == published) ? quiet + 1 : 0;
+    published = now;
+    usleep(20000);
+  }
+} /* }}} void h_settle */
+
+#endif /* HARNESS_H */
@@ -0,0 +1,40 @@
+/* The parts of collectd's "collectd.h" the plugin uses, for building it
+ * outside of the collectd tree. See tests/Makefile. */
+#ifndef COLLECTD_H
+#define COLLECTD_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#define KERNEL_LINUX 1
+#endif
+
+#define PRIsz "zu"
+#define STATIC_ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
+
+#ifndef GAUGE_FORMAT
+#define GAUGE_FORMAT "%.15g"
+#endif
+
+#endif /* COLLECTD_H */
@@ -0,0 +1,560 @@
+/**
+ * The collectd daemon functions the plugin calls, for building it outside of
+ * the collectd tree. format_json_*() behave like collectd's
+ * src/utils/format_json/format_json.c for value lists without metadata, so
+ * the tests can compare the plugin's own JSON encoder against them.
+ **/
+
+#include "collectd.h"
+
+#include "plugin.h"
+#include "utils_cache.h"
+#include "utils_complain.h"
+#include "utils_random.h"
+#include "utils/common/common.h"
+#include "utils/format_json/format_json.h"
+
+#include "stub.h"
+
+#include <endian.h>
+#include <stdarg.h>
+
+char *hostname_g = "localhost";
+int stub_log_level = LOG_WARNING;
+
+stub_callback_t stub_writes[STUB_MAX_CALLBACKS];
+int stub_writes_num;
+stub_callback_t stub_flushes[STUB_MAX_CALLBACKS];
+int stub_flushes_num;
+stub_callback_t stub_reads[STUB_MAX_CALLBACKS];
+int stub_reads_num;
+int (*stub_config_cb)(oconfig_item_t *);
+int (*stub_init_cb)(void);
+int (*stub_shutdown_cb)(void);
+
+static pthread_mutex_t stub_dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+int stub_dispatched;
+void (*stub_dispatch_hook)(value_list_t const *vl);
+
+cdtime_t cdtime(void) /* {{{ */
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return TIME_T_TO_CDTIME_T(ts.tv_sec) + NS_TO_CDTIME_T(ts.tv_nsec);
+} /* }}} cdtime_t cdtime */
+
+void plugin_log(int level, const char *format, ...) /* {{{ */
+{
+  va_list ap;
+
+  if (level > stub_log_level)
+    return;
+
+  va_start(ap, format);
+  fprintf(stderr, "[%d] ", level);
+  vfprintf(stderr, format, ap);
+  fputc('\n', stderr);
+  va_end(ap);
+} /* }}} void plugin_log */
+
+void c_complain(int level, c_complain_t *c, const char *format, ...) /* {{{ */
+{
+  va_list ap;
+
+  if (c->interval != 0)
+    return;
+  c->interval = 1;
+
+  if (level > stub_log_level)
+    return;
+
+  va_start(ap, format);
+  fprintf(stderr, "[%d] ", level);
+  vfprintf(stderr, format, ap);
+  fputc('\n', stderr);
+  va_end(ap);
+} /* }}} void c_complain */
+
+void c_do_release(int level, c_complain_t *c, const char *format, /* {{{ */
+                  ...) {
+  va_list ap;
+
+  c->interval = 0;
+
+  if (level > stub_log_level)
+    return;
+
+  va_start(ap, format);
+  fprintf(stderr, "[%d] ", level);
+  vfprintf(stderr, format, ap);
+  fputc('\n', stderr);
+  va_end(ap);
+} /* }}} void c_do_release */
+
+double cdrand_d(void) { return (double)random() / ((double)RAND_MAX + 1.0); }
+
+char *sstrncpy(char *dest, const char *src, size_t n) /* {{{ */
+{
+  size_t len = strnlen(src, n - 1);
+
+  memcpy(dest, src, len);
+  dest[len] = 0;
+  return dest;
+} /* }}} char *sstrncpy */
+
+char *sstrerror(int errnum, char *buf, size_t buflen) /* {{{ */
+{
+  snprintf(buf, buflen, "%s", strerror(errnum));
+  return buf;
+} /* }}} char *sstrerror */
+
+int format_name(char *ret, int ret_len, const char *hostname, /* {{{ */
+                const char *plugin, const char *plugin_instance,
+                const char *type, const char *type_instance) {
+  int status = snprintf(
+      ret, (size_t)ret_len, "%s/%s%s%s/%s%s%s", hostname, plugin,
+      (plugin_instance[0] != 0) ? "-" : "", plugin_instance, type,
+      (type_instance[0] != 0) ? "-" : "", type_instance);
+  if ((status < 0) || (status >= ret_len))
+    return ENOBUFS;
+  return 0;
+} /* }}} int format_name */
+
+counter_t counter_diff(counter_t old_value, counter_t new_value) /* {{{ */
+{
+  if (old_value <= new_value)
+    return new_value - old_value;
+  if (old_value <= 4294967295U)
+    return (4294967295U - old_value) + new_value + 1;
+  return (18446744073709551615ULL - old_value) + new_value + 1;
+} /* }}} counter_t counter_diff */
+
+uint64_t htonll(uint64_t n) { return htobe64(n); }
+
+double htond(double d) /* {{{ */
+{
+  uint64_t bits;
+
+  memcpy(&bits, &d, sizeof(bits));
+  bits = htole64(bits);
+  memcpy(&d, &bits, sizeof(d));
+  return d;
+} /* }}} double htond */
+
+/* The daemon's value cache: every rate is 1.5. */
+gauge_t *uc_get_rate(const data_set_t *ds, const value_list_t *vl) /* {{{ */
+{
+  gauge_t *rates = calloc(ds->ds_num, sizeof(*rates));
+  if (rates == NULL)
+    return NULL;
+
+  for (size_t i = 0; i < ds->ds_num; i++)
+    rates[i] = 1.5;
+  return rates;
+} /* }}} gauge_t *uc_get_rate */
+
+/*
+ * Registration
+ */
+static int stub_register(stub_callback_t *list, int *num, /* {{{ */
+                         const char *name, void *callback,
+                         user_data_t const *user_data, cdtime_t interval) {
+  if (*num >= STUB_MAX_CALLBACKS)
+    return -1;
+
+  stub_callback_t *r = list + (*num)++;
+  sstrncpy(r->name, name, sizeof(r->name));
+  r->callback = callback;
+  r->user_data = *user_data;
+  r->interval = interval;
+  return 0;
+} /* }}} int stub_register */
+
+int plugin_register_complex_config(const char *type, /* {{{ */
+                                   int (*callback)(oconfig_item_t *)) {
+  stub_config_cb = callback;
+  return 0;
+} /* }}} int plugin_register_complex_config */
+
+int plugin_register_init(const char *name, int (*callback)(void)) /* {{{ */
+{
+  stub_init_cb = callback;
+  return 0;
+} /* }}} int plugin_register_init */
+
+int plugin_register_shutdown(const char *name, int (*callback)(void)) /* {{{ */
+{
+  stub_shutdown_cb = callback;
+  return 0;
+} /* }}} int plugin_register_shutdown */
+
+int plugin_register_write(const char *name, plugin_write_cb callback, /* {{{ */
+                          user_data_t const *user_data) {
+  return stub_register(stub_writes, &stub_writes_num, name, (void *)callback,
+                       user_data, 0);
+} /* }}} int plugin_register_write */
+
+int plugin_register_flush(const char *name, plugin_flush_cb callback, /* {{{ */
+                          user_data_t const *user_data) {
+  return stub_register(stub_flushes, &stub_flushes_num, name, (void *)callback,
+                       user_data, 0);
+} /* }}} int plugin_register_flush */
+
+int plugin_register_complex_read(const char *group, const char *name, /* {{{ */
+                                 plugin_read_cb callback, cdtime_t interval,
+                                 user_data_t const *user_data) {
+  return stub_register(stub_reads, &stub_reads_num, name, (void *)callback,
+                       user_data, interval);
+} /* }}} int plugin_register_complex_read */
+
+int plugin_dispatch_values(value_list_t const *vl) /* {{{ */
+{
+  pthread_mutex_lock(&stub_dispatch_lock);
+  stub_dispatched++;
+  if (stub_dispatch_hook != NULL)
+    stub_dispatch_hook(vl);
+  pthread_mutex_unlock(&stub_dispatch_lock);
+  return 0;
+} /* }}} int plugin_dispatch_values */
+
+int plugin_thread_create(pthread_t *thread, /* {{{ */
+                         void *(*start_routine)(void *), void *arg,
+                         char const *name) {
+  return pthread_create(thread, NULL, start_routine, arg);
+} /* }}} int plugin_thread_create */
+
+/*
+ * Configuration
+ */
+int cf_util_get_string(const oconfig_item_t *ci, char **ret_string) /* {{{ */
+{
+  if ((ci->values_num != 1) || (ci->values[0].type != OCONFIG_TYPE_STRING))
+    return EINVAL;
+
+  char *string = strdup(ci->values[0].value.string);
+  if (string == NULL)
+    return -1;
+  free(*ret_string);
+  *ret_string = string;
+  return 0;
+} /* }}} int cf_util_get_string */
+
+int cf_util_get_string_buffer(const oconfig_item_t *ci, /* {{{ */
+                              char *buffer, size_t buffer_size) {
+  if ((ci->values_num != 1) || (ci->values[0].type != OCONFIG_TYPE_STRING))
+    return EINVAL;
+
+  sstrncpy(buffer, ci->values[0].value.string, buffer_size);
+  return 0;
+} /* }}} int cf_util_get_string_buffer */
+
+int cf_util_get_int(const oconfig_item_t *ci, int *ret_value) /* {{{ */
+{
+  if ((ci->values_num != 1) || (ci->values[0].type != OCONFIG_TYPE_NUMBER))
+    return EINVAL;
+
+  *ret_value = (int)ci->values[0].value.number;
+  return 0;
+} /* }}} int cf_util_get_int */
+
+int cf_util_get_double(const oconfig_item_t *ci, double *ret_value) /* {{{ */
+{
+  if ((ci->values_num != 1) || (ci->values[0].type != OCONFIG_TYPE_NUMBER))
+    return EINVAL;
+
+  *ret_value = ci->values[0].value.number;
+  return 0;
+} /* }}} int cf_util_get_double */
+
+int cf_util_get_boolean(const oconfig_item_t *ci, bool *ret_bool) /* {{{ */
+{
+  if ((ci->values_num != 1) || (ci->values[0].type != OCONFIG_TYPE_BOOLEAN))
+    return EINVAL;
+
+  *ret_bool = ci->values[0].value.boolean ? true : false;
+  return 0;
+} /* }}} int cf_util_get_boolean */
+
+int cf_util_get_port_number(const oconfig_item_t *ci) /* {{{ */
+{
+  if (ci->values_num != 1)
+    return -1;
+  if (ci->values[0].type == OCONFIG_TYPE_NUMBER)
+    return (int)ci->values[0].value.number;
+  if (ci->values[0].type == OCONFIG_TYPE_STRING)
+    return atoi(ci->values[0].value.string);
+  return -1;
+} /* }}} int cf_util_get_port_number */
+
+int cf_util_get_cdtime(const oconfig_item_t *ci, cdtime_t *ret_value) /* {{{ */
+{
+  if ((ci->values_num != 1) || (ci->values[0].type != OCONFIG_TYPE_NUMBER) ||
+      (ci->values[0].value.number < 0))
+    return EINVAL;
+
+  *ret_value = DOUBLE_TO_CDTIME_T(ci->values[0].value.number);
+  return 0;
+} /* }}} int cf_util_get_cdtime */
+
+/*
+ * format_json
+ */
+#define BUFFER_ADD(...)                                                        \
+  do {                                                                         \
+    int status = snprintf(buffer + offset, buffer_size - offset, __VA_ARGS__); \
+    if (status < 1)                                                            \
+      return -1;                                                               \
+    else if (((size_t)status) >= (buffer_size - offset))                       \
+      return -ENOMEM;                                                          \
+    else                                                                       \
+      offset += ((size_t)status);                                              \
+  } while (0)
+
+static int json_escape_string(char *buffer, size_t buffer_size, /* {{{ */
+                              const char *string) {
+  size_t dst_pos = 0;
+
+#define BUFFER_ADD_CHAR(c)                                                     \
+  do {                                                                         \
+    if (dst_pos >= (buffer_size - 1))                                          \
+      return -ENOMEM;                                                          \
+    buffer[dst_pos] = (c);                                                     \
+    dst_pos++;                                                                 \
+  } while (0)
+
+  /* Like collectd, this compares a plain (and on most platforms signed) char,
+   * so bytes above 0x7f are replaced, too. */
+  BUFFER_ADD_CHAR('"');
+  for (size_t src_pos = 0; string[src_pos] != 0; src_pos++) {
+    if ((string[src_pos] == '"') || (string[src_pos] == '\\')) {
+      BUFFER_ADD_CHAR('\\');
+      BUFFER_ADD_CHAR(string[src_pos]);
+    } else if (string[src_pos] <= 0x001F)
+      BUFFER_ADD_CHAR('?');
+    else
+      BUFFER_ADD_CHAR(string[src_pos]);
+  }
+  BUFFER_ADD_CHAR('"');
+  buffer[dst_pos] = 0;
+
+#undef BUFFER_ADD_CHAR
+  return 0;
+} /* }}} int json_escape_string */
+
+static int values_to_json(char *buffer, size_t buffer_size, /* {{{ */
+                          const data_set_t *ds, const value_list_t *vl,
+                          int store_rates) {
+  size_t offset = 0;
+  gauge_t *rates = NULL;
+
+  memset(buffer, 0, buffer_size);
+
+  BUFFER_ADD("[");
+  for (size_t i = 0; i < ds->ds_num; i++) {
+    if (i > 0)
+      BUFFER_ADD(",");
+
+    if (ds->ds[i].type == DS_TYPE_GAUGE) {
+      if (isfinite(vl->values[i].gauge))
+        BUFFER_ADD(GAUGE_FORMAT, vl->values[i].gauge);
+      else
+        BUFFER_ADD("null");
+    } else if (store_rates) {
+      if (rates == NULL)
+        rates = uc_get_rate(ds, vl);
+      if (rates == NULL)
+        return -1;
+
+      if (isfinite(rates[i]))
+        BUFFER_ADD(GAUGE_FORMAT, rates[i]);
+      else
+        BUFFER_ADD("null");
+    } else if (ds->ds[i].type == DS_TYPE_COUNTER)
+      BUFFER_ADD("%llu", vl->values[i].counter);
+    else if (ds->ds[i].type == DS_TYPE_DERIVE)
+      BUFFER_ADD("%" PRIi64, vl->values[i].derive);
+    else if (ds->ds[i].type == DS_TYPE_ABSOLUTE)
+      BUFFER_ADD("%" PRIu64, vl->values[i].absolute);
+    else {
+      free(rates);
+      return -1;
+    }
+  }
+  BUFFER_ADD("]");
+
+  free(rates);
+  return 0;
+} /* }}} int values_to_json */
+
+static int dstypes_to_json(char *buffer, size_t buffer_size, /* {{{ */
+                           const data_set_t *ds) {
+  size_t offset = 0;
+
+  memset(buffer, 0, buffer_size);
+
+  BUFFER_ADD("[");
+  for (size_t i = 0; i < ds->ds_num; i++) {
+    if (i > 0)
+      BUFFER_ADD(",");
+    BUFFER_ADD("\"%s\"", DS_TYPE_TO_STRING(ds->ds[i].type));
+  }
+  BUFFER_ADD("]");
+  return 0;
+} /* }}} int dstypes_to_json */
+
+static int dsnames_to_json(char *buffer, size_t buffer_size, /* {{{ */
+                           const data_set_t *ds) {
+  size_t offset = 0;
+
+  memset(buffer, 0, buffer_size);
+
+  BUFFER_ADD("[");
+  for (size_t i = 0; i < ds->ds_num; i++) {
+    if (i > 0)
+      BUFFER_ADD(",");
+    BUFFER_ADD("\"%s\"", ds->ds[i].name);
+  }
+  BUFFER_ADD("]");
+  return 0;
+} /* }}} int dsnames_to_json */
+
+static int value_list_to_json(char *buffer, size_t buffer_size, /* {{{ */
+                              const data_set_t *ds, const value_list_t *vl,
+                              int store_rates) {
+  char temp[512];
+  size_t offset = 0;
+  int status;
+
+  memset(buffer, 0, buffer_size);
+
+  /* All value lists have a leading comma. The first one will be replaced with
+   * a square bracket in `format_json_finalize'. */
+  BUFFER_ADD(",{");
+
+  status = values_to_json(temp, sizeof(temp), ds, vl, store_rates);
+  if (status != 0)
+    return status;
+  BUFFER_ADD("\"values\":%s", temp);
+
+  status = dstypes_to_json(temp, sizeof(temp), ds);
+  if (status != 0)
+    return status;
+  BUFFER_ADD(",\"dstypes\":%s", temp);
+
+  status = dsnames_to_json(temp, sizeof(temp), ds);
+  if (status != 0)
+    return status;
+  BUFFER_ADD(",\"dsnames\":%s", temp);
+
+  BUFFER_ADD(",\"time\":%.3f", CDTIME_T_TO_DOUBLE(vl->time));
+  BUFFER_ADD(",\"interval\":%.3f", CDTIME_T_TO_DOUBLE(vl->interval));
+
+#define BUFFER_ADD_KEYVAL(key, value)                                          \
+  do {                                                                         \
+    status = json_escape_string(temp, sizeof(temp), (value));                  \
+    if (status != 0)                                                           \
+      return status;                                                           \
+    BUFFER_ADD(",\"%s\":%s", (key), temp);                                     \
+  } while (0)
+
+  BUFFER_ADD_KEYVAL("host", vl->host);
+  BUFFER_ADD_KEYVAL("plugin", vl->plugin);
+  BUFFER_ADD_KEYVAL("plugin_instance", vl->plugin_instance);
+  BUFFER_ADD_KEYVAL("type", vl->type);
+  BUFFER_ADD_KEYVAL("type_instance", vl->type_instance);
+
+#undef BUFFER_ADD_KEYVAL
+
+  /* Metadata is opaque to the stubs, and the plugin's own encoder hands value
+   * lists with metadata to collectd's anyway. */
+
+  BUFFER_ADD("}");
+  return 0;
+} /* }}} int value_list_to_json */
+
+#undef BUFFER_ADD
+
+int format_json_initialize(char *buffer, size_t *ret_buffer_fill, /* {{{ */
+                           size_t *ret_buffer_free) {
+  size_t buffer_fill;
+  size_t buffer_free;
+
+  if ((buffer == NULL) || (ret_buffer_fill == NULL) ||
+      (ret_buffer_free == NULL))
+    return -EINVAL;
+
+  buffer_fill = *ret_buffer_fill;
+  buffer_free = *ret_buffer_free;
+
+  buffer_free = buffer_fill + buffer_free;
+  buffer_fill = 0;
+
+  if (buffer_free < 3)
+    return -ENOMEM;
+
+  memset(buffer, 0, buffer_free);
+  *ret_buffer_fill = buffer_fill;
+  *ret_buffer_free = buffer_free;
+
+  return 0;
+} /* }}} int format_json_initialize */
+
+int format_json_finalize(char *buffer, size_t *ret_buffer_fill, /* {{{ */
+                         size_t *ret_buffer_free) {
+  size_t pos;
+
+  if ((buffer == NULL) || (ret_buffer_fill == NULL) ||
+      (ret_buffer_free == NULL))
+    return -EINVAL;
+
+  if (*ret_buffer_free < 2)
+    return -ENOMEM;
+
+  /* Replace the leading comma added in `value_list_to_json' with a square
+   * bracket. */
+  if (buffer[0] != ',')
+    return -EINVAL;
+  buffer[0] = '[';
+
+  pos = *ret_buffer_fill;
+  buffer[pos] = ']';
+  buffer[pos + 1] = 0;
+
+  (*ret_buffer_fill)++;
+  (*ret_buffer_free)--;
+
+  return 0;
+} /* }}} int format_json_finalize */
+
+int format_json_value_list(char *buffer, size_t *ret_buffer_fill, /* {{{ */
+                           size_t *ret_buffer_free, const data_set_t *ds,
+                           const value_list_t *vl, int store_rates) {
+  char temp[4096];
+  size_t temp_size;
+  int status;
+
+  if ((buffer == NULL) || (ret_buffer_fill == NULL) ||
+      (ret_buffer_free == NULL) || (ds == NULL) || (vl == NULL))
+    return -EINVAL;
+
+  if (*ret_buffer_free < 3)
+    return -ENOMEM;
+
+  /* collectd formats into a temporary buffer the size of the free space; the
+   * stub caps it, which only matters for value lists that do not fit. */
+  temp_size = *ret_buffer_free - 2;
+  if (temp_size > sizeof(temp))
+    temp_size = sizeof(temp);
+
+  status = value_list_to_json(temp, temp_size, ds, vl, store_rates);
+  if (status != 0)
+    return status;
+  temp_size = strlen(temp);
+
+  memcpy(buffer + (*ret_buffer_fill), temp, temp_size + 1);
+  (*ret_buffer_fill) += temp_size;
+  (*ret_buffer_free) -= temp_size;
+
+  return 0;
+} /* }}} int format_json_value_list */
@@ -0,0 +1,586 @@
+/**
+ * An in-process loopback broker behind libmosquitto's client API. See
+ * stub.h for what it does and tests/Makefile for how it is used.
+ **/
+
+#include "collectd.h"
+
+#include "utils/common/common.h"
+
+#include "stub.h"
+
+#include <mosquitto.h>
+#include <sys/socket.h>
+
+typedef struct {
+  int *mids;
+  size_t num;
+  size_t size;
+} stub_mids_t;
+
+struct mosquitto {
+  void *obj;
+  void (*on_connect_v5)(struct mosquitto *, void *, int, int,
+                        const mosquitto_property *);
+  void (*on_disconnect)(struct mosquitto *, void *, int);
+  void (*on_publish)(struct mosquitto *, void *, int);
+
+  bool clean_session;
+  bool threaded;
+  bool connected;
+  /* The read end is the client's socket, the broker rings the write end when
+   * acknowledgements are waiting in acks. */
+  int sv[2];
+  bool rung;
+  /* A CONNECT or DISCONNECT packet is waiting to be written. */
+  bool control_queued;
+  /* Written by mosquitto_loop_write(). */
+  stub_mids_t queued;
+  stub_mids_t acks;
+
+  int mid;
+  /* Messages not acknowledged, resent on reconnecting with a persistent
+   * session. */
+  bool unacked[65536];
+
+  char *aliases[65536];
+};
+
+struct mqtt5__property {
+  int identifier;
+  uint32_t value;
+  char *name;
+  char *string;
+  struct mqtt5__property *next;
+};
+
+volatile int stub_broker_down;
+volatile int stub_hold_acks;
+uint16_t stub_topic_alias_maximum;
+
+uint64_t stub_connects;
+uint64_t stub_published;
+uint64_t stub_published_bytes;
+void (*stub_publish_hook)(const char *topic, const void *payload,
+                          int payloadlen);
+
+static pthread_mutex_t stub_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+  struct mosquitto *mosq;
+  int mid;
+} stub_held_t;
+static stub_held_t *stub_held;
+static size_t stub_held_num;
+static size_t stub_held_size;
+
+static void stub_mids_push(stub_mids_t *m, int mid) /* {{{ */
+{
+  if (m->num == m->size) {
+    size_t size = (m->size > 0) ? 2 * m->size : 64;
+    int *mids = realloc(m->mids, size * sizeof(*mids));
+    if (mids == NULL)
+      abort();
+    m->mids = mids;
+    m->size = size;
+  }
+  m->mids[m->num++] = mid;
+} /* }}} void stub_mids_push */
+
+/* must hold stub_lock when calling. */
+static void stub_ring(struct mosquitto *mosq) /* {{{ */
+{
+  char c = 1;
+
+  if (mosq->rung || (mosq->sv[1] < 0))
+    return;
+  if (write(mosq->sv[1], &c, 1) == 1)
+    mosq->rung = true;
+} /* }}} void stub_ring */
+
+/* must hold stub_lock when calling. */
+static void stub_close(struct mosquitto *mosq) /* {{{ */
+{
+  for (int i = 0; i < 2; i++) {
+    if (mosq->sv[i] >= 0)
+      close(mosq->sv[i]);
+    mosq->sv[i] = -1;
+  }
+  mosq->rung = false;
+  mosq->control_queued = false;
+  mosq->queued.num = 0;
+  mosq->acks.num = 0;
+} /* }}} void stub_close */
+
+int mosquitto_lib_init(void) { return MOSQ_ERR_SUCCESS; }
+int mosquitto_lib_cleanup(void) { return MOSQ_ERR_SUCCESS; }
+
+struct mosquitto *mosquitto_new(const char *id, /* {{{ */
+                                bool clean_session, void *obj) {
+  struct mosquitto *mosq = calloc(1, sizeof(*mosq));
+  if (mosq == NULL)
+    return NULL;
+
+  mosq->obj = obj;
+  mosq->clean_session = clean_session;
+  mosq->sv[0] = mosq->sv[1] = -1;
+  return mosq;
+} /* }}} struct mosquitto *mosquitto_new */
+
+void mosquitto_destroy(struct mosquitto *mosq) /* {{{ */
+{
+  if (mosq == NULL)
+    return;
+
+  pthread_mutex_lock(&stub_lock);
+  stub_close(mosq);
+  /* Held acknowledgements of this client go away with it. */
+  size_t j = 0;
+  for (size_t i = 0; i < stub_held_num; i++)
+    if (stub_held[i].mosq != mosq)
+      stub_held[j++] = stub_held[i];
+  stub_held_num = j;
+  pthread_mutex_unlock(&stub_lock);
+
+  for (size_t i = 0; i < STATIC_ARRAY_SIZE(mosq->aliases); i++)
+    free(mosq->aliases[i]);
+  free(mosq->queued.mids);
+  free(mosq->acks.mids);
+  free(mosq);
+} /* }}} void mosquitto_destroy */
+
+int mosquitto_opts_set(struct mosquitto *mosq, /* {{{ */
+                       enum mosq_opt_t option, void *value) {
+  return MOSQ_ERR_SUCCESS;
+} /* }}} int mosquitto_opts_set */
+
+int mosquitto_threaded_set(struct mosquitto *mosq, bool threaded) /* {{{ */
+{
+  mosq->threaded = threaded;
+  return MOSQ_ERR_SUCCESS;
+} /* }}} int mosquitto_threaded_set */
+
+int mosquitto_max_inflight_messages_set(struct mosquitto *mosq, /* {{{ */
+                                        unsigned int max_inflight_messages) {
+  return MOSQ_ERR_SUCCESS;
+} /* }}} int mosquitto_max_inflight_messages_set */
+
+int mosquitto_tls_set(struct mosquitto *mosq, const char *cafile, /* {{{ */
+                      const char *capath, const char *certfile,
+                      const char *keyfile,
+                      int (*pw_callback)(char *buf, int size, int rwflag,
+                                         void *userdata)) {
+  return MOSQ_ERR_SUCCESS;
+} /* }}} int mosquitto_tls_set */
+
+int mosquitto_tls_insecure_set(struct mosquitto *mosq, bool value) /* {{{ */
+{
+  return MOSQ_ERR_SUCCESS;
+} /* }}} int mosquitto_tls_insecure_set */
+
+static int stub_connect(struct mosquitto *mosq) /* {{{ */
+{
+  pthread_mutex_lock(&stub_lock);
+  if (stub_broker_down) {
+    pthread_mutex_unlock(&stub_lock);
+    errno = ECONNREFUSED;
+    return MOSQ_ERR_ERRNO;
+  }
+
+  stub_close(mosq);
+  if (mosq->threaded) {
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                   mosq->sv) != 0) {
+      pthread_mutex_unlock(&stub_lock);
+      return MOSQ_ERR_ERRNO;
+    }
+    mosq->control_queued = true;
+  }
+  mosq->connected = true;
+  stub_connects++;
+
+  /* A persistent session resumes: unacknowledged messages are resent. */
+  if (!mosq->clean_session)
+    for (size_t mid = 1; mid < STATIC_ARRAY_SIZE(mosq->unacked); mid++)
+      if (mosq->unacked[mid])
+        stub_mids_push(&mosq->queued, (int)mid);
+
+  for (size_t i = 0; i < STATIC_ARRAY_SIZE(mosq->aliases); i++)
+    sfree(mosq->aliases[i]);
+  pthread_mutex_unlock(&stub_lock);
+
+  if (mosq->on_connect_v5 != NULL) {
+    mosquitto_property *props = NULL;
+
+    if (stub_topic_alias_maximum > 0)
+      mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM,
+                                   stub_topic_alias_maximum);
+    mosq->on_connect_v5(mosq, mosq->obj, /* rc = */ 0, /* flags = */ 0, props);
+    mosquitto_property_free_all(&props);
+  }
+
+  return MOSQ_ERR_SUCCESS;
+} /* }}} int stub_connect */
+
+int mosquitto_connect(struct mosquitto *mosq, const char *host, /* {{{ */
+                      int port, int keepalive) {
+  return stub_connect(mosq);
+} /* }}} int mosquitto_connect */
+
+int mosquitto_connect_bind_v5(struct mosquitto *mosq, /* {{{ */
+                              const char *host, int port, int keepalive,
+                              const char *bind_address,
+                              const mosquitto_property *properties) {
+  return stub_connect(mosq);
+} /* }}} int mosquitto_connect_bind_v5 */
+
+int mosquitto_reconnect(struct mosquitto *mosq) /* {{{ */
+{
+  return stub_connect(mosq);
+} /* }}} int mosquitto_reconnect */
+
+int mosquitto_disconnect(struct mosquitto *mosq) /* {{{ */
+{
+  pthread_mutex_lock(&stub_lock);
+  mosq->connected = false;
+  if (mosq->sv[0] >= 0)
+    mosq->control_queued = true;
+  pthread_mutex_unlock(&stub_lock);
+  return MOSQ_ERR_SUCCESS;
+} /* }}} int mosquitto_disconnect */
+
+/* must hold stub_lock when calling. */
+static void stub_ack(struct mosquitto *mosq, int mid) /* {{{ */
+{
+  if (stub_hold_acks) {
+    if (stub_held_num == stub_held_size) {
+      size_t size = (stub_held_size > 0) ? 2 * stub_held_size : 64;
+      stub_held_t *held = realloc(stub_held, size * sizeof(*held));
+      if (held == NULL)
+        abort();
+      stub_held = held;
+      stub_held_size = size;
+    }
+    stub_held[stub_held_num++] = (stub_held_t){.mosq = mosq, .mid = mid};
+    return;
+  }
+
+  mosq->unacked[mid] = false;
+  stub_mids_push(&mosq->acks, mid);
+  stub_ring(mosq);
+} /* }}} void stub_ack */
+
+/* Calls on_publish() for all acknowledgements waiting, without holding
+ * stub_lock. */
+static void stub_deliver_acks(struct mosquitto *mosq) /* {{{ */
+{
+  stub_mids_t acks;
+
+  pthread_mutex_lock(&stub_lock);
+  acks = mosq->acks;
+  mosq->acks = (stub_mids_t){0};
+  mosq->rung = false;
+  pthread_mutex_unlock(&stub_lock);
+
+  for (size_t i = 0; i < acks.num; i++)
+    if (mosq->on_publish != NULL)
+      mosq->on_publish(mosq, mosq->obj, acks.mids[i]);
+
+  pthread_mutex_lock(&stub_lock);
+  if (mosq->acks.mids == NULL) {
+    mosq->acks = acks;
+    mosq->acks.num = 0;
+  } else
+    free(acks.mids);
+  pthread_mutex_unlock(&stub_lock);
+} /* }}} void stub_deliver_acks */
+
+int mosquitto_publish(struct mosquitto *mosq, int *mid, /* {{{ */
+                      const char *topic, int payloadlen, const void *payload,
+                      int qos, bool retain) {
+  pthread_mutex_lock(&stub_lock);
+  if (stub_broker_down || !mosq->connected) {
+    mosq->connected = false;
+    pthread_mutex_unlock(&stub_lock);
+    return MOSQ_ERR_NO_CONN;
+  }
+
+  if (++mosq->mid >= (int)STATIC_ARRAY_SIZE(mosq->unacked))
+    mosq->mid = 1;
+  if (mid != NULL)
+    *mid = mosq->mid;
+
+  stub_published++;
+  stub_published_bytes += (uint64_t)payloadlen;
+  if (stub_publish_hook != NULL)
+    stub_publish_hook(topic, payload, payloadlen);
+
+  if (qos > 0)
+    mosq->unacked[mosq->mid] = true;
+
+  if (mosq->threaded) {
+    stub_mids_push(&mosq->queued, mosq->mid);
+    pthread_mutex_unlock(&stub_lock);
+    return MOSQ_ERR_SUCCESS;
+  }
+
+  /* Without a network loop, the broker acknowledges right away. */
+  stub_ack(mosq, mosq->mid);
+  pthread_mutex_unlock(&stub_lock);
+  stub_deliver_acks(mosq);
+  return MOSQ_ERR_SUCCESS;
+} /* }}} int mosquitto_publish */
+
+int mosquitto_publish_v5(struct mosquitto *mosq, int *mid, /* {{{ */
+                         const char *topic, int payloadlen,
+                         const void *payload, int qos, bool retain,
+                         const mosquitto_property *properties) {
+  uint16_t alias = 0;
+
+  if (mosquitto_property_read_int16(properties, MQTT_PROP_TOPIC_ALIAS, &alias,
+                                    false) == NULL) {
+    if (topic == NULL)
+      return MOSQ_ERR_INVAL;
+    return mosquitto_publish(mosq, mid, topic, payloadlen, payload, qos,
+                             retain);
+  }
+
+  if ((alias == 0) || (alias > stub_topic_alias_maximum))
+    return MOSQ_ERR_INVAL;
+
+  pthread_mutex_lock(&stub_lock);
+  if (topic != NULL) {
+    free(mosq->aliases[alias]);
+    mosq->aliases[alias] = strdup(topic);
+  }
+  /* An alias the broker does not know is a protocol error. */
+  const char *resolved = mosq->aliases[alias];
+  pthread_mutex_unlock(&stub_lock);
+  if (resolved == NULL)
+    return MOSQ_ERR_PROTOCOL;
+
+  return mosquitto_publish(mosq, mid, resolved, payloadlen, payload, qos,
+                           retain);
+} /* }}} int mosquitto_publish_v5 */
+
+int stub_release_acks(void) /* {{{ */
+{
+  stub_held_t *held;
+  size_t held_num;
+
+  pthread_mutex_lock(&stub_lock);
+  held = stub_held;
+  held_num = stub_held_num;
+  stub_held = NULL;
+  stub_held_num = stub_held_size = 0;
+
+  for (size_t i = 0; i < held_num; i++) {
+    struct mosquitto *mosq = held[i].mosq;
+
+    mosq->unacked[held[i].mid] = false;
+    stub_mids_push(&mosq->acks, held[i].mid);
+    stub_ring(mosq);
+  }
+  pthread_mutex_unlock(&stub_lock);
+
+  for (size_t i = 0; i < held_num; i++)
+    if (!held[i].mosq->threaded)
+      stub_deliver_acks(held[i].mosq);
+
+  free(held);
+  return (int)held_num;
+} /* }}} int stub_release_acks */
+
+void stub_drop_connection(struct mosquitto *mosq) /* {{{ */
+{
+  pthread_mutex_lock(&stub_lock);
+  mosq->connected = false;
+  if (mosq->threaded) {
+    /* The network loop notices the socket closing. */
+    if (mosq->sv[1] >= 0)
+      shutdown(mosq->sv[1], SHUT_RDWR);
+    pthread_mutex_unlock(&stub_lock);
+    return;
+  }
+  pthread_mutex_unlock(&stub_lock);
+
+  if (mosq->on_disconnect != NULL)
+    mosq->on_disconnect(mosq, mosq->obj, MOSQ_ERR_CONN_LOST);
+} /* }}} void stub_drop_connection */
+
+int mosquitto_loop_start(struct mosquitto *mosq) /* {{{ */
+{
+  /* The tests run where the plugin has its own epoll network loop. */
+  return MOSQ_ERR_NOT_SUPPORTED;
+} /* }}} int mosquitto_loop_start */
+
+int mosquitto_loop_stop(struct mosquitto *mosq, bool force) /* {{{ */
+{
+  return MOSQ_ERR_SUCCESS;
+} /* }}} int mosquitto_loop_stop */
+
+int mosquitto_loop_read(struct mosquitto *mosq, int max_packets) /* {{{ */
+{
+  char buffer[64];
+  ssize_t status = read(mosq->sv[0], buffer, sizeof(buffer));
+
+  if (status == 0)
+    return MOSQ_ERR_CONN_LOST;
+  if ((status < 0) && (errno != EAGAIN))
+    return MOSQ_ERR_ERRNO;
+
+  stub_deliver_acks(mosq);
+  return MOSQ_ERR_SUCCESS;
+} /* }}} int mosquitto_loop_read */
+
+int mosquitto_loop_write(struct mosquitto *mosq, int max_packets) /* {{{ */
+{
+  pthread_mutex_lock(&stub_lock);
+  /* Everything queued goes out at once; the broker acknowledges what it
+   * received. */
+  for (size_t i = 0; i < mosq->queued.num; i++)
+    stub_ack(mosq, mosq->queued.mids[i]);
+  mosq->queued.num = 0;
+  mosq->control_queued = false;
+  pthread_mutex_unlock(&stub_lock);
+  return MOSQ_ERR_SUCCESS;
+} /* }}} int mosquitto_loop_write */
+
+int mosquitto_loop_misc(struct mosquitto *mosq) /* {{{ */
+{
+  return MOSQ_ERR_SUCCESS;
+} /* }}} int mosquitto_loop_misc */
+
+int mosquitto_socket(struct mosquitto *mosq) /* {{{ */
+{
+  pthread_mutex_lock(&stub_lock);
+  int fd = mosq->sv[0];
+  pthread_mutex_unlock(&stub_lock);
+  return fd;
+} /* }}} int mosquitto_socket */
+
+bool mosquitto_want_write(struct mosquitto *mosq) /* {{{ */
+{
+  pthread_mutex_lock(&stub_lock);
+  bool want = mosq->control_queued || (mosq->queued.num > 0);
+  pthread_mutex_unlock(&stub_lock);
+  return want;
+} /* }}} bool mosquitto_want_write */
+
+const char *mosquitto_strerror(int mosq_errno) /* {{{ */
+{
+  switch (mosq_errno) {
+  case MOSQ_ERR_SUCCESS:
+    return "No error.";
+  case MOSQ_ERR_NO_CONN:
+    return "The client is not currently connected.";
+  case MOSQ_ERR_CONN_LOST:
+    return "The connection was lost.";
+  case MOSQ_ERR_PROTOCOL:
+    return "A network protocol error occurred when communicating with the "
+           "broker.";
+  case MOSQ_ERR_INVAL:
+    return "Invalid function arguments provided.";
+  default:
+    return "Unknown error.";
+  }
+} /* }}} const char *mosquitto_strerror */
+
+void mosquitto_connect_v5_callback_set( /* {{{ */
+    struct mosquitto *mosq,
+    void (*on_connect)(struct mosquitto *, void *, int, int,
+                       const mosquitto_property *props)) {
+  mosq->on_connect_v5 = on_connect;
+} /* }}} void mosquitto_connect_v5_callback_set */
+
+void mosquitto_disconnect_callback_set( /* {{{ */
+    struct mosquitto *mosq,
+    void (*on_disconnect)(struct mosquitto *, void *, int)) {
+  mosq->on_disconnect = on_disconnect;
+} /* }}} void mosquitto_disconnect_callback_set */
+
+void mosquitto_publish_callback_set( /* {{{ */
+    struct mosquitto *mosq,
+    void (*on_publish)(struct mosquitto *, void *, int)) {
+  mosq->on_publish = on_publish;
+} /* }}} void mosquitto_publish_callback_set */
+
+static int stub_property_add(mosquitto_property **proplist, /* {{{ */
+                             int identifier, uint32_t value, const char *name,
+                             const char *string) {
+  struct mqtt5__property *prop = calloc(1, sizeof(*prop));
+  if (prop == NULL)
+    return MOSQ_ERR_NOMEM;
+
+  prop->identifier = identifier;
+  prop->value = value;
+  prop->name = (name != NULL) ? strdup(name) : NULL;
+  prop->string = (string != NULL) ? strdup(string) : NULL;
+
+  while (*proplist != NULL)
+    proplist = &(*proplist)->next;
+  *proplist = prop;
+  return MOSQ_ERR_SUCCESS;
+} /* }}} int stub_property_add */
+
+int mosquitto_property_add_int16(mosquitto_property **proplist, /* {{{ */
+                                 int identifier, uint16_t value) {
+  return stub_property_add(proplist, identifier, value, NULL, NULL);
+} /* }}} int mosquitto_property_add_int16 */
+
+int mosquitto_property_add_int32(mosquitto_property **proplist, /* {{{ */
+                                 int identifier, uint32_t value) {
+  return stub_property_add(proplist, identifier, value, NULL, NULL);
+} /* }}} int mosquitto_property_add_int32 */
+
+int mosquitto_property_add_string(mosquitto_property **proplist, /* {{{ */
+                                  int identifier, const char *value) {
+  return stub_property_add(proplist, identifier, 0, NULL, value);
+} /* }}} int mosquitto_property_add_string */
+
+int mosquitto_property_add_string_pair( /* {{{ */
+    mosquitto_property **proplist, int identifier, const char *name,
+    const char *value) {
+  return stub_property_add(proplist, identifier, 0, name, value);
+} /* }}} int mosquitto_property_add_string_pair */
+
+int mosquitto_property_copy_all(mosquitto_property **dest, /* {{{ */
+                                const mosquitto_property *src) {
+  *dest = NULL;
+  for (; src != NULL; src = src->next) {
+    int status = stub_property_add(dest, src->identifier, src->value,
+                                   src->name, src->string);
+    if (status != MOSQ_ERR_SUCCESS) {
+      mosquitto_property_free_all(dest);
+      return status;
+    }
+  }
+  return MOSQ_ERR_SUCCESS;
+} /* }}} int mosquitto_property_copy_all */
+
+void mosquitto_property_free_all(mosquitto_property **properties) /* {{{ */
+{
+  struct mqtt5__property *prop = *properties;
+
+  while (prop != NULL) {
+    struct mqtt5__property *next = prop->next;
+    free(prop->name);
+    free(prop->string);
+    free(prop);
+    prop = next;
+  }
+  *properties = NULL;
+} /* }}} void mosquitto_property_free_all */
+
+const mosquitto_property * /* {{{ */
+mosquitto_property_read_int16(const mosquitto_property *proplist,
+                              int identifier, uint16_t *value,
+                              bool skip_first) {
+  for (; proplist != NULL; proplist = proplist->next) {
+    if (proplist->identifier == identifier) {
+      *value = (uint16_t)proplist->value;
+      return proplist;
+    }
+  }
+  return NULL;
+} /* }}} const mosquitto_property *mosquitto_property_read_int16 */
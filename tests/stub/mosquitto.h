@@ -0,0 +1,124 @@
+/* The parts of libmosquitto's <mosquitto.h> the plugin uses. The functions
+ * are implemented by tests/stub/mosquitto.c, an in-process loopback broker,
+ * so the plugin can be tested and benchmarked without a broker. */
+#ifndef MOSQUITTO_H
+#define MOSQUITTO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LIBMOSQUITTO_MAJOR 2
+#define LIBMOSQUITTO_MINOR 0
+#define LIBMOSQUITTO_REVISION 15
+#define LIBMOSQUITTO_VERSION_NUMBER                                            \
+  (LIBMOSQUITTO_MAJOR * 1000000 + LIBMOSQUITTO_MINOR * 1000 +                  \
+   LIBMOSQUITTO_REVISION)
+
+#define MQTT_PROTOCOL_V31 3
+#define MQTT_PROTOCOL_V311 4
+#define MQTT_PROTOCOL_V5 5
+
+enum mosq_err_t {
+  MOSQ_ERR_SUCCESS = 0,
+  MOSQ_ERR_NOMEM = 1,
+  MOSQ_ERR_PROTOCOL = 2,
+  MOSQ_ERR_INVAL = 3,
+  MOSQ_ERR_NO_CONN = 4,
+  MOSQ_ERR_CONN_REFUSED = 5,
+  MOSQ_ERR_NOT_FOUND = 6,
+  MOSQ_ERR_CONN_LOST = 7,
+  MOSQ_ERR_TLS = 8,
+  MOSQ_ERR_PAYLOAD_SIZE = 9,
+  MOSQ_ERR_NOT_SUPPORTED = 10,
+  MOSQ_ERR_AUTH = 11,
+  MOSQ_ERR_ACL_DENIED = 12,
+  MOSQ_ERR_UNKNOWN = 13,
+  MOSQ_ERR_ERRNO = 14,
+};
+
+enum mosq_opt_t {
+  MOSQ_OPT_PROTOCOL_VERSION = 1,
+  MOSQ_OPT_SSL_CTX = 2,
+};
+
+enum mqtt5_property {
+  MQTT_PROP_CONTENT_TYPE = 3,
+  MQTT_PROP_SESSION_EXPIRY_INTERVAL = 17,
+  MQTT_PROP_TOPIC_ALIAS_MAXIMUM = 34,
+  MQTT_PROP_TOPIC_ALIAS = 35,
+  MQTT_PROP_USER_PROPERTY = 38,
+};
+
+struct mosquitto;
+typedef struct mqtt5__property mosquitto_property;
+
+int mosquitto_lib_init(void);
+int mosquitto_lib_cleanup(void);
+struct mosquitto *mosquitto_new(const char *id, bool clean_session, void *obj);
+void mosquitto_destroy(struct mosquitto *mosq);
+int mosquitto_opts_set(struct mosquitto *mosq, enum mosq_opt_t option,
+                       void *value);
+int mosquitto_threaded_set(struct mosquitto *mosq, bool threaded);
+int mosquitto_max_inflight_messages_set(struct mosquitto *mosq,
+                                        unsigned int max_inflight_messages);
+int mosquitto_tls_set(struct mosquitto *mosq, const char *cafile,
+                      const char *capath, const char *certfile,
+                      const char *keyfile,
+                      int (*pw_callback)(char *buf, int size, int rwflag,
+                                         void *userdata));
+int mosquitto_tls_insecure_set(struct mosquitto *mosq, bool value);
+
+int mosquitto_connect(struct mosquitto *mosq, const char *host, int port,
+                      int keepalive);
+int mosquitto_connect_bind_v5(struct mosquitto *mosq, const char *host,
+                              int port, int keepalive,
+                              const char *bind_address,
+                              const mosquitto_property *properties);
+int mosquitto_reconnect(struct mosquitto *mosq);
+int mosquitto_disconnect(struct mosquitto *mosq);
+
+int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic,
+                      int payloadlen, const void *payload, int qos,
+                      bool retain);
+int mosquitto_publish_v5(struct mosquitto *mosq, int *mid, const char *topic,
+                         int payloadlen, const void *payload, int qos,
+                         bool retain, const mosquitto_property *properties);
+
+int mosquitto_loop_start(struct mosquitto *mosq);
+int mosquitto_loop_stop(struct mosquitto *mosq, bool force);
+int mosquitto_loop_read(struct mosquitto *mosq, int max_packets);
+int mosquitto_loop_write(struct mosquitto *mosq, int max_packets);
+int mosquitto_loop_misc(struct mosquitto *mosq);
+int mosquitto_socket(struct mosquitto *mosq);
+bool mosquitto_want_write(struct mosquitto *mosq);
+const char *mosquitto_strerror(int mosq_errno);
+
+void mosquitto_connect_v5_callback_set(
+    struct mosquitto *mosq,
+    void (*on_connect)(struct mosquitto *, void *, int, int,
+                       const mosquitto_property *props));
+void mosquitto_disconnect_callback_set(struct mosquitto *mosq,
+                                       void (*on_disconnect)(struct mosquitto *,
+                                                             void *, int));
+void mosquitto_publish_callback_set(struct mosquitto *mosq,
+                                    void (*on_publish)(struct mosquitto *,
+                                                       void *, int));
+
+int mosquitto_property_add_int16(mosquitto_property **proplist, int identifier,
+                                 uint16_t value);
+int mosquitto_property_add_int32(mosquitto_property **proplist, int identifier,
+                                 uint32_t value);
+int mosquitto_property_add_string(mosquitto_property **proplist,
+                                  int identifier, const char *value);
+int mosquitto_property_add_string_pair(mosquitto_property **proplist,
+                                       int identifier, const char *name,
+                                       const char *value);
+int mosquitto_property_copy_all(mosquitto_property **dest,
+                                const mosquitto_property *src);
+void mosquitto_property_free_all(mosquitto_property **properties);
+const mosquitto_property *
+mosquitto_property_read_int16(const mosquitto_property *proplist,
+                              int identifier, uint16_t *value,
+                              bool skip_first);
+
+#endif /* MOSQUITTO_H */
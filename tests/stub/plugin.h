@@ -0,0 +1,143 @@
+/* The parts of collectd's "plugin.h" the plugin uses. */
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+#include "collectd.h"
+
+typedef uint64_t cdtime_t;
+cdtime_t cdtime(void);
+
+#define TIME_T_TO_CDTIME_T(t) (((cdtime_t)(t)) << 30)
+#define MS_TO_CDTIME_T(ms) ((cdtime_t)(((double)(ms)) * 1073741.824))
+#define US_TO_CDTIME_T(us) ((cdtime_t)(((double)(us)) * 1073.741824))
+#define NS_TO_CDTIME_T(ns) ((cdtime_t)(((double)(ns)) * 1.073741824))
+#define CDTIME_T_TO_TIME_T(t) ((time_t)(((t) + (1 << 29)) >> 30))
+#define CDTIME_T_TO_MS(t) ((uint64_t)(((double)(t)) / 1073741.824))
+#define CDTIME_T_TO_US(t) ((uint64_t)(((double)(t)) / 1073.741824))
+#define CDTIME_T_TO_NS(t) ((uint64_t)(((double)(t)) / 1.073741824))
+#define CDTIME_T_TO_DOUBLE(t) (((double)(t)) / 1073741824.0)
+#define DOUBLE_TO_CDTIME_T(d) ((cdtime_t)((d)*1073741824.0))
+#define CDTIME_T_TO_TIMESPEC(t)                                                \
+  ((struct timespec){                                                          \
+      .tv_sec = (time_t)((t) >> 30),                                           \
+      .tv_nsec = (long)((((t)&0x3fffffff) * 1000000000 + (1 << 29)) >> 30)})
+
+#define DATA_MAX_NAME_LEN 128
+
+#define DS_TYPE_COUNTER 0
+#define DS_TYPE_GAUGE 1
+#define DS_TYPE_DERIVE 2
+#define DS_TYPE_ABSOLUTE 3
+#define DS_TYPE_TO_STRING(t)                                                   \
+  ((t) == DS_TYPE_COUNTER)    ? "counter"                                      \
+  : ((t) == DS_TYPE_GAUGE)    ? "gauge"                                        \
+  : ((t) == DS_TYPE_DERIVE)   ? "derive"                                       \
+  : ((t) == DS_TYPE_ABSOLUTE) ? "absolute"                                     \
+                              : "unknown"
+
+typedef unsigned long long counter_t;
+typedef double gauge_t;
+typedef int64_t derive_t;
+typedef uint64_t absolute_t;
+
+union value_u {
+  counter_t counter;
+  gauge_t gauge;
+  derive_t derive;
+  absolute_t absolute;
+};
+typedef union value_u value_t;
+
+typedef struct meta_data_s meta_data_t;
+
+struct value_list_s {
+  value_t *values;
+  size_t values_len;
+  cdtime_t time;
+  cdtime_t interval;
+  char host[DATA_MAX_NAME_LEN];
+  char plugin[DATA_MAX_NAME_LEN];
+  char plugin_instance[DATA_MAX_NAME_LEN];
+  char type[DATA_MAX_NAME_LEN];
+  char type_instance[DATA_MAX_NAME_LEN];
+  meta_data_t *meta;
+};
+typedef struct value_list_s value_list_t;
+#define VALUE_LIST_INIT                                                        \
+  { .values = NULL, .meta = NULL }
+
+struct data_source_s {
+  char name[DATA_MAX_NAME_LEN];
+  int type;
+  double min;
+  double max;
+};
+typedef struct data_source_s data_source_t;
+
+struct data_set_s {
+  char type[DATA_MAX_NAME_LEN];
+  size_t ds_num;
+  data_source_t *ds;
+};
+typedef struct data_set_s data_set_t;
+
+typedef struct user_data_s {
+  void *data;
+  void (*free_func)(void *);
+} user_data_t;
+
+#define OCONFIG_TYPE_STRING 0
+#define OCONFIG_TYPE_NUMBER 1
+#define OCONFIG_TYPE_BOOLEAN 2
+
+typedef struct oconfig_value_s {
+  union {
+    char *string;
+    double number;
+    int boolean;
+  } value;
+  int type;
+} oconfig_value_t;
+
+typedef struct oconfig_item_s oconfig_item_t;
+struct oconfig_item_s {
+  char *key;
+  oconfig_value_t *values;
+  int values_num;
+  oconfig_item_t *parent;
+  oconfig_item_t *children;
+  int children_num;
+};
+
+typedef int (*plugin_write_cb)(const data_set_t *, const value_list_t *,
+                               user_data_t *);
+typedef int (*plugin_flush_cb)(cdtime_t timeout, const char *identifier,
+                               user_data_t *);
+typedef int (*plugin_read_cb)(user_data_t *);
+
+int plugin_register_complex_config(const char *type,
+                                   int (*callback)(oconfig_item_t *));
+int plugin_register_init(const char *name, int (*callback)(void));
+int plugin_register_shutdown(const char *name, int (*callback)(void));
+int plugin_register_write(const char *name, plugin_write_cb callback,
+                          user_data_t const *user_data);
+int plugin_register_flush(const char *name, plugin_flush_cb callback,
+                          user_data_t const *user_data);
+int plugin_register_complex_read(const char *group, const char *name,
+                                 plugin_read_cb callback, cdtime_t interval,
+                                 user_data_t const *user_data);
+int plugin_dispatch_values(value_list_t const *vl);
+int plugin_thread_create(pthread_t *thread, void *(*start_routine)(void *),
+                         void *arg, char const *name);
+
+void plugin_log(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+#define ERROR(...) plugin_log(LOG_ERR, __VA_ARGS__)
+#define WARNING(...) plugin_log(LOG_WARNING, __VA_ARGS__)
+#define NOTICE(...) plugin_log(LOG_NOTICE, __VA_ARGS__)
+#define INFO(...) plugin_log(LOG_INFO, __VA_ARGS__)
+#define DEBUG(...) /* noop */
+
+extern char *hostname_g;
+
+#endif /* PLUGIN_H */
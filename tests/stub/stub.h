@@ -0,0 +1,65 @@
+/* Controls and counters of the daemon and broker stubs, for the tests and the
+ * benchmark. */
+#ifndef STUB_H
+#define STUB_H
+
+#include "plugin.h"
+
+#include <mosquitto.h>
+
+#define STUB_MAX_CALLBACKS 16
+
+/* plugin_log() and c_complain() print messages up to this level, LOG_WARNING
+ * by default. */
+extern int stub_log_level;
+
+typedef struct {
+  char name[DATA_MAX_NAME_LEN];
+  void *callback;
+  user_data_t user_data;
+  cdtime_t interval;
+} stub_callback_t;
+
+extern stub_callback_t stub_writes[STUB_MAX_CALLBACKS];
+extern int stub_writes_num;
+extern stub_callback_t stub_flushes[STUB_MAX_CALLBACKS];
+extern int stub_flushes_num;
+extern stub_callback_t stub_reads[STUB_MAX_CALLBACKS];
+extern int stub_reads_num;
+extern int (*stub_config_cb)(oconfig_item_t *);
+extern int (*stub_init_cb)(void);
+extern int (*stub_shutdown_cb)(void);
+
+/* Value lists passed to plugin_dispatch_values(), i.e. the plugin's own
+ * statistics. The hook is called with a lock held. */
+extern int stub_dispatched;
+extern void (*stub_dispatch_hook)(value_list_t const *vl);
+
+/*
+ * The loopback broker
+ *
+ * Connections succeed unless stub_broker_down is set. Published messages are
+ * counted, handed to stub_publish_hook, and acknowledged: right away from
+ * within mosquitto_publish() for an unthreaded client, or through a socket
+ * pair the plugin's network loop reads for a threaded one, like a real broker
+ * would. While stub_hold_acks is set, acknowledgements are held back until
+ * stub_release_acks().
+ */
+extern volatile int stub_broker_down;
+extern volatile int stub_hold_acks;
+extern uint16_t stub_topic_alias_maximum;
+
+extern uint64_t stub_connects;
+extern uint64_t stub_published;
+extern uint64_t stub_published_bytes;
+
+/* Called for every published message, with the topic resolved from a topic
+ * alias. Called with a lock held, so calls never overlap. */
+extern void (*stub_publish_hook)(const char *topic, const void *payload,
+                                 int payloadlen);
+
+int stub_release_acks(void);
+/* Drops the connection as if the broker went away. */
+void stub_drop_connection(struct mosquitto *mosq);
+
+#endif /* STUB_H */
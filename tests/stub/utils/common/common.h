@@ -0,0 +1,37 @@
+/* The parts of collectd's "utils/common/common.h" the plugin uses. */
+#ifndef COMMON_H
+#define COMMON_H
+
+#include "collectd.h"
+#include "plugin.h"
+
+#define sfree(ptr)                                                             \
+  do {                                                                         \
+    free(ptr);                                                                 \
+    (ptr) = NULL;                                                              \
+  } while (0)
+
+char *sstrncpy(char *dest, const char *src, size_t n);
+char *sstrerror(int errnum, char *buf, size_t buflen);
+
+int format_name(char *ret, int ret_len, const char *hostname,
+                const char *plugin, const char *plugin_instance,
+                const char *type, const char *type_instance);
+#define FORMAT_VL(ret, ret_len, vl)                                            \
+  format_name(ret, ret_len, (vl)->host, (vl)->plugin, (vl)->plugin_instance,   \
+              (vl)->type, (vl)->type_instance)
+
+int cf_util_get_string(const oconfig_item_t *ci, char **ret_string);
+int cf_util_get_string_buffer(const oconfig_item_t *ci, char *buffer,
+                              size_t buffer_size);
+int cf_util_get_int(const oconfig_item_t *ci, int *ret_value);
+int cf_util_get_double(const oconfig_item_t *ci, double *ret_value);
+int cf_util_get_boolean(const oconfig_item_t *ci, bool *ret_bool);
+int cf_util_get_port_number(const oconfig_item_t *ci);
+int cf_util_get_cdtime(const oconfig_item_t *ci, cdtime_t *ret_value);
+
+counter_t counter_diff(counter_t old_value, counter_t new_value);
+uint64_t htonll(uint64_t n);
+double htond(double d);
+
+#endif /* COMMON_H */
@@ -0,0 +1,17 @@
+/* The parts of collectd's "utils/format_json/format_json.h" the plugin
+ * uses. */
+#ifndef FORMAT_JSON_H
+#define FORMAT_JSON_H
+
+#include "collectd.h"
+#include "plugin.h"
+
+int format_json_initialize(char *buffer, size_t *ret_buffer_fill,
+                           size_t *ret_buffer_free);
+int format_json_value_list(char *buffer, size_t *ret_buffer_fill,
+                           size_t *ret_buffer_free, const data_set_t *ds,
+                           const value_list_t *vl, int store_rates);
+int format_json_finalize(char *buffer, size_t *ret_buffer_fill,
+                         size_t *ret_buffer_free);
+
+#endif /* FORMAT_JSON_H */
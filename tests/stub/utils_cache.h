@@ -0,0 +1,9 @@
+/* The parts of collectd's "utils_cache.h" the plugin uses. */
+#ifndef UTILS_CACHE_H
+#define UTILS_CACHE_H
+
+#include "plugin.h"
+
+gauge_t *uc_get_rate(const data_set_t *ds, const value_list_t *vl);
+
+#endif /* UTILS_CACHE_H */
@@ -0,0 +1,32 @@
+/* The parts of collectd's "utils_complain.h" the plugin uses. */
+#ifndef UTILS_COMPLAIN_H
+#define UTILS_COMPLAIN_H
+
+#include "plugin.h"
+
+typedef struct {
+  cdtime_t last;
+  cdtime_t interval;
+  bool complained_once;
+} c_complain_t;
+
+#define C_COMPLAIN_INIT(c)                                                     \
+  do {                                                                         \
+    (c)->last = 0;                                                             \
+    (c)->interval = 0;                                                         \
+    (c)->complained_once = false;                                              \
+  } while (0)
+#define C_COMPLAIN_INIT_STATIC                                                 \
+  { 0, 0, 0 }
+
+void c_complain(int level, c_complain_t *c, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+void c_do_release(int level, c_complain_t *c, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+#define c_release(level, c, ...)                                               \
+  do {                                                                         \
+    if ((c)->interval != 0)                                                    \
+      c_do_release(level, c, __VA_ARGS__);                                     \
+  } while (0)
+
+#endif /* UTILS_COMPLAIN_H */
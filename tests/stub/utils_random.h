@@ -0,0 +1,7 @@
+/* The parts of collectd's "utils_random.h" the plugin uses. */
+#ifndef UTILS_RANDOM_H
+#define UTILS_RANDOM_H
+
+double cdrand_d(void);
+
+#endif /* UTILS_RANDOM_H */
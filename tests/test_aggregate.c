@@ -0,0 +1,173 @@
+/**
+ * AggregationInterval: windows are published when the next one starts, when
+ * they are overdue at a flush, and at shutdown, with one or more
+ * AggregationFunctions.
+ **/
+
+#include "harness.h"
+
+static char published[1 << 16];
+static size_t published_len;
+
+static void collect(const char *topic, const void *payload, /* {{{ */
+                    int payloadlen) {
+  if (published_len + (size_t)payloadlen + 2 > sizeof(published))
+    return;
+  memcpy(published + published_len, payload, (size_t)payloadlen);
+  published_len += (size_t)payloadlen;
+  published[published_len++] = '\n';
+  published[published_len] = 0;
+} /* }}} void collect */
+
+static data_source_t load_sources[] = {{"value", DS_TYPE_GAUGE, 0, NAN}};
+static data_set_t load = {"load", 1, load_sources};
+
+static void write_load_instance(wm_callback_t *cb, time_t time, /* {{{ */
+                                gauge_t value, char const *type_instance) {
+  value_t values[1] = {{.gauge = value}};
+  value_list_t vl = VALUE_LIST_INIT;
+
+  vl.values = values;
+  vl.values_len = 1;
+  vl.time = TIME_T_TO_CDTIME_T(time);
+  vl.interval = TIME_T_TO_CDTIME_T(1);
+  sstrncpy(vl.host, "example.org", sizeof(vl.host));
+  sstrncpy(vl.plugin, "load", sizeof(vl.plugin));
+  sstrncpy(vl.type, "load", sizeof(vl.type));
+  sstrncpy(vl.type_instance, type_instance, sizeof(vl.type_instance));
+  CHECK(h_write(cb, &load, &vl) == 0);
+} /* }}} void write_load_instance */
+
+static void write_load(wm_callback_t *cb, time_t time, gauge_t value) /* {{{ */
+{
+  write_load_instance(cb, time, value, "");
+} /* }}} void write_load */
+
+static void published_reset(void) /* {{{ */
+{
+  h_settle(TIME_T_TO_CDTIME_T(5));
+  published_len = 0;
+  published[0] = 0;
+} /* }}} void published_reset */
+
+static bool published_has(char const *needle) /* {{{ */
+{
+  return strstr(published, needle) != NULL;
+} /* }}} bool published_has */
+
+/* One function: an overdue window goes out with a flush. */
+static void test_flush_overdue(void) /* {{{ */
+{
+  wm_callback_t *cb;
+
+  h_config_string("Host", "localhost");
+  h_config_number("AggregationInterval", 10);
+  cb = h_configure("flush");
+  CHECK(cb != NULL);
+  published_reset();
+
+  for (int i = 0; i < 4; i++)
+    write_load(cb, 1000000 + i, 1.0 + i);
+  CHECK(h_flush(cb, 0) == 0);
+  h_settle(TIME_T_TO_CDTIME_T(5));
+  CHECK(published_has("\"values\":[2.5]"));
+  CHECK(published_has("\"time\":1000003.000,\"interval\":10.000"));
+  CHECK(published_has("\"type_instance\":\"\""));
+  h_free(cb);
+  printf("flush: %s", published);
+} /* }}} void test_flush_overdue */
+
+/* Several functions, published with a suffix when the next window starts,
+ * when overdue and at shutdown. */
+static void test_functions(void) /* {{{ */
+{
+  wm_callback_t *cb;
+
+  h_config_string("Host", "localhost");
+  h_config_number("AggregationInterval", 10);
+  h_config_string("AggregationFunction", "Minimum");
+  h_config_string("AggregationFunction", "Maximum");
+  h_config_string("Priority", "example.org/load/load");
+  cb = h_configure("functions");
+  CHECK(cb != NULL);
+  published_reset();
+
+  /* The next window starts. */
+  write_load(cb, 1000000, 3.0);
+  write_load(cb, 1000001, 1.0);
+  write_load(cb, 1000002, 2.0);
+  write_load(cb, 1000010, 5.0);
+  CHECK(h_flush(cb, 0) == 0);
+  h_settle(TIME_T_TO_CDTIME_T(5));
+  CHECK(published_has("\"values\":[1],\"dstypes\":[\"gauge\"],\"dsnames\":["
+                      "\"value\"],\"time\":1000002.000,\"interval\":10.000,"
+                      "\"host\":\"example.org\",\"plugin\":\"load\","
+                      "\"plugin_instance\":\"\",\"type\":\"load\","
+                      "\"type_instance\":\"minimum\"}"));
+  CHECK(published_has("\"values\":[3]"));
+  CHECK(published_has("\"type_instance\":\"maximum\""));
+  CHECK(published_has("\"values\":[5]"));
+  printf("functions: %s", published);
+
+  /* The second window is overdue at the flush. */
+  published_reset();
+  write_load(cb, 2000000, 4.0);
+  CHECK(h_flush(cb, 0) == 0);
+  h_settle(TIME_T_TO_CDTIME_T(5));
+  CHECK(published_has("\"values\":[4]"));
+  CHECK(published_has("\"type_instance\":\"maximum\""));
+
+  /* A current window is left alone by a flush and published at shutdown. */
+  published_reset();
+  write_load(cb, CDTIME_T_TO_TIME_T(cdtime()), 6.0);
+  CHECK(h_flush(cb, 0) == 0);
+  h_settle(TIME_T_TO_CDTIME_T(1));
+  CHECK(published_len == 0);
+  h_free(cb);
+  CHECK(published_has("\"values\":[6]"));
+  CHECK(published_has("\"type_instance\":\"minimum\""));
+  CHECK(published_has("\"type_instance\":\"maximum\""));
+  printf("shutdown: %s", published);
+} /* }}} void test_functions */
+
+/* The function suffix still fits after a type instance of maximum length. */
+static void test_long_type_instance(void) /* {{{ */
+{
+  char type_instance[DATA_MAX_NAME_LEN];
+  char expected[2][DATA_MAX_NAME_LEN + 64];
+  wm_callback_t *cb;
+
+  memset(type_instance, 'x', sizeof(type_instance) - 1);
+  type_instance[sizeof(type_instance) - 1] = 0;
+  snprintf(expected[0], sizeof(expected[0]), "\"type_instance\":\"%.*s-last\"}",
+           DATA_MAX_NAME_LEN - 6, type_instance);
+  snprintf(expected[1], sizeof(expected[1]),
+           "\"type_instance\":\"%.*s-average\"}", DATA_MAX_NAME_LEN - 9,
+           type_instance);
+
+  h_config_string("Host", "localhost");
+  h_config_number("AggregationInterval", 10);
+  h_config_string("AggregationFunction", "Average");
+  h_config_string("AggregationFunction", "Last");
+  cb = h_configure("long");
+  CHECK(cb != NULL);
+  published_reset();
+
+  write_load_instance(cb, 1000000, 1.0, type_instance);
+  CHECK(h_flush(cb, 0) == 0);
+  h_settle(TIME_T_TO_CDTIME_T(5));
+  CHECK(published_has(expected[0]));
+  CHECK(published_has(expected[1]));
+  h_free(cb);
+  printf("long type instance: %zu Bytes published\n", published_len);
+} /* }}} void test_long_type_instance */
+
+int main(void) /* {{{ */
+{
+  stub_publish_hook = collect;
+
+  test_flush_overdue();
+  test_functions();
+  test_long_type_instance();
+  return 0;
+} /* }}} int main */
@@ -0,0 +1,451 @@
+/**
+ * The Columnar format: messages published by the plugin are decoded as
+ * documented in src/write_mqtt.c and must give back every value list that
+ * was written, times, gauges bit for bit and counters alike, also when a
+ * batch is split by MaxMessageSize.
+ **/
+
+#include "harness.h"
+
+#include <float.h>
+
+#define ROWS_MAX 20000
+
+/* A written or decoded value list. */
+typedef struct {
+  char key[5 * DATA_MAX_NAME_LEN];
+  uint64_t interval_ms;
+  uint64_t time_ms;
+  uint8_t types[4];
+  uint64_t values[4];
+  size_t values_num;
+} row_t;
+
+static row_t written[ROWS_MAX];
+static size_t written_num;
+static row_t decoded[ROWS_MAX];
+static size_t decoded_num;
+static size_t messages;
+
+static data_source_t mixed_sources[] = {
+    {"g", DS_TYPE_GAUGE, 0, NAN},
+    {"c", DS_TYPE_COUNTER, 0, NAN},
+    {"d", DS_TYPE_DERIVE, 0, NAN},
+    {"a", DS_TYPE_ABSOLUTE, 0, NAN},
+};
+static data_set_t mixed = {"mixed", 4, mixed_sources};
+
+/*
+ * Decoder
+ */
+typedef struct {
+  uint8_t const *data;
+  size_t len;
+  size_t pos;
+} reader_t;
+
+static uint8_t read_u8(reader_t *r) /* {{{ */
+{
+  CHECK(r->pos < r->len);
+  return r->data[r->pos++];
+} /* }}} uint8_t read_u8 */
+
+static uint64_t read_varint(reader_t *r) /* {{{ */
+{
+  uint64_t v = 0;
+
+  for (int shift = 0;; shift += 7) {
+    uint8_t byte = read_u8(r);
+
+    CHECK(shift < 64);
+    v |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0)
+      return v;
+  }
+} /* }}} uint64_t read_varint */
+
+static void read_string(reader_t *r, char *buffer, size_t size) /* {{{ */
+{
+  uint64_t len = read_varint(r);
+
+  CHECK((len < size) && (len <= r->len - r->pos));
+  memcpy(buffer, r->data + r->pos, len);
+  buffer[len] = 0;
+  r->pos += len;
+} /* }}} void read_string */
+
+/* Bits, most significant first. */
+typedef struct {
+  uint8_t const *data;
+  size_t len;
+  size_t bit;
+} bit_reader_t;
+
+static uint64_t read_bits(bit_reader_t *b, int num) /* {{{ */
+{
+  uint64_t v = 0;
+
+  for (int i = 0; i < num; i++, b->bit++) {
+    CHECK(b->bit / 8 < b->len);
+    v = (v << 1) | ((b->data[b->bit / 8] >> (7 - b->bit % 8)) & 1);
+  }
+  return v;
+} /* }}} uint64_t read_bits */
+
+static int64_t read_signed(bit_reader_t *b, int num) /* {{{ */
+{
+  uint64_t v = read_bits(b, num);
+
+  if (v & (UINT64_C(1) << (num - 1)))
+    v |= ~UINT64_C(0) << num;
+  return (int64_t)v;
+} /* }}} int64_t read_signed */
+
+static int64_t read_dod(bit_reader_t *b) /* {{{ */
+{
+  if (read_bits(b, 1) == 0)
+    return 0;
+  if (read_bits(b, 1) == 0)
+    return read_signed(b, 7);
+  if (read_bits(b, 1) == 0)
+    return read_signed(b, 9);
+  if (read_bits(b, 1) == 0)
+    return read_signed(b, 12);
+  return (int64_t)read_bits(b, 64);
+} /* }}} int64_t read_dod */
+
+static void decode_series(reader_t *r) /* {{{ */
+{
+  char fields[5][DATA_MAX_NAME_LEN];
+  char name[DATA_MAX_NAME_LEN];
+  uint8_t types[4];
+  uint64_t interval_ms;
+  size_t values_num;
+  size_t count;
+  size_t first = decoded_num;
+  bit_reader_t b;
+
+  for (int i = 0; i < 5; i++)
+    read_string(r, fields[i], sizeof(fields[i]));
+  interval_ms = read_varint(r);
+  values_num = read_u8(r);
+  CHECK(values_num <= STATIC_ARRAY_SIZE(types));
+  for (size_t i = 0; i < values_num; i++) {
+    types[i] = read_u8(r);
+    read_string(r, name, sizeof(name));
+    CHECK(strcmp(name, mixed_sources[i].name) == 0);
+  }
+  count = read_varint(r);
+  CHECK((count > 0) && (decoded_num + count <= ROWS_MAX));
+
+  for (size_t i = 0; i < count; i++) {
+    row_t *row = decoded + decoded_num + i;
+
+    *row = (row_t){.interval_ms = interval_ms, .values_num = values_num};
+    snprintf(row->key, sizeof(row->key), "%s/%s-%s/%s-%s", fields[0],
+             fields[1], fields[2], fields[3], fields[4]);
+    memcpy(row->types, types, sizeof(types));
+  }
+  decoded[first].time_ms = read_varint(r);
+
+  b = (bit_reader_t){.len = read_varint(r)};
+  CHECK(b.len <= r->len - r->pos);
+  b.data = r->data + r->pos;
+  r->pos += b.len;
+
+  int64_t delta = 0;
+  for (size_t i = 1; i < count; i++) {
+    delta = (int64_t)((uint64_t)delta + (uint64_t)read_dod(&b));
+    decoded[first + i].time_ms =
+        decoded[first + i - 1].time_ms + (uint64_t)delta;
+  }
+
+  for (size_t v = 0; v < values_num; v++) {
+    uint64_t value = 0;
+    int leading = 0;
+    int trailing = 0;
+
+    delta = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (types[v] != DS_TYPE_GAUGE) {
+        delta = (int64_t)((uint64_t)delta + (uint64_t)read_dod(&b));
+        value += (uint64_t)delta;
+      } else if (i == 0) {
+        value = read_bits(&b, 64);
+      } else if (read_bits(&b, 1) == 1) {
+        if (read_bits(&b, 1) == 1) {
+          int meaningful;
+
+          leading = (int)read_bits(&b, 5);
+          meaningful = (int)read_bits(&b, 6) + 1;
+          trailing = 64 - leading - meaningful;
+          CHECK(trailing >= 0);
+        }
+        value ^= read_bits(&b, 64 - leading - trailing) << trailing;
+      }
+      decoded[first + i].values[v] = value;
+    }
+  }
+
+  /* Only padding is left. */
+  CHECK(b.len - b.bit / 8 <= 1);
+  CHECK((b.bit % 8 == 0) || (read_bits(&b, 8 - (int)(b.bit % 8)) == 0));
+  decoded_num += count;
+} /* }}} void decode_series */
+
+static void decode(const char *topic, const void *payload, /* {{{ */
+                   int payloadlen) {
+  reader_t r = {.data = payload, .len = (size_t)payloadlen};
+  size_t series_num;
+
+  CHECK((r.len >= 4) && (memcmp(r.data, "WMC1", 4) == 0));
+  r.pos = 4;
+  series_num = read_varint(&r);
+  for (size_t i = 0; i < series_num; i++)
+    decode_series(&r);
+  CHECK(r.pos == r.len);
+  messages++;
+} /* }}} void decode */
+
+/*
+ * Tests
+ */
+static void write_row(wm_callback_t *cb, int series, /* {{{ */
+                      uint64_t time_ms, uint64_t const values[4]) {
+  value_t v[4];
+  value_list_t vl = VALUE_LIST_INIT;
+  row_t *row = written + written_num++;
+
+  CHECK(written_num <= ROWS_MAX);
+  memcpy(v, values, sizeof(v));
+  vl.values = v;
+  vl.values_len = 4;
+  vl.time = MS_TO_CDTIME_T(time_ms);
+  vl.interval = MS_TO_CDTIME_T(10000);
+  sstrncpy(vl.host, "example.org", sizeof(vl.host));
+  sstrncpy(vl.plugin, "columnar", sizeof(vl.plugin));
+  snprintf(vl.plugin_instance, sizeof(vl.plugin_instance), "%d", series);
+  sstrncpy(vl.type, "mixed", sizeof(vl.type));
+  CHECK(h_write(cb, &mixed, &vl) == 0);
+
+  /* The plugin rounds times to milliseconds itself. */
+  *row = (row_t){.interval_ms = CDTIME_T_TO_MS(vl.interval),
+                 .time_ms = CDTIME_T_TO_MS(vl.time),
+                 .values_num = 4};
+  snprintf(row->key, sizeof(row->key), "%s/%s-%s/%s-%s", vl.host, vl.plugin,
+           vl.plugin_instance, vl.type, vl.type_instance);
+  for (size_t i = 0; i < 4; i++)
+    row->types[i] = (uint8_t)mixed_sources[i].type;
+  memcpy(row->values, values, sizeof(row->values));
+} /* }}} void write_row */
+
+/* Every series must come back with its value lists in the order written. */
+static void compare(void) /* {{{ */
+{
+  CHECK(decoded_num == written_num);
+
+  for (size_t i = 0; i < written_num; i++) {
+    size_t before = 0;
+    size_t j;
+
+    for (size_t k = 0; k < i; k++)
+      before += (strcmp(written[k].key, written[i].key) == 0);
+    for (j = 0; j < decoded_num; j++)
+      if ((strcmp(decoded[j].key, written[i].key) == 0) && (before-- == 0))
+        break;
+    CHECK(j < decoded_num);
+
+    row_t const *w = written + i;
+    row_t const *d = decoded + j;
+    if ((d->interval_ms != w->interval_ms) || (d->time_ms != w->time_ms) ||
+        (d->values_num != w->values_num) ||
+        (memcmp(d->types, w->types, sizeof(w->types)) != 0) ||
+        (memcmp(d->values, w->values, sizeof(w->values)) != 0)) {
+      fprintf(stderr,
+              "%s row %" PRIsz ": time %" PRIu64 " != %" PRIu64
+              ", values %016" PRIx64 " %016" PRIx64 " %016" PRIx64
+              " %016" PRIx64 " != %016" PRIx64 " %016" PRIx64 " %016" PRIx64
+              " %016" PRIx64 "\n",
+              w->key, i, d->time_ms, w->time_ms, d->values[0], d->values[1],
+              d->values[2], d->values[3], w->values[0], w->values[1],
+              w->values[2], w->values[3]);
+      CHECK(0);
+    }
+  }
+} /* }}} void compare */
+
+static wm_callback_t *start(size_t max_message_size) /* {{{ */
+{
+  wm_callback_t *cb;
+
+  written_num = decoded_num = messages = 0;
+  h_config_string("Host", "localhost");
+  h_config_string("Format", "Columnar");
+  h_config_number("BufferSize", 1024 * 1024);
+  if (max_message_size > 0)
+    h_config_number("MaxMessageSize", (double)max_message_size);
+  cb = h_configure("columnar");
+  CHECK(cb != NULL);
+  return cb;
+} /* }}} wm_callback_t *start */
+
+static void finish(wm_callback_t *cb, char const *name) /* {{{ */
+{
+  CHECK(h_flush(cb, 0) == 0);
+  h_settle(TIME_T_TO_CDTIME_T(5));
+  compare();
+  h_free(cb);
+  printf("%s: %" PRIsz " value lists in %" PRIsz " messages round-trip\n",
+         name, written_num, messages);
+} /* }}} void finish */
+
+static uint64_t gauge_bits(gauge_t g) /* {{{ */
+{
+  uint64_t bits;
+
+  memcpy(&bits, &g, sizeof(bits));
+  return bits;
+} /* }}} uint64_t gauge_bits */
+
+/* Regular, jittered and irregular intervals hit every bucket of the
+ * delta-of-delta encoding, also going back in time. */
+static void test_times(void) /* {{{ */
+{
+  static int64_t const steps[] = {10000, 10000, 10000, 10001, 9999, 10063,
+                                  9936,  10255, 9744,  12047, 7953, 10000,
+                                  15000, 1,     0,     0,     -5000, 1000000,
+                                  10000, 10000};
+  wm_callback_t *cb = start(0);
+  uint64_t const values[4] = {0};
+
+  for (int series = 0; series < 3; series++) {
+    uint64_t time_ms = UINT64_C(1700000000000) + (uint64_t)series;
+
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(steps); i++) {
+      time_ms += (uint64_t)steps[(i + (size_t)series) % STATIC_ARRAY_SIZE(steps)];
+      write_row(cb, series, time_ms, values);
+    }
+  }
+  /* A series with a single value list has no time bits. */
+  write_row(cb, 3, UINT64_C(1700000000000), values);
+
+  finish(cb, "times");
+} /* }}} void test_times */
+
+static void test_gauges(void) /* {{{ */
+{
+  gauge_t const gauges[] = {
+      1.0,       1.0,       NAN,      NAN,      INFINITY, -INFINITY,
+      INFINITY,  0.0,       -0.0,     0.0,      1.0,      nextafter(1.0, 2),
+      1.0,       -1.0,      1e300,    1e-300,   DBL_MIN,  DBL_MAX,
+      -DBL_MAX,  5e-324,    0.0,      42.125,   42.125,   42.25,
+      42.375,    42.5,      -NAN,     3.0,      3.0,      3.0,
+  };
+  wm_callback_t *cb = start(0);
+  uint64_t time_ms = UINT64_C(1700000000000);
+  uint64_t state = UINT64_C(0x2545f4914f6cdd1d);
+
+  for (size_t i = 0; i < STATIC_ARRAY_SIZE(gauges); i++) {
+    uint64_t values[4] = {gauge_bits(gauges[i])};
+    write_row(cb, 0, time_ms += 10000, values);
+  }
+
+  /* Values differing in their lowest bits only: 31 and more leading zeros,
+   * more than the 5 bits of the window can tell. */
+  for (int i = 0; i < 64; i++) {
+    uint64_t values[4] = {gauge_bits(1.0) ^ ((UINT64_C(1) << (i % 34)) - 1)};
+    write_row(cb, 1, time_ms += 10000, values);
+  }
+
+  /* Random bits, and random bits within a narrowing window. */
+  for (int i = 0; i < 500; i++) {
+    uint64_t values[4];
+
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    values[0] = (i < 250) ? state
+                          : (gauge_bits(100.0) ^ (state >> (8 + i % 56)));
+    write_row(cb, 2, time_ms += 10000, values);
+  }
+
+  finish(cb, "gauges");
+} /* }}} void test_gauges */
+
+static void test_counters(void) /* {{{ */
+{
+  wm_callback_t *cb = start(0);
+  uint64_t time_ms = UINT64_C(1700000000000);
+  uint64_t state = UINT64_C(0x9e3779b97f4a7c15);
+  int64_t const derives[] = {0,         1,         -1,        INT64_MAX,
+                             INT64_MIN, INT64_MAX, -1000000,  1000000,
+                             0,         0,         123456789, 123456789};
+
+  /* A steady rate, a counter wrapping around, extreme derives and absolutes
+   * that are roughly constant. */
+  for (int i = 0; i < 200; i++) {
+    uint64_t values[4];
+    int64_t derive = derives[i % STATIC_ARRAY_SIZE(derives)];
+
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    values[0] = gauge_bits((double)i);
+    values[1] = UINT64_MAX - 1000 + (uint64_t)i * 17;
+    memcpy(values + 2, &derive, sizeof(derive));
+    values[3] = (i % 50 == 0) ? state : 1000 + state % 5;
+    write_row(cb, i % 2, time_ms += 10000, values);
+  }
+
+  finish(cb, "counters");
+} /* }}} void test_counters */
+
+/* Messages split by MaxMessageSize each carry their own series headers. */
+static void test_split(void) /* {{{ */
+{
+  wm_callback_t *cb = start(2048);
+  uint64_t time_ms = UINT64_C(1700000000000);
+
+  for (int i = 0; i < 2000; i++) {
+    uint64_t values[4] = {gauge_bits(i * 0.5), (uint64_t)i * 100,
+                          (uint64_t)(i % 7), (uint64_t)i};
+    write_row(cb, i % 13, time_ms += 1000, values);
+  }
+  finish(cb, "split");
+  CHECK(messages > 10);
+} /* }}} void test_split */
+
+/* A message that cannot be encoded, e.g. a damaged record from the spool
+ * file, is dropped and counted. The publish thread is idle, so the test can
+ * stand in for it. */
+static void test_malformed(void) /* {{{ */
+{
+  wm_callback_t *cb = start(0);
+  wm_conn_t *conn = cb->conns;
+  char record[64] = {0};
+  uint32_t len = sizeof(record);
+
+  CHECK(wm_publish(conn, "collectd/columnar", record, sizeof(record),
+                   /* owned = */ NULL) == 0);
+  memcpy(record, &len, sizeof(len));
+  CHECK(wm_publish(conn, "collectd/columnar", record, sizeof(record),
+                   /* owned = */ NULL) == 0);
+  uint64_t dropped = conn->stats.batches_dropped;
+  CHECK(dropped == 2);
+  CHECK(messages == 0);
+
+  h_free(cb);
+  printf("malformed: %" PRIu64 " messages dropped\n", dropped);
+} /* }}} void test_malformed */
+
+int main(void) /* {{{ */
+{
+  stub_publish_hook = decode;
+
+  test_times();
+  test_gauges();
+  test_counters();
+  test_split();
+  test_malformed();
+  return 0;
+} /* }}} int main */
@@ -0,0 +1,158 @@
+/**
+ * Gauges are printed with the fewest digits that parse back to the same
+ * double: checked against strtod() for random bit patterns, subnormals and
+ * edge cases. Where GAUGE_FORMAT ("%.15g") round-trips as well, the output
+ * of normal gauges is byte for byte the same as format_json's, but for the
+ * rare ones Grisu2 prints a digit longer.
+ **/
+
+#include "harness.h"
+
+#include <float.h>
+
+#define RANDOM_VALUES 500000
+
+static uint64_t checked;
+static uint64_t same_as_printf;
+static uint64_t longer;
+
+static uint64_t xorshift(uint64_t *state) /* {{{ */
+{
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+} /* }}} uint64_t xorshift */
+
+static void check_gauge(double value) /* {{{ */
+{
+  char buffer[64];
+  char expected[64];
+  wm_writer_t w = {.data = buffer, .size = sizeof(buffer) - 1};
+  double parsed;
+  char *end;
+  size_t digits = 0;
+
+  if (!isfinite(value))
+    return;
+
+  wm_json_put_gauge(&w, value);
+  CHECK(!w.overflow);
+  buffer[w.pos] = 0;
+
+  parsed = strtod(buffer, &end);
+  if ((*end != 0) || (memcmp(&parsed, &value, sizeof(value)) != 0)) {
+    fprintf(stderr, "%a printed as \"%s\"\n", value, buffer);
+    CHECK(0);
+  }
+  /* Significant digits: leading zeros, as in "0.000ddd", do not count. */
+  for (char const *p = buffer + strspn(buffer, "-0."); (*p != 0) && (*p != 'e');
+       p++)
+    digits += (*p != '.');
+  CHECK(digits <= 17);
+
+  /* Subnormals have fewer significant digits than "%.15g" prints. Grisu2
+   * may print one digit more than needed: 1e23 comes out as
+   * 9.999999999999999e+22. */
+  snprintf(expected, sizeof(expected), GAUGE_FORMAT, value);
+  if ((fabs(value) < DBL_MIN) || (strtod(expected, NULL) != value))
+    ;
+  else if (digits > 15)
+    longer++;
+  else {
+    if (strcmp(expected, buffer) != 0) {
+      fprintf(stderr, "%a printed as \"%s\", \"%s\" expected\n", value,
+              buffer, expected);
+      CHECK(0);
+    }
+    same_as_printf++;
+  }
+  checked++;
+} /* }}} void check_gauge */
+
+static void test_edge_cases(void) /* {{{ */
+{
+  double const values[] = {
+      0.0,
+      -0.0,
+      0.1,
+      -0.1,
+      1.0 / 3.0,
+      2.0 / 3.0,
+      0.30000000000000004,
+      1e-4,
+      9.99e-5,
+      1e-7,
+      123e-20,
+      123456.789,
+      299792458.0001,
+      999999999999999.9,
+      1e15,
+      -1e15,
+      1e15 + 0.5,
+      1e16,
+      1e21,
+      1e22,
+      1e23,
+      1e300,
+      1e-300,
+      9007199254740992.0,
+      9007199254740994.0,
+      M_PI,
+      M_E,
+      DBL_EPSILON,
+      DBL_MIN,
+      DBL_MAX,
+      -DBL_MAX,
+      DBL_TRUE_MIN,
+      2.2250738585072009e-308,
+  };
+
+  for (size_t i = 0; i < STATIC_ARRAY_SIZE(values); i++)
+    check_gauge(values[i]);
+
+  /* Powers of two and ten across the whole range. */
+  for (int e = -1074; e <= 1023; e++) {
+    check_gauge(ldexp(1.0, e));
+    check_gauge(nextafter(ldexp(1.0, e), 0.0));
+    check_gauge(nextafter(ldexp(1.0, e), INFINITY));
+  }
+  for (int e = -323; e <= 308; e++) {
+    check_gauge(pow(10.0, e));
+    check_gauge(1.5 * pow(10.0, e));
+  }
+} /* }}} void test_edge_cases */
+
+static void test_random(void) /* {{{ */
+{
+  uint64_t state = UINT64_C(0x9e3779b97f4a7c15);
+
+  for (int i = 0; i < RANDOM_VALUES; i++) {
+    uint64_t bits = xorshift(&state);
+    double value;
+
+    memcpy(&value, &bits, sizeof(value));
+    check_gauge(value);
+
+    /* Gauges as they come: a few digits, in a common range. */
+    check_gauge((double)(bits % 1000000) / 1000.0);
+    /* Subnormals. */
+    bits &= (UINT64_C(1) << 52) - 1;
+    memcpy(&value, &bits, sizeof(value));
+    check_gauge(value);
+  }
+} /* }}} void test_random */
+
+int main(void) /* {{{ */
+{
+  test_edge_cases();
+  test_random();
+
+  printf("%" PRIu64 " gauges round-trip, %" PRIu64
+         " of them the same as \"%s\", %" PRIu64 " longer\n",
+         checked, same_as_printf, GAUGE_FORMAT, longer);
+  CHECK(longer * 1000 < same_as_printf);
+  return 0;
+} /* }}} int main */
@@ -0,0 +1,232 @@
+/**
+ * The JSON encoder: the vectorized escaper matches the scalar one byte for
+ * byte, value lists come out as format_json prints them, and the series
+ * cache is in use and renders the same bytes.
+ **/
+
+#include "harness.h"
+
+#define MAX_LEN 70
+
+static uint64_t compared;
+
+/* Bytes format_json treats specially, and some it does not. */
+static char special_bytes(char *bytes) /* {{{ */
+{
+  size_t num = 0;
+
+  for (int c = 0x01; c <= 0x1f; c++)
+    bytes[num++] = (char)c;
+  bytes[num++] = '"';
+  bytes[num++] = '\\';
+  bytes[num++] = ' ';
+  bytes[num++] = 'a';
+  bytes[num++] = 0x7f;
+  bytes[num++] = (char)0x80;
+  bytes[num++] = (char)0xc3;
+  bytes[num++] = (char)0xa9;
+  bytes[num++] = (char)0xff;
+  return (char)num;
+} /* }}} char special_bytes */
+
+/* wm_json_put_string() takes the vector path with room to spare, the
+ * scalar one otherwise. */
+static void compare_escape(char const *s) /* {{{ */
+{
+  char vector[2 * MAX_LEN + 8];
+  char scalar[2 * MAX_LEN + 8];
+  wm_writer_t v = {.data = vector, .size = sizeof(vector)};
+  wm_writer_t w = {.data = scalar, .size = sizeof(scalar)};
+
+  wm_json_put_string(&v, s);
+  wm_json_put_string_scalar(&w, s, strlen(s));
+  CHECK(!v.overflow && !w.overflow);
+  if ((v.pos != w.pos) || (memcmp(vector, scalar, v.pos) != 0)) {
+    fprintf(stderr, "\"%.*s\" escaped as \"%.*s\"\n", (int)w.pos, scalar,
+            (int)v.pos, vector);
+    CHECK(0);
+  }
+  compared++;
+} /* }}} void compare_escape */
+
+static void test_escape(void) /* {{{ */
+{
+  /* Room before the string, so that it starts at every alignment. */
+  char buffer[16 + MAX_LEN + 1];
+  char bytes[64];
+  int bytes_num = special_bytes(bytes);
+  uint64_t state = UINT64_C(0x2545f4914f6cdd1d);
+
+  /* One special byte at every position of strings around the block size. */
+  for (size_t offset = 0; offset < 16; offset++) {
+    char *s = buffer + offset;
+
+    for (size_t len = 0; len <= 3 * 16 + 1; len++) {
+      memset(s, 'x', len);
+      s[len] = 0;
+      compare_escape(s);
+
+      for (size_t pos = 0; pos < len; pos++)
+        for (int i = 0; i < bytes_num; i++) {
+          s[pos] = bytes[i];
+          compare_escape(s);
+          s[pos] = 'x';
+        }
+    }
+  }
+
+  /* Random strings, special bytes in half of the positions. */
+  for (int i = 0; i < 200000; i++) {
+    size_t len;
+
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    len = (size_t)(state % (MAX_LEN + 1));
+    for (size_t pos = 0; pos < len; pos++) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      if (state & 1)
+        buffer[pos] = bytes[(state >> 8) % (uint64_t)bytes_num];
+      else
+        buffer[pos] = (char)(1 + (state >> 8) % 255);
+    }
+    buffer[len] = 0;
+    compare_escape(buffer);
+  }
+
+  printf("escape: %" PRIu64 " strings, vector and scalar agree\n", compared);
+} /* }}} void test_escape */
+
+/* Gauges are integral or short: those format_json prints the same. */
+static data_source_t gauges_sources[] = {
+    {"value", DS_TYPE_GAUGE, 0, NAN},
+    {"other", DS_TYPE_GAUGE, 0, NAN},
+};
+static data_set_t gauges = {"gauges", 2, gauges_sources};
+
+static void gauge_value_list(value_list_t *vl, value_t values[2], /* {{{ */
+                             char const *name, gauge_t value) {
+  *vl = (value_list_t)VALUE_LIST_INIT;
+  values[0].gauge = value;
+  values[1].gauge = -value / 4;
+  vl->values = values;
+  vl->values_len = 2;
+  vl->time = TIME_T_TO_CDTIME_T(1700000000) + 123456789;
+  vl->interval = DOUBLE_TO_CDTIME_T(10.5);
+  sstrncpy(vl->host, name, sizeof(vl->host));
+  sstrncpy(vl->plugin, "plugin\"\\", sizeof(vl->plugin));
+  sstrncpy(vl->plugin_instance, name, sizeof(vl->plugin_instance));
+  sstrncpy(vl->type, "gauges", sizeof(vl->type));
+  sstrncpy(vl->type_instance, "caf\xc3\xa9", sizeof(vl->type_instance));
+} /* }}} void gauge_value_list */
+
+static void test_format_json(void) /* {{{ */
+{
+  char const *const names[] = {
+      "",
+      "example.org",
+      "quote\"backslash\\tab\tnewline\n",
+      "0123456789abcde\"0123456789abcdef\\0123456789abcdef",
+      "\x01\x1f\x7f\x80\xff",
+  };
+  gauge_t const values[] = {0, 1, -1, 2.5, 1e20, 0.001, NAN};
+  int compared_lists = 0;
+
+  for (size_t i = 0; i < STATIC_ARRAY_SIZE(names); i++)
+    for (size_t j = 0; j < STATIC_ARRAY_SIZE(values); j++) {
+      char ours[4096] = {0};
+      char theirs[4096] = {0};
+      size_t ours_fill = 0;
+      size_t ours_free = sizeof(ours);
+      size_t theirs_fill = 0;
+      size_t theirs_free = sizeof(theirs);
+      value_t v[2];
+      value_list_t vl;
+
+      gauge_value_list(&vl, v, names[i], values[j]);
+      CHECK(wm_json_value_list(ours, &ours_fill, &ours_free, &gauges, &vl,
+                               /* store_rates = */ 0) == 0);
+      CHECK(format_json_value_list(theirs, &theirs_fill, &theirs_free,
+                                   &gauges, &vl, /* store_rates = */ 0) == 0);
+      if ((ours_fill != theirs_fill) || (strcmp(ours, theirs) != 0)) {
+        fprintf(stderr, "%s\n!=\n%s\n", ours, theirs);
+        CHECK(0);
+      }
+      compared_lists++;
+    }
+
+  printf("format_json: %d value lists identical\n", compared_lists);
+} /* }}} void test_format_json */
+
+static char published[8192];
+static size_t published_len;
+
+static void keep_payload(const char *topic, const void *payload, /* {{{ */
+                         int payloadlen) {
+  CHECK((size_t)payloadlen < sizeof(published));
+  memcpy(published, payload, (size_t)payloadlen);
+  published_len = (size_t)payloadlen;
+} /* }}} void keep_payload */
+
+/* The second value list of a series is rendered from the cache. */
+static void test_cache(void) /* {{{ */
+{
+  char expected[8192];
+  size_t fill = 0;
+  size_t free = sizeof(expected);
+  value_t v[3][2];
+  value_list_t vl[3];
+  wm_series_t *series = NULL;
+  wm_callback_t *cb;
+
+  h_config_string("Host", "localhost");
+  cb = h_configure("json");
+  CHECK(cb != NULL);
+  CHECK(cb->json_cache);
+
+  gauge_value_list(vl + 0, v[0], "cached\"host", 1);
+  gauge_value_list(vl + 1, v[1], "cached\"host", 2.5);
+  vl[1].time += TIME_T_TO_CDTIME_T(10);
+  h_value_list(vl + 2, v[2], 7, 42);
+
+  CHECK(format_json_initialize(expected, &fill, &free) == 0);
+  for (size_t i = 0; i < STATIC_ARRAY_SIZE(vl); i++) {
+    data_set_t const *ds = (i < 2) ? &gauges : &h_if_octets;
+
+    CHECK(h_write(cb, ds, vl + i) == 0);
+    CHECK(format_json_value_list(expected, &fill, &free, ds, vl + i,
+                                 /* store_rates = */ 0) == 0);
+  }
+  CHECK(format_json_finalize(expected, &fill, &free) == 0);
+
+  for (size_t i = 0; i < cb->shards[0].series_size; i++)
+    for (wm_series_t *s = cb->shards[0].series[i]; s != NULL; s = s->hash_next)
+      if (strcmp(s->key, "cached\"host") == 0)
+        series = s;
+  CHECK(series != NULL);
+  CHECK(series->json != NULL);
+
+  published_len = 0;
+  CHECK(h_flush(cb, 0) == 0);
+  h_settle(TIME_T_TO_CDTIME_T(5));
+  if ((published_len != fill) || (memcmp(published, expected, fill) != 0)) {
+    fprintf(stderr, "%.*s\n!=\n%s\n", (int)published_len, published,
+            expected);
+    CHECK(0);
+  }
+
+  h_free(cb);
+  printf("cache: %" PRIsz " Bytes identical to format_json\n", fill);
+} /* }}} void test_cache */
+
+int main(void) /* {{{ */
+{
+  test_escape();
+  test_format_json();
+
+  stub_publish_hook = keep_payload;
+  test_cache();
+  return 0;
+} /* }}} int main */
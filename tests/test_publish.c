@@ -0,0 +1,79 @@
+/**
+ * Value lists written by several threads are all published, as well-formed
+ * JSON arrays, with QoS 0 and with QoS 1 acknowledged through the network
+ * loop.
+ **/
+
+#include "harness.h"
+
+#define WRITERS 4
+#define VALUES 20000
+
+static uint64_t entries;
+static int malformed;
+
+static void count_entries(const char *topic, const void *payload, /* {{{ */
+                          int payloadlen) {
+  const char *json = payload;
+
+  if ((payloadlen < 2) || (json[0] != '[') || (json[payloadlen - 1] != ']'))
+    malformed++;
+  for (const char *p = json; (p = memmem(p, (size_t)(json + payloadlen - p),
+                                          "{\"values\":[", 11)) != NULL;
+       p += 11)
+    entries++;
+} /* }}} void count_entries */
+
+static void *writer(void *arg) /* {{{ */
+{
+  wm_callback_t *cb = arg;
+  value_t values[2];
+  value_list_t vl;
+
+  for (int i = 0; i < VALUES; i++) {
+    h_value_list(&vl, values, i % 50, i);
+    CHECK(h_write(cb, &h_if_octets, &vl) == 0);
+  }
+  return NULL;
+} /* }}} void *writer */
+
+static void test_publish(int qos, int connections) /* {{{ */
+{
+  pthread_t threads[WRITERS];
+  wm_callback_t *cb;
+
+  entries = 0;
+  h_config_string("Host", "localhost");
+  h_config_number("QoS", qos);
+  h_config_number("Connections", connections);
+  h_config_number("BufferSize", 16384);
+  cb = h_configure("publish");
+  CHECK(cb != NULL);
+
+  for (int i = 0; i < WRITERS; i++)
+    CHECK(pthread_create(threads + i, NULL, writer, cb) == 0);
+  for (int i = 0; i < WRITERS; i++)
+    pthread_join(threads[i], NULL);
+  CHECK(h_flush(cb, 0) == 0);
+  h_settle(TIME_T_TO_CDTIME_T(10));
+
+  CHECK(malformed == 0);
+  CHECK(entries == WRITERS * VALUES);
+  if (qos > 0)
+    for (size_t i = 0; i < cb->conns_num; i++)
+      CHECK(cb->conns[i].inflight == 0);
+
+  h_free(cb);
+  printf("QoS %d, %d connections: %" PRIu64 " value lists published\n", qos,
+         connections, entries);
+} /* }}} void test_publish */
+
+int main(void) /* {{{ */
+{
+  stub_publish_hook = count_entries;
+
+  test_publish(0, 1);
+  test_publish(1, 1);
+  test_publish(1, 3);
+  return 0;
+} /* }}} int main */
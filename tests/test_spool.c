@@ -0,0 +1,196 @@
+/**
+ * Batches replayed from the spool file: when no batch can be allocated for
+ * a record, the record stays in the file and the publish thread retries
+ * later instead of spinning. The space of replayed records is reused, and
+ * a node's name cannot leave SpoolDir.
+ **/
+
+#include "harness.h"
+
+#define RECORDS 10
+#define RECORD_SIZE 32768
+
+/* Fails allocations of at least "fail_size" bytes while it is non-zero,
+ * which only batches for the large records below come near. AddressSanitizer
+ * replaces malloc() itself, so the test is skipped there. */
+static size_t fail_size;
+static uint64_t failed;
+
+#ifndef __SANITIZE_ADDRESS__
+extern void *__libc_malloc(size_t size);
+
+void *malloc(size_t size) /* {{{ */
+{
+  size_t limit = __atomic_load_n(&fail_size, __ATOMIC_RELAXED);
+
+  if ((limit > 0) && (size >= limit)) {
+    __atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return __libc_malloc(size);
+} /* }}} void *malloc */
+#endif
+
+static uint64_t records;
+
+static void count_records(const char *topic, const void *payload, /* {{{ */
+                          int payloadlen) {
+  if (payloadlen == RECORD_SIZE)
+    records++;
+} /* }}} void count_records */
+
+static bool spool_empty(wm_callback_t *cb) /* {{{ */
+{
+  pthread_mutex_lock(&cb->send_lock);
+  bool empty = wm_backlog_empty(cb);
+  pthread_mutex_unlock(&cb->send_lock);
+  return empty;
+} /* }}} bool spool_empty */
+
+static void test_alloc_failure(char const *dir) /* {{{ */
+{
+  static char data[RECORD_SIZE];
+  wm_callback_t *cb;
+
+  stub_broker_down = 1;
+  h_config_string("Host", "localhost");
+  h_config_string("SpoolDir", dir);
+  h_config_number("ReplayRate", 0);
+  h_config_number("BatchPoolSize", 0);
+  h_config_number("ReconnectMinInterval", 0.05);
+  h_config_number("ReconnectMaxInterval", 0.05);
+  cb = h_configure("spool");
+  CHECK(cb != NULL);
+  CHECK(cb->spool != NULL);
+
+  memset(data, 'x', sizeof(data));
+  pthread_mutex_lock(&cb->send_lock);
+  for (int i = 0; i < RECORDS; i++)
+    CHECK(wm_spool_append(cb, "collectd/spool", data, sizeof(data)) == 0);
+  pthread_mutex_unlock(&cb->send_lock);
+
+  __atomic_store_n(&fail_size, RECORD_SIZE, __ATOMIC_RELAXED);
+  stub_broker_down = 0;
+  for (cdtime_t end = cdtime() + TIME_T_TO_CDTIME_T(5);
+       !__atomic_load_n(&cb->conns[0].connected, __ATOMIC_ACQUIRE) &&
+       (cdtime() < end);)
+    usleep(1000);
+  CHECK(cb->conns[0].connected);
+  usleep(500000);
+
+  /* One attempt per WRITE_MQTT_SPOOL_RETRY_INTERVAL, nothing lost. */
+  uint64_t attempts = __atomic_load_n(&failed, __ATOMIC_RELAXED);
+  CHECK((attempts >= 1) && (attempts <= 2));
+  CHECK(records == 0);
+  CHECK(!spool_empty(cb));
+
+  __atomic_store_n(&fail_size, 0, __ATOMIC_RELAXED);
+  for (cdtime_t end = cdtime() + TIME_T_TO_CDTIME_T(5);
+       !spool_empty(cb) && (cdtime() < end);)
+    usleep(10000);
+  h_settle(TIME_T_TO_CDTIME_T(5));
+  CHECK(records == RECORDS);
+
+  h_free(cb);
+  printf("allocation failure: %" PRIu64 " attempts while failing, %" PRIu64
+         " records replayed\n",
+         attempts, records);
+} /* }}} void test_alloc_failure */
+
+#define SMALL_RECORDS 10
+#define SMALL_SIZE 1000
+
+static int spool_push(wm_callback_t *cb, int id) /* {{{ */
+{
+  char data[SMALL_SIZE];
+
+  memset(data, 'x', sizeof(data));
+  memcpy(data, &id, sizeof(id));
+  return wm_spool_append(cb, "collectd/spool", data, sizeof(data));
+} /* }}} int spool_push */
+
+static int spool_pop(wm_callback_t *cb) /* {{{ */
+{
+  wm_batch_t *batch = NULL;
+  int id;
+
+  CHECK(wm_spool_pop(cb, &batch) == 0);
+  if (batch == NULL)
+    return -1;
+  CHECK(batch->len == SMALL_SIZE);
+  CHECK(strcmp(batch->topic, "collectd/spool") == 0);
+  memcpy(&id, batch->data, sizeof(id));
+  wm_batch_free(cb, batch);
+  return id;
+} /* }}} int spool_pop */
+
+static void test_compact(char const *dir) /* {{{ */
+{
+  size_t record = sizeof(uint32_t) + sizeof(uint16_t) +
+                  strlen("collectd/spool") + SMALL_SIZE;
+  char path[PATH_MAX];
+  struct stat statbuf;
+  wm_callback_t *cb;
+  int next = 0;
+  int expected = 0;
+
+  stub_broker_down = 1;
+  h_config_string("Host", "localhost");
+  h_config_string("SpoolDir", dir);
+  h_config_number("MaxSpoolBytes",
+                  (double)(sizeof(wm_spool_header_t) + SMALL_RECORDS * record));
+  cb = h_configure("../compact/");
+  CHECK(cb != NULL);
+  CHECK(cb->spool != NULL);
+
+  snprintf(path, sizeof(path), "%s/.._compact_.spool", dir);
+  CHECK(stat(path, &statbuf) == 0);
+
+  pthread_mutex_lock(&cb->send_lock);
+  while (spool_push(cb, next) == 0)
+    next++;
+  CHECK(next == SMALL_RECORDS);
+
+  /* Fewer replayed than left: the file stays full. */
+  for (int i = 0; i < SMALL_RECORDS / 2 - 1; i++)
+    CHECK(spool_pop(cb) == expected++);
+  CHECK(spool_push(cb, next) != 0);
+
+  /* As many replayed as left: their space is reused. */
+  CHECK(spool_pop(cb) == expected++);
+  while (spool_push(cb, next) == 0)
+    next++;
+  CHECK(next == SMALL_RECORDS + SMALL_RECORDS / 2);
+
+  while (expected < next)
+    CHECK(spool_pop(cb) == expected++);
+  CHECK(spool_pop(cb) == -1);
+  pthread_mutex_unlock(&cb->send_lock);
+
+  h_free(cb);
+  stub_broker_down = 0;
+  unlink(path);
+  printf("compact: %d records through a file of %d\n", next, SMALL_RECORDS);
+} /* }}} void test_compact */
+
+int main(void) /* {{{ */
+{
+  char dir[] = "/tmp/test_spool.XXXXXX";
+  char path[sizeof(dir) + 16];
+
+  CHECK(mkdtemp(dir) != NULL);
+  stub_publish_hook = count_records;
+
+#ifdef __SANITIZE_ADDRESS__
+  printf("allocation failure: skipped with AddressSanitizer\n");
+#else
+  test_alloc_failure(dir);
+#endif
+  test_compact(dir);
+
+  snprintf(path, sizeof(path), "%s/spool.spool", dir);
+  unlink(path);
+  rmdir(dir);
+  return 0;
+} /* }}} int main */
@@ -0,0 +1,53 @@
+/**
+ * Counters the write threads keep without a lock add up exactly, also with
+ * more threads than there are slots for them.
+ **/
+
+#include "harness.h"
+
+#define WRITERS (WM_WRITER_SLOTS + 16)
+#define VALUES 2000
+
+static void *writer(void *arg) /* {{{ */
+{
+  wm_callback_t *cb = arg;
+  value_t values[2];
+  value_list_t vl;
+
+  for (int i = 0; i < VALUES; i++) {
+    h_value_list(&vl, values, i % 2, i);
+    CHECK(h_write(cb, &h_if_octets, &vl) == 0);
+  }
+  return NULL;
+} /* }}} void *writer */
+
+static void test_filtered(void) /* {{{ */
+{
+  pthread_t threads[WRITERS];
+  wm_stats_t total = {0};
+  wm_callback_t *cb;
+
+  h_config_string("Host", "localhost");
+  h_config_boolean("CollectStatistics", true);
+  h_config_string("Exclude", "*/interface-eth1/*");
+  cb = h_configure("stats");
+  CHECK(cb != NULL);
+
+  for (int i = 0; i < WRITERS; i++)
+    CHECK(pthread_create(threads + i, NULL, writer, cb) == 0);
+  for (int i = 0; i < WRITERS; i++)
+    pthread_join(threads[i], NULL);
+
+  wm_writer_stats_sum(&total, cb);
+  CHECK(total.values_filtered == WRITERS * VALUES / 2);
+
+  h_free(cb);
+  printf("filtered: %" PRIu64 " value lists from %d threads\n",
+         total.values_filtered, WRITERS);
+} /* }}} void test_filtered */
+
+int main(void) /* {{{ */
+{
+  test_filtered();
+  return 0;
+} /* }}} int main */
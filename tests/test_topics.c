@@ -0,0 +1,87 @@
+/**
+ * Topics rendered from the TopicTemplate are bounded by SeriesCacheSize:
+ * the least recently used ones without buffers are forgotten, while
+ * topics whose batches are still queued are kept.
+ **/
+
+#include "harness.h"
+
+#define SERIES 1000
+#define TOPICS_MAX 16
+
+static uint64_t entries;
+static int misrouted;
+
+/* Every value list must end up on the topic of its plugin instance. */
+static void check_topic(const char *topic, const void *payload, /* {{{ */
+                        int payloadlen) {
+  const char *json = payload;
+  char instance[64];
+
+  CHECK(sscanf(topic, "collectd/example.org/%63s", instance) == 1);
+  for (const char *p = json;
+       (p = memmem(p, (size_t)(json + payloadlen - p), "\"plugin_instance\":\"",
+                   19)) != NULL;
+       p += 19) {
+    size_t len = strlen(instance);
+    if ((strncmp(p + 19, instance, len) != 0) || (p[19 + len] != '"'))
+      misrouted++;
+    entries++;
+  }
+} /* }}} void check_topic */
+
+static void test_bounded(int shards) /* {{{ */
+{
+  value_t values[2];
+  value_list_t vl;
+  wm_callback_t *cb;
+
+  entries = 0;
+  h_config_string("Host", "localhost");
+  h_config_string("TopicTemplate", "collectd/%{host}/%{plugin_instance}");
+  h_config_number("SeriesCacheSize", TOPICS_MAX);
+  h_config_number("WriteShards", shards);
+  h_config_number("SendBuffers", 4);
+  cb = h_configure("topics");
+  CHECK(cb != NULL);
+
+  for (int round = 0; round < 2; round++)
+    for (int i = 0; i < SERIES; i++) {
+      h_value_list(&vl, values, i, i);
+      CHECK(h_write(cb, &h_if_octets, &vl) == 0);
+
+      for (size_t j = 0; j < cb->shards_num; j++) {
+        wm_shard_t *shard = cb->shards + j;
+        size_t busy = 0;
+
+        pthread_mutex_lock(&shard->lock);
+        for (size_t k = 0; k < shard->topics_size; k++)
+          for (wm_topic_t *t = shard->topics[k]; t != NULL; t = t->hash_next)
+            busy += (t->refs > 0);
+        /* Topics with buffers may exceed the bound, there are only as many
+         * of them as buffers. */
+        CHECK(shard->topics_num <=
+              (TOPICS_MAX + cb->shards_num - 1) / cb->shards_num + busy);
+        CHECK(busy <= cb->buffers_num);
+        pthread_mutex_unlock(&shard->lock);
+      }
+    }
+  CHECK(h_flush(cb, 0) == 0);
+  h_settle(TIME_T_TO_CDTIME_T(10));
+
+  CHECK(misrouted == 0);
+  CHECK(entries == 2 * SERIES);
+
+  h_free(cb);
+  printf("%d shards: %" PRIu64 " value lists on %d topics, at most %d kept\n",
+         shards, entries, SERIES, TOPICS_MAX);
+} /* }}} void test_bounded */
+
+int main(void) /* {{{ */
+{
+  stub_publish_hook = check_topic;
+
+  test_bounded(1);
+  test_bounded(4);
+  return 0;
+} /* }}} int main */